@@ -0,0 +1,151 @@
+/*
+Macro cache benchmark: startup with and without the compiled macro cache
+
+Stores N macros in a file store, then times what the plugin does at
+startup: without the cache, opening the store, reading the macros and
+compiling them; with it, checking the store fingerprint and the cache
+header (what startup waits for), then loading the cache in the background.
+The expansions of both macro sets are compared. The files go to the
+system temporary directory and are removed afterwards.
+
+Usage: climacros_cache_bench [--count N] [--json]
+  --count N  number of macros (default: 100000)
+  --json     emit one JSON document on stdout (for tracking regressions)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include "macro_replacer.h"
+#include "macro_store.h"
+#include "macro_table.h"
+
+using bench_clock_t = std::chrono::steady_clock;
+
+static double ms_since(bench_clock_t::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock_t::now() - t0).count();
+}
+
+static std::string identity(std::string_view expr)
+{
+    return std::string(expr);
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    size_t count = 100000;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+            count = size_t(strtoull(argv[++i], nullptr, 10));
+    }
+
+    auto tmp = std::filesystem::temp_directory_path();
+    const std::string store_path = (tmp / "climacros_cache_bench.macros").string();
+    const std::string cache_path = store_path + ".cache";
+    std::error_code ec;
+    auto cleanup = [&]()
+    {
+        for (auto &p: { store_path, store_path + ".journal", cache_path })
+            std::filesystem::remove(p, ec);
+    };
+    cleanup();
+
+    {
+        macro_table_t table;
+        table.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto n = std::to_string(i);
+            table.insert("$m" + n, "${'%x' % (idc.here() + " + n + ")}$ at " + n, "Cursor location plus " + n);
+        }
+        file_macro_store_t store(store_path);
+        store.open();
+        if (!store.save_all(table))
+        {
+            fprintf(stderr, "save_all: %s\n", store.error().c_str());
+            return 1;
+        }
+    }
+
+    // Startup without the cache; the compiled set is saved for the next one
+    macro_replacer_t cold(identity);
+    auto t0 = bench_clock_t::now();
+    {
+        file_macro_store_t store(store_path);
+        store.open();
+        macro_table_t table;
+        store.load_table(table);
+        cold.begin_update();
+        for (auto slot: table.order())
+            cold.update(table.name(slot), table.expr(slot));
+        cold.end_update();
+    }
+    const double cold_ms = ms_since(t0);
+
+    file_macro_store_t store(store_path);
+    const uint64_t key = store.fingerprint();
+    t0 = bench_clock_t::now();
+    if (!cold.save_cache(cache_path, key))
+    {
+        fprintf(stderr, "save_cache failed\n");
+        return 1;
+    }
+    const double save_ms = ms_since(t0);
+    const size_t cache_size = size_t(std::filesystem::file_size(cache_path, ec));
+
+    // Startup with the cache
+    macro_replacer_t warm(identity);
+    bool failed = false;
+    t0 = bench_clock_t::now();
+    if (!warm.load_cache_async(cache_path, store.fingerprint(), [&]() { failed = true; }))
+    {
+        fprintf(stderr, "the cache was not accepted\n");
+        return 1;
+    }
+    const double open_ms = ms_since(t0);
+    warm.wait_update();
+    const double load_ms = ms_since(t0);
+    if (failed)
+    {
+        fprintf(stderr, "the cache failed to load\n");
+        return 1;
+    }
+
+    // Both macro sets expand alike
+    std::string line, a, b;
+    for (size_t i = 0; i < count; i += count / 1000 + 1)
+        line += "x $m" + std::to_string(i) + " ";
+    bool same = cold.expand(line, a) == warm.expand(line, b) && a == b;
+
+    cleanup();
+    if (!same)
+    {
+        fprintf(stderr, "the expansions differ\n");
+        return 1;
+    }
+
+    if (json)
+    {
+        printf("{\n  \"benchmark\": \"climacros_cache_bench\",\n  \"count\": %zu,\n  \"cache_size\": %zu,\n", count, cache_size);
+        printf("  \"cold_ms\": %.2f,\n  \"save_ms\": %.2f,\n", cold_ms, save_ms);
+        printf("  \"startup_ms\": %.3f,\n  \"background_load_ms\": %.2f\n}\n", open_ms, load_ms);
+    }
+    else
+    {
+        printf("%zu macros, cache of %zu bytes\n", count, cache_size);
+        printf("%-32s %12.2f ms\n", "startup without cache", cold_ms);
+        printf("%-32s %12.2f ms\n", "cache save", save_ms);
+        printf("%-32s %12.3f ms\n", "startup with cache", open_ms);
+        printf("%-32s %12.2f ms\n", "cache load (background)", load_ms);
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+Expression VM benchmark: compile and run times of the expression VM
+
+Measures expr_program_t outside of IDA, with stub host functions, on the
+expressions of the former default macros and a few heavier ones. The
+comparison with the Python paths (eval_expr and compiled functions) needs
+IDA: run the plugin with argument 1 (see macro_eval_t::benchmark()).
+
+Usage: climacros_expr_vm_bench [--json]
+  --json   emit one JSON document on stdout (for tracking regressions)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "expr_vm.h"
+
+using bench_clock_t = std::chrono::steady_clock;
+
+//-------------------------------------------------------------------------
+// Stub host functions
+//-------------------------------------------------------------------------
+static bool stub_here(const int64_t *, int64_t &result)
+{
+    result = 0x401000;
+    return true;
+}
+
+static bool stub_read(const int64_t *args, int64_t &result)
+{
+    result = (args[0] * 2654435761LL) & 0xFFFFFFFF;
+    return true;
+}
+
+static bool stub_sel_start(const int64_t *, int64_t &result)
+{
+    result = 0x401010;
+    return true;
+}
+
+static bool stub_sel_end(const int64_t *, int64_t &result)
+{
+    result = 0x401080;
+    return true;
+}
+
+static const expr_func_t STUB_FUNCS[] =
+{
+    { "here",                 0, stub_here },
+    { "get_screen_ea",        0, stub_here },
+    { "get_wide_dword",       1, stub_read },
+    { "get_qword",            1, stub_read },
+    { "get_segm_start",       1, stub_read },
+    { "read_selection_start", 0, stub_sel_start },
+    { "read_selection_end",   0, stub_sel_end },
+};
+
+static const char *const SAMPLES[] =
+{
+    "'0x%x' % idc.here()",
+    "'%x' % idc.here()",
+    "'0x%x' % idc.get_wide_dword(idc.here())",
+    "'0x%x' % idc.get_qword(idc.here())",
+    "'%x' % (idc.read_selection_end() - idc.read_selection_start())",
+    "hex(idc.get_segm_start(idc.here()))",
+    "'%08X %d' % (here() & 0xFFFF, (read_selection_end() - read_selection_start()) // 4)",
+    "str(min(here() + 16, read_selection_end())) + ':' + hex(max(1, 2, 3) << 4)",
+};
+
+//-------------------------------------------------------------------------
+struct result_t
+{
+    const char *expr;
+    bool   compiled;
+    double compile_ns;
+    double run_ns;
+};
+
+// Nanoseconds per call of 'fn', repeated for about 'budget_ms'
+template<class F>
+static double time_ns(double budget_ms, F &&fn)
+{
+    size_t iters = 0;
+    auto t0 = bench_clock_t::now();
+    std::chrono::duration<double, std::milli> dt{};
+    do
+    {
+        for (int i = 0; i < 1000; ++i)
+            fn();
+        iters += 1000;
+        dt = bench_clock_t::now() - t0;
+    } while (dt.count() < budget_ms);
+    return dt.count() * 1e6 / double(iters);
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+    }
+
+    const double budget_ms = 100;
+    const size_t nfuncs = sizeof(STUB_FUNCS) / sizeof(STUB_FUNCS[0]);
+
+    std::vector<result_t> results;
+    for (auto expr: SAMPLES)
+    {
+        result_t r = { expr, false, 0, 0 };
+        expr_program_t program;
+        r.compiled = program.compile(expr, STUB_FUNCS, nfuncs);
+        if (r.compiled)
+        {
+            r.compile_ns = time_ns(budget_ms, [&]() { program.compile(expr, STUB_FUNCS, nfuncs); });
+
+            std::string value;
+            r.run_ns = time_ns(budget_ms, [&]()
+            {
+                if (!program.run(value))
+                    value.clear();
+            });
+        }
+        results.push_back(r);
+    }
+
+    if (json)
+    {
+        printf("{\n  \"benchmark\": \"climacros_expr_vm_bench\",\n  \"expressions\": [\n");
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            auto &r = results[i];
+            std::string escaped;
+            for (const char *p = r.expr; *p != '\0'; ++p)
+            {
+                if (*p == '"' || *p == '\\')
+                    escaped += '\\';
+                escaped += *p;
+            }
+            printf("    {\"expr\": \"%s\", \"compiled\": %s, \"compile_ns\": %.1f, \"run_ns\": %.1f}%s\n",
+                   escaped.c_str(), r.compiled ? "true" : "false", r.compile_ns, r.run_ns,
+                   i + 1 < results.size() ? "," : "");
+        }
+        printf("  ]\n}\n");
+    }
+    else
+    {
+        printf("%-84s %12s %10s\n", "expression", "compile ns", "run ns");
+        for (auto &r: results)
+        {
+            if (r.compiled)
+                printf("%-84s %12.1f %10.1f\n", r.expr, r.compile_ns, r.run_ns);
+            else
+                printf("%-84s %12s %10s\n", r.expr, "n/a", "n/a");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/*
+Macro index benchmark: filtering a large macro set
+
+Indexes N macros, then times filters of the editor list (name prefixes,
+words of the expressions and descriptions, several words) and the updates
+made when a macro is edited.
+
+Usage: climacros_index_bench [--count N] [--json]
+  --count N  number of macros (default: 100000)
+  --json     emit one JSON document on stdout (for tracking regressions)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "macro_index.h"
+#include "macro_table.h"
+
+using bench_clock_t = std::chrono::steady_clock;
+
+static double us_since(bench_clock_t::time_point t0)
+{
+    return std::chrono::duration<double, std::micro>(bench_clock_t::now() - t0).count();
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    size_t count = 100000;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+            count = size_t(strtoull(argv[++i], nullptr, 10));
+    }
+
+    static const char *const words[] = { "cursor", "segment", "selection", "byte", "dword", "debugger", "value", "size" };
+    macro_table_t table;
+    table.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        const char *word = words[i % std::size(words)];
+        table.insert("$m" + n, "${'%x' % (idc.here() + " + n + ")}$", std::string("Current ") + word + " plus " + n);
+    }
+
+    macro_index_t index;
+    auto t0 = bench_clock_t::now();
+    for (auto slot: table.order())
+        index.add(slot, table.name(slot), table.expr(slot), table.desc(slot));
+    const double build_ms = us_since(t0) / 1000.0;
+
+    struct filter_t
+    {
+        const char *name;
+        const char *filter;
+        double us;
+        size_t rows;
+    };
+    filter_t filters[] =
+    {
+        { "name prefix (narrow)", "$m4242", 0, 0 },
+        { "name prefix (wide)",   "$m1", 0, 0 },
+        { "expression word",      "here", 0, 0 },
+        { "description word",     "debug", 0, 0 },
+        { "two words",            "segment 77", 0, 0 },
+        { "no match",             "nothing", 0, 0 },
+    };
+    std::vector<uint32_t> rows;
+    for (auto &f: filters)
+    {
+        const int runs = 20;
+        t0 = bench_clock_t::now();
+        for (int r = 0; r < runs; ++r)
+            index.query(f.filter, table.order(), rows);
+        f.us = us_since(t0) / runs;
+        f.rows = rows.size();
+    }
+
+    // An edit: the macro is indexed again
+    const size_t edits = std::min<size_t>(count, 10000);
+    t0 = bench_clock_t::now();
+    for (size_t i = 0; i < edits; ++i)
+    {
+        uint32_t slot = table.at((i * 7919) % count);
+        index.add(slot, table.name(slot), "${native:here:x}$", "Edited description");
+    }
+    const double edit_us = us_since(t0) / double(edits);
+
+    if (json)
+    {
+        printf("{\n  \"benchmark\": \"climacros_index_bench\",\n  \"count\": %zu,\n  \"build_ms\": %.2f,\n", count, build_ms);
+        printf("  \"edit_us\": %.2f,\n  \"filters\": [", edit_us);
+        for (size_t i = 0; i < std::size(filters); ++i)
+        {
+            printf("%s\n    {\"filter\": \"%s\", \"rows\": %zu, \"us\": %.1f}",
+                   i == 0 ? "" : ",", filters[i].filter, filters[i].rows, filters[i].us);
+        }
+        printf("\n  ]\n}\n");
+    }
+    else
+    {
+        printf("%zu macros\n", count);
+        printf("%-28s %12.2f ms\n", "build", build_ms);
+        printf("%-28s %12.2f us\n", "edit (reindex one macro)", edit_us);
+        for (auto &f: filters)
+            printf("%-28s %12.1f us  %8zu rows  \"%s\"\n", f.name, f.us, f.rows, f.filter);
+    }
+    return 0;
+}
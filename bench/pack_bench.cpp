@@ -0,0 +1,141 @@
+/*
+Macro pack benchmark: bulk import and export of a large macro pack
+
+Writes a pack of N macros, then times what the macro editor does with it:
+importing it into an empty list and into a list that already has the
+macros (replacing them), committing the list to the file store in one
+batch, rebuilding the matcher once, and exporting the list again. The
+files go to the system temporary directory and are removed afterwards.
+
+Usage: climacros_pack_bench [--count N] [--json]
+  --count N  number of macros (default: 100000)
+  --json     emit one JSON document on stdout (for tracking regressions)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include "macro_pack.h"
+#include "macro_replacer.h"
+#include "macro_store.h"
+#include "macro_table.h"
+
+using bench_clock_t = std::chrono::steady_clock;
+
+static double ms_since(bench_clock_t::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock_t::now() - t0).count();
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    size_t count = 100000;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+            count = size_t(strtoull(argv[++i], nullptr, 10));
+    }
+
+    auto tmp = std::filesystem::temp_directory_path();
+    const std::string pack_path   = (tmp / "climacros_pack_bench.txt").string();
+    const std::string export_path = (tmp / "climacros_pack_bench.out.txt").string();
+    const std::string store_path  = (tmp / "climacros_pack_bench.macros").string();
+    std::error_code ec;
+    auto cleanup = [&]()
+    {
+        for (auto &p: { pack_path, export_path, store_path, store_path + ".journal" })
+            std::filesystem::remove(p, ec);
+    };
+    cleanup();
+
+    // The pack, with a duplicate and a malformed line every 1000 macros
+    {
+        FILE *fp = fopen(pack_path.c_str(), "wb");
+        if (fp == nullptr)
+            return 1;
+        std::string line;
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto n = std::to_string(i);
+            line = "$m" + n + "\t${'%x' % (idc.here() + " + n + ")}$\tCursor location plus " + n + "\\t(hexadecimal)\n";
+            if (i % 1000 == 999)
+                line += "$m" + n + "\tduplicate\n" + "malformed\n";
+            fwrite(line.data(), 1, line.size(), fp);
+        }
+        fclose(fp);
+    }
+    const size_t pack_size = size_t(std::filesystem::file_size(pack_path, ec));
+
+    std::string error;
+    macro_table_t table;
+    macro_pack_result_t result;
+    auto t0 = bench_clock_t::now();
+    if (!import_macro_pack(pack_path, table, false, result, error))
+    {
+        fprintf(stderr, "import: %s\n", error.c_str());
+        return 1;
+    }
+    const double import_ms = ms_since(t0);
+    const macro_pack_result_t first = result;
+
+    t0 = bench_clock_t::now();
+    import_macro_pack(pack_path, table, true, result, error);
+    const double reimport_ms = ms_since(t0);
+
+    double commit_ms;
+    {
+        file_macro_store_t store(store_path);
+        store.open();
+        t0 = bench_clock_t::now();
+        if (!store.save_all(table))
+        {
+            fprintf(stderr, "save_all: %s\n", store.error().c_str());
+            return 1;
+        }
+        commit_ms = ms_since(t0);
+    }
+
+    macro_replacer_t replacer([](std::string_view expr) { return std::string(expr); });
+    t0 = bench_clock_t::now();
+    replacer.begin_update();
+    for (auto slot: table.order())
+        replacer.update(table.name(slot), table.expr(slot));
+    replacer.end_update();
+    const double rebuild_ms = ms_since(t0);
+
+    t0 = bench_clock_t::now();
+    if (!export_macro_pack(export_path, table, error))
+    {
+        fprintf(stderr, "export: %s\n", error.c_str());
+        return 1;
+    }
+    const double export_ms = ms_since(t0);
+
+    cleanup();
+
+    if (json)
+    {
+        printf("{\n  \"benchmark\": \"climacros_pack_bench\",\n  \"count\": %zu,\n  \"pack_size\": %zu,\n", count, pack_size);
+        printf("  \"added\": %zu,\n  \"duplicates\": %zu,\n  \"invalid\": %zu,\n", first.added, first.duplicates, first.invalid);
+        printf("  \"import_ms\": %.2f,\n  \"reimport_ms\": %.2f,\n  \"commit_ms\": %.2f,\n", import_ms, reimport_ms, commit_ms);
+        printf("  \"rebuild_ms\": %.2f,\n  \"export_ms\": %.2f\n}\n", rebuild_ms, export_ms);
+    }
+    else
+    {
+        printf("%zu macros, %zu bytes: %zu added, %zu duplicates, %zu invalid\n",
+               count, pack_size, first.added, first.duplicates, first.invalid);
+        printf("%-28s %12.2f ms\n", "import (empty list)", import_ms);
+        printf("%-28s %12.2f ms\n", "import (replacing)", reimport_ms);
+        printf("%-28s %12.2f ms\n", "commit (file store)", commit_ms);
+        printf("%-28s %12.2f ms\n", "matcher rebuild", rebuild_ms);
+        printf("%-28s %12.2f ms\n", "export", export_ms);
+    }
+    return 0;
+}
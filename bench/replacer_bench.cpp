@@ -0,0 +1,261 @@
+/*
+Replacer benchmark: expansion throughput and latency of the macro engine
+
+Measures macro_replacer_t outside of IDA, with a stub evaluator, across:
+- macro set sizes (the 25 defaults, 1k, 10k and 100k macros)
+- line lengths
+- hit densities (share of the words of a line that are macros)
+- number of inline "${expr}$" expressions per line
+and the time end_update() takes to rebuild each macro set, compared with
+an incremental edit of a single macro.
+
+Usage: climacros_bench [--json] [--quick]
+  --json   emit one JSON document on stdout (for tracking regressions)
+  --quick  smaller sets and shorter runs
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "macro_replacer.h"
+
+using bench_clock_t = std::chrono::steady_clock;
+
+// Names of the default macros (see DEFAULT_MACROS)
+static const char *const DEFAULT_MACRO_NAMES[] =
+{
+    "$!", "$!!", "$<", "$>", "$<<", "$>>", "$@b", "$@B", "$@d", "$@D", "$@q", "$@Q",
+    "$*b", "$*B", "$*d", "$*D", "$*q", "$*Q", "$[", "$]", "$[[", "$]]", "$#", "$##", "$cls"
+};
+
+//-------------------------------------------------------------------------
+struct result_t
+{
+    std::string name;
+    size_t macros;
+    size_t line_len;
+    int    hit_pct;
+    int    evals;
+    double ns_per_line;
+    double p50_ns;
+    double p99_ns;
+    double mb_per_s;
+};
+
+struct rebuild_result_t
+{
+    size_t macros;
+    double ms;
+    double edit_us;
+};
+
+//-------------------------------------------------------------------------
+// Macro set: the defaults followed by generated "$name_N" macros
+static void make_macro_set(std::vector<std::string> &names, size_t count)
+{
+    names.clear();
+    for (auto name: DEFAULT_MACRO_NAMES)
+    {
+        if (names.size() == count)
+            return;
+        names.push_back(name);
+    }
+
+    char buf[32];
+    for (size_t i = 0; names.size() < count; ++i)
+    {
+        snprintf(buf, sizeof(buf), "$m%zx_", i);
+        names.push_back(buf);
+    }
+}
+
+static double load_macros(macro_replacer_t &replacer, const std::vector<std::string> &names)
+{
+    auto t0 = bench_clock_t::now();
+    replacer.begin_update();
+    for (size_t i = 0; i < names.size(); ++i)
+        replacer.update(names[i], i % 2 == 0 ? "0x401000" : "${'0x%x' % idc.here()}$");
+    replacer.end_update();
+    return std::chrono::duration<double, std::milli>(bench_clock_t::now() - t0).count();
+}
+
+// Average time of an incremental single macro edit (add + remove)
+static double edit_macros(macro_replacer_t &replacer, size_t count)
+{
+    char buf[32];
+    auto t0 = bench_clock_t::now();
+    for (size_t i = 0; i < count; ++i)
+    {
+        snprintf(buf, sizeof(buf), "$edit%zx_", i);
+        replacer.add(buf, "${'0x%x' % idc.here()}$");
+        replacer.remove(buf);
+    }
+    return std::chrono::duration<double, std::micro>(bench_clock_t::now() - t0).count() / count;
+}
+
+//-------------------------------------------------------------------------
+// Lines of about 'len' bytes where 'hit_pct' percent of the words are
+// macros, with 'evals' inline expressions
+static void make_lines(
+    std::vector<std::string> &lines,
+    const std::vector<std::string> &names,
+    size_t len,
+    int hit_pct,
+    int evals,
+    std::mt19937 &rng)
+{
+    static const char *const words[] = { "idc.", "print", "(ea)", "0x1000", "dump", "+", "x", "db" };
+    lines.resize(64);
+    for (auto &line: lines)
+    {
+        line.clear();
+        while (line.size() < len)
+        {
+            if (int(rng() % 100) < hit_pct)
+                line += names[rng() % names.size()];
+            else
+                line += words[rng() % std::size(words)];
+            line += ' ';
+        }
+        for (int i = 0; i < evals; ++i)
+        {
+            size_t pos = rng() % (line.size() + 1);
+            while (pos > 0 && line[pos - 1] != ' ')
+                --pos;
+            line.insert(pos, "${hex(idc.here())}$ ");
+        }
+    }
+}
+
+//-------------------------------------------------------------------------
+static result_t run_case(
+    macro_replacer_t &replacer,
+    const std::vector<std::string> &lines,
+    double budget_ms)
+{
+    std::string out;
+    size_t bytes = 0;
+    for (auto &line: lines)
+        bytes += line.size();
+
+    // Each sample expands all the lines; the latency figures are per line
+    std::vector<double> samples;
+    double total_ns = 0;
+    size_t total_lines = 0;
+    auto deadline = bench_clock_t::now() + std::chrono::duration<double, std::milli>(budget_ms);
+    do
+    {
+        auto t0 = bench_clock_t::now();
+        for (auto &line: lines)
+        {
+            if (!replacer.expand(line, out))
+                out.clear();
+        }
+        double ns = std::chrono::duration<double, std::nano>(bench_clock_t::now() - t0).count();
+        samples.push_back(ns / lines.size());
+        total_ns += ns;
+        total_lines += lines.size();
+    } while (bench_clock_t::now() < deadline || samples.size() < 5);
+
+    std::sort(samples.begin(), samples.end());
+
+    result_t r = {};
+    r.ns_per_line = total_ns / total_lines;
+    r.p50_ns      = samples[samples.size() / 2];
+    r.p99_ns      = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+    r.mb_per_s    = (double(bytes) * (total_lines / lines.size())) / (total_ns / 1e9) / (1 << 20);
+    return r;
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    bool json = false, quick = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+    }
+
+    const size_t set_sizes[]  = { 25, 1000, 10000, quick ? size_t(20000) : size_t(100000) };
+    const size_t line_lens[]  = { 64, 1024, 16384 };
+    const int    hit_pcts[]   = { 0, 1, 10, 50 };
+    const int    eval_counts[] = { 0, 1, 8 };
+    const double budget_ms = quick ? 5 : 50;
+
+    // Stub evaluator
+    macro_replacer_t replacer([](std::string_view) { return std::string("0x401000"); });
+
+    std::mt19937 rng(1234);
+    std::vector<std::string> names, lines;
+    std::vector<result_t> results;
+    std::vector<rebuild_result_t> rebuilds;
+    for (size_t set_size: set_sizes)
+    {
+        make_macro_set(names, set_size);
+        double ms = load_macros(replacer, names);
+        rebuilds.push_back({ set_size, ms, edit_macros(replacer, 1000) });
+
+        for (size_t len: line_lens)
+        {
+            for (int hit: hit_pcts)
+            {
+                for (int evals: eval_counts)
+                {
+                    make_lines(lines, names, len, hit, evals, rng);
+                    result_t r = run_case(replacer, lines, budget_ms);
+                    r.name     = "expand";
+                    r.macros   = set_size;
+                    r.line_len = len;
+                    r.hit_pct  = hit;
+                    r.evals    = evals;
+                    results.push_back(r);
+                }
+            }
+        }
+    }
+
+    if (json)
+    {
+        printf("{\n  \"benchmark\": \"climacros_bench\",\n  \"rebuild\": [\n");
+        for (size_t i = 0; i < rebuilds.size(); ++i)
+        {
+            printf("    {\"macros\": %zu, \"ms\": %.3f, \"edit_us\": %.3f}%s\n",
+                   rebuilds[i].macros, rebuilds[i].ms, rebuilds[i].edit_us,
+                   i + 1 < rebuilds.size() ? "," : "");
+        }
+        printf("  ],\n  \"expand\": [\n");
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            auto &r = results[i];
+            printf("    {\"macros\": %zu, \"line_len\": %zu, \"hit_pct\": %d, \"evals\": %d, "
+                   "\"ns_per_line\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"mb_per_s\": %.1f}%s\n",
+                   r.macros, r.line_len, r.hit_pct, r.evals,
+                   r.ns_per_line, r.p50_ns, r.p99_ns, r.mb_per_s,
+                   i + 1 < results.size() ? "," : "");
+        }
+        printf("  ]\n}\n");
+    }
+    else
+    {
+        printf("%-8s %12s %12s\n", "macros", "rebuild ms", "edit us");
+        for (auto &r: rebuilds)
+            printf("%-8zu %12.3f %12.3f\n", r.macros, r.ms, r.edit_us);
+
+        printf("\n%-8s %8s %5s %6s %12s %12s %12s %10s\n",
+               "macros", "line", "hit%", "evals", "ns/line", "p50 ns", "p99 ns", "MB/s");
+        for (auto &r: results)
+        {
+            printf("%-8zu %8zu %5d %6d %12.1f %12.1f %12.1f %10.1f\n",
+                   r.macros, r.line_len, r.hit_pct, r.evals,
+                   r.ns_per_line, r.p50_ns, r.p99_ns, r.mb_per_s);
+        }
+    }
+    return 0;
+}
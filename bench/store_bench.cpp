@@ -0,0 +1,136 @@
+/*
+Macro store benchmark: file store operations on a large macro set
+
+Writes a snapshot of N macros, then times opening and loading it (what the
+plugin does at startup), looking macros and descriptions up, appending
+changes to the journal and compacting it. The files go to the system
+temporary directory and are removed afterwards.
+
+Usage: climacros_store_bench [--count N] [--json]
+  --count N  number of macros (default: 100000)
+  --json     emit one JSON document on stdout (for tracking regressions)
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "macro_store.h"
+
+using bench_clock_t = std::chrono::steady_clock;
+
+static double ms_since(bench_clock_t::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock_t::now() - t0).count();
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    size_t count = 100000;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+            count = size_t(strtoull(argv[++i], nullptr, 10));
+    }
+
+    const std::string path = (std::filesystem::temp_directory_path() / "climacros_store_bench.macros").string();
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    std::filesystem::remove(path + ".journal", ec);
+
+    macros_t macros;
+    macros.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        macros.push_back({ "$m" + n, "${'%x' % (idc.here() + " + n + ")}$", "Cursor location plus " + n + " (hexadecimal)" });
+    }
+
+    double save_all_ms, open_ms, load_ms, find_ns, desc_ns, append_ns, compact_ms;
+    size_t loaded, file_size;
+    {
+        file_macro_store_t store(path);
+        store.open();
+        auto t0 = bench_clock_t::now();
+        if (!store.save_all(macros))
+        {
+            fprintf(stderr, "save_all: %s\n", store.error().c_str());
+            return 1;
+        }
+        save_all_ms = ms_since(t0);
+        file_size = size_t(std::filesystem::file_size(path, ec));
+    }
+
+    {
+        file_macro_store_t store(path);
+        auto t0 = bench_clock_t::now();
+        if (!store.open())
+        {
+            fprintf(stderr, "open: %s\n", store.error().c_str());
+            return 1;
+        }
+        open_ms = ms_since(t0);
+
+        macros_t loaded_macros;
+        t0 = bench_clock_t::now();
+        store.load(loaded_macros);
+        load_ms = ms_since(t0);
+        loaded = loaded_macros.size();
+
+        const size_t lookups = std::min<size_t>(count, 100000);
+        macro_def_t def;
+        t0 = bench_clock_t::now();
+        for (size_t i = 0; i < lookups; ++i)
+            store.find(macros[(i * 7919) % count].macro, def);
+        find_ns = ms_since(t0) * 1e6 / double(lookups);
+
+        t0 = bench_clock_t::now();
+        size_t total = 0;
+        for (size_t i = 0; i < lookups; ++i)
+            total += store.desc(loaded_macros[(i * 7919) % count]).size();
+        desc_ns = ms_since(t0) * 1e6 / double(lookups);
+        if (total == 0)
+            return 1;
+
+        // Stay below the compaction threshold
+        const size_t appends = file_macro_store_t::MIN_COMPACT_RECORDS;
+        t0 = bench_clock_t::now();
+        for (size_t i = 0; i < appends; ++i)
+            store.save({ "$new" + std::to_string(i), "new", "" });
+        append_ns = ms_since(t0) * 1e6 / double(appends);
+
+        t0 = bench_clock_t::now();
+        store.compact();
+        compact_ms = ms_since(t0);
+    }
+
+    std::filesystem::remove(path, ec);
+    std::filesystem::remove(path + ".journal", ec);
+
+    if (json)
+    {
+        printf("{\n  \"benchmark\": \"climacros_store_bench\",\n  \"count\": %zu,\n  \"file_size\": %zu,\n", count, file_size);
+        printf("  \"save_all_ms\": %.2f,\n  \"open_ms\": %.2f,\n  \"load_ms\": %.2f,\n", save_all_ms, open_ms, load_ms);
+        printf("  \"find_ns\": %.1f,\n  \"desc_ns\": %.1f,\n  \"append_ns\": %.1f,\n  \"compact_ms\": %.2f\n}\n",
+               find_ns, desc_ns, append_ns, compact_ms);
+    }
+    else
+    {
+        printf("%zu macros, %zu bytes (%zu loaded)\n", count, file_size, loaded);
+        printf("%-28s %12.2f ms\n", "save_all", save_all_ms);
+        printf("%-28s %12.2f ms\n", "open (map + journal)", open_ms);
+        printf("%-28s %12.2f ms\n", "load (no descriptions)", load_ms);
+        printf("%-28s %12.1f ns\n", "find", find_ns);
+        printf("%-28s %12.1f ns\n", "desc", desc_ns);
+        printf("%-28s %12.1f ns\n", "journal append", append_ns);
+        printf("%-28s %12.2f ms\n", "compact", compact_ms);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+Stress benchmark: expansion throughput on 1 to 64 MB inputs
+
+Runs the macro replacer, with a stub evaluator, over large generated inputs
+(pasted hex dumps, generated scripts, pathological '${' runs...) both in one
+shot and in streaming mode, and reports the throughput. A linear engine keeps
+the MB/s figure flat as the input size grows.
+
+Usage: climacros_stress_bench [max_mb=64]
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "macro_replacer.h"
+
+// Names of the default macros (see DEFAULT_MACROS)
+static const char *const DEFAULT_MACRO_NAMES[] =
+{
+    "$!", "$!!", "$<", "$>", "$<<", "$>>", "$@b", "$@B", "$@d", "$@D", "$@q", "$@Q",
+    "$*b", "$*B", "$*d", "$*D", "$*q", "$*Q", "$[", "$]", "$[[", "$]]", "$#", "$##", "$cls"
+};
+
+//-------------------------------------------------------------------------
+// Input generators: fill 'out' with 'size' bytes
+using generator_t = void (*)(std::string &out, size_t size);
+
+static void gen_hexdump(std::string &out, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned v = 0x1234567;
+    while (out.size() < size)
+    {
+        v = v * 1103515245 + 12345;
+        out += hex[(v >> 16) & 0xF];
+        out += hex[(v >> 20) & 0xF];
+        out += out.size() % 48 == 47 ? '\n' : ' ';
+    }
+    out.resize(size);
+}
+
+static void gen_script(std::string &out, size_t size)
+{
+    while (out.size() < size)
+        out += "auto x = get_wide_dword($!) + $@d; print(\"${hex(x)}$\", $<, $>);\n";
+    out.resize(size);
+}
+
+static void gen_dollars(std::string &out, size_t size)
+{
+    // Lead bytes of every macro but never a match
+    while (out.size() < size)
+        out += "$ $$ $x $@ $* $(";
+    out.resize(size);
+}
+
+static void gen_open_exprs(std::string &out, size_t size)
+{
+    // Unterminated inline expressions on a single line
+    while (out.size() < size)
+        out += "${'${\"${{";
+    out.resize(size);
+}
+
+static void gen_long_line(std::string &out, size_t size)
+{
+    // One huge line sprinkled with macros and inline expressions
+    while (out.size() < size)
+        out += "aaaaaaaaaaaaaaaaaaaaaaaa $! bbbbbbbbbbbbbbbbb ${1+2}$ ccccccccccccccccc $## ";
+    out.resize(size);
+}
+
+struct workload_t
+{
+    const char *name;
+    generator_t gen;
+};
+
+static const workload_t WORKLOADS[] =
+{
+    { "hexdump",    gen_hexdump },
+    { "script",     gen_script },
+    { "dollars",    gen_dollars },
+    { "open_exprs", gen_open_exprs },
+    { "long_line",  gen_long_line },
+};
+
+//-------------------------------------------------------------------------
+static double seconds_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_mb = argc > 1 ? size_t(atoi(argv[1])) : 64;
+
+    macro_replacer_t replacer([](std::string_view) { return std::string("0x401000"); });
+    replacer.begin_update();
+    for (auto name: DEFAULT_MACRO_NAMES)
+        replacer.update(name, "${'0x%x' % idc.here()}$");
+    replacer.end_update();
+
+    printf("%-12s %6s %12s %12s\n", "workload", "MB", "oneshot MB/s", "stream MB/s");
+    std::string input, out;
+    for (auto &w: WORKLOADS)
+    {
+        for (size_t mb = 1; mb <= max_mb; mb *= 2)
+        {
+            input.clear();
+            w.gen(input, mb << 20);
+
+            auto t0 = std::chrono::steady_clock::now();
+            if (!replacer.expand(input, out))
+                out = input;
+            double oneshot = seconds_since(t0);
+            size_t oneshot_size = out.size();
+
+            t0 = std::chrono::steady_clock::now();
+            out.clear();
+            macro_replacer_t::stream_t stream(replacer);
+            const size_t CHUNK = 64 * 1024;
+            for (size_t pos = 0; pos < input.size(); pos += CHUNK)
+                stream.feed(std::string_view(input).substr(pos, CHUNK), out);
+            stream.finish(out);
+            double streamed = seconds_since(t0);
+
+            if (out.size() != oneshot_size)
+            {
+                fprintf(stderr, "%s: streaming output differs from one shot output!\n", w.name);
+                return EXIT_FAILURE;
+            }
+            printf("%-12s %6zu %12.1f %12.1f\n", w.name, mb, mb / oneshot, mb / streamed);
+        }
+    }
+    return EXIT_SUCCESS;
+}
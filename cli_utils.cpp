@@ -8,6 +8,7 @@ CLI Utils: Cross-platform code for CLI finding and hooking
 #include "idasdk.h"
 #include "cli_utils.h"
 #include "macro_editor.h"
+#include "macro_trace.h"
 #include <idacpp/callbacks/callbacks.hpp>
 
 using namespace idacpp::callbacks;
@@ -353,8 +354,14 @@ const cli_t *hook_cli(const cli_t *cli)
         // Register callback with lambda that captures old_cli
         auto result = cli_execute_registry.register_callback(
             [&ctx](const char *line) -> bool {
-                std::string repl = macro_replacer(line);
-                return ctx.old_cli->execute_line(repl.c_str());
+                macro_trace_t::span_t span(macro_trace, "line", "cli", line);
+
+                // Lines without macros are forwarded as-is (no allocation)
+                std::string repl;
+                bool expanded = macro_replacer.expand(line, repl);
+
+                macro_trace_t::span_t exec_span(macro_trace, "execute_line", "cli", ctx.old_cli->sname);
+                return ctx.old_cli->execute_line(expanded ? repl.c_str() : line);
             }
         );
 
@@ -0,0 +1,1128 @@
+/*
+Expression VM: Compiler and interpreter implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include "expr_vm.h"
+
+// Modules the host functions may be qualified with
+static const char *const KNOWN_MODULES[] =
+{
+    "idc", "idaapi", "ida_bytes", "ida_kernwin", "ida_segment", "ida_name", "ida_funcs", "ida_dbg"
+};
+
+// Nesting of parentheses, calls and unary operators
+static constexpr int MAX_NESTING = 32;
+
+// Widest formatted field
+static constexpr int MAX_FORMAT_WIDTH = 1024;
+
+//-------------------------------------------------------------------------
+// Lexer
+//-------------------------------------------------------------------------
+namespace {
+
+enum tok_kind_t
+{
+    TK_END,
+    TK_INT,
+    TK_STR,
+    TK_NAME,
+    TK_OP,
+    TK_ERROR,
+};
+
+struct token_t
+{
+    tok_kind_t       kind = TK_END;
+    std::string_view text;      // Names and operators
+    int64_t          ival = 0;
+    std::string      sval;
+};
+
+class lexer_t
+{
+    std::string_view m_src;
+    size_t m_pos = 0;
+
+    static bool is_ident_char(char ch)
+    {
+        return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+    }
+
+    static int digit_value(char ch)
+    {
+        if (ch >= '0' && ch <= '9')
+            return ch - '0';
+        if (ch >= 'a' && ch <= 'f')
+            return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F')
+            return ch - 'A' + 10;
+        return 99;
+    }
+
+    bool lex_int(token_t &tok);
+    bool lex_str(token_t &tok);
+
+public:
+    lexer_t(std::string_view src) : m_src(src) { }
+
+    void next(token_t &tok);
+};
+
+//-------------------------------------------------------------------------
+bool lexer_t::lex_int(token_t &tok)
+{
+    int base = 10;
+    if (m_src[m_pos] == '0' && m_pos + 1 < m_src.size())
+    {
+        switch (m_src[m_pos + 1])
+        {
+            case 'x': case 'X': base = 16; break;
+            case 'o': case 'O': base = 8;  break;
+            case 'b': case 'B': base = 2;  break;
+        }
+        if (base != 10)
+            m_pos += 2;
+    }
+
+    uint64_t v = 0;
+    size_t ndigits = 0;
+    for (; m_pos < m_src.size() && is_ident_char(m_src[m_pos]); ++m_pos)
+    {
+        char ch = m_src[m_pos];
+        if (ch == '_')
+            continue;
+
+        int d = digit_value(ch);
+        if (d >= base || v > (uint64_t(INT64_MAX) - d) / base)
+            return false;
+        // Python rejects decimal literals with leading zeros
+        if (base == 10 && ndigits == 1 && v == 0)
+            return false;
+        v = v * base + d;
+        ++ndigits;
+    }
+
+    // Floats are not supported
+    if (ndigits == 0 || (m_pos < m_src.size() && m_src[m_pos] == '.'))
+        return false;
+
+    tok.kind = TK_INT;
+    tok.ival = int64_t(v);
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool lexer_t::lex_str(token_t &tok)
+{
+    const char quote = m_src[m_pos++];
+    tok.sval.clear();
+    while (m_pos < m_src.size())
+    {
+        char ch = m_src[m_pos++];
+        if (ch == quote)
+        {
+            // Triple quoted strings are not supported
+            if (tok.sval.empty() && m_pos < m_src.size() && m_src[m_pos] == quote)
+                return false;
+            tok.kind = TK_STR;
+            return true;
+        }
+        if (ch == '\n' || uint8_t(ch) >= 0x80)
+            return false;
+        if (ch != '\\')
+        {
+            tok.sval += ch;
+            continue;
+        }
+
+        if (m_pos >= m_src.size())
+            return false;
+        ch = m_src[m_pos++];
+        switch (ch)
+        {
+            case '\\': case '\'': case '"': tok.sval += ch; break;
+            case 'n': tok.sval += '\n'; break;
+            case 't': tok.sval += '\t'; break;
+            case 'r': tok.sval += '\r'; break;
+            case 'x':
+            {
+                if (m_pos + 2 > m_src.size())
+                    return false;
+                int hi = digit_value(m_src[m_pos]), lo = digit_value(m_src[m_pos + 1]);
+                if (hi > 15 || lo > 15 || hi > 7)
+                    return false;
+                tok.sval += char(hi * 16 + lo);
+                m_pos += 2;
+                break;
+            }
+            default:
+                // Octal escapes and the like are not supported
+                if (ch >= '0' && ch <= '9')
+                    return false;
+                // Unknown escapes are kept as-is, like Python does
+                tok.sval += '\\';
+                tok.sval += ch;
+                break;
+        }
+    }
+    return false;
+}
+
+//-------------------------------------------------------------------------
+void lexer_t::next(token_t &tok)
+{
+    while (m_pos < m_src.size() && (m_src[m_pos] == ' ' || m_src[m_pos] == '\t'))
+        ++m_pos;
+
+    tok.text = std::string_view();
+    if (m_pos >= m_src.size())
+    {
+        tok.kind = TK_END;
+        return;
+    }
+
+    const size_t start = m_pos;
+    const char ch = m_src[m_pos];
+    if (ch >= '0' && ch <= '9')
+    {
+        if (!lex_int(tok))
+            tok.kind = TK_ERROR;
+        return;
+    }
+    if (ch == '\'' || ch == '"')
+    {
+        if (!lex_str(tok))
+            tok.kind = TK_ERROR;
+        return;
+    }
+    if (is_ident_char(ch))
+    {
+        while (m_pos < m_src.size() && is_ident_char(m_src[m_pos]))
+            ++m_pos;
+        tok.kind = TK_NAME;
+        tok.text = m_src.substr(start, m_pos - start);
+        return;
+    }
+
+    static const char *const ops2[] = { "//", "<<", ">>", "<=", ">=", "==", "!=", "**" };
+    for (auto op: ops2)
+    {
+        if (m_src.substr(m_pos, 2) == op)
+        {
+            m_pos += 2;
+            tok.kind = TK_OP;
+            tok.text = m_src.substr(start, 2);
+            return;
+        }
+    }
+    if (strchr("+-*/%&|^~<>(),.", ch) != nullptr)
+    {
+        ++m_pos;
+        tok.kind = TK_OP;
+        tok.text = m_src.substr(start, 1);
+        return;
+    }
+    tok.kind = TK_ERROR;
+}
+
+} // namespace
+
+//-------------------------------------------------------------------------
+// Compiler
+//-------------------------------------------------------------------------
+
+// Recursive descent compiler emitting stack machine code, with static
+// typing (the subset has no dynamic types)
+class expr_compiler_t
+{
+    using type_t   = expr_program_t::type_t;
+    using opcode_t = expr_program_t::opcode_t;
+
+    lexer_t m_lex;
+    token_t m_tok;
+    expr_program_t &m_prog;
+    const expr_func_t *m_funcs;
+    size_t m_nfuncs;
+    std::string *m_error;
+
+    int    m_nesting = 0;
+    size_t m_stack   = 0;
+
+    void advance() { m_lex.next(m_tok); }
+
+    bool is_op(const char *op) const { return m_tok.kind == TK_OP && m_tok.text == op; }
+    bool is_name(const char *name) const { return m_tok.kind == TK_NAME && m_tok.text == name; }
+
+    bool fail(const char *why)
+    {
+        if (m_error != nullptr && m_error->empty())
+            *m_error = why;
+        return false;
+    }
+
+    static bool is_number(type_t t) { return t != expr_program_t::T_STR; }
+
+    // Emit an instruction and track the stack depth
+    uint32_t emit(opcode_t op, uint32_t arg, int stack_delta)
+    {
+        m_prog.m_code.push_back({ op, arg });
+        m_stack += stack_delta;
+        m_prog.m_max_stack = std::max(m_prog.m_max_stack, m_stack);
+        return uint32_t(m_prog.m_code.size() - 1);
+    }
+
+    bool parse_expr(type_t &t);
+    bool parse_logical(type_t &t, const char *keyword);
+    bool parse_not(type_t &t);
+    bool parse_compare(type_t &t);
+    bool parse_binary(type_t &t, int level);
+    bool parse_unary(type_t &t, size_t *tuple_len = nullptr);
+    bool parse_primary(type_t &t, size_t *tuple_len);
+    bool parse_call(std::string_view name, bool qualified, type_t &t);
+
+public:
+    expr_compiler_t(
+        std::string_view src,
+        expr_program_t &prog,
+        const expr_func_t *funcs,
+        size_t nfuncs,
+        std::string *error)
+        : m_lex(src), m_prog(prog), m_funcs(funcs), m_nfuncs(nfuncs), m_error(error)
+    {
+    }
+
+    bool compile();
+};
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::compile()
+{
+    advance();
+    type_t t;
+    if (!parse_expr(t))
+        return false;
+    if (m_tok.kind != TK_END)
+        return fail("unsupported syntax");
+    if (t != expr_program_t::T_STR)
+        return fail("the expression does not evaluate to a string");
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::parse_expr(type_t &t)
+{
+    if (++m_nesting > MAX_NESTING)
+        return fail("expression nested too deeply");
+    bool ok = parse_logical(t, "or");
+    --m_nesting;
+    return ok;
+}
+
+//-------------------------------------------------------------------------
+// "a or b" / "a and b": the value of the operand that decided
+bool expr_compiler_t::parse_logical(type_t &t, const char *keyword)
+{
+    const bool is_or = strcmp(keyword, "or") == 0;
+    if (!(is_or ? parse_logical(t, "and") : parse_not(t)))
+        return false;
+
+    while (is_name(keyword))
+    {
+        advance();
+        uint32_t jump = emit(
+            is_or ? expr_program_t::OP_JUMP_IF_TRUE_OR_POP : expr_program_t::OP_JUMP_IF_FALSE_OR_POP,
+            0,
+            -1);
+
+        type_t t2;
+        if (!(is_or ? parse_logical(t2, "and") : parse_not(t2)))
+            return false;
+        if (t2 != t)
+            return fail("operands of different types");
+        m_prog.m_code[jump].arg = uint32_t(m_prog.m_code.size());
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::parse_not(type_t &t)
+{
+    if (!is_name("not"))
+        return parse_compare(t);
+
+    advance();
+    if (++m_nesting > MAX_NESTING)
+        return fail("expression nested too deeply");
+    bool ok = parse_not(t);
+    --m_nesting;
+    if (!ok)
+        return false;
+
+    emit(expr_program_t::OP_NOT, 0, 0);
+    t = expr_program_t::T_BOOL;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::parse_compare(type_t &t)
+{
+    if (!parse_binary(t, 0))
+        return false;
+
+    static const struct { const char *op; opcode_t code; } cmps[] =
+    {
+        { "<",  expr_program_t::OP_LT }, { "<=", expr_program_t::OP_LE },
+        { ">",  expr_program_t::OP_GT }, { ">=", expr_program_t::OP_GE },
+        { "==", expr_program_t::OP_EQ }, { "!=", expr_program_t::OP_NE },
+    };
+    for (auto &cmp: cmps)
+    {
+        if (!is_op(cmp.op))
+            continue;
+
+        advance();
+        type_t t2;
+        if (!parse_binary(t2, 0))
+            return false;
+        if (is_number(t) != is_number(t2))
+            return fail("comparison of different types");
+        emit(cmp.code, 0, -1);
+        t = expr_program_t::T_BOOL;
+
+        for (auto &chained: cmps)
+        {
+            if (is_op(chained.op))
+                return fail("chained comparisons are not supported");
+        }
+        break;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Binary operators, by increasing precedence
+bool expr_compiler_t::parse_binary(type_t &t, int level)
+{
+    static const struct { const char *op; opcode_t code; } levels[][4] =
+    {
+        { { "|",  expr_program_t::OP_OR } },
+        { { "^",  expr_program_t::OP_XOR } },
+        { { "&",  expr_program_t::OP_AND } },
+        { { "<<", expr_program_t::OP_SHL }, { ">>", expr_program_t::OP_SHR } },
+        { { "+",  expr_program_t::OP_ADD }, { "-",  expr_program_t::OP_SUB } },
+        { { "*",  expr_program_t::OP_MUL }, { "//", expr_program_t::OP_FLOORDIV }, { "%", expr_program_t::OP_MOD } },
+    };
+    const int nlevels = int(std::size(levels));
+    const bool last = level == nlevels - 1;
+
+    if (!(last ? parse_unary(t) : parse_binary(t, level + 1)))
+        return false;
+
+    while (true)
+    {
+        const char *op = nullptr;
+        opcode_t code = expr_program_t::OP_POP;
+        for (auto &entry: levels[level])
+        {
+            if (entry.op != nullptr && is_op(entry.op))
+            {
+                op = entry.op;
+                code = entry.code;
+            }
+        }
+        if (op == nullptr)
+        {
+            if (last && (is_op("/") || is_op("**")))
+                return fail("unsupported operator");
+            return true;
+        }
+        advance();
+
+        // String formatting: 'fmt' % value or 'fmt' % (v1, v2...)
+        if (code == expr_program_t::OP_MOD && t == expr_program_t::T_STR)
+        {
+            size_t n = 1;
+            type_t t2;
+            if (!parse_unary(t2, &n))
+                return false;
+            emit(expr_program_t::OP_FORMAT, uint32_t(n), -int(n));
+            continue;
+        }
+
+        type_t t2;
+        if (!(last ? parse_unary(t2) : parse_binary(t2, level + 1)))
+            return false;
+
+        if (code == expr_program_t::OP_ADD && t == expr_program_t::T_STR && t2 == expr_program_t::T_STR)
+        {
+            emit(expr_program_t::OP_CONCAT, 0, -1);
+            continue;
+        }
+        if (!is_number(t) || !is_number(t2))
+            return fail("unsupported operand types");
+        emit(code, 0, -1);
+
+        // Bitwise operations on booleans give booleans
+        const bool bitwise = code == expr_program_t::OP_AND || code == expr_program_t::OP_OR || code == expr_program_t::OP_XOR;
+        if (!bitwise || t != expr_program_t::T_BOOL || t2 != expr_program_t::T_BOOL)
+            t = expr_program_t::T_INT;
+    }
+}
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::parse_unary(type_t &t, size_t *tuple_len)
+{
+    opcode_t code;
+    if (is_op("-"))
+        code = expr_program_t::OP_NEG;
+    else if (is_op("~"))
+        code = expr_program_t::OP_INV;
+    else if (is_op("+"))
+        code = expr_program_t::OP_POP;
+    else
+        return parse_primary(t, tuple_len);
+
+    advance();
+    if (++m_nesting > MAX_NESTING)
+        return fail("expression nested too deeply");
+    bool ok = parse_unary(t);
+    --m_nesting;
+    if (!ok)
+        return false;
+    if (!is_number(t))
+        return fail("unsupported operand type");
+
+    // Unary plus only turns booleans into integers
+    if (code == expr_program_t::OP_POP)
+        emit(expr_program_t::OP_INT, 0, 0);
+    else
+        emit(code, 0, 0);
+    t = expr_program_t::T_INT;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::parse_primary(type_t &t, size_t *tuple_len)
+{
+    switch (m_tok.kind)
+    {
+        case TK_INT:
+            m_prog.m_ints.push_back(m_tok.ival);
+            emit(expr_program_t::OP_PUSH_INT, uint32_t(m_prog.m_ints.size() - 1), 1);
+            t = expr_program_t::T_INT;
+            advance();
+            return true;
+
+        case TK_STR:
+            m_prog.m_strs.push_back(std::move(m_tok.sval));
+            emit(expr_program_t::OP_PUSH_STR, uint32_t(m_prog.m_strs.size() - 1), 1);
+            t = expr_program_t::T_STR;
+            advance();
+            if (m_tok.kind == TK_STR)
+                return fail("implicit string concatenation is not supported");
+            return true;
+
+        case TK_NAME:
+        {
+            // Qualified names: module.function
+            std::string_view name = m_tok.text;
+            bool qualified = false;
+            advance();
+            while (is_op("."))
+            {
+                bool module = false;
+                for (auto mod: KNOWN_MODULES)
+                    module |= name == mod;
+                if (!module)
+                    return fail("attributes are not supported");
+
+                advance();
+                if (m_tok.kind != TK_NAME)
+                    return fail("unsupported syntax");
+                name = m_tok.text;
+                qualified = true;
+                advance();
+            }
+            if (!is_op("("))
+                return fail("variables are not supported");
+            return parse_call(name, qualified, t);
+        }
+
+        case TK_OP:
+        {
+            if (!is_op("("))
+                break;
+
+            advance();
+            if (!parse_expr(t))
+                return false;
+
+            // Tuples are only allowed as format arguments
+            size_t n = 1;
+            bool tuple = false;
+            while (is_op(","))
+            {
+                tuple = true;
+                advance();
+                if (is_op(")"))
+                    break;
+                type_t t2;
+                if (!parse_expr(t2))
+                    return false;
+                ++n;
+            }
+            if (!is_op(")"))
+                return fail("unsupported syntax");
+            advance();
+
+            if (tuple)
+            {
+                if (tuple_len == nullptr)
+                    return fail("tuples are not supported");
+                *tuple_len = n;
+            }
+            return true;
+        }
+
+        default:
+            break;
+    }
+    return fail("unsupported syntax");
+}
+
+//-------------------------------------------------------------------------
+bool expr_compiler_t::parse_call(std::string_view name, bool qualified, type_t &t)
+{
+    // Arguments
+    advance();
+    std::vector<type_t> args;
+    while (!is_op(")"))
+    {
+        type_t ta;
+        if (!parse_expr(ta))
+            return false;
+        args.push_back(ta);
+        if (is_op(","))
+            advance();
+        else if (!is_op(")"))
+            return fail("unsupported syntax");
+    }
+    advance();
+
+    const size_t n = args.size();
+    auto all_int = [&args]()
+    {
+        return std::all_of(args.begin(), args.end(), [](type_t ta) { return ta == expr_program_t::T_INT; });
+    };
+
+    // Builtins (not module attributes)
+    if (!qualified)
+    {
+        if (name == "hex" || name == "int" || name == "abs")
+        {
+            if (n != 1 || !is_number(args[0]))
+                return fail("unsupported builtin call");
+            emit(name == "hex" ? expr_program_t::OP_HEX : name == "int" ? expr_program_t::OP_INT : expr_program_t::OP_ABS, 0, 0);
+            t = name == "hex" ? expr_program_t::T_STR : expr_program_t::T_INT;
+            return true;
+        }
+        if (name == "str")
+        {
+            if (n != 1)
+                return fail("unsupported builtin call");
+            if (args[0] != expr_program_t::T_STR)
+                emit(expr_program_t::OP_STR, 0, 0);
+            t = expr_program_t::T_STR;
+            return true;
+        }
+        if (name == "len")
+        {
+            if (n != 1 || args[0] != expr_program_t::T_STR)
+                return fail("unsupported builtin call");
+            emit(expr_program_t::OP_LEN, 0, 0);
+            t = expr_program_t::T_INT;
+            return true;
+        }
+        if (name == "min" || name == "max")
+        {
+            if (n < 2 || !all_int())
+                return fail("unsupported builtin call");
+            emit(name == "min" ? expr_program_t::OP_MIN : expr_program_t::OP_MAX, uint32_t(n), 1 - int(n));
+            t = expr_program_t::T_INT;
+            return true;
+        }
+    }
+
+    // Host functions
+    for (size_t i = 0; i < m_nfuncs; ++i)
+    {
+        auto &func = m_funcs[i];
+        if (name != func.name)
+            continue;
+        if (int(n) != func.nargs || !std::all_of(args.begin(), args.end(), is_number))
+            return fail("wrong arguments to a host function");
+
+        uint32_t index = 0;
+        while (index < m_prog.m_funcs.size() && m_prog.m_funcs[index].func != func.func)
+            ++index;
+        if (index == m_prog.m_funcs.size())
+            m_prog.m_funcs.push_back(func);
+
+        emit(expr_program_t::OP_CALL, index, 1 - int(n));
+        t = expr_program_t::T_INT;
+        return true;
+    }
+    return fail("unknown function");
+}
+
+//-------------------------------------------------------------------------
+bool expr_program_t::compile(
+    std::string_view expr,
+    const expr_func_t *funcs,
+    size_t nfuncs,
+    std::string *error)
+{
+    m_code.clear();
+    m_ints.clear();
+    m_strs.clear();
+    m_funcs.clear();
+    m_max_stack = 0;
+    if (error != nullptr)
+        error->clear();
+
+    expr_compiler_t compiler(expr, *this, funcs, nfuncs, error);
+    if (!compiler.compile())
+    {
+        m_code.clear();
+        return false;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Interpreter
+//-------------------------------------------------------------------------
+namespace {
+
+struct value_t
+{
+    expr_program_t::type_t type;
+    int64_t i = 0;
+    std::string s;
+
+    value_t() : type(expr_program_t::T_INT) { }
+    value_t(expr_program_t::type_t type, int64_t i) : type(type), i(i) { }
+    value_t(std::string s) : type(expr_program_t::T_STR), s(std::move(s)) { }
+};
+
+bool truthy(const value_t &v)
+{
+    return v.type == expr_program_t::T_STR ? !v.s.empty() : v.i != 0;
+}
+
+bool checked_add(int64_t a, int64_t b, int64_t &r)
+{
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+        return false;
+    r = a + b;
+    return true;
+}
+
+bool checked_sub(int64_t a, int64_t b, int64_t &r)
+{
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b))
+        return false;
+    r = a - b;
+    return true;
+}
+
+bool checked_mul(int64_t a, int64_t b, int64_t &r)
+{
+    if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+              : (b > 0 ? a < INT64_MIN / b : (a != 0 && b < INT64_MAX / a)))
+    {
+        return false;
+    }
+    r = a * b;
+    return true;
+}
+
+// Python integer operations that are not plain C ones
+bool py_floordiv(int64_t a, int64_t b, int64_t &r)
+{
+    if (b == 0 || (a == INT64_MIN && b == -1))
+        return false;
+    r = a / b;
+    if (a % b != 0 && ((a < 0) != (b < 0)))
+        --r;
+    return true;
+}
+
+bool py_mod(int64_t a, int64_t b, int64_t &r)
+{
+    if (b == 0)
+        return false;
+    if (b == -1)
+    {
+        r = 0;
+        return true;
+    }
+    r = a % b;
+    if (r != 0 && ((r < 0) != (b < 0)))
+        r += b;
+    return true;
+}
+
+bool py_shl(int64_t a, int64_t b, int64_t &r)
+{
+    if (b < 0)
+        return false;
+    if (a == 0)
+    {
+        r = 0;
+        return true;
+    }
+    if (b >= 63 || a > (INT64_MAX >> b) || a < (INT64_MIN >> b))
+        return false;
+    r = int64_t(uint64_t(a) << b);
+    return true;
+}
+
+bool py_shr(int64_t a, int64_t b, int64_t &r)
+{
+    if (b < 0)
+        return false;
+    r = b >= 63 ? (a < 0 ? -1 : 0) : a >> b;
+    return true;
+}
+
+void py_str(const value_t &v, std::string &out)
+{
+    if (v.type == expr_program_t::T_STR)
+        out = v.s;
+    else if (v.type == expr_program_t::T_BOOL)
+        out = v.i != 0 ? "True" : "False";
+    else
+        out = std::to_string(v.i);
+}
+
+bool is_ascii(const std::string &s)
+{
+    return std::all_of(s.begin(), s.end(), [](char ch) { return uint8_t(ch) < 0x80; });
+}
+
+// printf-style formatting ('fmt' % args), restricted to the conversions
+// where C and Python agree
+bool py_format(const std::string &fmt, const value_t *args, size_t nargs, std::string &out)
+{
+    out.clear();
+    size_t next_arg = 0;
+    std::string spec, str;
+    for (size_t i = 0; i < fmt.size(); ++i)
+    {
+        char ch = fmt[i];
+        if (ch != '%')
+        {
+            out += ch;
+            continue;
+        }
+        if (++i >= fmt.size())
+            return false;
+        if (fmt[i] == '%')
+        {
+            out += '%';
+            continue;
+        }
+
+        // %[flags][width][.precision]conversion
+        spec = "%";
+        bool alt = false, sign = false, zero = false, left = false;
+        for (; i < fmt.size() && strchr("-+ #0", fmt[i]) != nullptr; ++i)
+        {
+            alt  |= fmt[i] == '#';
+            sign |= fmt[i] == '+' || fmt[i] == ' ';
+            zero |= fmt[i] == '0';
+            left |= fmt[i] == '-';
+            spec += fmt[i];
+        }
+        int width = 0, precision = -1;
+        for (; i < fmt.size() && fmt[i] >= '0' && fmt[i] <= '9'; ++i)
+        {
+            width = width * 10 + (fmt[i] - '0');
+            if (width > MAX_FORMAT_WIDTH)
+                return false;
+            spec += fmt[i];
+        }
+        if (i < fmt.size() && fmt[i] == '.')
+        {
+            spec += fmt[i++];
+            precision = 0;
+            for (; i < fmt.size() && fmt[i] >= '0' && fmt[i] <= '9'; ++i)
+            {
+                precision = precision * 10 + (fmt[i] - '0');
+                if (precision > MAX_FORMAT_WIDTH)
+                    return false;
+                spec += fmt[i];
+            }
+        }
+        if (i >= fmt.size() || next_arg >= nargs)
+            return false;
+
+        const value_t &arg = args[next_arg++];
+        const char conv = fmt[i];
+        char buf[2 * MAX_FORMAT_WIDTH + 64];
+
+        // With a precision, C ignores the '0' flag and prints nothing for
+        // a zero of precision 0; Python pads with zeros and prints "0"
+        if (conv != 's' && precision >= 0 && ((zero && !left) || (precision == 0 && arg.i == 0)))
+            return false;
+
+        switch (conv)
+        {
+            case 'd': case 'i': case 'u':
+                if (arg.type == expr_program_t::T_STR)
+                    return false;
+                spec += "lld";
+                snprintf(buf, sizeof(buf), spec.c_str(), (long long)arg.i);
+                break;
+
+            case 'x': case 'X': case 'o':
+                // Python prints negative values with a sign, and "0o"/"0x0"
+                // prefixes differently than C does. C also ignores the '+'
+                // and ' ' flags here, which Python honors ('%+x' % 255 is "+ff")
+                if (arg.type == expr_program_t::T_STR || arg.i < 0 || sign || (alt && (conv == 'o' || arg.i == 0)))
+                    return false;
+                spec += "ll";
+                spec += conv;
+                snprintf(buf, sizeof(buf), spec.c_str(), (long long)arg.i);
+                break;
+
+            case 's':
+            {
+                // Strings are padded with spaces, even with the '0' flag
+                py_str(arg, str);
+                if (!is_ascii(str))
+                    return false;
+                if (precision >= 0)
+                    str.resize(std::min(str.size(), size_t(precision)));
+                size_t pad = size_t(std::max(0, width - int(str.size())));
+                if (left)
+                    out.append(str).append(pad, ' ');
+                else
+                    out.append(pad, ' ').append(str);
+                continue;
+            }
+
+            default:
+                return false;
+        }
+        out += buf;
+    }
+
+    // Python refuses leftover arguments
+    return next_arg == nargs;
+}
+
+} // namespace
+
+//-------------------------------------------------------------------------
+bool expr_program_t::run(std::string &result) const
+{
+    if (m_code.empty())
+        return false;
+
+    std::vector<value_t> stack;
+    stack.reserve(m_max_stack);
+
+    int64_t args[16];
+    for (size_t pc = 0; pc < m_code.size(); ++pc)
+    {
+        const insn_t &insn = m_code[pc];
+        switch (insn.op)
+        {
+            case OP_PUSH_INT:
+                stack.push_back({ T_INT, m_ints[insn.arg] });
+                break;
+
+            case OP_PUSH_STR:
+                stack.push_back(value_t(m_strs[insn.arg]));
+                break;
+
+            case OP_CALL:
+            {
+                auto &func = m_funcs[insn.arg];
+                if (func.nargs > int(std::size(args)))
+                    return false;
+                size_t base = stack.size() - func.nargs;
+                for (int k = 0; k < func.nargs; ++k)
+                    args[k] = stack[base + k].i;
+                stack.resize(base);
+
+                int64_t r;
+                if (!func.func(args, r))
+                    return false;
+                stack.push_back({ T_INT, r });
+                break;
+            }
+
+            case OP_POP:
+                stack.pop_back();
+                break;
+
+            case OP_NEG:
+            {
+                auto &v = stack.back();
+                if (v.i == INT64_MIN)
+                    return false;
+                v = { T_INT, -v.i };
+                break;
+            }
+
+            case OP_INV:
+                stack.back() = { T_INT, ~stack.back().i };
+                break;
+
+            case OP_NOT:
+                stack.back() = { T_BOOL, truthy(stack.back()) ? 0 : 1 };
+                break;
+
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_FLOORDIV: case OP_MOD:
+            case OP_SHL: case OP_SHR: case OP_AND: case OP_OR: case OP_XOR:
+            {
+                const bool bools = stack.back().type == T_BOOL && stack[stack.size() - 2].type == T_BOOL;
+                int64_t b = stack.back().i;
+                stack.pop_back();
+                int64_t a = stack.back().i, r = 0;
+                bool ok = true;
+                switch (insn.op)
+                {
+                    case OP_ADD:      ok = checked_add(a, b, r); break;
+                    case OP_SUB:      ok = checked_sub(a, b, r); break;
+                    case OP_MUL:      ok = checked_mul(a, b, r); break;
+                    case OP_FLOORDIV: ok = py_floordiv(a, b, r); break;
+                    case OP_MOD:      ok = py_mod(a, b, r);      break;
+                    case OP_SHL:      ok = py_shl(a, b, r);      break;
+                    case OP_SHR:      ok = py_shr(a, b, r);      break;
+                    case OP_AND:      r = a & b; break;
+                    case OP_OR:       r = a | b; break;
+                    default:          r = a ^ b; break;
+                }
+                if (!ok)
+                    return false;
+                const bool bitwise = insn.op == OP_AND || insn.op == OP_OR || insn.op == OP_XOR;
+                stack.back() = { bitwise && bools ? T_BOOL : T_INT, r };
+                break;
+            }
+
+            case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+            {
+                value_t b = std::move(stack.back());
+                stack.pop_back();
+                auto &a = stack.back();
+                int c = a.type == T_STR ? a.s.compare(b.s) : (a.i < b.i ? -1 : a.i > b.i);
+                bool r;
+                switch (insn.op)
+                {
+                    case OP_LT: r = c < 0;  break;
+                    case OP_LE: r = c <= 0; break;
+                    case OP_GT: r = c > 0;  break;
+                    case OP_GE: r = c >= 0; break;
+                    case OP_EQ: r = c == 0; break;
+                    default:    r = c != 0; break;
+                }
+                a = { T_BOOL, r ? 1 : 0 };
+                break;
+            }
+
+            case OP_CONCAT:
+            {
+                value_t b = std::move(stack.back());
+                stack.pop_back();
+                stack.back().s += b.s;
+                break;
+            }
+
+            case OP_FORMAT:
+            {
+                size_t base = stack.size() - insn.arg;
+                std::string out;
+                if (!py_format(stack[base - 1].s, &stack[base], insn.arg, out))
+                    return false;
+                stack.resize(base);
+                stack.back().s = std::move(out);
+                break;
+            }
+
+            case OP_HEX:
+            {
+                auto &v = stack.back();
+                if (v.i == INT64_MIN)
+                    return false;
+                char buf[32];
+                snprintf(buf, sizeof(buf), "%s0x%llx", v.i < 0 ? "-" : "", (unsigned long long)(v.i < 0 ? -v.i : v.i));
+                v = value_t(buf);
+                break;
+            }
+
+            case OP_STR:
+            {
+                auto &v = stack.back();
+                std::string s;
+                py_str(v, s);
+                v = value_t(std::move(s));
+                break;
+            }
+
+            case OP_INT:
+                stack.back().type = T_INT;
+                break;
+
+            case OP_LEN:
+            {
+                auto &v = stack.back();
+                if (!is_ascii(v.s))
+                    return false;
+                v = { T_INT, int64_t(v.s.size()) };
+                break;
+            }
+
+            case OP_ABS:
+            {
+                auto &v = stack.back();
+                if (v.i == INT64_MIN)
+                    return false;
+                v = { T_INT, v.i < 0 ? -v.i : v.i };
+                break;
+            }
+
+            case OP_MIN: case OP_MAX:
+            {
+                size_t base = stack.size() - insn.arg;
+                int64_t r = stack[base].i;
+                for (size_t k = base + 1; k < stack.size(); ++k)
+                    r = insn.op == OP_MIN ? std::min(r, stack[k].i) : std::max(r, stack[k].i);
+                stack.resize(base + 1);
+                stack.back() = { T_INT, r };
+                break;
+            }
+
+            case OP_JUMP_IF_FALSE_OR_POP:
+            case OP_JUMP_IF_TRUE_OR_POP:
+                if (truthy(stack.back()) == (insn.op == OP_JUMP_IF_TRUE_OR_POP))
+                    pc = insn.arg - 1;
+                else
+                    stack.pop_back();
+                break;
+        }
+    }
+
+    result = std::move(stack.back().s);
+    return true;
+}
@@ -0,0 +1,99 @@
+/*
+Expression VM: Native compiler and interpreter for simple inline expressions
+
+Compiles a safe subset of Python expressions into bytecode once, then runs
+it without an interpreter:
+- integer literals, string literals
+- arithmetic (+ - * // % << >> & | ^ ~), comparisons, and/or/not
+- string formatting: 'fmt' % value and 'fmt' % (v1, v2, ...)
+- builtins: hex, str, int, len, abs, min, max
+- host functions (e.g. the IDA queries), optionally module qualified
+
+Integers are 64-bit: whenever Python would give a different result (overflow,
+division by zero, unsupported format...) the evaluation fails and the caller
+falls back to Python. Expressions outside the subset do not compile.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//-------------------------------------------------------------------------
+// Host functions callable from expressions
+//-------------------------------------------------------------------------
+struct expr_func_t
+{
+    const char *name;
+    int nargs;
+
+    // Returns false if the value is not available
+    bool (*func)(const int64_t *args, int64_t &result);
+};
+
+//-------------------------------------------------------------------------
+// Compiled expression
+//-------------------------------------------------------------------------
+class expr_program_t
+{
+public:
+    enum type_t : uint8_t
+    {
+        T_INT,
+        T_BOOL,
+        T_STR,
+    };
+
+    enum opcode_t : uint8_t
+    {
+        OP_PUSH_INT,        // arg: constant index
+        OP_PUSH_STR,        // arg: constant index
+        OP_CALL,            // arg: host function index
+        OP_POP,
+        OP_NEG, OP_INV, OP_NOT,
+        OP_ADD, OP_SUB, OP_MUL, OP_FLOORDIV, OP_MOD,
+        OP_SHL, OP_SHR, OP_AND, OP_OR, OP_XOR,
+        OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE,
+        OP_CONCAT,
+        OP_FORMAT,          // arg: number of values
+        OP_HEX, OP_STR, OP_INT, OP_LEN, OP_ABS,
+        OP_MIN, OP_MAX,     // arg: number of values
+        OP_JUMP_IF_FALSE_OR_POP,    // arg: target
+        OP_JUMP_IF_TRUE_OR_POP,     // arg: target
+    };
+
+    struct insn_t
+    {
+        opcode_t op;
+        uint32_t arg;
+    };
+
+private:
+    friend class expr_compiler_t;
+
+    std::vector<insn_t>      m_code;
+    std::vector<int64_t>     m_ints;
+    std::vector<std::string> m_strs;
+    std::vector<expr_func_t> m_funcs;
+    size_t                   m_max_stack = 0;
+
+public:
+    // Compile an expression. Returns false (and the reason in 'error') if
+    // the expression is outside the supported subset or does not evaluate
+    // to a string
+    bool compile(
+        std::string_view expr,
+        const expr_func_t *funcs,
+        size_t nfuncs,
+        std::string *error = nullptr);
+
+    bool empty() const { return m_code.empty(); }
+
+    // Run the program. Returns false if Python would not give the same
+    // result (the caller should then fall back to Python)
+    bool run(std::string &result) const;
+};
@@ -0,0 +1,35 @@
+/*
+File Mapping: Read-only memory mapping of a whole file
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//-------------------------------------------------------------------------
+class file_mapping_t
+{
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void *m_file = nullptr;
+    void *m_section = nullptr;
+#endif
+
+public:
+    file_mapping_t() = default;
+    ~file_mapping_t() { close(); }
+    file_mapping_t(const file_mapping_t &) = delete;
+    file_mapping_t &operator=(const file_mapping_t &) = delete;
+
+    // Fails if the file does not exist or is empty
+    bool open(const std::string &path);
+    void close();
+
+    const uint8_t *data() const { return m_data; }
+    size_t size() const { return m_size; }
+};
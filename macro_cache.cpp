@@ -0,0 +1,131 @@
+/*
+Macro Cache: Cache file implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <cerrno>
+#include <filesystem>
+#include "macro_cache.h"
+
+static constexpr char     CACHE_MAGIC[8] = { 'C', 'L', 'I', 'M', 'C', 'A', 'C', 'H' };
+static constexpr uint32_t CACHE_VERSION  = 1;
+
+struct cache_header_t
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t format;        // Of the payload, given by the writer
+    uint64_t key;
+    uint64_t payload_size;
+    uint64_t checksum;      // Of the payload
+};
+
+//-------------------------------------------------------------------------
+// FNV-1a over 8-byte words, then over the bytes left: several times faster
+// than hashing byte by byte, and a change to any word still changes it
+static uint64_t checksum(const void *data, size_t size)
+{
+    auto p = (const uint8_t *)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for (; i < size; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+//-------------------------------------------------------------------------
+// Cache files
+//-------------------------------------------------------------------------
+bool write_cache_file(
+    const std::string &path,
+    uint32_t format,
+    uint64_t key,
+    const std::string &payload,
+    std::string &error)
+{
+    cache_header_t h = {};
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version      = CACHE_VERSION;
+    h.format       = format;
+    h.key          = key;
+    h.payload_size = payload.size();
+    h.checksum     = checksum(payload.data(), payload.size());
+
+    // Written aside, then renamed over the previous cache
+    const std::string tmp_path = path + ".tmp";
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (fp == nullptr)
+    {
+        error = "cannot create '" + tmp_path + "': " + strerror(errno);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+           && fwrite(payload.data(), 1, payload.size(), fp) == payload.size();
+    ok = fclose(fp) == 0 && ok;
+
+    std::error_code ec;
+    if (ok)
+        std::filesystem::rename(tmp_path, path, ec);
+    if (!ok || ec)
+    {
+        std::filesystem::remove(tmp_path, ec);
+        error = "cannot write '" + path + "'";
+        return false;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool cache_file_t::open(const std::string &path, uint32_t format, uint64_t key)
+{
+    close();
+    if (!m_map.open(path))
+        return false;
+
+    cache_header_t h;
+    if (m_map.size() < sizeof(h))
+    {
+        close();
+        return false;
+    }
+    memcpy(&h, m_map.data(), sizeof(h));
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0
+        || h.version != CACHE_VERSION
+        || h.format != format
+        || h.key != key
+        || h.payload_size != m_map.size() - sizeof(h))
+    {
+        close();
+        return false;
+    }
+    m_checksum = h.checksum;
+    return true;
+}
+
+void cache_file_t::close()
+{
+    m_map.close();
+    m_checksum = 0;
+}
+
+//-------------------------------------------------------------------------
+bool cache_file_t::verify() const
+{
+    if (m_map.data() == nullptr)
+        return false;
+    return checksum(m_map.data() + sizeof(cache_header_t), m_map.size() - sizeof(cache_header_t)) == m_checksum;
+}
+
+cache_reader_t cache_file_t::reader() const
+{
+    if (m_map.data() == nullptr)
+        return cache_reader_t();
+    return cache_reader_t(m_map.data() + sizeof(cache_header_t), m_map.size() - sizeof(cache_header_t));
+}
@@ -0,0 +1,137 @@
+/*
+Macro Cache: Versioned binary cache files
+
+A cache file holds a payload (built with cache_writer_t), the key of what
+it was built from (e.g. the fingerprint of the macro store, see
+macro_store.h) and a checksum of the payload:
+
+    header_t | payload
+
+Opening a cache maps the file and only checks its header: the version,
+the payload format, the key and the size. That takes the same time
+whatever the size of the payload, so it can be done at startup; the
+checksum is verified by verify(), on the thread that reads the payload.
+Cache files are written aside and renamed, so a reader never sees a
+partial one.
+
+The files use the byte order of the machine (little endian in practice).
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "file_mapping.h"
+
+//-------------------------------------------------------------------------
+// Payload serialization
+//-------------------------------------------------------------------------
+class cache_writer_t
+{
+    std::string m_data;
+
+public:
+    void put_u32(uint32_t v) { put_bytes(&v, sizeof(v)); }
+    void put_u64(uint64_t v) { put_bytes(&v, sizeof(v)); }
+    void put_bytes(const void *data, size_t size) { m_data.append((const char *)data, size); }
+
+    // Length-prefixed string
+    void put_str(std::string_view s)
+    {
+        put_u32(uint32_t(s.size()));
+        put_bytes(s.data(), s.size());
+    }
+
+    const std::string &data() const { return m_data; }
+};
+
+//-------------------------------------------------------------------------
+// Bounds-checked reader of a payload. A read past the end fails, and so do
+// all the reads after it: checking ok() once at the end is enough
+class cache_reader_t
+{
+    const uint8_t *m_p   = nullptr;
+    const uint8_t *m_end = nullptr;
+    bool m_ok = true;
+
+public:
+    cache_reader_t() = default;
+    cache_reader_t(const void *data, size_t size)
+        : m_p((const uint8_t *)data), m_end((const uint8_t *)data + size)
+    {
+    }
+
+    bool ok() const { return m_ok; }
+    bool at_end() const { return m_p == m_end; }
+    size_t left() const { return size_t(m_end - m_p); }
+
+    bool get_bytes(void *data, size_t size)
+    {
+        if (!m_ok || size > left())
+            return m_ok = false;
+        memcpy(data, m_p, size);
+        m_p += size;
+        return true;
+    }
+
+    bool get_u32(uint32_t &v) { return get_bytes(&v, sizeof(v)); }
+    bool get_u64(uint64_t &v) { return get_bytes(&v, sizeof(v)); }
+
+    // The string points into the payload
+    bool get_str(std::string_view &s)
+    {
+        uint32_t len;
+        if (!get_u32(len) || len > left())
+            return m_ok = false;
+        s = std::string_view((const char *)m_p, len);
+        m_p += len;
+        return true;
+    }
+
+    // 'count' trivially copyable elements
+    template <class T>
+    bool get_array(std::vector<T> &v, size_t count)
+    {
+        if (!m_ok || count > left() / sizeof(T))
+            return m_ok = false;
+        v.resize(count);
+        return get_bytes(v.data(), count * sizeof(T));
+    }
+};
+
+//-------------------------------------------------------------------------
+// Cache files
+//-------------------------------------------------------------------------
+
+// Write a cache file. 'format' is the version of the payload layout
+// Returns false, with the reason in 'error', if it cannot be written
+bool write_cache_file(
+    const std::string &path,
+    uint32_t format,
+    uint64_t key,
+    const std::string &payload,
+    std::string &error);
+
+// Cache file opened for reading
+class cache_file_t
+{
+    file_mapping_t m_map;
+    uint64_t m_checksum = 0;
+
+public:
+    // Map the file and check its header. Fails if it does not exist, is
+    // damaged, or was written with another format or key
+    bool open(const std::string &path, uint32_t format, uint64_t key);
+    void close();
+
+    // Check the payload against its checksum (reads all of it)
+    bool verify() const;
+
+    cache_reader_t reader() const;
+};
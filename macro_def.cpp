@@ -0,0 +1,46 @@
+/*
+Macro Definitions: Serialization
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include "macro_def.h"
+#include "macro_table.h"
+
+//-------------------------------------------------------------------------
+void macro_def_t::from_string(std::string_view str)
+{
+    std::string *fields[] = { &macro, &expr, &desc };
+    for (auto field: fields)
+    {
+        size_t sep = str.find(SER_SEPARATOR[0]);
+        field->assign(str.substr(0, sep));
+        str = sep == std::string_view::npos ? std::string_view() : str.substr(sep + 1);
+    }
+}
+
+//-------------------------------------------------------------------------
+void macro_store_t::load_table(macro_table_t &table)
+{
+    macros_t macros;
+    load(macros);
+    table.reserve(macros.size());
+    for (auto &m: macros)
+        table.insert(m);
+}
+
+//-------------------------------------------------------------------------
+// One change at a time. The stores list the most recently saved macro
+// first, hence the reverse order
+bool macro_store_t::save_all(const macro_table_t &table)
+{
+    macros_t macros;
+    load(macros);
+    for (auto &m: macros)
+        remove(m);
+
+    auto &order = table.order();
+    for (auto p = order.rbegin(); p != order.rend(); ++p)
+        save(table.def(*p));
+    return true;
+}
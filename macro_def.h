@@ -0,0 +1,106 @@
+/*
+Macro Definitions: Macro data structures, default macros and storage interface
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+//-------------------------------------------------------------------------
+// Constants for macro serialization
+//-------------------------------------------------------------------------
+constexpr char SER_SEPARATOR[] = "\x1";
+
+//-------------------------------------------------------------------------
+// Macro definition structure
+//-------------------------------------------------------------------------
+struct macro_def_t
+{
+    std::string macro;
+    std::string expr;
+    std::string desc;
+
+    bool operator==(const macro_def_t& rhs) const
+    {
+        return macro == rhs.macro;
+    }
+
+    void to_string(std::string& str) const
+    {
+        str = macro + SER_SEPARATOR + expr + SER_SEPARATOR + desc;
+    }
+
+    // Parse the output of to_string(); missing fields are left empty
+    void from_string(std::string_view str);
+};
+typedef std::vector<macro_def_t> macros_t;
+
+class macro_table_t;
+
+// Default macros (native expressions, see native_eval.h)
+static macro_def_t DEFAULT_MACROS[] =
+{
+    {"$!",    "${native:here:hex}$",        "Current cursor location (0x...)"},
+    {"$!!",   "${native:here:x}$",          "Current cursor location"},
+    {"$<",    "${native:segm_start:hex}$",  "Current segment start (0x...)"},
+    {"$>",    "${native:segm_end:hex}$",    "Current segment end (0x...)"},
+    {"$<<",   "${native:segm_start:x}$",    "Current segment start"},
+    {"$>>",   "${native:segm_end:x}$",      "Current segment end"},
+    {"$@b",   "${native:byte:hex}$",        "Byte value at current cursor location (0x...)" },
+    {"$@B",   "${native:byte:x}$",          "Byte value at current cursor location"},
+    {"$@d",   "${native:dword:hex}$",       "Dword value at current cursor location (0x...)"},
+    {"$@D",   "${native:dword:x}$",         "Dword value at current cursor location"},
+    {"$@q",   "${native:qword:hex}$",       "Qword value at current cursor location (0x...)"},
+    {"$@Q",   "${native:qword:x}$",         "Qword value at current cursor location"},
+    {"$*b",   "${native:dbg_byte:hex}$",    "Debugger byte value at current cursor location (0x...)" },
+    {"$*B",   "${native:dbg_byte:x}$",      "Debugger byte value at current cursor location"},
+    {"$*d",   "${native:dbg_dword:hex}$",   "Debugger dword value at current cursor location (0x...)"},
+    {"$*D",   "${native:dbg_dword:x}$",     "Debugger dword value at current cursor location"},
+    {"$*q",   "${native:dbg_qword:hex}$",   "Debugger qword value at current cursor location (0x...)"},
+    {"$*Q",   "${native:dbg_qword:x}$",     "Debugger qword value at current cursor location"},
+    {"$[",    "${native:sel_start:hex}$",   "Selection start (0x...)"},
+    {"$]",    "${native:sel_end:hex}$",     "Selection end (0x...)"},
+    {"$[[",   "${native:sel_start:x}$",     "Selection start"},
+    {"$]]",   "${native:sel_end:x}$",       "Selection end"},
+    {"$#",    "${native:sel_size:hex}$",    "Selection size (0x...)"},
+    {"$##",   "${native:sel_size:x}$",      "Selection size"},
+    {"$cls",  "${native:msg_clear}$",       "Clears the output window"}
+};
+
+//-------------------------------------------------------------------------
+// Macro storage interface
+//-------------------------------------------------------------------------
+
+// Persistent storage of the macro definitions
+class macro_store_t
+{
+public:
+    virtual ~macro_store_t() { }
+
+    // Read all the stored macro definitions
+    virtual void load(macros_t &macros) = 0;
+
+    // Same, into a macro table (see macro_table.h). A name stored twice
+    // keeps its first definition
+    virtual void load_table(macro_table_t &table);
+
+    // Store a macro definition
+    virtual void save(const macro_def_t &macro) = 0;
+
+    // Remove a stored macro definition
+    virtual void remove(const macro_def_t &macro) = 0;
+
+    // Replace all the stored macros with the ones of 'table', in its order
+    virtual bool save_all(const macro_table_t &table);
+
+    // Description of a macro returned by load(). Stores that read the
+    // descriptions lazily leave them empty in load() and return them here
+    virtual std::string desc(const macro_def_t &macro) { return macro.desc; }
+
+    // Reason of the last failure, for the stores that can fail
+    virtual std::string error() const { return {}; }
+};
@@ -6,166 +6,148 @@ Macro Editor: Complete macro subsystem implementation
 
 #include <algorithm>
 #include "macro_editor.h"
+#include "macro_eval.h"
+#include "macro_pack.h"
 
 //-------------------------------------------------------------------------
-// Custom regex_replace with callback (similar to Python's re.sub())
-// Based on https://stackoverflow.com/a/37516316
-//-------------------------------------------------------------------------
-template<class BidirIt, class Traits, class CharT, class UnaryFunction>
-static std::basic_string<CharT> regex_replace_cb(
-    BidirIt first,
-    BidirIt last,
-    const std::basic_regex<CharT, Traits> &re,
-    UnaryFunction f)
-{
-    std::basic_string<CharT> s;
-
-    typename std::match_results<BidirIt>::difference_type positionOfLastMatch = 0;
-    auto endOfLastMatch = first;
-
-    auto callback = [&](const std::match_results<BidirIt> &match)
+// Global macro replacer instance
+// Dynamic expressions go through the caching evaluator (see macro_eval.h)
+macro_replacer_t macro_replacer(
+    [](std::string_view expr)->std::string
     {
-        auto positionOfThisMatch = match.position(0);
-        auto diff = positionOfThisMatch - positionOfLastMatch;
-
-        auto startOfThisMatch = endOfLastMatch;
-        std::advance(startOfThisMatch, diff);
-
-        s.append(endOfLastMatch, startOfThisMatch);
-        s.append(f(match));
-
-        auto lengthOfMatch = match.length(0);
-
-        positionOfLastMatch = positionOfThisMatch + lengthOfMatch;
-
-        endOfLastMatch = startOfThisMatch;
-        std::advance(endOfLastMatch, lengthOfMatch);
-    };
-
-    std::regex_iterator<BidirIt> begin(first, last, re), end;
-    std::for_each(begin, end, callback);
+        return macro_eval(expr);
+    },
+    [](const std::vector<std::string_view> &exprs, std::vector<std::string> &values)
+    {
+        macro_eval.eval_batch(exprs, values);
+    }
+);
 
-    s.append(endOfLastMatch, last);
+//-------------------------------------------------------------------------
+// Registry macro store
+//-------------------------------------------------------------------------
+void reg_macro_store_t::load(macros_t &macros)
+{
+    qstrvec_t ser_macros;
+    reg_read_strlist(&ser_macros, IDAREG_CLI_MACROS);
+    for (auto &ser_macro: ser_macros)
+        macros.emplace_back().from_string(std::string_view(ser_macro.c_str(), ser_macro.length()));
+}
 
-    return s;
+//-------------------------------------------------------------------------
+void reg_macro_store_t::save(const macro_def_t &macro)
+{
+    std::string ser;
+    macro.to_string(ser);
+    reg_update_strlist(IDAREG_CLI_MACROS, ser.c_str(), MAX_CLI_MACROS);
 }
 
-template<class Traits, class CharT, class UnaryFunction>
-static std::string regex_replace_cb(
-    const std::string &s,
-    const std::basic_regex<CharT, Traits> &re,
-    UnaryFunction f)
+//-------------------------------------------------------------------------
+void reg_macro_store_t::remove(const macro_def_t &macro)
 {
-    return regex_replace_cb(s.cbegin(), s.cend(), re, f);
+    std::string ser;
+    macro.to_string(ser);
+    reg_update_strlist(IDAREG_CLI_MACROS, nullptr, MAX_CLI_MACROS, ser.c_str());
 }
 
 //-------------------------------------------------------------------------
-// Macro Replacer Implementation
+// Macro Editor UI Implementation
 //-------------------------------------------------------------------------
 
-std::regex macro_replacer_t::RE_EVAL = std::regex(R"(\$\{(.+?)\}\$)");
-
-macro_replacer_t::macro_replacer_t(repl_func_t repl_func)
-    : m_repl_func(repl_func)
-{
-}
+// Static members
+const uint32 macro_editor_t::flags_ = CH_MODAL | CH_KEEP | CH_CAN_DEL | CH_CAN_EDIT | CH_CAN_INS | CH_CAN_REFRESH;
+const int macro_editor_t::widths_[3] = { 10, 30, 70 };
+const char *const macro_editor_t::header_[3] = { "Macro", "Expression", "Description" };
 
-std::string macro_replacer_t::operator()(const char* text)
+//-------------------------------------------------------------------------
+macro_editor_t::macro_editor_t(const char *title_)
+    : chooser_t(flags_, qnumber(widths_), widths_, header_, title_),
+      m_file_store(std::string(get_user_idadir()) + "/" + CLI_MACROS_FILE)
 {
-    return operator()(std::string(text));
 }
 
-std::string macro_replacer_t::operator()(std::string text)
+macro_editor_t::~macro_editor_t()
 {
-    if (!replace_map.empty())
-        text = regex_replace_cb(text, re_replace, [this](auto &m) { return replace_map[m.str(0)]; });
-
-    return regex_replace_cb(text, RE_EVAL, [this](auto &m) { return m_repl_func(m.str(1)); });
+    macro_replacer.wait_update();
+    if (m_reload_id >= 0)
+        cancel_exec_request(m_reload_id);
 }
 
-// Similar to Python's "re.escape()"
-std::string macro_replacer_t::escape_re(const std::string re_text)
+//-------------------------------------------------------------------------
+// Only the header of the cache is checked here: the compiled macros are
+// read in the background, and the store and the macro list are left alone
+// until the list is needed
+void macro_editor_t::start()
 {
-    std::string out;
-    out.reserve(re_text.size() * 2);
-    for (auto ch: re_text)
+    const uint64_t key = m_file_store.fingerprint();
+    if (m_store == &m_file_store && key != 0)
     {
-        if (isalnum(ch))
-        {
-            out += ch;
-            continue;
-        }
-        else if (ch == 0)
+        auto on_failure = [this]()
         {
-            out += "\\x0";
-        }
-        else
+            m_reload_id = execute_sync(m_reload, MFF_NOWAIT);
+        };
+        if (macro_replacer.load_cache_async(cache_path(), key, on_failure))
         {
-            out += '\\';
-            out += ch;
+            m_from_cache = true;
+            m_cache_key = key;
+            return;
         }
     }
-    return out;
+    build_macros_list();
 }
 
-void macro_replacer_t::begin_update()
+//-------------------------------------------------------------------------
+ssize_t idaapi macro_editor_t::reload_request_t::execute()
 {
-    replace_map.clear();
+    editor->m_reload_id = -1;
+    editor->m_cache_key = 0;
+    msg("climacros: the macro cache is damaged, compiling the macros again\n");
+    if (editor->m_loaded)
+        editor->publish_macros();
+    else
+        editor->build_macros_list();
+    return 0;
 }
 
-void macro_replacer_t::update(std::string macro, std::string expr)
+//-------------------------------------------------------------------------
+// The cache is written from the compiled macros of the replacer, which
+// match the store once the changes are flushed
+void macro_editor_t::save_cache()
 {
-    replace_map[macro] = expr;
+    if (m_store != &m_file_store)
+        return;
+    const uint64_t key = m_file_store.fingerprint();
+    if (key == 0 || key == m_cache_key)
+        return;
+    if (macro_replacer.save_cache(cache_path(), key))
+        m_cache_key = key;
 }
 
-void macro_replacer_t::end_update()
+//-------------------------------------------------------------------------
+void macro_editor_t::open_store()
 {
-    if (replace_map.empty())
+    if (m_store != &m_file_store || m_file_store.is_open())
         return;
 
-    std::string re_str;
-    for (auto &kv: replace_map)
-    {
-        re_str.append(escape_re(kv.first));
-        re_str.append("|");
-    }
-    // Get rid of the trailing '|'
-    re_str.pop_back();
-
-    // Form the single regular expression
-    re_replace = re_str;
-}
-
-//-------------------------------------------------------------------------
-// Global macro replacer instance
-// Macro replace and expand via Python expression evaluation
-macro_replacer_t macro_replacer(
-    [](std::string expr)->std::string
+    const bool existed = m_file_store.exists();
+    if (!m_file_store.open())
     {
-        if (auto py = pylang())
-        {
-            qstring errbuf;
-            idc_value_t rv;
-            if (py->eval_expr(&rv, BADADDR, expr.c_str(), &errbuf) && rv.vtype == VT_STR)
-                return rv.qstr().c_str();
-        }
-        return std::move(expr);
+        msg("climacros: %s, using the registry instead\n", m_file_store.error().c_str());
+        m_store = &m_reg_store;
+        return;
     }
-);
-
-//-------------------------------------------------------------------------
-// Macro Editor UI Implementation
-//-------------------------------------------------------------------------
-
-// Static members
-const uint32 macro_editor_t::flags_ = CH_MODAL | CH_KEEP | CH_CAN_DEL | CH_CAN_EDIT | CH_CAN_INS | CH_CAN_REFRESH;
-const int macro_editor_t::widths_[3] = { 10, 30, 70 };
-const char *const macro_editor_t::header_[3] = { "Macro", "Expression", "Description" };
+    if (existed)
+        return;
 
-//-------------------------------------------------------------------------
-macro_editor_t::macro_editor_t(const char *title_)
-    : chooser_t(flags_, qnumber(widths_), widths_, header_, title_)
-{
+    // One-time migration: the registry list is left as it was
+    macros_t macros;
+    m_reg_store.load(macros);
+    if (macros.empty())
+        return;
+    if (m_file_store.save_all(macros))
+        msg("climacros: moved %" FMT_Z " macros from the registry to %s\n", macros.size(), m_file_store.path().c_str());
+    else
+        msg("climacros: could not move the macros from the registry: %s\n", m_file_store.error().c_str());
 }
 
 //-------------------------------------------------------------------------
@@ -197,43 +179,138 @@ bool macro_editor_t::edit_macro_def(macro_def_t &def, bool as_new)
 }
 
 //-------------------------------------------------------------------------
-void macro_editor_t::reg_del_macro(const macro_def_t &macro)
+void macro_editor_t::set_dirty(
+    const std::string &name,
+    const macro_def_t *stored,
+    const macro_def_t *current)
 {
-    std::string ser;
-    macro.to_string(ser);
-    reg_update_strlist(IDAREG_CLI_MACROS, nullptr, MAX_CLI_MACROS, ser.c_str());
+    auto p = m_dirty.find(name);
+    if (p == m_dirty.end())
+    {
+        p = m_dirty.emplace(name, dirty_t()).first;
+        if (stored != nullptr)
+            p->second.stored = *stored;
+    }
+    if (current != nullptr)
+        p->second.current = *current;
+    else
+        p->second.current.reset();
 }
 
 //-------------------------------------------------------------------------
-void macro_editor_t::reg_save_macro(const macro_def_t &macro, std::string *ser_out)
+// The description of a changed macro is in memory, not in the store
+std::string macro_editor_t::desc_of(uint32_t slot) const
 {
-    std::string ser;
-    macro.to_string(ser);
-    reg_update_strlist(IDAREG_CLI_MACROS, ser.c_str(), MAX_CLI_MACROS);
-    if (ser_out != nullptr)
-        *ser_out = std::move(ser);
+    auto desc = m_macros.desc(slot);
+    if (!desc.empty() || m_dirty.find(m_macros.name(slot)) != m_dirty.end())
+        return std::string(desc);
+    return m_store->desc(m_macros.def(slot));
+}
+
+//-------------------------------------------------------------------------
+// Only the macros changed since the last flush are written. A macro changed
+// back to its stored definition is left alone
+void macro_editor_t::flush()
+{
+    for (auto &[name, dirty]: m_dirty)
+    {
+        auto &stored = dirty.stored, &current = dirty.current;
+        if (stored && current
+            && stored->macro == current->macro
+            && stored->expr  == current->expr
+            && stored->desc  == current->desc)
+        {
+            continue;
+        }
+        if (stored)
+            m_store->remove(*stored);
+        if (current)
+            m_store->save(*current);
+    }
+    m_dirty.clear();
 }
 
 //-------------------------------------------------------------------------
-// Add a new macro
-macro_def_t *macro_editor_t::add_macro(macro_def_t macro)
+// Filtering
+//-------------------------------------------------------------------------
+void macro_editor_t::set_filter(std::string_view filter)
 {
-    auto &new_macro = m_macros.push_back();
-    new_macro       = std::move(macro);
-    return &new_macro;
+    m_filter = filter;
+    apply_filter();
+}
+
+//-------------------------------------------------------------------------
+bool macro_editor_t::ask_filter()
+{
+    qstring filter;
+    filter = m_filter.c_str();
+    if (!ask_str(&filter, HIST_SRCH, "Filter the macros (name prefixes, or words of the expressions and descriptions)"))
+        return false;
+
+    set_filter(std::string_view(filter.c_str(), filter.length()));
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// The descriptions are needed to build the index: the first filter reads
+// them from the store
+void macro_editor_t::apply_filter()
+{
+    if (m_filter.empty())
+    {
+        m_visible.clear();
+        return;
+    }
+
+    if (!m_indexed)
+    {
+        m_index.clear();
+        for (auto slot: m_macros.order())
+            m_index.add(slot, m_macros.name(slot), m_macros.expr(slot), desc_of(slot));
+        m_indexed = true;
+    }
+    m_index.query(m_filter, m_macros.order(), m_visible);
+}
+
+//-------------------------------------------------------------------------
+// 'def' is the new definition of the macro, or null if it was removed
+void macro_editor_t::reindex(uint32_t slot, const macro_def_t *def)
+{
+    if (m_indexed)
+    {
+        if (def != nullptr)
+            m_index.add(slot, def->macro, def->expr, def->desc);
+        else
+            m_index.remove(slot);
+    }
+    if (!m_filter.empty())
+        apply_filter();
 }
 
 //-------------------------------------------------------------------------
 bool macro_editor_t::init()
 {
-    build_macros_list();
+    ensure_loaded();
     return true;
 }
 
+//-------------------------------------------------------------------------
+void idaapi macro_editor_t::closed()
+{
+    flush();
+}
+
+//-------------------------------------------------------------------------
+chooser_t::cbret_t idaapi macro_editor_t::refresh(ssize_t n)
+{
+    build_macros_list();
+    return cbret_t(n, chooser_base_t::ALL_CHANGED);
+}
+
 //-------------------------------------------------------------------------
 size_t idaapi macro_editor_t::get_count() const
 {
-    return m_macros.size();
+    return m_filter.empty() ? m_macros.size() : m_visible.size();
 }
 
 //-------------------------------------------------------------------------
@@ -243,10 +320,11 @@ void idaapi macro_editor_t::get_row(
     chooser_item_attrs_t *attrs,
     size_t n) const
 {
-    auto &macro = m_macros[n];
-    cols->at(0) = macro.macro.c_str();
-    cols->at(1) = macro.expr.c_str();
-    cols->at(2) = macro.desc.c_str();
+    auto slot = slot_at(n);
+    auto name = m_macros.name(slot), expr = m_macros.expr(slot);
+    cols->at(0) = qstring(name.data(), name.size());
+    cols->at(1) = qstring(expr.data(), expr.size());
+    cols->at(2) = desc_of(slot).c_str();
 }
 
 //-------------------------------------------------------------------------
@@ -259,16 +337,24 @@ chooser_t::cbret_t idaapi macro_editor_t::ins(ssize_t n)
         if (!edit_macro_def(new_macro, true))
             return cbret_t(n, chooser_base_t::NOTHING_CHANGED);
 
-        auto p = m_macros.find({ new_macro.macro });
-        if (p == m_macros.end())
+        if (m_macros.contains(new_macro.macro))
+        {
+            warning("A macro with the name '%s' already exists. Please choose another name!", new_macro.macro.c_str());
+            continue;
+        }
+
+        qstring errbuf;
+        if (macro_eval.precompile_macro(new_macro.expr, &errbuf))
             break;
 
-        warning("A macro with the name '%s' already exists. Please choose another name!", new_macro.macro.c_str());
+        warning("The expression of macro '%s' does not compile:\n%s", new_macro.macro.c_str(), errbuf.c_str());
     }
 
-    reg_save_macro(*add_macro(std::move(new_macro)));
+    // New macros go first, like in the store
+    set_dirty(new_macro.macro, nullptr, &new_macro);
+    macro_replacer.add(new_macro.macro, new_macro.expr);
+    reindex(m_macros.insert(new_macro, 0), &new_macro);
 
-    build_macros_list();
     return cbret_t(0, chooser_base_t::ALL_CHANGED);
 }
 
@@ -276,9 +362,13 @@ chooser_t::cbret_t idaapi macro_editor_t::ins(ssize_t n)
 // Remove a script from the list
 chooser_t::cbret_t idaapi macro_editor_t::del(size_t n)
 {
-    reg_del_macro(m_macros[n]);
+    const auto slot = slot_at(n);
+    auto macro = m_macros.def(slot);
+    set_dirty(macro.macro, &macro, nullptr);
+    macro_replacer.remove(macro.macro);
+    m_macros.erase(slot);
+    reindex(slot, nullptr);
 
-    build_macros_list();
     return adjust_last_item(n);
 }
 
@@ -286,11 +376,14 @@ chooser_t::cbret_t idaapi macro_editor_t::del(size_t n)
 // Edit the macro
 chooser_t::cbret_t idaapi macro_editor_t::edit(size_t n)
 {
-    // Take a copy of the old macro
-    auto old_macro = m_macros[n];
+    // Take a copy of the old macro, with its description (which the store
+    // may not have loaded)
+    const auto slot = slot_at(n);
+    auto old_macro = m_macros.def(slot);
+    old_macro.desc = desc_of(slot);
 
     // Edit a copy of the macro
-    auto edited_macro = m_macros[n];
+    auto edited_macro = old_macro;
     while (true)
     {
         if (!edit_macro_def(edited_macro, false))
@@ -299,24 +392,39 @@ chooser_t::cbret_t idaapi macro_editor_t::edit(size_t n)
         // Check if macro name changed and if new name already exists
         if (edited_macro.macro != old_macro.macro)
         {
-            auto p = m_macros.find({ edited_macro.macro });
-            if (p != m_macros.end())
+            if (m_macros.contains(edited_macro.macro))
             {
                 warning("A macro with the name '%s' already exists. Please choose another name!", edited_macro.macro.c_str());
                 continue;
             }
         }
-        break;
+
+        qstring errbuf;
+        if (macro_eval.precompile_macro(edited_macro.expr, &errbuf))
+            break;
+
+        warning("The expression of macro '%s' does not compile:\n%s", edited_macro.macro.c_str(), errbuf.c_str());
     }
 
-    // Delete the old macro
-    reg_del_macro(old_macro);
+    if (edited_macro.macro != old_macro.macro)
+    {
+        set_dirty(old_macro.macro, &old_macro, nullptr);
+        set_dirty(edited_macro.macro, nullptr, &edited_macro);
+    }
+    else
+    {
+        set_dirty(old_macro.macro, &old_macro, &edited_macro);
+    }
 
-    // Update the macro in-place and save
-    m_macros[n] = edited_macro;
-    reg_save_macro(m_macros[n]);
+    // Update the macro in-place
+    m_macros.set(slot, edited_macro);
+    reindex(slot, &edited_macro);
+
+    // Only the edited macro is recompiled
+    if (edited_macro.macro != old_macro.macro)
+        macro_replacer.remove(old_macro.macro);
+    macro_replacer.add(edited_macro.macro, edited_macro.expr);
 
-    build_macros_list();
     return cbret_t(n, chooser_base_t::ALL_CHANGED);
 }
 
@@ -324,13 +432,37 @@ chooser_t::cbret_t idaapi macro_editor_t::edit(size_t n)
 // Rebuilds the macros list
 void macro_editor_t::build_macros_list()
 {
-    // Read all the serialized macro definitions
-    qstrvec_t ser_macros;
-    reg_read_strlist(&ser_macros, IDAREG_CLI_MACROS);
-    m_macros.qclear();
+    load_macros();
+    publish_macros();
+}
+
+//-------------------------------------------------------------------------
+// The macros are only read from the store the first time. When the
+// replacer was started from the cache, it already has them
+void macro_editor_t::ensure_loaded()
+{
+    if (m_loaded)
+        return;
+    load_macros();
+    if (m_from_cache && m_store == &m_file_store)
+        precompile_macros();
+    else
+        publish_macros();
+}
+
+//-------------------------------------------------------------------------
+void macro_editor_t::load_macros()
+{
+    // Read all the macro definitions
+    flush();
+    open_store();
+    m_macros.clear();
+    m_store->load_table(m_macros);
+    m_loaded = true;
+    m_indexed = false;
 
     // Empty macros?
-    if (ser_macros.empty())
+    if (m_macros.empty())
     {
         // If this is not the first run, then keep the macros list empty
         qstring first_run;
@@ -341,36 +473,348 @@ void macro_editor_t::build_macros_list()
             FILE *fp = qfopen(first_run.c_str(), "w"); qfclose(fp);
             for (auto &macro: DEFAULT_MACROS)
             {
-                std::string ser_macro;
-                reg_save_macro(*add_macro(macro), &ser_macro);
-                ser_macros.push_back(ser_macro.c_str());
+                m_macros.insert(macro);
+                m_store->save(macro);
             }
         }
     }
-    else
+
+    apply_filter();
+}
+
+//-------------------------------------------------------------------------
+void macro_editor_t::precompile_macros()
+{
+    macro_eval.unpin_all();
+    for (auto slot: m_macros.order())
     {
-        for (auto &ser_macro: ser_macros)
+        qstring errbuf;
+        if (!macro_eval.precompile_macro(m_macros.expr(slot), &errbuf))
         {
-            char *macro_str = ser_macro.extract();
-            char *sptr;
-            int icol = 0;
-            macro_def_t macro;
-            for (auto tok = qstrtok(macro_str, SER_SEPARATOR, &sptr);
-                 tok != nullptr;
-                 tok = qstrtok(nullptr, SER_SEPARATOR, &sptr), ++icol)
-            {
-                if (icol == 0)      macro.macro = tok;
-                else if (icol == 1) macro.expr  = tok;
-                else if (icol == 2) macro.desc  = tok;
-            }
-            add_macro(std::move(macro));
-            qfree(macro_str);
+            auto name = m_macros.name(slot);
+            msg("climacros: the expression of macro '%.*s' does not compile: %s\n", int(name.size()), name.data(), errbuf.c_str());
         }
     }
+}
 
-    // Re-create the pattern replacement
+//-------------------------------------------------------------------------
+// Hand the whole macro list to the evaluator and the replacer. The
+// compiled macros are cached for the next start, keyed by the store
+// fingerprint
+void macro_editor_t::publish_macros()
+{
+    precompile_macros();
+
+    // Re-create the pattern replacement in the background: the CLIs keep
+    // using the previous macro set until the new one is published
+    m_from_cache = false;
+    m_cache_key = m_store == &m_file_store ? m_file_store.fingerprint() : 0;
     macro_replacer.begin_update();
-    for (auto &m: m_macros)
-        macro_replacer.update(m.macro, m.expr);
-    macro_replacer.end_update();
-}
\ No newline at end of file
+    for (auto slot: m_macros.order())
+        macro_replacer.update(m_macros.name(slot), m_macros.expr(slot));
+    macro_replacer.end_update_async(m_cache_key != 0 ? cache_path() : std::string(), m_cache_key);
+}
+
+//-------------------------------------------------------------------------
+// Macro packs
+//-------------------------------------------------------------------------
+
+// The file store does not load the descriptions: they are read before the
+// store is rewritten
+void macro_editor_t::load_descs()
+{
+    for (auto slot: m_macros.order())
+    {
+        if (!m_macros.desc(slot).empty())
+            continue;
+        auto desc = m_store->desc(m_macros.def(slot));
+        if (!desc.empty())
+            m_macros.set_desc(slot, desc);
+    }
+}
+
+//-------------------------------------------------------------------------
+// The pack is merged into the list, which is then saved at once and
+// compiled once
+void macro_editor_t::import_pack()
+{
+    const char *answer = ask_file(false, "*.txt", "FILTER Macro packs|*.txt\nImport a macro pack");
+    if (answer == nullptr)
+        return;
+    const std::string path = answer;
+
+    int replace = ask_yn(ASKBTN_NO, "HIDECANCEL\nReplace the macros that are already defined?");
+    if (replace == ASKBTN_CANCEL)
+        return;
+
+    ensure_loaded();
+    flush();
+    load_descs();
+
+    macro_pack_result_t result;
+    std::string error;
+    // The expressions are checked like the editor does
+    auto check = [](std::string_view expr, std::string &reason)
+    {
+        qstring errbuf;
+        if (macro_eval.precompile_macro(expr, &errbuf))
+            return true;
+        reason = errbuf.c_str();
+        return false;
+    };
+    if (!import_macro_pack(path, m_macros, replace == ASKBTN_YES, result, error, check))
+    {
+        warning("Could not import the macro pack: %s", error.c_str());
+        build_macros_list();
+        return;
+    }
+
+    msg("climacros: imported '%s' (%" FMT_Z " lines): %" FMT_Z " added, %" FMT_Z " replaced, %" FMT_Z " unchanged, %" FMT_Z " duplicates, %" FMT_Z " invalid\n",
+        path.c_str(), result.lines, result.added, result.replaced, result.unchanged, result.duplicates, result.invalid);
+    for (auto &e: result.errors)
+        msg("climacros:   line %s\n", e.c_str());
+
+    if (result.added == 0 && result.replaced == 0)
+        return;
+
+    if (!m_store->save_all(m_macros))
+        warning("Could not save the imported macros: %s", m_store->error().c_str());
+
+    m_indexed = false;
+    apply_filter();
+    publish_macros();
+}
+
+//-------------------------------------------------------------------------
+void macro_editor_t::export_pack()
+{
+    const char *answer = ask_file(true, "climacros.txt", "FILTER Macro packs|*.txt\nExport the macros to a pack");
+    if (answer == nullptr)
+        return;
+    const std::string path = answer;
+
+    ensure_loaded();
+
+    std::string error;
+    if (export_macro_pack(path, m_macros, error, [this](uint32_t slot) { return desc_of(slot); }))
+        msg("climacros: exported %" FMT_Z " macros to '%s'\n", m_macros.size(), path.c_str());
+    else
+        warning("Could not export the macros: %s", error.c_str());
+}
+//-------------------------------------------------------------------------
+// Macro Statistics UI Implementation
+//-------------------------------------------------------------------------
+
+// Static members
+const uint32 macro_stats_view_t::flags_ = CH_MODAL | CH_KEEP | CH_CAN_INS | CH_CAN_DEL | CH_CAN_REFRESH;
+const int macro_stats_view_t::widths_[10] = { 16, 8, 8, 8, 8, 10, 10, 10, 10, 50 };
+const char *const macro_stats_view_t::header_[10] =
+{
+    "Macro", "Matches", "Evals", "Cache hits", "Timeouts", "p50", "p99", "Bytes in", "Bytes out", "Expression"
+};
+
+//-------------------------------------------------------------------------
+macro_stats_view_t::macro_stats_view_t(const char *title_)
+    : chooser_t(flags_, qnumber(widths_), widths_, header_, title_)
+{
+    popup_names[POPUP_INS] = "Dump to JSON...";
+    popup_names[POPUP_DEL] = "Reset the statistics";
+}
+
+//-------------------------------------------------------------------------
+// The lines first, then the macros, then the inline expressions that are
+// not part of a macro
+void macro_stats_view_t::build_rows()
+{
+    auto add_eval_stats = [](row_t &row, const eval_stats_t &stats)
+    {
+        row.evals      += stats.evals;
+        row.cache_hits += stats.cache_hits;
+        row.native     += stats.native;
+        row.vm         += stats.vm;
+        row.python     += stats.python;
+        row.failures   += stats.failures;
+        row.timeouts   += stats.timeouts;
+        row.latency.merge(stats.latency);
+    };
+
+    m_rows.clear();
+
+    auto &lines = macro_replacer.line_stats();
+    auto &total = m_rows.emplace_back();
+    total.name      = "(lines)";
+    total.matches   = lines.expanded.get();
+    total.evals     = lines.evals.get();
+    total.bytes_in  = lines.bytes_in.get();
+    total.bytes_out = lines.bytes_out.get();
+    total.latency.merge(lines.latency);
+
+    std::vector<macro_replacer_t::macro_stat_t> macros;
+    macro_replacer.macro_stats(macros);
+
+    // Expressions of the macros, not reported again on their own
+    std::vector<std::string_view> macro_exprs;
+    auto &evals = macro_eval.stats();
+    for (auto &m: macros)
+    {
+        auto &row = m_rows.emplace_back();
+        row.name      = m.macro;
+        row.expr      = m.expr;
+        row.matches   = m.matches;
+        row.bytes_in  = m.bytes_in;
+        row.bytes_out = m.bytes_out;
+
+        macro_replacer_t::eval_span_t span;
+        for (size_t pos = 0;
+             macro_replacer_t::find_eval_span(m.expr.data(), m.expr.size(), pos, span);
+             pos = span.end)
+        {
+            std::string_view expr(m.expr.data() + span.expr_start, span.expr_end - span.expr_start);
+            macro_exprs.push_back(expr);
+            auto p = evals.find(expr);
+            if (p != evals.end())
+                add_eval_stats(row, p->second);
+        }
+    }
+    std::sort(macro_exprs.begin(), macro_exprs.end());
+
+    for (auto &kv: evals)
+    {
+        if (kv.second.evals == 0 || std::binary_search(macro_exprs.begin(), macro_exprs.end(), std::string_view(kv.first)))
+            continue;
+
+        auto &row = m_rows.emplace_back();
+        row.name      = "(inline)";
+        row.expr      = kv.first;
+        row.bytes_in  = kv.second.bytes_in;
+        row.bytes_out = kv.second.bytes_out;
+        add_eval_stats(row, kv.second);
+    }
+
+    // Most used first
+    std::stable_sort(m_rows.begin() + 1, m_rows.end(), [](const row_t &a, const row_t &b)
+    {
+        return std::max(a.matches, a.evals) > std::max(b.matches, b.evals);
+    });
+}
+
+//-------------------------------------------------------------------------
+std::string macro_stats_view_t::to_json() const
+{
+    std::string out = "{\n  \"rows\": [";
+    for (size_t i = 0; i < m_rows.size(); ++i)
+    {
+        auto &row = m_rows[i];
+        out += i == 0 ? "\n    {" : ",\n    {";
+        out += "\"name\": ";
+        json_append_string(out, row.name);
+        out += ", \"expr\": ";
+        json_append_string(out, row.expr);
+
+        const std::pair<const char *, uint64> fields[] =
+        {
+            { "matches",    row.matches },
+            { "evals",      row.evals },
+            { "cache_hits", row.cache_hits },
+            { "native",     row.native },
+            { "vm",         row.vm },
+            { "python",     row.python },
+            { "failures",   row.failures },
+            { "timeouts",   row.timeouts },
+            { "bytes_in",   row.bytes_in },
+            { "bytes_out",  row.bytes_out },
+            { "timed",      row.latency.count() },
+            { "total_ns",   row.latency.total_ns() },
+            { "p50_ns",     row.latency.percentile(50) },
+            { "p99_ns",     row.latency.percentile(99) },
+        };
+        for (auto &field: fields)
+        {
+            out += ", \"";
+            out += field.first;
+            out += "\": ";
+            out += std::to_string(field.second);
+        }
+        out += "}";
+    }
+    out += "\n  ]\n}\n";
+    return out;
+}
+
+//-------------------------------------------------------------------------
+bool macro_stats_view_t::init()
+{
+    build_rows();
+    return true;
+}
+
+//-------------------------------------------------------------------------
+size_t idaapi macro_stats_view_t::get_count() const
+{
+    return m_rows.size();
+}
+
+//-------------------------------------------------------------------------
+void idaapi macro_stats_view_t::get_row(
+    qstrvec_t *cols,
+    int *icon,
+    chooser_item_attrs_t *attrs,
+    size_t n) const
+{
+    auto &row = m_rows[n];
+    auto number = [](qstring &col, uint64 v) { col.sprnt("%" FMT_64 "u", v); };
+    auto duration = [&row](qstring &col, double p)
+    {
+        if (row.latency.count() != 0)
+            col = format_duration(row.latency.percentile(p)).c_str();
+    };
+
+    cols->at(0) = row.name.c_str();
+    number(cols->at(1), row.matches);
+    number(cols->at(2), row.evals);
+    number(cols->at(3), row.cache_hits);
+    number(cols->at(4), row.timeouts);
+    duration(cols->at(5), 50);
+    duration(cols->at(6), 99);
+    number(cols->at(7), row.bytes_in);
+    number(cols->at(8), row.bytes_out);
+    cols->at(9) = row.expr.c_str();
+}
+
+//-------------------------------------------------------------------------
+// Dump the statistics to a JSON file
+chooser_t::cbret_t idaapi macro_stats_view_t::ins(ssize_t n)
+{
+    const char *path = ask_file(true, "climacros-stats.json", "FILTER JSON files|*.json\nSave the statistics as");
+    if (path == nullptr)
+        return cbret_t(n, chooser_base_t::NOTHING_CHANGED);
+
+    build_rows();
+    std::string json = to_json();
+    FILE *fp = qfopen(path, "wb");
+    if (fp == nullptr || qfwrite(fp, json.data(), json.size()) != ssize_t(json.size()))
+        warning("Could not write the statistics to '%s'", path);
+    else
+        msg("climacros: statistics saved to '%s'\n", path);
+    if (fp != nullptr)
+        qfclose(fp);
+
+    return cbret_t(n, chooser_base_t::ALL_CHANGED);
+}
+
+//-------------------------------------------------------------------------
+// Reset all the statistics
+chooser_t::cbret_t idaapi macro_stats_view_t::del(size_t n)
+{
+    macro_replacer.reset_stats();
+    macro_eval.reset_stats();
+    build_rows();
+    return cbret_t(0, chooser_base_t::ALL_CHANGED);
+}
+
+//-------------------------------------------------------------------------
+chooser_t::cbret_t idaapi macro_stats_view_t::refresh(ssize_t n)
+{
+    build_rows();
+    return cbret_t(n, chooser_base_t::ALL_CHANGED);
+}
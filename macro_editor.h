@@ -2,140 +2,152 @@
 Macro Editor: Complete macro subsystem for IDA CLI macros
 
 This module contains:
-- Macro data structures and default macros
-- Macro replacement engine
+- The registry macro store (the file store replaced it, see macro_store.h)
+- The global macro replacer (see macro_replacer.h for the engine)
 - Macro editor UI
+- Macro statistics UI
 */
 
 #pragma once
 
-#include <string>
-#include <regex>
 #include <map>
-#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
 #include "idasdk.h"
+#include "macro_def.h"
+#include "macro_index.h"
+#include "macro_replacer.h"
+#include "macro_stats.h"
+#include "macro_store.h"
+#include "macro_table.h"
 
 //-------------------------------------------------------------------------
-// Constants for macro serialization and CLI management
+// Constants for macro registry storage and CLI management
 //-------------------------------------------------------------------------
 constexpr char IDAREG_CLI_MACROS[] = "CLI_Macros";
 constexpr int MAX_CLI_MACROS = 200;
 constexpr int MAX_CLIS = 20;
-constexpr char SER_SEPARATOR[] = "\x1";
 
-//-------------------------------------------------------------------------
-// Macro definition structure
-//-------------------------------------------------------------------------
-struct macro_def_t
-{
-    std::string macro;
-    std::string expr;
-    std::string desc;
+// Macro file, in the user IDA directory
+constexpr char CLI_MACROS_FILE[] = "climacros.macros";
 
-    bool operator==(const macro_def_t& rhs) const
-    {
-        return macro == rhs.macro;
-    }
+// Compiled macros (see macro_cache.h), next to the macro file
+constexpr char CLI_MACROS_CACHE_EXT[] = ".cache";
 
-    void to_string(std::string& str) const
-    {
-        str = macro + SER_SEPARATOR + expr + SER_SEPARATOR + desc;
-    }
-};
-typedef qvector<macro_def_t> macros_t;
+//-------------------------------------------------------------------------
+// Global macro replacer instance
+extern macro_replacer_t macro_replacer;
+
+//-------------------------------------------------------------------------
+// Registry macro store
+//-------------------------------------------------------------------------
 
-// Default macros
-static macro_def_t DEFAULT_MACROS[] =
+// Macros saved as a list of serialized definitions in the IDA registry
+class reg_macro_store_t: public macro_store_t
 {
-    {"$!",    "${'0x%x' % idc.here()}$",                                              "Current cursor location (0x...)"},
-    {"$!!",   "${'%x' % idc.here()}$",                                                "Current cursor location"},
-    {"$<",    "${'0x%x' % idc.get_segm_start(idc.here())}$",                          "Current segment start (0x...)"},
-    {"$>",    "${'0x%x' % idc.get_segm_end(idc.here())}$",                            "Current segment end (0x...)"},
-    {"$<<",   "${'%x' % idc.get_segm_start(idc.here())}$",                            "Current segment start"},
-    {"$>>",   "${'%x' % idc.get_segm_end(idc.here())}$",                              "Current segment end"},
-    {"$@b",   "${'0x%x' % idc.get_wide_byte(idc.here())}$",                           "Byte value at current cursor location (0x...)" },
-    {"$@B",   "${'%x' % idc.get_wide_byte(idc.here())}$",                             "Byte value at current cursor location"},
-    {"$@d",   "${'0x%x' % idc.get_wide_dword(idc.here())}$",                          "Dword value at current cursor location (0x...)"},
-    {"$@D",   "${'%x' % idc.get_wide_dword(idc.here())}$",                            "Dword value at current cursor location"},
-    {"$@q",   "${'0x%x' % idc.get_qword(idc.here())}$",                               "Qword value at current cursor location (0x...)"},
-    {"$@Q",   "${'%x' % idc.get_qword(idc.here())}$",                                 "Qword value at current cursor location"},
-    {"$*b",   "${'0x%x' % idc.read_dbg_byte(idc.here())}$",                           "Debugger byte value at current cursor location (0x...)" },
-    {"$*B",   "${'%x' % idc.read_dbg_byte(idc.here())}$",                             "Debugger byte value at current cursor location"},
-    {"$*d",   "${'0x%x' % idc.read_dbg_dword(idc.here())}$",                          "Debugger dword value at current cursor location (0x...)"},
-    {"$*D",   "${'%x' % idc.read_dbg_dword(idc.here())}$",                            "Debugger dword value at current cursor location"},
-    {"$*q",   "${'0x%x' % idc.read_dbg_qword(idc.here())}$",                          "Debugger qword value at current cursor location (0x...)"},
-    {"$*Q",   "${'%x' % idc.read_dbg_qword(idc.here())}$",                            "Debugger qword value at current cursor location"},
-    {"$[",    "${'0x%x' % idc.read_selection_start()}$",                              "Selection start (0x...)"},
-    {"$]",    "${'0x%x' % idc.read_selection_end()}$",                                "Selection end (0x...)"},
-    {"$[[",   "${'%x' % idc.read_selection_start()}$",                                "Selection start"},
-    {"$]]",   "${'%x' % idc.read_selection_end()}$",                                  "Selection end"},
-    {"$#",    "${'0x%x' % (idc.read_selection_end() - idc.read_selection_start())}$", "Selection size (0x...)"},
-    {"$##",   "${'%x' % (idc.read_selection_end() - idc.read_selection_start())}$",   "Selection size"},
-    {"$cls",  "${idaapi.msg_clear()}$",                                               "Clears the output window"}
+public:
+    void load(macros_t &macros) override;
+    void save(const macro_def_t &macro) override;
+    void remove(const macro_def_t &macro) override;
 };
 
 //-------------------------------------------------------------------------
-// Macro Replacement Engine
+// Macro Editor UI
 //-------------------------------------------------------------------------
 
-// Utility class to replace macros with static patterns and dynamic expressions
-class macro_replacer_t
+// Modal macro editor
+//
+// The edits are made to the macros in memory and pushed to the macro
+// replacer one macro at a time. The changed macros are written to the store
+// when the editor closes (see flush())
+class macro_editor_t: public chooser_t
 {
-public:
-    using repl_func_t = std::function<std::string(std::string)>;
+protected:
+    static const uint32 flags_;
+    static const int widths_[];
+    static const char *const header_[];
+
+    // The macros in display order (see macro_table.h)
+    macro_table_t m_macros;
+    bool m_loaded = false;
 
-private:
-    static std::regex RE_EVAL;
-    std::regex re_replace;
+    // Filter of the list (see macro_index.h), and the slots of the macros
+    // that pass it. The index is built the first time a filter is set
+    std::string m_filter;
+    std::vector<uint32_t> m_visible;
+    macro_index_t m_index;
+    bool m_indexed = false;
 
-    struct LongerPatternSort
+    // Slot of the macro shown at row n
+    uint32_t slot_at(size_t n) const { return m_filter.empty() ? m_macros.at(n) : m_visible[n]; }
+
+    // Update the index and the rows after a change of the macro at 'slot'
+    void reindex(uint32_t slot, const macro_def_t *def);
+    void apply_filter();
+
+    // Macro changed since the last flush: its definition in the store and
+    // its current one (either may be missing)
+    struct dirty_t
     {
-        bool operator()(const std::string& lhs, const std::string& rhs) const
-        {
-            if (lhs.size() > rhs.size())
-                return true;
-            else if (lhs.size() < rhs.size())
-                return false;
-            else
-                return lhs < rhs;
-        }
+        std::optional<macro_def_t> stored;
+        std::optional<macro_def_t> current;
     };
-    std::map<std::string, std::string, LongerPatternSort> replace_map;
+    std::map<std::string, dirty_t, std::less<>> m_dirty;
 
-    repl_func_t m_repl_func;
+    // Description of a macro, read from the store if not loaded
+    std::string desc_of(uint32_t slot) const;
 
-public:
-    macro_replacer_t(repl_func_t repl_func);
+    // Record a change of the macro 'name'. 'stored' is its definition
+    // before the change: it is only kept for the first change
+    void set_dirty(
+        const std::string &name,
+        const macro_def_t *stored,
+        const macro_def_t *current);
 
-    // Replace macros in text
-    std::string operator()(const char* text);
-    std::string operator()(std::string text);
+    // Where the macros are persisted. The registry store is only read
+    // once, to move its macros to the file store
+    file_macro_store_t m_file_store;
+    reg_macro_store_t m_reg_store;
+    macro_store_t *m_store = &m_file_store;
 
-    // Similar to Python's "re.escape()"
-    static std::string escape_re(const std::string re_text);
+    // Read the macros from the store
+    void load_macros();
 
-    // Update the macro replacement map
-    void begin_update();
-    void update(std::string macro, std::string expr);
-    void end_update();
-};
+    // Compile the macros and rebuild the replacer
+    void publish_macros();
 
-// Global macro replacer instance
-extern macro_replacer_t macro_replacer;
+    // Compile the macro expressions ahead of use, reporting the broken ones
+    void precompile_macros();
 
-//-------------------------------------------------------------------------
-// Macro Editor UI
-//-------------------------------------------------------------------------
+    // The replacer was started from the cache: the macros are only read
+    // from the store when the list is needed (see ensure_loaded())
+    bool m_from_cache = false;
 
-// Modal macro editor
-class macro_editor_t: public chooser_t
-{
-protected:
-    static const uint32 flags_;
-    static const int widths_[];
-    static const char *const header_[];
+    // Store fingerprint the cache was written with (0 if none)
+    uint64_t m_cache_key = 0;
+    std::string cache_path() const { return m_file_store.path() + CLI_MACROS_CACHE_EXT; }
+
+    // Compiles the macros on the main thread when the cache turned out to
+    // be damaged
+    struct reload_request_t: public exec_request_t
+    {
+        macro_editor_t *editor;
+        reload_request_t(macro_editor_t *editor): editor(editor) { }
+        ssize_t idaapi execute() override;
+    };
+    reload_request_t m_reload{ this };
+    int m_reload_id = -1;
 
-    macros_t m_macros;
+    // Read the macros, if not done yet
+    void ensure_loaded();
+
+    // Read the descriptions the store did not load
+    void load_descs();
+
+    // Open the file store, migrating the registry macros the first time.
+    // Falls back to the registry if the file cannot be read
+    void open_store();
 
     // Edit a macro definition using a modal dialog
     // Parameters:
@@ -144,15 +156,9 @@ protected:
     // Returns: true if user confirmed changes, false if cancelled
     static bool edit_macro_def(macro_def_t &def, bool as_new);
 
-    // Registry operations
-    void reg_del_macro(const macro_def_t &macro);
-    void reg_save_macro(const macro_def_t &macro, std::string *ser_out = nullptr);
-
-    // Add a new macro to the list
-    macro_def_t *add_macro(macro_def_t macro);
-
     // Chooser overrides
     bool init() override;
+    void idaapi closed() override;
     size_t idaapi get_count() const override;
     void idaapi get_row(
         qstrvec_t *cols,
@@ -164,10 +170,104 @@ protected:
     cbret_t idaapi ins(ssize_t n) override;
     cbret_t idaapi del(size_t n) override;
     cbret_t idaapi edit(size_t n) override;
+    cbret_t idaapi refresh(ssize_t n) override;
 
 public:
     macro_editor_t(const char *title_ = "CLI macros editor");
+    ~macro_editor_t();
 
-    // Rebuilds the macros list from registry and updates the macro replacer
+    // Use another macro store (the macro file is used by default). The
+    // pending changes go to the previous store
+    void set_store(macro_store_t *store)
+    {
+        flush();
+        m_store = store;
+        m_loaded = false;
+        m_from_cache = false;
+    }
+
+    // Start the macro replacer: from the cache when it matches the macro
+    // file, which takes the same time however many macros there are, or
+    // else from the store (see build_macros_list())
+    void start();
+
+    // Rebuilds the macros list from the store and updates the macro replacer
+    // (the pending changes are written first)
     void build_macros_list();
-};
\ No newline at end of file
+
+    // Write the changed macros to the store
+    void flush();
+
+    // Write the cache of the compiled macros, if they changed since it was
+    // written. Call it after flush()
+    void save_cache();
+
+    // Only show the macros that pass a filter (empty to show all of them)
+    void set_filter(std::string_view filter);
+
+    // Ask for the filter and apply it. False if it was not changed
+    bool ask_filter();
+
+    // Ask for a macro pack file and import it, or export the macros to one
+    // (see macro_pack.h)
+    void import_pack();
+    void export_pack();
+};
+
+//-------------------------------------------------------------------------
+// Macro Statistics UI
+//-------------------------------------------------------------------------
+
+// Usage statistics of the macros and of the inline expressions, gathered by
+// the macro replacer and the evaluator. Insert dumps them to a JSON file and
+// Delete resets them
+class macro_stats_view_t: public chooser_t
+{
+protected:
+    static const uint32 flags_;
+    static const int widths_[];
+    static const char *const header_[];
+
+    // A macro (with the statistics of its expressions), an inline
+    // expression, or the totals of the expanded lines
+    struct row_t
+    {
+        std::string name;
+        std::string expr;
+        uint64 matches    = 0;
+        uint64 evals      = 0;
+        uint64 cache_hits = 0;
+        uint64 native     = 0;
+        uint64 vm         = 0;
+        uint64 python     = 0;
+        uint64 failures   = 0;
+        uint64 timeouts   = 0;
+        uint64 bytes_in   = 0;
+        uint64 bytes_out  = 0;
+        latency_histogram_t latency;
+    };
+    std::vector<row_t> m_rows;
+
+    // Gather the statistics
+    void build_rows();
+
+    // The statistics as a JSON document
+    std::string to_json() const;
+
+    // Chooser overrides
+    bool init() override;
+    size_t idaapi get_count() const override;
+    void idaapi get_row(
+        qstrvec_t *cols,
+        int *icon,
+        chooser_item_attrs_t *attrs,
+        size_t n) const override;
+
+    // Chooser actions
+    cbret_t idaapi ins(ssize_t n) override;
+    cbret_t idaapi del(size_t n) override;
+    cbret_t idaapi refresh(ssize_t n) override;
+
+public:
+    macro_stats_view_t(const char *title_ = "CLI macros statistics");
+};
@@ -0,0 +1,1123 @@
+/*
+Macro Evaluator: Cached evaluation of the dynamic expressions
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include "macro_eval.h"
+#include "macro_replacer.h"
+#include "macro_trace.h"
+#include "native_eval.h"
+#include <dbg.hpp>
+
+macro_eval_t macro_eval;
+
+//-------------------------------------------------------------------------
+// Dependency inference
+//-------------------------------------------------------------------------
+
+struct known_func_t
+{
+    const char *name;
+    uint32 deps;
+};
+
+// Functions whose result only depends on the given inputs
+static const known_func_t KNOWN_FUNCS[] =
+{
+    { "here",                 EVAL_DEP_SCREEN_EA },
+    { "get_screen_ea",        EVAL_DEP_SCREEN_EA },
+    { "read_selection_start", EVAL_DEP_SELECTION },
+    { "read_selection_end",   EVAL_DEP_SELECTION },
+    { "get_wide_byte",        EVAL_DEP_IDB },
+    { "get_wide_word",        EVAL_DEP_IDB },
+    { "get_wide_dword",       EVAL_DEP_IDB },
+    { "get_qword",            EVAL_DEP_IDB },
+    { "get_bytes",            EVAL_DEP_IDB },
+    { "get_segm_start",       EVAL_DEP_IDB },
+    { "get_segm_end",         EVAL_DEP_IDB },
+    { "get_segm_name",        EVAL_DEP_IDB },
+    { "get_func_name",        EVAL_DEP_IDB },
+    { "get_name",             EVAL_DEP_IDB },
+    { "get_name_ea_simple",   EVAL_DEP_IDB },
+    { "get_item_size",        EVAL_DEP_IDB },
+    { "next_head",            EVAL_DEP_IDB },
+    { "prev_head",            EVAL_DEP_IDB },
+    { "read_dbg_byte",        EVAL_DEP_DEBUGGER },
+    { "read_dbg_word",        EVAL_DEP_DEBUGGER },
+    { "read_dbg_dword",       EVAL_DEP_DEBUGGER },
+    { "read_dbg_qword",       EVAL_DEP_DEBUGGER },
+    { "read_dbg_memory",      EVAL_DEP_DEBUGGER },
+    { "get_reg_value",        EVAL_DEP_DEBUGGER },
+
+    // Builtins and string methods without inputs
+    { "hex",    0 }, { "int",   0 }, { "str",    0 }, { "len",   0 },
+    { "abs",    0 }, { "min",   0 }, { "max",    0 }, { "ord",   0 },
+    { "chr",    0 }, { "format", 0 }, { "upper", 0 }, { "lower", 0 },
+    { "strip",  0 }, { "zfill", 0 }, { "rjust",  0 }, { "ljust", 0 },
+    { "sum",    0 }, { "range", 0 },
+
+    // Keywords
+    { "and", 0 }, { "or", 0 }, { "not", 0 }, { "if", 0 }, { "else", 0 },
+    { "in",  0 }, { "is", 0 }, { "None", 0 }, { "True", 0 }, { "False", 0 },
+};
+
+// Modules the known functions may be qualified with
+static const char *const KNOWN_MODULES[] =
+{
+    "idc", "idaapi", "ida_bytes", "ida_kernwin", "ida_segment", "ida_name", "ida_funcs", "ida_dbg"
+};
+
+static bool is_ident_char(char ch)
+{
+    return isalnum(uint8_t(ch)) || ch == '_';
+}
+
+static bool is_known_module(std::string_view name)
+{
+    for (auto mod: KNOWN_MODULES)
+    {
+        if (name == mod)
+            return true;
+    }
+    return false;
+}
+
+static uint32 known_func_deps(std::string_view name)
+{
+    for (auto &func: KNOWN_FUNCS)
+    {
+        if (name == func.name)
+            return func.deps;
+    }
+    return EVAL_DEP_VOLATILE;
+}
+
+//-------------------------------------------------------------------------
+// Every name used by the expression must be a known function, possibly
+// qualified by a known module, or a keyword. Anything else (variables,
+// other functions, lambdas...) makes the expression volatile
+uint32 infer_eval_deps(std::string_view expr)
+{
+    uint32 deps = 0;
+    const size_t len = expr.size();
+    for (size_t i = 0; i < len && (deps & EVAL_DEP_VOLATILE) == 0; )
+    {
+        char ch = expr[i];
+        if (ch == '\'' || ch == '"')
+        {
+            // Skip string literals
+            for (++i; i < len && expr[i] != ch; ++i)
+            {
+                if (expr[i] == '\\')
+                    ++i;
+            }
+            ++i;
+        }
+        else if (isdigit(uint8_t(ch)))
+        {
+            // Numbers (including hexadecimal ones)
+            while (i < len && is_ident_char(expr[i]))
+                ++i;
+        }
+        else if (is_ident_char(ch))
+        {
+            // Dotted name: all but the last component must be modules
+            size_t start = i;
+            while (i < len && is_ident_char(expr[i]))
+                ++i;
+            std::string_view name = expr.substr(start, i - start);
+            while (i + 1 < len && expr[i] == '.' && is_ident_char(expr[i + 1]) && is_known_module(name))
+            {
+                start = ++i;
+                while (i < len && is_ident_char(expr[i]))
+                    ++i;
+                name = expr.substr(start, i - start);
+            }
+            deps |= known_func_deps(name);
+        }
+        else if (ch == ':' && i + 1 < len && expr[i + 1] == '=')
+        {
+            // Assignment expression
+            deps |= EVAL_DEP_VOLATILE;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    return deps;
+}
+
+//-------------------------------------------------------------------------
+// Caching evaluator
+//-------------------------------------------------------------------------
+void macro_eval_t::hook()
+{
+    if (m_hooked)
+        return;
+
+    hook_event_listener(HT_IDB, &m_idb_events);
+    hook_event_listener(HT_DBG, &m_dbg_events);
+    m_hooked = true;
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::unhook()
+{
+    if (!m_hooked)
+        return;
+
+    unhook_event_listener(HT_IDB, &m_idb_events);
+    unhook_event_listener(HT_DBG, &m_dbg_events);
+    m_watchdog.stop();
+    m_hooked = false;
+    clear();
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::read_inputs(uint32 deps, inputs_t &inputs) const
+{
+    if (deps & EVAL_DEP_SCREEN_EA)
+        inputs.screen_ea = get_screen_ea();
+    if ((deps & EVAL_DEP_SELECTION) && !read_range_selection(nullptr, &inputs.sel_start, &inputs.sel_end))
+        inputs.sel_start = inputs.sel_end = BADADDR;
+    if (deps & EVAL_DEP_IDB)
+        inputs.idb_gen = m_idb_events.gen;
+    if (deps & EVAL_DEP_DEBUGGER)
+        inputs.dbg_gen = m_dbg_events.gen;
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::same_inputs(uint32 deps, const inputs_t &a, const inputs_t &b) const
+{
+    return (!(deps & EVAL_DEP_SCREEN_EA) || a.screen_ea == b.screen_ea)
+        && (!(deps & EVAL_DEP_SELECTION) || (a.sel_start == b.sel_start && a.sel_end == b.sel_end))
+        && (!(deps & EVAL_DEP_IDB)       || a.idb_gen == b.idb_gen)
+        && (!(deps & EVAL_DEP_DEBUGGER)  || a.dbg_gen == b.dbg_gen);
+}
+
+//-------------------------------------------------------------------------
+// Compiled expressions
+//-------------------------------------------------------------------------
+void macro_eval_t::clear()
+{
+    for (auto &kv: m_cache)
+    {
+        if (!kv.second.func.empty())
+            m_free_funcs.push_back(std::move(kv.second.func));
+    }
+    m_cache.clear();
+    m_lru.clear();
+}
+
+//-------------------------------------------------------------------------
+macro_eval_t::cache_t::iterator macro_eval_t::get_entry(std::string_view expr)
+{
+    auto p = m_cache.find(expr);
+    if (p != m_cache.end())
+        return p;
+
+    p = m_cache.emplace(std::string(expr), entry_t()).first;
+    p->second.deps = infer_eval_deps(expr);
+    p->second.lru  = m_lru.insert(m_lru.begin(), &p->first);
+    evict();
+    return p;
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::touch(entry_t &entry)
+{
+    if (!entry.pinned)
+        m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+}
+
+//-------------------------------------------------------------------------
+// Drop the least recently used inline expressions
+void macro_eval_t::evict()
+{
+    while (m_lru.size() > MAX_CACHE_ENTRIES)
+    {
+        auto p = m_cache.find(*m_lru.back());
+        m_lru.pop_back();
+        if (!p->second.func.empty())
+            m_free_funcs.push_back(std::move(p->second.func));
+        m_cache.erase(p);
+    }
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::compile(const std::string &expr, entry_t &entry, qstring *errbuf)
+{
+    auto py = pylang();
+    if (py == nullptr)
+        return true;
+
+    // Reuse the function name of an evicted expression
+    if (entry.func.empty())
+    {
+        if (!m_free_funcs.empty())
+        {
+            entry.func = std::move(m_free_funcs.back());
+            m_free_funcs.pop_back();
+        }
+        else
+        {
+            entry.func = "__climacros_expr_" + std::to_string(m_func_serial++);
+        }
+    }
+
+    qstring err;
+    if (!py->compile_expr(entry.func.c_str(), BADADDR, expr.c_str(), &err))
+    {
+        entry.state = COMPILE_FAILED;
+        if (errbuf != nullptr)
+            *errbuf = err;
+        return false;
+    }
+    entry.state = COMPILED;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::precompile_macro(std::string_view macro_expr, qstring *errbuf)
+{
+    bool ok = true;
+    macro_replacer_t::eval_span_t span;
+    for (size_t pos = 0;
+         macro_replacer_t::find_eval_span(macro_expr.data(), macro_expr.size(), pos, span);
+         pos = span.end)
+    {
+        auto expr = macro_expr.substr(span.expr_start, span.expr_end - span.expr_start);
+        if (is_native_expr(expr))
+        {
+            if (!check_native_expr(expr, ok ? errbuf : nullptr))
+                ok = false;
+            continue;
+        }
+
+        auto p = get_entry(expr);
+        auto &entry = p->second;
+        if (!entry.pinned)
+        {
+            entry.pinned = true;
+            m_lru.erase(entry.lru);
+        }
+        if (!entry.vm_compiled)
+            compile_vm(p->first, entry);
+
+        // Python remains the fallback of the bytecode
+        if (entry.state != COMPILED && !compile(p->first, entry, ok ? errbuf : nullptr))
+            ok = false;
+    }
+    return ok;
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::unpin_all()
+{
+    for (auto &kv: m_cache)
+    {
+        if (kv.second.pinned)
+        {
+            kv.second.pinned = false;
+            kv.second.lru = m_lru.insert(m_lru.end(), &kv.first);
+        }
+    }
+    evict();
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::compile_vm(const std::string &expr, entry_t &entry)
+{
+    size_t nfuncs;
+    const expr_func_t *funcs = ida_expr_funcs(nfuncs);
+    entry.program.compile(expr, funcs, nfuncs);
+    entry.vm_compiled = true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::eval_vm(const std::string &expr, entry_t &entry, std::string &value)
+{
+    if (!m_use_vm)
+        return false;
+    if (!entry.vm_compiled)
+        compile_vm(expr, entry);
+    return !entry.program.empty() && entry.program.run(value);
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::eval_python(
+    const std::string &expr,
+    entry_t &entry,
+    std::string &value,
+    size_t count,
+    bool *timed_out)
+{
+    if (timed_out != nullptr)
+        *timed_out = false;
+
+    if (entry.state == NOT_COMPILED)
+        compile(expr, entry, nullptr);
+    if (entry.state != COMPILED)
+        return false;
+
+    auto py = pylang();
+    if (py == nullptr)
+        return false;
+
+    const int64 budget = time_left_ms(count);
+    if (budget == 0)
+    {
+        if (timed_out != nullptr)
+            *timed_out = true;
+        return false;
+    }
+
+    // The watchdog interrupts the call once the budget is spent
+    if (!m_interrupt_checked)
+    {
+        m_interruptible = py_interrupt_init();
+        m_interrupt_checked = true;
+    }
+    const bool watched = budget > 0 && m_interruptible;
+    if (watched)
+        m_watchdog.arm(std::chrono::milliseconds(budget));
+
+    qstring errbuf;
+    idc_value_t rv;
+    bool ok = py->call_func(&rv, entry.func.c_str(), nullptr, 0, &errbuf) && rv.vtype == VT_STR;
+
+    // The interrupt may still be pending if the call returned meanwhile
+    if (watched && m_watchdog.disarm())
+    {
+        py_interrupt_cancel();
+        if (!ok && timed_out != nullptr)
+            *timed_out = true;
+    }
+    if (!ok)
+        return false;
+
+    value = rv.qstr().c_str();
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::eval_fast(std::string_view expr, pending_t &pending, std::string &value, bool cache_only)
+{
+    auto p = get_entry(expr);
+    auto &entry = p->second;
+    touch(entry);
+    pending.expr  = &p->first;
+    pending.entry = &entry;
+
+    // Database and debugger changes are only noticed while hooked, and the
+    // memory of a running process changes without notice
+    const uint32 deps = entry.deps;
+    bool cacheable = (deps & EVAL_DEP_VOLATILE) == 0
+                  && (m_hooked || (deps & (EVAL_DEP_IDB | EVAL_DEP_DEBUGGER)) == 0);
+    if (cacheable && (deps & EVAL_DEP_DEBUGGER) != 0 && get_process_state() != DSTATE_SUSP)
+        cacheable = false;
+
+    pending.cacheable = cacheable;
+    if (cacheable)
+    {
+        read_inputs(deps, pending.inputs);
+        if (entry.valid && same_inputs(deps, entry.inputs, pending.inputs))
+        {
+            value = entry.value;
+            pending.ok   = true;
+            pending.path = EVAL_PATH_CACHE;
+            return true;
+        }
+    }
+
+    if (cache_only || !eval_vm(p->first, entry, value))
+        return false;
+    pending.path = EVAL_PATH_VM;
+    finish(pending, true, value);
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::finish(pending_t &pending, bool ok, const std::string &value)
+{
+    auto &entry = *pending.entry;
+    pending.ok  = ok;
+    entry.valid = ok && pending.cacheable;
+    if (ok)
+    {
+        entry.inputs    = pending.inputs;
+        entry.value     = value;
+        entry.has_value = true;
+    }
+    return ok;
+}
+
+//-------------------------------------------------------------------------
+// Statistics
+//-------------------------------------------------------------------------
+static const char *const EVAL_PATH_NAMES[] = { "cache", "native", "vm", "python" };
+
+static uint64 elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return uint64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+//-------------------------------------------------------------------------
+eval_stats_t *macro_eval_t::stats_of(std::string_view expr, entry_t *entry)
+{
+    if (entry != nullptr && entry->stats != nullptr)
+        return entry->stats;
+
+    auto p = m_stats.find(expr);
+    if (p == m_stats.end())
+    {
+        if (m_stats.size() >= MAX_STATS_ENTRIES)
+            return nullptr;
+        p = m_stats.try_emplace(std::string(expr)).first;
+    }
+    if (entry != nullptr)
+        entry->stats = &p->second;
+    return &p->second;
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::record(
+    std::string_view expr,
+    entry_t *entry,
+    eval_path_t path,
+    eval_outcome_t outcome,
+    size_t value_len,
+    uint64 ns)
+{
+    auto stats = stats_of(expr, entry);
+    if (stats == nullptr)
+        return;
+
+    ++stats->evals;
+    switch (path)
+    {
+        case EVAL_PATH_CACHE:  ++stats->cache_hits; break;
+        case EVAL_PATH_NATIVE: ++stats->native;     break;
+        case EVAL_PATH_VM:     ++stats->vm;         break;
+        case EVAL_PATH_PYTHON: ++stats->python;     break;
+    }
+    if (outcome == EVAL_FAILED)
+        ++stats->failures;
+    else if (outcome == EVAL_TIMED_OUT)
+        ++stats->timeouts;
+    stats->bytes_in  += expr.size();
+    stats->bytes_out += outcome == EVAL_OK ? value_len : 0;
+    stats->latency.record(ns);
+}
+
+//-------------------------------------------------------------------------
+// The statistics stay where they are: the cache entries point to them
+void macro_eval_t::reset_stats()
+{
+    for (auto &kv: m_stats)
+        kv.second.reset();
+}
+
+//-------------------------------------------------------------------------
+// Time budgets
+//-------------------------------------------------------------------------
+int64 macro_eval_t::time_left_ms(size_t count) const
+{
+    int64 left = m_budget.expr_ms != 0 ? int64(m_budget.expr_ms) * int64(count) : -1;
+    if (m_in_line && m_budget.line_ms != 0)
+    {
+        auto line_left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            m_line_deadline - std::chrono::steady_clock::now()).count();
+        line_left = std::max<int64>(line_left, 0);
+        left = left < 0 ? line_left : std::min<int64>(left, line_left);
+    }
+    return left;
+}
+
+//-------------------------------------------------------------------------
+std::string macro_eval_t::timeout_value(std::string_view expr) const
+{
+    if (m_budget.use_stale)
+    {
+        auto p = m_cache.find(expr);
+        if (p != m_cache.end() && p->second.has_value)
+            return p->second.value;
+    }
+    return std::string(expr);
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::report_timeout(std::string_view expr, size_t skipped) const
+{
+    msg("climacros: '%.*s' ran out of time (budget: %u ms per expression, %u ms per line)\n",
+        int(expr.size()), expr.data(), m_budget.expr_ms, m_budget.line_ms);
+    if (skipped != 0)
+        msg("climacros: %" FMT_Z " other expression(s) of the line were not evaluated\n", skipped);
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::load_budget()
+{
+    eval_budget_t def;
+    m_budget.expr_ms   = uint32(reg_read_int(IDAREG_EVAL_EXPR_MS, int(def.expr_ms)));
+    m_budget.line_ms   = uint32(reg_read_int(IDAREG_EVAL_LINE_MS, int(def.line_ms)));
+    m_budget.use_stale = reg_read_bool(IDAREG_EVAL_USE_STALE, def.use_stale);
+}
+
+void macro_eval_t::save_budget() const
+{
+    reg_write_int(IDAREG_EVAL_EXPR_MS, int(m_budget.expr_ms));
+    reg_write_int(IDAREG_EVAL_LINE_MS, int(m_budget.line_ms));
+    reg_write_bool(IDAREG_EVAL_USE_STALE, m_budget.use_stale);
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::edit_budget()
+{
+    static const char form[] =
+        "Expression time budgets\n"
+        "\n"
+        "<~E~xpression budget (ms, 0 = unlimited):D1:10:10::>\n"
+        "<~L~ine budget (ms, 0 = unlimited)      :D2:10:10::>\n"
+        "<~U~se the previous value on timeout:C3>>\n"
+        "\n";
+
+    sval_t expr_ms = m_budget.expr_ms, line_ms = m_budget.line_ms;
+    ushort flags = m_budget.use_stale ? 1 : 0;
+    if (ask_form(form, &expr_ms, &line_ms, &flags) <= 0)
+        return false;
+
+    m_budget.expr_ms   = uint32(std::max<sval_t>(expr_ms, 0));
+    m_budget.line_ms   = uint32(std::max<sval_t>(line_ms, 0));
+    m_budget.use_stale = (flags & 1) != 0;
+    save_budget();
+    return true;
+}
+
+//-------------------------------------------------------------------------
+std::string macro_eval_t::operator()(std::string_view expr)
+{
+    // Native expressions are cheaper than the cache itself
+    macro_trace_t::span_t span(macro_trace, "native", "eval", expr);
+    const auto start = std::chrono::steady_clock::now();
+    std::string value;
+    if (is_native_expr(expr))
+    {
+        bool ok = eval_native_expr(expr, value);
+        record(expr, nullptr, EVAL_PATH_NATIVE, ok ? EVAL_OK : EVAL_FAILED, value.size(), elapsed_ns(start));
+        return ok ? value : std::string(expr);
+    }
+
+    pending_t pending;
+    if (eval_fast(expr, pending, value))
+    {
+        span.set_name(EVAL_PATH_NAMES[pending.path]);
+        record(expr, pending.entry, pending.path, EVAL_OK, value.size(), elapsed_ns(start));
+        return value;
+    }
+
+    span.set_name(EVAL_PATH_NAMES[EVAL_PATH_PYTHON]);
+    bool timed_out;
+    bool ok = eval_python(*pending.expr, *pending.entry, value, 1, &timed_out);
+    finish(pending, ok, value);
+    record(
+        expr,
+        pending.entry,
+        EVAL_PATH_PYTHON,
+        ok ? EVAL_OK : timed_out ? EVAL_TIMED_OUT : EVAL_FAILED,
+        value.size(),
+        elapsed_ns(start));
+    if (ok)
+        return value;
+    if (!timed_out)
+        return std::string(expr);
+
+    report_timeout(expr, 0);
+    return timeout_value(expr);
+}
+
+//-------------------------------------------------------------------------
+// Batches
+//-------------------------------------------------------------------------
+
+// Separates the values returned by a batch, and marks the failed ones
+static constexpr char BATCH_SEP  = '\x1f';
+static constexpr char BATCH_FAIL = '\x1e';
+static constexpr char BATCH_LATE = '\x1d';
+
+// Evaluates the expressions (passed as lambdas) of a batch. Once the
+// watchdog interrupted one, the next ones are not evaluated
+static const char BATCH_HELPER[] =
+    "def __climacros_batch(*funcs):\n"
+    "    values = []\n"
+    "    late = False\n"
+    "    for func in funcs:\n"
+    "        value = None\n"
+    "        if not late:\n"
+    "            try:\n"
+    "                value = func()\n"
+    "            except KeyboardInterrupt:\n"
+    "                late = True\n"
+    "            except Exception:\n"
+    "                pass\n"
+    "        if late:\n"
+    "            values.append('\\x1d')\n"
+    "        else:\n"
+    "            values.append(value if isinstance(value, str) and '\\x1f' not in value else '\\x1e')\n"
+    "    return '\\x1f'.join(values)\n";
+
+// Queries that return the same value throughout a line
+static const char *const LINE_INVARIANT_FUNCS[] =
+{
+    "here", "get_screen_ea", "read_selection_start", "read_selection_end"
+};
+
+// Call of a line invariant query in an expression
+struct invariant_call_t
+{
+    size_t start;
+    size_t end;
+};
+
+//-------------------------------------------------------------------------
+// Find the argument-less calls of the line invariant queries, possibly
+// qualified by a known module, outside of string literals
+static void find_invariant_calls(std::string_view expr, std::vector<invariant_call_t> &calls)
+{
+    calls.clear();
+    const size_t len = expr.size();
+    for (size_t i = 0; i < len; )
+    {
+        char ch = expr[i];
+        if (ch == '\'' || ch == '"')
+        {
+            for (++i; i < len && expr[i] != ch; ++i)
+            {
+                if (expr[i] == '\\')
+                    ++i;
+            }
+            ++i;
+        }
+        else if (isdigit(uint8_t(ch)))
+        {
+            while (i < len && is_ident_char(expr[i]))
+                ++i;
+        }
+        else if (is_ident_char(ch))
+        {
+            // Not an attribute of something else
+            size_t prev = i;
+            while (prev > 0 && isspace(uint8_t(expr[prev - 1])))
+                --prev;
+            const bool attribute = prev > 0 && expr[prev - 1] == '.';
+
+            const size_t start = i;
+            while (i < len && is_ident_char(expr[i]))
+                ++i;
+            std::string_view name = expr.substr(start, i - start);
+            while (i + 1 < len && expr[i] == '.' && is_ident_char(expr[i + 1]) && is_known_module(name))
+            {
+                size_t s = ++i;
+                while (i < len && is_ident_char(expr[i]))
+                    ++i;
+                name = expr.substr(s, i - s);
+            }
+
+            // "name()"
+            size_t j = i;
+            while (j < len && isspace(uint8_t(expr[j])))
+                ++j;
+            if (attribute || j >= len || expr[j] != '(')
+                continue;
+            ++j;
+            while (j < len && isspace(uint8_t(expr[j])))
+                ++j;
+            if (j >= len || expr[j] != ')')
+                continue;
+
+            for (auto func: LINE_INVARIANT_FUNCS)
+            {
+                if (name == func)
+                {
+                    calls.push_back({ start, j + 1 });
+                    i = j + 1;
+                    break;
+                }
+            }
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+//-------------------------------------------------------------------------
+// Build the Python expression evaluating a batch. The line invariant
+// queries called more than once are called once and passed as arguments:
+//   (lambda __climacros_c0: __climacros_batch((lambda: E1), ...))(idc.here())
+static std::string make_batch_expr(const std::vector<const std::string *> &exprs)
+{
+    // Count the calls by their text
+    std::vector<std::vector<invariant_call_t>> calls(exprs.size());
+    std::vector<std::pair<std::string_view, int>> counts;
+    for (size_t i = 0; i < exprs.size(); ++i)
+    {
+        find_invariant_calls(*exprs[i], calls[i]);
+        for (auto &call: calls[i])
+        {
+            std::string_view text = std::string_view(*exprs[i]).substr(call.start, call.end - call.start);
+            auto p = std::find_if(counts.begin(), counts.end(), [text](auto &c) { return c.first == text; });
+            if (p == counts.end())
+                counts.emplace_back(text, 1);
+            else
+                ++p->second;
+        }
+    }
+
+    // Shared calls become parameters
+    std::vector<std::string_view> params;
+    for (auto &c: counts)
+    {
+        if (c.second > 1)
+            params.push_back(c.first);
+    }
+
+    std::string batch;
+    if (!params.empty())
+    {
+        batch = "(lambda ";
+        for (size_t k = 0; k < params.size(); ++k)
+            batch += (k == 0 ? "__climacros_c" : ", __climacros_c") + std::to_string(k);
+        batch += ": ";
+    }
+    batch += "__climacros_batch(";
+    for (size_t i = 0; i < exprs.size(); ++i)
+    {
+        const std::string &expr = *exprs[i];
+        batch += i == 0 ? "(lambda: (" : ", (lambda: (";
+        size_t pos = 0;
+        for (auto &call: calls[i])
+        {
+            std::string_view text = std::string_view(expr).substr(call.start, call.end - call.start);
+            auto p = std::find(params.begin(), params.end(), text);
+            if (p == params.end())
+                continue;
+            batch.append(expr, pos, call.start - pos);
+            batch += "__climacros_c" + std::to_string(p - params.begin());
+            pos = call.end;
+        }
+        batch.append(expr, pos);
+        batch += "))";
+    }
+    batch += ")";
+    if (!params.empty())
+    {
+        batch += ")(";
+        for (size_t k = 0; k < params.size(); ++k)
+        {
+            if (k != 0)
+                batch += ", ";
+            batch += params[k];
+        }
+        batch += ")";
+    }
+    return batch;
+}
+
+//-------------------------------------------------------------------------
+bool macro_eval_t::eval_python_batch(
+    const std::vector<std::string_view> &exprs,
+    std::vector<pending_t> &pending,
+    const std::vector<size_t> &todo,
+    std::vector<std::string> &values,
+    std::vector<size_t> &late)
+{
+    auto py = pylang();
+    if (py == nullptr)
+        return false;
+
+    if (!m_batch_helper)
+    {
+        qstring errbuf;
+        if (!py->eval_snippet(BATCH_HELPER, &errbuf))
+            return false;
+        m_batch_helper = true;
+    }
+
+    // Distinct expressions
+    std::vector<const std::string *> distinct;
+    std::vector<size_t> slots;
+    slots.reserve(todo.size());
+    for (size_t i: todo)
+    {
+        auto p = std::find(distinct.begin(), distinct.end(), pending[i].expr);
+        slots.push_back(p - distinct.begin());
+        if (p == distinct.end())
+            distinct.push_back(pending[i].expr);
+    }
+
+    // The batch expression is compiled and kept like the others. Its
+    // budget is that of all its expressions
+    auto p = get_entry(make_batch_expr(distinct));
+    touch(p->second);
+    std::string result;
+    bool timed_out;
+    if (!eval_python(p->first, p->second, result, distinct.size(), &timed_out))
+    {
+        if (!timed_out)
+            return false;
+
+        // Interrupted outside of the expressions
+        for (size_t i: todo)
+        {
+            finish(pending[i], false, values[i]);
+            late.push_back(i);
+        }
+        return true;
+    }
+
+    std::vector<std::string_view> parts;
+    for (size_t pos = 0; ; )
+    {
+        size_t sep = result.find(BATCH_SEP, pos);
+        parts.push_back(std::string_view(result).substr(pos, sep == std::string::npos ? std::string::npos : sep - pos));
+        if (sep == std::string::npos)
+            break;
+        pos = sep + 1;
+    }
+    if (parts.size() != distinct.size())
+        return false;
+
+    for (size_t k = 0; k < todo.size(); ++k)
+    {
+        const size_t i = todo[k];
+        std::string_view part = parts[slots[k]];
+        if (part.size() == 1 && part[0] == BATCH_LATE)
+        {
+            finish(pending[i], false, values[i]);
+            late.push_back(i);
+            continue;
+        }
+        bool ok = !(part.size() == 1 && part[0] == BATCH_FAIL);
+        values[i] = ok ? std::string(part) : std::string(exprs[i]);
+        finish(pending[i], ok, values[i]);
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::eval_line(const std::vector<std::string_view> &exprs, std::vector<std::string> &values)
+{
+    const size_t n = exprs.size();
+    std::vector<pending_t> pending(n);
+    std::vector<size_t> todo, late;
+
+    // First expression that ran out of time
+    size_t culprit = n;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        // Native code cannot be interrupted: once out of time, only the
+        // cached values are used
+        const bool out_of_time = time_left_ms(1) == 0;
+        macro_trace_t::span_t span(macro_trace, "native", "eval", exprs[i]);
+        const auto start = std::chrono::steady_clock::now();
+        if (is_native_expr(exprs[i]))
+        {
+            if (out_of_time)
+            {
+                span.set_name("skipped");
+                late.push_back(i);
+                continue;
+            }
+            bool ok = eval_native_expr(exprs[i], values[i]);
+            record(exprs[i], nullptr, EVAL_PATH_NATIVE, ok ? EVAL_OK : EVAL_FAILED, values[i].size(), elapsed_ns(start));
+            if (!ok)
+                values[i] = exprs[i];
+        }
+        else if (eval_fast(exprs[i], pending[i], values[i], out_of_time))
+        {
+            span.set_name(EVAL_PATH_NAMES[pending[i].path]);
+            record(exprs[i], pending[i].entry, pending[i].path, EVAL_OK, values[i].size(), elapsed_ns(start));
+        }
+        else
+        {
+            // Left for Python
+            span.set_name(out_of_time ? "skipped" : "lookup");
+            (out_of_time ? late : todo).push_back(i);
+        }
+
+        if (culprit == n && !out_of_time && m_budget.expr_ms != 0
+            && std::chrono::steady_clock::now() - start > std::chrono::milliseconds(m_budget.expr_ms))
+        {
+            culprit = i;
+        }
+    }
+
+    // One expression at a time if the batch cannot run
+    const size_t native_late = late.size();
+    const auto py_start = std::chrono::steady_clock::now();
+    bool batched = false;
+    if (todo.size() > 1)
+    {
+        const std::string detail = std::to_string(todo.size()) + " expressions";
+        macro_trace_t::span_t span(macro_trace, "python_batch", "eval", detail);
+        batched = eval_python_batch(exprs, pending, todo, values, late);
+    }
+    if (!batched)
+    {
+        for (size_t i: todo)
+        {
+            macro_trace_t::span_t span(macro_trace, "python", "eval", exprs[i]);
+            bool timed_out;
+            bool ok = eval_python(*pending[i].expr, *pending[i].entry, values[i], 1, &timed_out);
+            if (finish(pending[i], ok, values[i]))
+                continue;
+            if (timed_out)
+                late.push_back(i);
+            else
+                values[i] = exprs[i];
+        }
+    }
+
+    // The Python evaluations share the time they took; the skipped
+    // expressions took none
+    std::vector<bool> is_late(n), called(n);
+    for (size_t i: late)
+        is_late[i] = true;
+    const uint64 py_ns = todo.empty() ? 0 : elapsed_ns(py_start) / todo.size();
+    for (size_t i: todo)
+    {
+        called[i] = true;
+        if (!is_late[i])
+            record(exprs[i], pending[i].entry, EVAL_PATH_PYTHON, pending[i].ok ? EVAL_OK : EVAL_FAILED, values[i].size(), py_ns);
+    }
+    for (size_t i: late)
+    {
+        const bool native = pending[i].entry == nullptr;
+        record(exprs[i], pending[i].entry, native ? EVAL_PATH_NATIVE : EVAL_PATH_PYTHON, EVAL_TIMED_OUT, 0, called[i] ? py_ns : 0);
+    }
+
+    if (culprit == n && late.size() > native_late)
+        culprit = late[native_late];
+    if (culprit == n && !late.empty())
+        culprit = late[0];
+    if (culprit == n)
+        return;
+
+    for (size_t i: late)
+        values[i] = timeout_value(exprs[i]);
+    const bool culprit_late = std::find(late.begin(), late.end(), culprit) != late.end();
+    report_timeout(exprs[culprit], late.size() - (culprit_late ? 1 : 0));
+}
+
+//-------------------------------------------------------------------------
+void macro_eval_t::eval_batch(const std::vector<std::string_view> &exprs, std::vector<std::string> &values)
+{
+    const size_t n = exprs.size();
+    values.assign(n, std::string());
+    dbg_cache_begin_line(exprs);
+    m_in_line = true;
+    m_line_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_budget.line_ms);
+
+    // The entries of a batch must not be evicted before it is done
+    if (n > MAX_CACHE_ENTRIES / 2)
+    {
+        for (size_t i = 0; i < n; ++i)
+            values[i] = (*this)(exprs[i]);
+    }
+    else
+    {
+        eval_line(exprs, values);
+    }
+
+    m_in_line = false;
+    dbg_cache_end_line();
+}
+
+//-------------------------------------------------------------------------
+// Benchmark
+//-------------------------------------------------------------------------
+void macro_eval_t::benchmark()
+{
+    // Expressions of the former default macros
+    static const char *const SAMPLES[] =
+    {
+        "'0x%x' % idc.here()",
+        "'%x' % idc.here()",
+        "'0x%x' % idc.get_wide_dword(idc.here())",
+        "'0x%x' % idc.get_qword(idc.here())",
+        "'%x' % (idc.read_selection_end() - idc.read_selection_start())",
+        "hex(idc.get_segm_start(idc.here()))",
+    };
+    const int PY_ITERS = 1000;
+    const int VM_ITERS = 100000;
+
+    // Nanoseconds per call, or -1 if a call fails
+    auto time = [](int iters, auto &&fn) -> double
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < iters; ++i)
+        {
+            if (!fn())
+                return -1;
+        }
+        std::chrono::duration<double, std::nano> dt = std::chrono::steady_clock::now() - t0;
+        return dt.count() / iters;
+    };
+    auto format = [](char (&buf)[32], double ns)
+    {
+        if (ns < 0)
+            qstrncpy(buf, "n/a", sizeof(buf));
+        else
+            qsnprintf(buf, sizeof(buf), "%.0f", ns);
+        return buf;
+    };
+
+    auto py = pylang();
+    size_t nfuncs;
+    const expr_func_t *funcs = ida_expr_funcs(nfuncs);
+
+    msg("climacros: expression evaluation (ns per call, uncached)\n");
+    msg("%-64s %10s %10s %10s\n", "expression", "eval_expr", "call_func", "vm");
+    for (const std::string expr: SAMPLES)
+    {
+        double eval_ns = -1, call_ns = -1, vm_ns = -1;
+        if (py != nullptr)
+        {
+            eval_ns = time(PY_ITERS, [&]()
+            {
+                qstring errbuf;
+                idc_value_t rv;
+                return py->eval_expr(&rv, BADADDR, expr.c_str(), &errbuf) && rv.vtype == VT_STR;
+            });
+
+            entry_t entry;
+            if (compile(expr, entry, nullptr))
+            {
+                std::string value;
+                call_ns = time(PY_ITERS, [&]() { return eval_python(expr, entry, value); });
+            }
+            if (!entry.func.empty())
+                m_free_funcs.push_back(std::move(entry.func));
+        }
+
+        expr_program_t program;
+        if (program.compile(expr, funcs, nfuncs))
+        {
+            std::string value;
+            vm_ns = time(VM_ITERS, [&]() { return program.run(value); });
+        }
+
+        char b1[32], b2[32], b3[32];
+        msg("%-64s %10s %10s %10s\n", expr.c_str(), format(b1, eval_ns), format(b2, call_ns), format(b3, vm_ns));
+    }
+}
@@ -0,0 +1,327 @@
+/*
+Macro Evaluator: Evaluation of the dynamic "${expr}$" expressions
+
+Native "${native:NAME:FMT}$" expressions are evaluated without Python (see
+native_eval.h). Expressions within the subset of the expression VM
+(integer arithmetic, comparisons, '%' formatting and the common IDA queries,
+see expr_vm.h) are compiled into bytecode and run without Python. Other
+expressions are compiled once into Python functions and called afterwards:
+those of the registered macros when the macros are loaded or edited, inline
+ones on first use (the most recently used ones are kept).
+
+Results are cached when the expression only calls functions whose inputs
+are known (cursor location, selection, database bytes, debugger memory): a
+cached result is reused until one of those inputs changes, which the
+database and debugger notifications and a cheap check of the cursor and
+selection tell.
+
+The expressions of a line are evaluated together: those that need Python
+go through a single call, which evaluates each distinct expression once and
+calls the cursor and selection queries they share (idc.here()...) once.
+
+Evaluations have time budgets, per expression and per line. A watchdog
+interrupts Python code that runs out of time (native code cannot be
+interrupted: the remaining expressions of the line are skipped instead).
+The expression is reported and its previous value used, if any.
+
+Statistics are kept per expression: how it was evaluated, how long it took
+and how much text went in and out. The expressions evaluated together by a
+Python batch share the time of the batch evenly.
+
+The evaluator runs on the main thread, like the CLIs.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "expr_vm.h"
+#include "macro_stats.h"
+#include "py_interrupt.h"
+#include "watchdog.h"
+#include "idasdk.h"
+
+//-------------------------------------------------------------------------
+// Inputs an expression result depends on
+//-------------------------------------------------------------------------
+enum eval_dep_t : uint32
+{
+    EVAL_DEP_SCREEN_EA = 0x01,  // Cursor location
+    EVAL_DEP_SELECTION = 0x02,  // Selected range
+    EVAL_DEP_IDB       = 0x04,  // Database contents
+    EVAL_DEP_DEBUGGER  = 0x08,  // Debugged process memory and registers
+    EVAL_DEP_VOLATILE  = 0x80,  // Unknown: never cached
+};
+
+// Infer the dependencies of a Python expression from the functions it calls
+uint32 infer_eval_deps(std::string_view expr);
+
+//-------------------------------------------------------------------------
+// Time budgets of the evaluations (0: unlimited)
+//-------------------------------------------------------------------------
+struct eval_budget_t
+{
+    uint32 expr_ms   = 1000;    // Each expression
+    uint32 line_ms   = 3000;    // All the expressions of a line
+    bool   use_stale = true;    // Use the previous value of an expression that ran out of time
+};
+
+// Registry values of the budget
+constexpr char IDAREG_EVAL_EXPR_MS[]   = "CLI_Macros_ExprBudget";
+constexpr char IDAREG_EVAL_LINE_MS[]   = "CLI_Macros_LineBudget";
+constexpr char IDAREG_EVAL_USE_STALE[] = "CLI_Macros_UseStale";
+
+//-------------------------------------------------------------------------
+// Statistics of an expression
+//-------------------------------------------------------------------------
+struct eval_stats_t
+{
+    uint64 evals      = 0;
+    uint64 cache_hits = 0;      // Cached values
+    uint64 native     = 0;      // Native evaluators
+    uint64 vm         = 0;      // Bytecode
+    uint64 python     = 0;      // Python calls, alone or in a batch
+    uint64 failures   = 0;
+    uint64 timeouts   = 0;
+    uint64 bytes_in   = 0;      // Expression text
+    uint64 bytes_out  = 0;      // Values
+    latency_histogram_t latency;
+
+    void reset() { *this = eval_stats_t(); }
+};
+
+//-------------------------------------------------------------------------
+// Caching expression evaluator
+//-------------------------------------------------------------------------
+class macro_eval_t
+{
+    // Counts the notifications of a hook type
+    struct gen_listener_t: public event_listener_t
+    {
+        uint64 gen = 0;
+        ssize_t idaapi on_event(ssize_t, va_list) override
+        {
+            ++gen;
+            return 0;
+        }
+    };
+    gen_listener_t m_idb_events;
+    gen_listener_t m_dbg_events;
+
+    // State of the inputs when a result was computed
+    struct inputs_t
+    {
+        ea_t   screen_ea = BADADDR;
+        ea_t   sel_start = BADADDR;
+        ea_t   sel_end   = BADADDR;
+        uint64 idb_gen   = 0;
+        uint64 dbg_gen   = 0;
+    };
+
+    enum compile_state_t
+    {
+        NOT_COMPILED,   // Not compiled yet (or Python was not available)
+        COMPILED,       // 'func' holds the compiled expression
+        COMPILE_FAILED,
+    };
+
+    struct entry_t
+    {
+        // Last value; 'valid' tells if it is current for 'inputs'
+        uint32      deps = 0;
+        bool        valid = false;
+        bool        has_value = false;
+        inputs_t    inputs;
+        std::string value;
+
+        compile_state_t state = NOT_COMPILED;
+        std::string     func;
+
+        // Bytecode of the expression (empty if outside the VM subset)
+        bool           vm_compiled = false;
+        expr_program_t program;
+
+        // Expressions of the registered macros are never evicted;
+        // the others are kept in most recently used order
+        bool pinned = false;
+        std::list<const std::string *>::iterator lru;
+
+        // Statistics of the expression (see stats_of())
+        eval_stats_t *stats = nullptr;
+    };
+
+    struct hash_t
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    };
+    using cache_t = std::unordered_map<std::string, entry_t, hash_t, std::equal_to<>>;
+    cache_t m_cache;
+    std::list<const std::string *> m_lru;
+
+    // Bound of the unpinned entries (inline expressions)
+    static constexpr size_t MAX_CACHE_ENTRIES = 1024;
+
+public:
+    using stats_map_t = std::unordered_map<std::string, eval_stats_t, hash_t, std::equal_to<>>;
+
+private:
+    // Statistics outlive the cache entries; expressions beyond the bound
+    // are not tracked
+    stats_map_t m_stats;
+    static constexpr size_t MAX_STATS_ENTRIES = 4096;
+
+    // Names of the Python functions holding compiled expressions
+    std::vector<std::string> m_free_funcs;
+    int m_func_serial = 0;
+
+    bool m_hooked = false;
+    bool m_use_vm = true;
+    bool m_batch_helper = false;
+
+    // Time budgets
+    eval_budget_t m_budget;
+    watchdog_t m_watchdog{ py_interrupt_main };
+    bool m_interrupt_checked = false;
+    bool m_interruptible = false;
+    bool m_in_line = false;
+    std::chrono::steady_clock::time_point m_line_deadline;
+
+    // How an expression was evaluated
+    enum eval_path_t
+    {
+        EVAL_PATH_CACHE,
+        EVAL_PATH_NATIVE,
+        EVAL_PATH_VM,
+        EVAL_PATH_PYTHON,
+    };
+
+    // Evaluation of an expression in progress
+    struct pending_t
+    {
+        const std::string *expr = nullptr;
+        entry_t *entry = nullptr;
+        inputs_t inputs;
+        bool cacheable = false;
+        bool ok = false;
+        eval_path_t path = EVAL_PATH_PYTHON;
+    };
+
+    void read_inputs(uint32 deps, inputs_t &inputs) const;
+    bool same_inputs(uint32 deps, const inputs_t &a, const inputs_t &b) const;
+
+    cache_t::iterator get_entry(std::string_view expr);
+    void touch(entry_t &entry);
+    void evict();
+
+    // Compile the expression of an entry; false if it does not compile
+    bool compile(const std::string &expr, entry_t &entry, qstring *errbuf);
+
+    // Compile the expression of an entry into bytecode, if it is in the subset
+    void compile_vm(const std::string &expr, entry_t &entry);
+
+    // Run the bytecode of an entry; false if the expression is outside the
+    // VM subset or must be evaluated by Python
+    bool eval_vm(const std::string &expr, entry_t &entry, std::string &value);
+
+    // Evaluate in Python, within the budget of 'count' expressions. False if
+    // the expression failed, is not a string or ran out of time ('timed_out')
+    bool eval_python(
+        const std::string &expr,
+        entry_t &entry,
+        std::string &value,
+        size_t count = 1,
+        bool *timed_out = nullptr);
+
+    // Get the value of an expression from the cache or, unless 'cache_only',
+    // its bytecode. Returns false if Python is needed
+    bool eval_fast(std::string_view expr, pending_t &pending, std::string &value, bool cache_only = false);
+
+    // Milliseconds left to evaluate 'count' expressions; -1 if unlimited
+    int64 time_left_ms(size_t count) const;
+
+    // Value of an expression that ran out of time: its previous value if
+    // allowed, otherwise the expression itself
+    std::string timeout_value(std::string_view expr) const;
+    void report_timeout(std::string_view expr, size_t skipped) const;
+
+    // Record the outcome of an evaluation; returns 'ok'
+    bool finish(pending_t &pending, bool ok, const std::string &value);
+
+    // Statistics of an expression (null if not tracked); 'entry' caches them
+    eval_stats_t *stats_of(std::string_view expr, entry_t *entry);
+
+    // Count an evaluation in the statistics of its expression
+    enum eval_outcome_t { EVAL_OK, EVAL_FAILED, EVAL_TIMED_OUT };
+    void record(
+        std::string_view expr,
+        entry_t *entry,
+        eval_path_t path,
+        eval_outcome_t outcome,
+        size_t value_len,
+        uint64 ns);
+
+    // Evaluate the expressions of a line within its budget
+    void eval_line(const std::vector<std::string_view> &exprs, std::vector<std::string> &values);
+
+    // Evaluate the 'todo' expressions of a batch in a single Python call;
+    // those that ran out of time are added to 'late'.
+    // Returns false if the batch could not be run (nothing was evaluated)
+    bool eval_python_batch(
+        const std::vector<std::string_view> &exprs,
+        std::vector<pending_t> &pending,
+        const std::vector<size_t> &todo,
+        std::vector<std::string> &values,
+        std::vector<size_t> &late);
+
+public:
+    ~macro_eval_t() { unhook(); }
+
+    // Follow the database and debugger notifications (results depending on
+    // them are not cached while unhooked)
+    void hook();
+    void unhook();
+
+    // Drop all the cached results and compiled expressions
+    void clear();
+
+    // Compile the inline expressions of a registered macro ahead of use.
+    // Returns false with the error if one does not compile (compilation is
+    // deferred, without error, until Python is available)
+    bool precompile_macro(std::string_view macro_expr, qstring *errbuf = nullptr);
+
+    // Let the expressions of the previously registered macros be evicted
+    void unpin_all();
+
+    // Run the expressions within the VM subset without Python (default)
+    void use_vm(bool enable) { m_use_vm = enable; }
+
+    // Time budgets, saved in the registry
+    const eval_budget_t &budget() const { return m_budget; }
+    void set_budget(const eval_budget_t &budget) { m_budget = budget; }
+    void load_budget();
+    void save_budget() const;
+
+    // Let the user edit the time budgets. Returns false if cancelled
+    bool edit_budget();
+
+    // Evaluate an expression. Returns the expression itself if it failed
+    std::string operator()(std::string_view expr);
+
+    // Evaluate the expressions of a line (see macro_replacer_t::batch_func_t)
+    void eval_batch(const std::vector<std::string_view> &exprs, std::vector<std::string> &values);
+
+    // Statistics of the evaluated expressions
+    const stats_map_t &stats() const { return m_stats; }
+    void reset_stats();
+
+    // Time the evaluation paths of sample expressions (output window)
+    void benchmark();
+};
+
+// Global evaluator used by the macro replacer
+extern macro_eval_t macro_eval;
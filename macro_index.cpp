@@ -0,0 +1,156 @@
+/*
+Macro Index: Search index implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include "macro_index.h"
+
+//-------------------------------------------------------------------------
+static char lower_char(char ch)
+{
+    return ch >= 'A' && ch <= 'Z' ? char(ch - 'A' + 'a') : ch;
+}
+
+static bool is_token_char(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+std::string macro_index_t::lower(std::string_view s)
+{
+    std::string r(s);
+    for (auto &ch: r)
+        ch = lower_char(ch);
+    return r;
+}
+
+//-------------------------------------------------------------------------
+// Append the lowercase tokens of 'text'
+void macro_index_t::tokenize(std::string_view text, std::vector<std::string> &tokens)
+{
+    for (size_t i = 0; i < text.size(); )
+    {
+        if (!is_token_char(text[i]))
+        {
+            ++i;
+            continue;
+        }
+        size_t j = i;
+        while (j < text.size() && is_token_char(text[j]))
+            ++j;
+        tokens.push_back(lower(text.substr(i, j - i)));
+        i = j;
+    }
+}
+
+//-------------------------------------------------------------------------
+void macro_index_t::clear()
+{
+    m_names.clear();
+    m_tokens.clear();
+    m_entries.clear();
+}
+
+//-------------------------------------------------------------------------
+void macro_index_t::add(uint32_t slot, std::string_view name, std::string_view expr, std::string_view desc)
+{
+    remove(slot);
+    if (m_entries.size() <= slot)
+        m_entries.resize(slot + 1);
+
+    auto &entry = m_entries[slot];
+    entry.used = true;
+    entry.name = &m_names.emplace(lower(name), slot).first->first;
+
+    std::vector<std::string> tokens;
+    tokenize(expr, tokens);
+    tokenize(desc, tokens);
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    entry.tokens.clear();
+    entry.tokens.reserve(tokens.size());
+    for (auto &token: tokens)
+    {
+        auto p = m_tokens.try_emplace(std::move(token)).first;
+        auto &slots = p->second;
+        slots.insert(std::lower_bound(slots.begin(), slots.end(), slot), slot);
+        entry.tokens.push_back(&p->first);
+    }
+}
+
+//-------------------------------------------------------------------------
+void macro_index_t::remove(uint32_t slot)
+{
+    if (slot >= m_entries.size() || !m_entries[slot].used)
+        return;
+
+    auto &entry = m_entries[slot];
+    m_names.erase({ *entry.name, slot });
+    for (auto token: entry.tokens)
+    {
+        auto p = m_tokens.find(*token);
+        auto &slots = p->second;
+        slots.erase(std::lower_bound(slots.begin(), slots.end(), slot));
+        if (slots.empty())
+            m_tokens.erase(p);
+    }
+    entry = entry_t();
+}
+
+//-------------------------------------------------------------------------
+// Each word marks the macros that passed all the previous words, so a
+// macro passes if it was marked by the last word
+void macro_index_t::query(std::string_view filter, const std::vector<uint32_t> &order, std::vector<uint32_t> &slots) const
+{
+    std::vector<std::string> words;
+    for (size_t i = 0; i < filter.size(); )
+    {
+        if (filter[i] == ' ' || filter[i] == '\t')
+        {
+            ++i;
+            continue;
+        }
+        size_t j = filter.find_first_of(" \t", i);
+        if (j == std::string_view::npos)
+            j = filter.size();
+        words.push_back(lower(filter.substr(i, j - i)));
+        i = j;
+    }
+
+    slots.clear();
+    if (words.empty())
+    {
+        slots = order;
+        return;
+    }
+
+    m_hits.assign(m_entries.size(), 0);
+    for (uint32_t w = 0; w < words.size(); ++w)
+    {
+        auto &word = words[w];
+        auto mark = [&](uint32_t slot)
+        {
+            if (m_hits[slot] == w)
+                m_hits[slot] = w + 1;
+        };
+
+        for (auto p = m_names.lower_bound({ word, 0 }); p != m_names.end() && p->first.compare(0, word.size(), word) == 0; ++p)
+            mark(p->second);
+
+        for (auto p = m_tokens.lower_bound(word); p != m_tokens.end() && p->first.compare(0, word.size(), word) == 0; ++p)
+        {
+            for (auto slot: p->second)
+                mark(slot);
+        }
+    }
+
+    const uint32_t all = uint32_t(words.size());
+    for (auto slot: order)
+    {
+        if (slot < m_hits.size() && m_hits[slot] == all)
+            slots.push_back(slot);
+    }
+}
@@ -0,0 +1,67 @@
+/*
+Macro Index: Incremental search index of the macros, for filtering
+
+A filter is a list of words. A macro passes if each word is a prefix of its
+name, or of one of the tokens of its expression or description. Tokens are
+the runs of letters, digits and underscores; the comparisons ignore the
+case (ASCII only).
+
+The names and the tokens are kept in ordered sets, which serve as prefix
+trees: the entries starting with a word are the range that lower_bound()
+finds. Each token has the list of the macros it appears in. Adding or
+removing a macro only updates its own entries.
+
+Macros are identified by their slot in a macro table (see macro_table.h).
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+//-------------------------------------------------------------------------
+class macro_index_t
+{
+    // Lowercase names
+    std::set<std::pair<std::string, uint32_t>> m_names;
+
+    // Lowercase tokens, with the sorted slots of the macros they appear in
+    std::map<std::string, std::vector<uint32_t>, std::less<>> m_tokens;
+
+    // By slot: the name and the tokens of the macro (keys of the sets
+    // above), to remove it
+    struct entry_t
+    {
+        bool used = false;
+        const std::string *name = nullptr;
+        std::vector<const std::string *> tokens;
+    };
+    std::vector<entry_t> m_entries;
+
+    // Query scratch: number of words matched, by slot
+    mutable std::vector<uint32_t> m_hits;
+
+    static std::string lower(std::string_view s);
+    static void tokenize(std::string_view text, std::vector<std::string> &tokens);
+
+public:
+    void clear();
+
+    // Index a macro (replacing what was indexed for its slot)
+    void add(uint32_t slot, std::string_view name, std::string_view expr, std::string_view desc);
+    void remove(uint32_t slot);
+
+    // Number of indexed macros
+    size_t size() const { return m_names.size(); }
+
+    // The slots of 'order' whose macros pass the filter, in that order.
+    // An empty filter lets all of them through
+    void query(std::string_view filter, const std::vector<uint32_t> &order, std::vector<uint32_t> &slots) const;
+};
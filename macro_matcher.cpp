@@ -0,0 +1,560 @@
+/*
+Macro Matcher: Aho-Corasick multi-pattern matcher implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include "macro_matcher.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define BYTE_FILTER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define BYTE_FILTER_SSE2
+#endif
+
+//-------------------------------------------------------------------------
+// Byte set prefilter
+//-------------------------------------------------------------------------
+void byte_filter_t::clear()
+{
+    memset(m_table, 0, sizeof(m_table));
+    m_count = 0;
+}
+
+//-------------------------------------------------------------------------
+void byte_filter_t::add(uint8_t ch)
+{
+    if (m_table[ch])
+        return;
+
+    m_table[ch] = true;
+    if (m_count < MAX_SIMD_BYTES)
+        m_bytes[m_count] = ch;
+    ++m_count;
+}
+
+//-------------------------------------------------------------------------
+size_t byte_filter_t::find(const char *text, size_t len, size_t from) const
+{
+    if (m_count == 0 || from >= len)
+        return len;
+
+    if (m_count == 1)
+    {
+        auto p = (const char *)memchr(text + from, m_bytes[0], len - from);
+        return p == nullptr ? len : p - text;
+    }
+
+    size_t i = from;
+    if (m_count <= MAX_SIMD_BYTES)
+    {
+#if defined(BYTE_FILTER_AVX2)
+        __m256i needles[MAX_SIMD_BYTES];
+        for (int k = 0; k < m_count; ++k)
+            needles[k] = _mm256_set1_epi8(char(m_bytes[k]));
+
+        for (; i + 32 <= len; i += 32)
+        {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(text + i));
+            __m256i hits  = _mm256_cmpeq_epi8(block, needles[0]);
+            for (int k = 1; k < m_count; ++k)
+                hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[k]));
+
+            uint32_t mask = uint32_t(_mm256_movemask_epi8(hits));
+            if (mask != 0)
+                return i + std::countr_zero(mask);
+        }
+#elif defined(BYTE_FILTER_SSE2)
+        __m128i needles[MAX_SIMD_BYTES];
+        for (int k = 0; k < m_count; ++k)
+            needles[k] = _mm_set1_epi8(char(m_bytes[k]));
+
+        for (; i + 16 <= len; i += 16)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+            __m128i hits  = _mm_cmpeq_epi8(block, needles[0]);
+            for (int k = 1; k < m_count; ++k)
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[k]));
+
+            uint32_t mask = uint32_t(_mm_movemask_epi8(hits));
+            if (mask != 0)
+                return i + std::countr_zero(mask);
+        }
+#endif
+    }
+
+    // Scalar tail (or large sets)
+    for (; i < len; ++i)
+    {
+        if (m_table[uint8_t(text[i])])
+            return i;
+    }
+    return len;
+}
+
+//-------------------------------------------------------------------------
+// Aho-Corasick automaton
+//-------------------------------------------------------------------------
+void macro_matcher_t::automaton_t::clear()
+{
+    patterns.clear();
+    nodes.assign(1, node_t());
+    edge_bytes.clear();
+    edge_targets.clear();
+    lead_bytes.clear();
+    std::fill(std::begin(root_next), std::end(root_next), ROOT);
+}
+
+//-------------------------------------------------------------------------
+// Goto function restricted to the trie edges (-1 if there is no edge)
+int32_t macro_matcher_t::automaton_t::child(int32_t s, uint8_t ch) const
+{
+    if (s == ROOT)
+        return root_next[ch] == ROOT ? -1 : root_next[ch];
+
+    auto &node = nodes[s];
+    auto first = edge_bytes.begin() + node.first_edge;
+    auto last  = first + node.n_edges;
+    auto p = std::lower_bound(first, last, ch);
+    if (p == last || *p != ch)
+        return -1;
+
+    return edge_targets[p - edge_bytes.begin()];
+}
+
+//-------------------------------------------------------------------------
+// Full transition function (follows failure links)
+int32_t macro_matcher_t::automaton_t::next_state(int32_t s, uint8_t ch) const
+{
+    while (s != ROOT)
+    {
+        int32_t c = child(s, ch);
+        if (c >= 0)
+            return c;
+        s = nodes[s].fail;
+    }
+    return root_next[ch];
+}
+
+//-------------------------------------------------------------------------
+// Compile the patterns (sorted in place)
+void macro_matcher_t::automaton_t::build(std::vector<pattern_t> &patterns)
+{
+    clear();
+
+    // Insert the patterns in sorted order so that the children of every
+    // trie node get created in increasing byte order
+    std::stable_sort(patterns.begin(), patterns.end(), [](const pattern_t &a, const pattern_t &b)
+    {
+        return a.text < b.text;
+    });
+
+    struct tnode_t
+    {
+        int32_t first_child  = -1;
+        int32_t last_child   = -1;
+        int32_t next_sibling = -1;
+        int32_t pattern      = -1;
+        uint8_t ch           = 0;
+    };
+    std::vector<tnode_t> trie(1);
+
+    // Path of the previously inserted pattern
+    std::vector<int32_t> path(1, 0);
+    const std::string *prev = nullptr;
+    for (auto &p: patterns)
+    {
+        auto &pat = p.text;
+        if (pat.empty())
+            continue;
+
+        // Reuse the prefix shared with the previous (sorted) pattern
+        size_t lcp = 0;
+        if (prev != nullptr)
+        {
+            size_t n = std::min(prev->size(), pat.size());
+            while (lcp < n && (*prev)[lcp] == pat[lcp])
+                ++lcp;
+        }
+        path.resize(lcp + 1);
+
+        for (size_t i = lcp; i < pat.size(); ++i)
+        {
+            int32_t parent = path.back();
+            int32_t c = int32_t(trie.size());
+            trie.push_back(tnode_t());
+            trie[c].ch = uint8_t(pat[i]);
+            if (trie[parent].last_child < 0)
+                trie[parent].first_child = c;
+            else
+                trie[trie[parent].last_child].next_sibling = c;
+            trie[parent].last_child = c;
+            path.push_back(c);
+        }
+        // Duplicated patterns: the last registered one wins
+        auto &term = trie[path.back()].pattern;
+        term = std::max(term, int32_t(p.id));
+        prev = &pat;
+    }
+
+    // Lay the nodes out in BFS order with contiguous edge lists
+    std::vector<int32_t> queue;
+    queue.reserve(trie.size());
+    queue.push_back(0);
+    nodes.resize(trie.size());
+    edge_bytes.reserve(trie.size());
+    edge_targets.reserve(trie.size());
+    for (size_t qi = 0; qi < queue.size(); ++qi)
+    {
+        int32_t t = queue[qi];
+        auto &node = nodes[qi];
+        node.term = trie[t].pattern;
+        node.out  = node.term >= 0 ? int32_t(qi) : -1;
+        node.first_edge = uint32_t(edge_bytes.size());
+        for (int32_t c = trie[t].first_child; c >= 0; c = trie[c].next_sibling)
+        {
+            int32_t id = int32_t(queue.size());
+            queue.push_back(c);
+            nodes[id].depth = node.depth + 1;
+            edge_bytes.push_back(trie[c].ch);
+            edge_targets.push_back(id);
+        }
+        node.n_edges = uint32_t(edge_bytes.size()) - node.first_edge;
+    }
+
+    for (uint32_t e = 0; e < nodes[ROOT].n_edges; ++e)
+    {
+        root_next[edge_bytes[e]] = edge_targets[e];
+        lead_bytes.add(edge_bytes[e]);
+    }
+
+    // Failure links and output links, computed in BFS order
+    for (size_t s = 0; s < nodes.size(); ++s)
+    {
+        auto &node = nodes[s];
+        for (uint32_t e = node.first_edge; e < node.first_edge + node.n_edges; ++e)
+        {
+            uint8_t ch = edge_bytes[e];
+            auto &c = nodes[edge_targets[e]];
+            c.fail = s == ROOT ? ROOT : next_state(node.fail, ch);
+            if (c.out < 0)
+                c.out = nodes[c.fail].out;
+        }
+    }
+}
+
+//-------------------------------------------------------------------------
+// The nodes and edges are written as they are laid out in memory; the root
+// transitions and the lead bytes are derived from them when loading
+void macro_matcher_t::automaton_t::save(cache_writer_t &w) const
+{
+    w.put_u32(uint32_t(nodes.size()));
+    w.put_bytes(nodes.data(), nodes.size() * sizeof(node_t));
+    w.put_u32(uint32_t(edge_bytes.size()));
+    w.put_bytes(edge_bytes.data(), edge_bytes.size());
+    w.put_bytes(edge_targets.data(), edge_targets.size() * sizeof(int32_t));
+}
+
+//-------------------------------------------------------------------------
+// Besides the bounds, the links must go to shallower nodes and the edges to
+// nodes one level deeper, in increasing byte order: this is what keeps the
+// transitions and the output chains finite
+bool macro_matcher_t::automaton_t::load(cache_reader_t &r, int next_id)
+{
+    clear();
+    uint32_t n_nodes, n_edges;
+    if (!r.get_u32(n_nodes)
+        || n_nodes == 0
+        || !r.get_array(nodes, n_nodes)
+        || !r.get_u32(n_edges)
+        || !r.get_array(edge_bytes, n_edges)
+        || !r.get_array(edge_targets, n_edges))
+    {
+        return false;
+    }
+
+    if (nodes[ROOT].depth != 0 || nodes[ROOT].term >= 0)
+        return false;
+    for (uint32_t s = 0; s < n_nodes; ++s)
+    {
+        auto &node = nodes[s];
+        if (node.fail < 0 || uint32_t(node.fail) >= n_nodes
+            || (s != ROOT && nodes[node.fail].depth >= node.depth)
+            || node.term < -1 || node.term >= next_id
+            || node.first_edge > n_edges || node.n_edges > n_edges - node.first_edge)
+        {
+            return false;
+        }
+        if (node.out >= 0
+            && (uint32_t(node.out) >= n_nodes || nodes[node.out].term < 0 || nodes[node.out].depth > node.depth))
+        {
+            return false;
+        }
+        for (uint32_t e = node.first_edge; e < node.first_edge + node.n_edges; ++e)
+        {
+            int32_t t = edge_targets[e];
+            if (t <= int32_t(s) || uint32_t(t) >= n_nodes || nodes[t].depth != node.depth + 1
+                || (e > node.first_edge && edge_bytes[e - 1] >= edge_bytes[e]))
+            {
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t e = 0; e < nodes[ROOT].n_edges; ++e)
+    {
+        root_next[edge_bytes[nodes[ROOT].first_edge + e]] = edge_targets[nodes[ROOT].first_edge + e];
+        lead_bytes.add(edge_bytes[nodes[ROOT].first_edge + e]);
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Leftmost-longest search:
+//   - every position reports the longest live pattern ending there (hence
+//     the leftmost start for that end position)
+//   - the scan stops as soon as the current state can no longer extend to
+//     a match starting at or before the best match found so far
+//   - while in the root state, input that cannot start a match is skipped
+//     with the lead bytes prefilter
+bool macro_matcher_t::automaton_t::find(
+    const std::vector<int> *dead,
+    const char *text,
+    size_t len,
+    size_t from,
+    match_t &m) const
+{
+    if (empty())
+        return false;
+
+    bool found = false;
+    int32_t s = ROOT;
+    for (size_t i = from; i < len; ++i)
+    {
+        if (s == ROOT)
+        {
+            if (found)
+                break;
+            i = lead_bytes.find(text, len, i);
+            if (i == len)
+                break;
+        }
+
+        s = next_state(s, uint8_t(text[i]));
+        auto &node = nodes[s];
+        if (found && i + 1 - node.depth > m.pos)
+            break;
+
+        // Skip erased patterns
+        int32_t o = node.out;
+        while (o >= 0 && dead != nullptr && std::binary_search(dead->begin(), dead->end(), nodes[o].term))
+            o = nodes[nodes[o].fail].out;
+        if (o < 0)
+            continue;
+
+        size_t plen  = nodes[o].depth;
+        size_t start = i + 1 - plen;
+        if (!found || start < m.pos || (start == m.pos && plen > m.len))
+        {
+            m.pos = start;
+            m.len = plen;
+            m.id  = nodes[o].term;
+            found = true;
+        }
+    }
+    return found;
+}
+
+//-------------------------------------------------------------------------
+// Multi-pattern matcher
+//-------------------------------------------------------------------------
+void macro_matcher_t::clear()
+{
+    m_pending.clear();
+    m_main.reset();
+    m_delta.reset();
+    m_dead.clear();
+    m_next_id = 0;
+    m_max_len = 0;
+    m_lead_bytes.clear();
+}
+
+//-------------------------------------------------------------------------
+int macro_matcher_t::add(std::string_view pattern)
+{
+    m_pending.push_back({ m_next_id, std::string(pattern) });
+    m_max_len = std::max(m_max_len, pattern.size());
+    return m_next_id++;
+}
+
+//-------------------------------------------------------------------------
+void macro_matcher_t::build()
+{
+    auto main = std::make_shared<automaton_t>();
+    main->build(m_pending);
+    m_pending.clear();
+    m_pending.shrink_to_fit();
+
+    m_main = std::move(main);
+    m_delta.reset();
+    m_dead.clear();
+    update_lead_bytes();
+}
+
+//-------------------------------------------------------------------------
+// Compile a new delta automaton; the current one may be shared by copies
+void macro_matcher_t::set_delta(std::vector<pattern_t> &patterns)
+{
+    if (patterns.empty())
+    {
+        m_delta.reset();
+    }
+    else
+    {
+        auto delta = std::make_shared<automaton_t>();
+        delta->build(patterns);
+        delta->patterns = std::move(patterns);
+        m_delta = std::move(delta);
+    }
+    update_lead_bytes();
+}
+
+//-------------------------------------------------------------------------
+int macro_matcher_t::insert(std::string_view pattern)
+{
+    std::vector<pattern_t> patterns;
+    if (m_delta)
+        patterns = m_delta->patterns;
+
+    int id = m_next_id++;
+    patterns.push_back({ id, std::string(pattern) });
+    m_max_len = std::max(m_max_len, pattern.size());
+    set_delta(patterns);
+    return id;
+}
+
+//-------------------------------------------------------------------------
+void macro_matcher_t::erase(int id)
+{
+    if (m_delta)
+    {
+        auto &delta = m_delta->patterns;
+        auto p = std::find_if(delta.begin(), delta.end(), [id](const pattern_t &pat) { return pat.id == id; });
+        if (p != delta.end())
+        {
+            std::vector<pattern_t> patterns(delta.begin(), p);
+            patterns.insert(patterns.end(), p + 1, delta.end());
+            set_delta(patterns);
+            return;
+        }
+    }
+
+    // Tombstone the pattern in the main automaton
+    auto p = std::lower_bound(m_dead.begin(), m_dead.end(), id);
+    if (p == m_dead.end() || *p != id)
+        m_dead.insert(p, id);
+}
+
+//-------------------------------------------------------------------------
+bool macro_matcher_t::needs_rebuild() const
+{
+    return m_dead.size() > MAX_DELTA_PATTERNS
+        || (m_delta && m_delta->patterns.size() > MAX_DELTA_PATTERNS);
+}
+
+//-------------------------------------------------------------------------
+bool macro_matcher_t::empty() const
+{
+    return (!m_main || m_main->empty()) && (!m_delta || m_delta->empty());
+}
+
+//-------------------------------------------------------------------------
+void macro_matcher_t::update_lead_bytes()
+{
+    m_lead_bytes.clear();
+    for (auto a: { m_main.get(), m_delta.get() })
+    {
+        if (a == nullptr)
+            continue;
+        for (int ch = 0; ch < 256; ++ch)
+        {
+            if (a->lead_bytes.contains(uint8_t(ch)))
+                m_lead_bytes.add(uint8_t(ch));
+        }
+    }
+}
+
+//-------------------------------------------------------------------------
+// Serialization
+//-------------------------------------------------------------------------
+bool macro_matcher_t::save(cache_writer_t &w) const
+{
+    if (!m_pending.empty() || m_delta || !m_dead.empty())
+        return false;
+
+    w.put_u32(uint32_t(m_next_id));
+    w.put_u64(m_max_len);
+    if (m_main)
+    {
+        m_main->save(w);
+    }
+    else
+    {
+        automaton_t empty;
+        empty.save(w);
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_matcher_t::load(cache_reader_t &r)
+{
+    clear();
+    uint32_t next_id;
+    uint64_t max_len;
+    auto main = std::make_shared<automaton_t>();
+    if (!r.get_u32(next_id) || next_id > INT32_MAX || !r.get_u64(max_len) || !main->load(r, int(next_id)))
+        return false;
+
+    // The stored length bounds the lookahead of the streamed expansion: it
+    // must be the depth of the deepest pattern
+    uint32_t depth = 0;
+    for (auto &node: main->nodes)
+    {
+        if (node.term >= 0)
+            depth = std::max(depth, node.depth);
+    }
+    if (max_len != depth)
+        return false;
+
+    m_next_id = int(next_id);
+    m_max_len = size_t(max_len);
+    m_main    = std::move(main);
+    update_lead_bytes();
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_matcher_t::find(
+    const char *text,
+    size_t len,
+    size_t from,
+    match_t &m) const
+{
+    bool found = m_main && m_main->find(m_dead.empty() ? nullptr : &m_dead, text, len, from, m);
+
+    match_t dm;
+    if (m_delta
+        && m_delta->find(nullptr, text, len, from, dm)
+        && (!found || dm.pos < m.pos || (dm.pos == m.pos && dm.len > m.len)))
+    {
+        m = dm;
+        found = true;
+    }
+    return found;
+}
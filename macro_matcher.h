@@ -0,0 +1,171 @@
+/*
+Macro Matcher: Aho-Corasick multi-pattern matcher used by the macro replacer
+
+The matcher finds the leftmost-longest occurrence of any registered pattern,
+which is what the former longest-first regex alternation used to do, but in
+time proportional to the scanned text rather than to the number of macros.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "macro_cache.h"
+
+//-------------------------------------------------------------------------
+// Byte set prefilter
+//-------------------------------------------------------------------------
+
+// Finds the next byte belonging to a small set (e.g. the first bytes of all
+// the macros). Small sets are searched 16/32 bytes at a time (SSE2/AVX2),
+// larger ones fall back to a table lookup
+class byte_filter_t
+{
+    static constexpr int MAX_SIMD_BYTES = 8;
+
+    bool    m_table[256];
+    uint8_t m_bytes[MAX_SIMD_BYTES];
+    int     m_count;
+
+public:
+    byte_filter_t() { clear(); }
+
+    void clear();
+    void add(uint8_t ch);
+
+    bool empty() const { return m_count == 0; }
+    bool contains(uint8_t ch) const { return m_table[ch]; }
+
+    // Offset of the first byte of the set in text[from..len), or 'len'
+    size_t find(const char *text, size_t len, size_t from) const;
+};
+
+//-------------------------------------------------------------------------
+// Multi-pattern matcher
+//-------------------------------------------------------------------------
+
+// Patterns are compiled into a main automaton. Patterns inserted afterwards
+// go to a small delta automaton and erased ones are tombstoned, so that
+// changing one pattern does not recompile the whole set. The compiled
+// automata are immutable and shared between copies of the matcher: copying
+// a matcher costs O(delta), which is what snapshots of the macro set rely on
+class macro_matcher_t
+{
+public:
+    struct match_t
+    {
+        size_t pos;     // Offset of the match in the scanned text
+        size_t len;     // Length of the matched pattern
+        int    id;      // Pattern id as returned by add()
+    };
+
+    // Delta or tombstones size past which build() should be called again
+    static constexpr size_t MAX_DELTA_PATTERNS = 256;
+
+private:
+    static constexpr int32_t ROOT = 0;
+
+    struct node_t
+    {
+        int32_t  fail  = ROOT;  // Failure link
+        int32_t  out   = -1;    // Longest node ending a pattern that is a suffix of this node
+        int32_t  term  = -1;    // Pattern ending exactly at this node
+        uint32_t depth = 0;     // Length of the string spelled by this node
+        uint32_t first_edge = 0;
+        uint32_t n_edges    = 0;
+    };
+
+    struct pattern_t
+    {
+        int         id;
+        std::string text;
+    };
+
+    // Compiled automaton over a subset of the patterns.
+    // Edges are stored per node, sorted by byte
+    struct automaton_t
+    {
+        std::vector<pattern_t> patterns;    // Only kept by the delta automaton
+        std::vector<node_t>    nodes;
+        std::vector<uint8_t>   edge_bytes;
+        std::vector<int32_t>   edge_targets;
+        int32_t                root_next[256];
+        byte_filter_t          lead_bytes;
+
+        automaton_t() { clear(); }
+
+        void clear();
+        void build(std::vector<pattern_t> &patterns);
+        void save(cache_writer_t &w) const;
+        bool load(cache_reader_t &r, int next_id);
+        bool empty() const { return nodes.size() <= 1; }
+
+        int32_t child(int32_t s, uint8_t ch) const;
+        int32_t next_state(int32_t s, uint8_t ch) const;
+        bool find(const std::vector<int> *dead, const char *text, size_t len, size_t from, match_t &m) const;
+    };
+
+    // Patterns registered by add(), waiting for build()
+    std::vector<pattern_t> m_pending;
+
+    std::shared_ptr<const automaton_t> m_main;
+    std::shared_ptr<const automaton_t> m_delta;
+
+    // Erased ids of the main automaton (sorted)
+    std::vector<int> m_dead;
+
+    int    m_next_id = 0;
+    size_t m_max_len = 0;
+
+    // First bytes of all the patterns
+    byte_filter_t m_lead_bytes;
+
+    void set_delta(std::vector<pattern_t> &patterns);
+    void update_lead_bytes();
+
+public:
+    // Remove all patterns and the compiled automata
+    void clear();
+
+    // Register a pattern and return its id. Empty patterns never match.
+    // The pattern is matched after the next build()
+    int add(std::string_view pattern);
+
+    // Compile the patterns registered since clear()
+    void build();
+
+    // Incremental updates of a built matcher. Their cost is proportional
+    // to the changed pattern (plus the small delta automaton)
+    int  insert(std::string_view pattern);
+    void erase(int id);
+
+    // Returns true when the delta or the tombstones grew large enough to
+    // warrant a full rebuild
+    bool needs_rebuild() const;
+
+    // Returns true if no pattern can ever match
+    bool empty() const;
+
+    // First bytes of all the patterns
+    const byte_filter_t &lead_bytes() const { return m_lead_bytes; }
+
+    // Length of the longest pattern
+    size_t max_len() const { return m_max_len; }
+
+    // Number of ids given out since clear()
+    int ids() const { return m_next_id; }
+
+    // Find the leftmost-longest match in text[from..len)
+    bool find(const char *text, size_t len, size_t from, match_t &m) const;
+
+    // Serialization of the compiled automaton (see macro_cache.h). save()
+    // fails if patterns were added or erased since build(). load()
+    // validates what it reads: a damaged cache cannot make find() loop or
+    // read out of bounds
+    bool save(cache_writer_t &w) const;
+    bool load(cache_reader_t &r);
+};
@@ -0,0 +1,265 @@
+/*
+Macro Pack: Import and export implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <cerrno>
+#include <cstring>
+#include "macro_pack.h"
+
+static constexpr char PACK_HEADER[] = "# climacros macro pack\n# macro\texpression\tdescription\n";
+
+// Size of the file reads and writes
+static constexpr size_t IO_CHUNK = 1 << 16;
+
+//-------------------------------------------------------------------------
+// Parser
+//-------------------------------------------------------------------------
+macro_pack_parser_t::macro_pack_parser_t(def_func_t on_def, error_func_t on_error)
+    : m_on_def(std::move(on_def)), m_on_error(std::move(on_error))
+{
+}
+
+//-------------------------------------------------------------------------
+void macro_pack_parser_t::parse_line(std::string_view line)
+{
+    ++m_line;
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+    if (line.empty() || line[0] == '#')
+        return;
+
+    auto fail = [&](const char *reason)
+    {
+        if (m_on_error != nullptr)
+            m_on_error(m_line, reason);
+    };
+
+    size_t nfields = 1;
+    m_fields[0].clear();
+    m_fields[1].clear();
+    m_fields[2].clear();
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+        char ch = line[i];
+        if (ch == '\t')
+        {
+            if (nfields == 3)
+                return fail("too many fields");
+            ++nfields;
+            continue;
+        }
+        if (ch == '\\')
+        {
+            if (++i == line.size())
+                return fail("backslash at the end of the line");
+            switch (line[i])
+            {
+                case 't':  ch = '\t'; break;
+                case 'n':  ch = '\n'; break;
+                case 'r':  ch = '\r'; break;
+                case '\\': ch = '\\'; break;
+                default:   return fail("unknown escape sequence");
+            }
+        }
+        m_fields[nfields - 1] += ch;
+    }
+
+    if (nfields < 2)
+        return fail("the expression is missing");
+    if (m_fields[0].empty())
+        return fail("the macro name is empty");
+    if (m_fields[1].empty())
+        return fail("the expression is empty");
+    m_on_def(m_line, m_fields[0], m_fields[1], m_fields[2]);
+}
+
+//-------------------------------------------------------------------------
+// Complete lines are parsed straight from the chunk; only the last,
+// incomplete one is copied
+void macro_pack_parser_t::feed(std::string_view chunk)
+{
+    while (!chunk.empty())
+    {
+        size_t eol = chunk.find('\n');
+        if (eol == std::string_view::npos)
+        {
+            m_partial.append(chunk);
+            return;
+        }
+        if (m_partial.empty())
+        {
+            parse_line(chunk.substr(0, eol));
+        }
+        else
+        {
+            m_partial.append(chunk.substr(0, eol));
+            parse_line(m_partial);
+            m_partial.clear();
+        }
+        chunk.remove_prefix(eol + 1);
+    }
+}
+
+void macro_pack_parser_t::finish()
+{
+    if (m_partial.empty())
+        return;
+    parse_line(m_partial);
+    m_partial.clear();
+}
+
+//-------------------------------------------------------------------------
+// Import and export
+//-------------------------------------------------------------------------
+void macro_pack_escape(std::string &out, std::string_view field)
+{
+    for (char ch: field)
+    {
+        switch (ch)
+        {
+            case '\t': out += "\\t"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\\': out += "\\\\"; break;
+            default:   out += ch; break;
+        }
+    }
+}
+
+//-------------------------------------------------------------------------
+bool import_macro_pack(
+    const std::string &path,
+    macro_table_t &table,
+    bool replace,
+    macro_pack_result_t &result,
+    std::string &error,
+    const macro_check_func_t &check)
+{
+    result = macro_pack_result_t();
+
+    auto add_error = [&](size_t line, std::string_view reason)
+    {
+        ++result.invalid;
+        if (result.errors.size() < macro_pack_result_t::MAX_ERRORS)
+            result.errors.push_back(std::to_string(line) + ": " + std::string(reason));
+    };
+
+    // Slots of the table defined by this pack, to tell its duplicates
+    // from the macros that were already there
+    std::vector<bool> from_pack(table.slots(), false);
+    std::string reason;
+
+    // Only the definitions that go in the table are checked
+    auto valid = [&](size_t line, std::string_view macro, std::string_view expr)
+    {
+        reason.clear();
+        if (check == nullptr || check(expr, reason))
+            return true;
+        add_error(line, "'" + std::string(macro) + "' is invalid: " + reason);
+        return false;
+    };
+
+    macro_pack_parser_t parser(
+        [&](size_t line, std::string_view macro, std::string_view expr, std::string_view desc)
+        {
+            auto slot = table.find(macro);
+            if (slot == macro_table_t::npos)
+            {
+                if (!valid(line, macro, expr))
+                    return;
+                slot = table.insert(macro, expr, desc);
+                ++result.added;
+            }
+            else if (slot < from_pack.size() && from_pack[slot])
+            {
+                ++result.duplicates;
+                if (result.errors.size() < macro_pack_result_t::MAX_ERRORS)
+                    result.errors.push_back(std::to_string(line) + ": '" + std::string(macro) + "' is already defined by the pack");
+                return;
+            }
+            else if (!replace || (table.expr(slot) == expr && table.desc(slot) == desc))
+            {
+                ++result.unchanged;
+            }
+            else
+            {
+                if (!valid(line, macro, expr))
+                    return;
+                table.set(slot, macro, expr, desc);
+                ++result.replaced;
+            }
+
+            if (from_pack.size() <= slot)
+                from_pack.resize(slot + 1, false);
+            from_pack[slot] = true;
+        },
+        add_error);
+
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+    {
+        error = "cannot open '" + path + "': " + strerror(errno);
+        return false;
+    }
+
+    std::vector<char> buf(IO_CHUNK);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), fp)) != 0)
+        parser.feed(std::string_view(buf.data(), n));
+    const bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if (failed)
+    {
+        error = "cannot read '" + path + "'";
+        return false;
+    }
+
+    parser.finish();
+    result.lines = parser.lines();
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool export_macro_pack(
+    const std::string &path,
+    const macro_table_t &table,
+    std::string &error,
+    const macro_desc_func_t &desc)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr)
+    {
+        error = "cannot create '" + path + "': " + strerror(errno);
+        return false;
+    }
+
+    bool ok = true;
+    std::string out(PACK_HEADER);
+    out.reserve(IO_CHUNK + 4096);
+    for (auto slot: table.order())
+    {
+        macro_pack_escape(out, table.name(slot));
+        out += '\t';
+        macro_pack_escape(out, table.expr(slot));
+        std::string d = desc != nullptr ? desc(slot) : std::string(table.desc(slot));
+        if (!d.empty())
+        {
+            out += '\t';
+            macro_pack_escape(out, d);
+        }
+        out += '\n';
+
+        if (out.size() >= IO_CHUNK)
+        {
+            ok = ok && fwrite(out.data(), 1, out.size(), fp) == out.size();
+            out.clear();
+        }
+    }
+    ok = ok && fwrite(out.data(), 1, out.size(), fp) == out.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok)
+        error = "cannot write '" + path + "'";
+    return ok;
+}
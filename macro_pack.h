@@ -0,0 +1,111 @@
+/*
+Macro Pack: Import and export of macro definitions as text files
+
+A macro pack has one macro per line: its name, expression and description
+separated by tabs (the description may be left out). Tabs, line breaks and
+backslashes in the fields are written "\t", "\n", "\r" and "\\". Empty
+lines and lines starting with '#' are ignored:
+
+    # climacros macro pack
+    $!	${native:here:hex}$	Current cursor location (0x...)
+
+Packs are read in chunks: the memory used does not depend on the size of
+the file. Each line is validated (by the caller's check of the expression
+too) and checked for duplicates as it is read, into a macro table (see
+macro_table.h) that the caller commits at once.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "macro_table.h"
+
+//-------------------------------------------------------------------------
+// Streaming parser: feed the text in chunks of any size, each definition is
+// passed to the callback as soon as its line is complete
+class macro_pack_parser_t
+{
+public:
+    // Called for each definition. 'line' is its line number (from 1)
+    using def_func_t = std::function<void(size_t line, std::string_view macro, std::string_view expr, std::string_view desc)>;
+
+    // Called for each malformed line
+    using error_func_t = std::function<void(size_t line, const char *reason)>;
+
+private:
+    def_func_t m_on_def;
+    error_func_t m_on_error;
+    std::string m_partial;      // Incomplete last line
+    std::string m_fields[3];    // Unescaped fields (reused)
+    size_t m_line = 0;
+
+    void parse_line(std::string_view line);
+
+public:
+    macro_pack_parser_t(def_func_t on_def, error_func_t on_error = nullptr);
+
+    void feed(std::string_view chunk);
+
+    // Parse the last line, if it did not end with a line break
+    void finish();
+
+    // Lines parsed so far
+    size_t lines() const { return m_line; }
+};
+
+//-------------------------------------------------------------------------
+// Import and export
+//-------------------------------------------------------------------------
+struct macro_pack_result_t
+{
+    // Longest list of errors kept
+    static constexpr size_t MAX_ERRORS = 20;
+
+    size_t lines      = 0;
+    size_t added      = 0;
+    size_t replaced   = 0;      // Existing macros given a new definition
+    size_t unchanged  = 0;      // Existing macros left as they were
+    size_t duplicates = 0;      // Macros defined again later in the pack
+    size_t invalid    = 0;      // Malformed lines and invalid definitions
+
+    // "<line>: <reason>", for the first errors
+    std::vector<std::string> errors;
+};
+
+// Check of the expression of an imported macro. Returns false, with the
+// reason in 'reason', to leave the definition out
+using macro_check_func_t = std::function<bool(std::string_view expr, std::string &reason)>;
+
+// Read a pack into 'table'. New macros are appended to it; the existing ones
+// are replaced only if 'replace' is set. Within the pack, the first valid
+// definition of a macro wins; the definitions that fail 'check' are counted
+// as invalid.
+// Returns false, with the reason in 'error', if the file cannot be read
+// (the table then holds what was read before the error)
+bool import_macro_pack(
+    const std::string &path,
+    macro_table_t &table,
+    bool replace,
+    macro_pack_result_t &result,
+    std::string &error,
+    const macro_check_func_t &check = nullptr);
+
+// Description of a macro of the table, for the stores that do not load them
+using macro_desc_func_t = std::function<std::string(uint32_t slot)>;
+
+// Write the macros of 'table', in its order
+bool export_macro_pack(
+    const std::string &path,
+    const macro_table_t &table,
+    std::string &error,
+    const macro_desc_func_t &desc = nullptr);
+
+// Append a field with its tabs, line breaks and backslashes escaped
+void macro_pack_escape(std::string &out, std::string_view field);
@@ -0,0 +1,866 @@
+/*
+Macro Replacer: Expansion engine implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include "macro_replacer.h"
+#include "macro_trace.h"
+
+static constexpr size_t NO_CLOSE = size_t(-1);
+
+// Layout of the cache payload: the number of macros, then for each macro in
+// order its name and expression, the number of inline expressions in the
+// expression and their spans (4 x u64), then the matcher (see
+// macro_matcher_t::save()). Bump it when any of these changes
+static constexpr uint32_t CACHE_FORMAT = 1;
+
+//-------------------------------------------------------------------------
+// Macro Replacer Implementation
+//-------------------------------------------------------------------------
+
+macro_replacer_t::macro_replacer_t(repl_func_t repl_func, batch_func_t batch_func)
+    : m_repl_func(repl_func), m_batch_func(batch_func)
+{
+    m_work.main_reps = std::make_shared<std::vector<replacement_t>>();
+    m_work.trigger_bytes.add('$');
+    m_compiled.publish(std::make_unique<compiled_t>(m_work));
+}
+
+macro_replacer_t::~macro_replacer_t()
+{
+    wait_update();
+}
+
+std::string macro_replacer_t::operator()(const char* text)
+{
+    std::string out;
+    if (!expand(text, out))
+        out = text;
+    return out;
+}
+
+std::string macro_replacer_t::operator()(std::string text)
+{
+    std::string out;
+    if (!expand(text, out))
+        return text;
+    return out;
+}
+
+// Single pass expansion: literal spans, static macros and inline
+// expressions are emitted, in order, into one output buffer
+bool macro_replacer_t::expand(std::string_view in, std::string &out)
+{
+    m_stats.lines.add();
+    m_stats.bytes_in.add(in.size());
+
+    wait_cache();
+    snapshot_ptr_t<compiled_t>::reader_t set(m_compiled);
+    cursor_t c;
+    if (!cursor_begin(c, *set, in.data(), in.size(), in.size()))
+    {
+        m_stats.bytes_out.add(in.size());
+        return false;
+    }
+
+    macro_trace_t::span_t span(macro_trace, "expand", "replacer");
+    const auto start = std::chrono::steady_clock::now();
+    out.clear();
+    out.reserve(in.size() + in.size() / 2);
+    deferred_evals_t deferred;
+    c.deferred = m_batch_func ? &deferred : nullptr;
+    {
+        // Without a batch function, the evaluations happen while matching
+        macro_trace_t::span_t match_span(macro_trace, "match", "replacer");
+        cursor_run(c, in.size(), out);
+    }
+    flush_deferred(deferred, out);
+
+    m_stats.expanded.add();
+    m_stats.bytes_out.add(out.size());
+    m_stats.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Locate the first static macro and inline expression; inline expressions
+// starting at or after 'limit' are not looked for.
+// Returns false if there are none
+bool macro_replacer_t::cursor_begin(
+    cursor_t &c,
+    const compiled_t &set,
+    const char *text,
+    size_t len,
+    size_t limit,
+    size_t lazy_only_before)
+{
+    c.set  = &set;
+    c.text = text;
+    c.len  = len;
+    c.pos  = 0;
+    c.scan = eval_scan_t();
+    c.scan.starts_before    = limit;
+    c.scan.lazy_only_before = lazy_only_before;
+    c.deferred = nullptr;
+
+    // Skip straight to the first possible macro or inline expression
+    size_t first = set.trigger_bytes.find(text, len, 0);
+    if (first == len)
+        return false;
+
+    c.have_m = set.matcher.find(text, len, first, c.m);
+    c.have_e = find_eval_span(text, len, first, c.span, &c.scan);
+    return c.have_m || c.have_e;
+}
+
+//-------------------------------------------------------------------------
+// Expand everything that starts before 'limit' and copy the literal text
+// up to 'limit'. The cursor position may end up past 'limit' when the
+// last expansion straddles it
+void macro_replacer_t::cursor_run(cursor_t &c, size_t limit, std::string &out)
+{
+    const char *p = c.text;
+    auto &set = *c.set;
+    while (c.have_m || c.have_e)
+    {
+        // Static macros take precedence over inline expressions that
+        // they overlap, like when statics were substituted first
+        bool take_m = c.have_m && (!c.have_e || c.m.pos <= c.span.start);
+        if ((take_m ? c.m.pos : c.span.start) >= limit)
+            break;
+
+        if (take_m)
+        {
+            auto &rep = set.replacement(c.m.id);
+            rep.counters->matches.add();
+            out.append(p + c.pos, c.m.pos - c.pos);
+            emit_replacement(rep, out, c.deferred);
+            c.pos = c.m.pos + c.m.len;
+        }
+        else
+        {
+            out.append(p + c.pos, c.span.start - c.pos);
+            emit_eval(set, p, c.span, out, c.deferred);
+            c.pos = c.span.end;
+        }
+
+        if (c.have_m && c.m.pos < c.pos)
+            c.have_m = set.matcher.find(p, c.len, c.pos, c.m);
+        if (c.have_e && c.span.start < c.pos)
+            c.have_e = find_eval_span(p, c.len, c.pos, c.span, &c.scan);
+    }
+
+    if (c.pos < limit)
+    {
+        out.append(p + c.pos, limit - c.pos);
+        c.pos = limit;
+    }
+}
+
+//-------------------------------------------------------------------------
+// The values of deferred expressions are added to the counters of their
+// macro once evaluated
+void macro_replacer_t::emit_expr(
+    std::string_view expr,
+    std::string &out,
+    deferred_evals_t *deferred,
+    macro_counters_t *counters)
+{
+    m_stats.evals.add();
+    if (deferred != nullptr)
+        deferred->push_back({ out.size(), std::string(expr), counters });
+    else
+        out.append(m_repl_func(expr));
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::emit_replacement(const replacement_t &rep, std::string &out, deferred_evals_t *deferred)
+{
+    const size_t start = out.size();
+    const char *p = rep.text.data();
+    size_t pos = 0;
+    for (auto &span: rep.evals)
+    {
+        out.append(p + pos, span.start - pos);
+        emit_expr(
+            std::string_view(p + span.expr_start, span.expr_end - span.expr_start),
+            out,
+            deferred,
+            rep.counters.get());
+        pos = span.end;
+    }
+    out.append(p + pos, rep.text.size() - pos);
+    rep.counters->bytes_out.add(out.size() - start);
+}
+
+//-------------------------------------------------------------------------
+// Evaluate an inline expression. Static macros used inside the expression
+// are substituted before evaluation
+void macro_replacer_t::emit_eval(
+    const compiled_t &set,
+    const char *text,
+    const eval_span_t &span,
+    std::string &out,
+    deferred_evals_t *deferred)
+{
+    std::string_view expr(text + span.expr_start, span.expr_end - span.expr_start);
+
+    macro_matcher_t::match_t m;
+    if (set.matcher.find(expr.data(), expr.size(), 0, m))
+    {
+        std::string expanded;
+        size_t pos = 0;
+        do
+        {
+            auto &rep = set.replacement(m.id);
+            rep.counters->matches.add();
+            expanded.append(expr.data() + pos, m.pos - pos);
+            expanded.append(rep.text);
+            pos = m.pos + m.len;
+        } while (set.matcher.find(expr.data(), expr.size(), pos, m));
+        expanded.append(expr.data() + pos, expr.size() - pos);
+        emit_expr(expanded, out, deferred);
+        return;
+    }
+    emit_expr(expr, out, deferred);
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::flush_deferred(deferred_evals_t &deferred, std::string &out)
+{
+    if (deferred.empty())
+        return;
+
+    std::vector<std::string_view> exprs;
+    exprs.reserve(deferred.size());
+    for (auto &d: deferred)
+        exprs.push_back(d.expr);
+    std::vector<std::string> values;
+    {
+        macro_trace_t::span_t span(macro_trace, "evaluate", "replacer");
+        m_batch_func(exprs, values);
+    }
+
+    // Rebuild the output from the first evaluation on
+    const size_t first = deferred[0].offset;
+    std::string tail(out, first);
+    out.resize(first);
+    for (size_t i = 0; i < deferred.size(); ++i)
+    {
+        size_t from = deferred[i].offset - first;
+        size_t to   = i + 1 < deferred.size() ? deferred[i + 1].offset - first : tail.size();
+        out.append(values[i]);
+        if (deferred[i].counters != nullptr)
+            deferred[i].counters->bytes_out.add(values[i].size());
+        out.append(tail, from, to - from);
+    }
+    deferred.clear();
+}
+
+//-------------------------------------------------------------------------
+// Inline expressions scanner
+//-------------------------------------------------------------------------
+
+// Skip a Python string literal starting at text[i] (a quote character).
+// Returns the offset past the closing quote, or where the scan stopped
+// (end of text or new line) if the literal is unterminated.
+static size_t skip_string_literal(const char *text, size_t len, size_t i)
+{
+    const char quote = text[i];
+    const bool triple = i + 2 < len && text[i + 1] == quote && text[i + 2] == quote;
+    for (i += triple ? 3 : 1; i < len; ++i)
+    {
+        char ch = text[i];
+        if (ch == '\\')
+        {
+            if (i + 1 < len && text[i + 1] != '\n')
+                ++i;
+        }
+        else if (ch == quote)
+        {
+            if (!triple)
+                return i + 1;
+            if (i + 2 < len && text[i + 1] == quote && text[i + 2] == quote)
+                return i + 3;
+        }
+        else if (ch == '\n')
+        {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Find the '}' of the "}$" closing the expression starting at text[i].
+// Braces must balance and string literals are skipped, so "}$" may
+// appear inside them. Returns NO_CLOSE, and where the scan stopped in
+// 'stop', if the expression is not closed.
+static size_t find_eval_close(const char *text, size_t len, size_t i, size_t &stop)
+{
+    int depth = 0;
+    while (i < len)
+    {
+        char ch = text[i];
+        switch (ch)
+        {
+            case '\n':
+                stop = i;
+                return NO_CLOSE;
+            case '\'':
+            case '"':
+                i = skip_string_literal(text, len, i);
+                continue;
+            case '{':
+                ++depth;
+                break;
+            case '}':
+                if (depth > 0)
+                    --depth;
+                else if (i + 1 < len && text[i + 1] == '$')
+                    return i;
+                break;
+        }
+        ++i;
+    }
+    stop = len;
+    return NO_CLOSE;
+}
+
+// Legacy (non-structured) closing: the first "}$" on the same line.
+// The result is cached: '${' met later on the same line are answered
+// without rescanning
+static size_t find_eval_close_lazy(
+    const char *text,
+    size_t len,
+    size_t i,
+    macro_replacer_t::eval_scan_t &scan)
+{
+    if (!scan.lazy_valid || i < scan.lazy_from || i > scan.lazy_stop)
+    {
+        size_t j = i;
+        bool found = false;
+        for (; j + 1 < len && text[j] != '\n'; ++j)
+        {
+            if (text[j] == '}' && text[j + 1] == '$')
+            {
+                found = true;
+                break;
+            }
+        }
+        scan.lazy_from  = i;
+        scan.lazy_stop  = j;
+        scan.lazy_found = found;
+        scan.lazy_valid = true;
+    }
+    return scan.lazy_found ? scan.lazy_stop : NO_CLOSE;
+}
+
+// Successive calls moving forward from the end of the previous span visit
+// every byte at most once with the structured scans (a failed scan turns
+// the '${' it covered into "first }$" ones) and once with the cached
+// "first }$" scans. A call starting inside the previous span (when a
+// static macro overlapped it) scans the '${' found there again, each for
+// up to MAX_EXPR_LEN bytes: the worst case is O(n * MAX_EXPR_LEN)
+bool macro_replacer_t::find_eval_span(
+    const char *text,
+    size_t len,
+    size_t from,
+    eval_span_t &span,
+    eval_scan_t *scan)
+{
+    eval_scan_t local_scan;
+    if (scan == nullptr)
+        scan = &local_scan;
+
+    const size_t search_end = std::min(len - (len != 0), scan->starts_before);
+    for (size_t i = from; i < search_end; ++i)
+    {
+        auto p = (const char *)memchr(text + i, '$', search_end - i);
+        if (p == nullptr)
+            break;
+
+        i = p - text;
+        if (text[i + 1] != '{')
+            continue;
+
+        // Unbalanced expressions fall back to the first "}$"
+        size_t expr = i + 2;
+        size_t close = NO_CLOSE;
+        if (expr >= scan->lazy_only_before)
+        {
+            size_t stop;
+            size_t limit = std::min(len, expr + MAX_EXPR_LEN + 2);
+            close = find_eval_close(text, limit, expr, stop);
+            if (close == NO_CLOSE)
+                scan->lazy_only_before = stop;
+        }
+        if (close == NO_CLOSE)
+            close = find_eval_close_lazy(text, len, expr, *scan);
+
+        // Empty and overly long expressions are left as-is
+        if (close == NO_CLOSE || close == expr || close - expr > MAX_EXPR_LEN)
+            continue;
+
+        span.start      = i;
+        span.expr_start = expr;
+        span.expr_end   = close;
+        span.end        = close + 2;
+        return true;
+    }
+    return false;
+}
+
+//-------------------------------------------------------------------------
+size_t macro_replacer_t::lookahead() const
+{
+    wait_cache();
+    snapshot_ptr_t<compiled_t>::reader_t set(m_compiled);
+    return std::max(set->matcher.max_len(), MAX_EXPR_LEN + 4);
+}
+
+//-------------------------------------------------------------------------
+// Compiled macro set
+//-------------------------------------------------------------------------
+
+// Pre-split the replacement text around its inline expressions
+macro_replacer_t::replacement_t::replacement_t(std::string_view text, std::shared_ptr<macro_counters_t> counters)
+    : text(text), counters(counters != nullptr ? std::move(counters) : std::make_shared<macro_counters_t>())
+{
+    eval_span_t span;
+    for (size_t pos = 0; find_eval_span(this->text.data(), this->text.size(), pos, span); pos = span.end)
+        evals.push_back(span);
+}
+
+macro_replacer_t::replacement_t::replacement_t(
+    std::string_view text,
+    std::vector<eval_span_t> evals,
+    std::shared_ptr<macro_counters_t> counters)
+    : text(text), evals(std::move(evals)), counters(std::move(counters))
+{
+}
+
+const macro_replacer_t::replacement_t &macro_replacer_t::compiled_t::replacement(int id) const
+{
+    if (size_t(id) < main_reps->size())
+        return (*main_reps)[id];
+
+    auto p = std::lower_bound(delta_reps.begin(), delta_reps.end(), id, [](auto &rep, int id)
+    {
+        return rep.first < id;
+    });
+    return *p->second;
+}
+
+//-------------------------------------------------------------------------
+// Full rebuild of the compiled set from the replacement map
+void macro_replacer_t::compile_locked()
+{
+    macro_matcher_t matcher;
+    auto reps = std::make_shared<std::vector<replacement_t>>();
+    reps->reserve(m_macros.size());
+    m_ids.assign(m_macros.slots(), -1);
+    for (auto slot: m_macros.order())
+    {
+        m_ids[slot] = matcher.add(m_macros.name(slot));
+        reps->emplace_back(m_macros.expr(slot), counters_locked(m_macros.name(slot)));
+    }
+    prune_counters_locked();
+
+    // Compile the multi-pattern matcher
+    matcher.build();
+    install_locked(matcher, std::move(reps));
+}
+
+//-------------------------------------------------------------------------
+// Make a fully built matcher and its replacements the working set, and
+// publish it
+void macro_replacer_t::install_locked(macro_matcher_t &matcher, std::shared_ptr<std::vector<replacement_t>> reps)
+{
+    m_work.matcher   = std::move(matcher);
+    m_work.main_reps = std::move(reps);
+    m_work.delta_reps.clear();
+    m_work.trigger_bytes = m_work.matcher.lead_bytes();
+    m_work.trigger_bytes.add('$');
+    publish_locked();
+}
+
+//-------------------------------------------------------------------------
+// Forget the counters of the macros that are gone
+void macro_replacer_t::prune_counters_locked()
+{
+    for (auto p = m_counters.begin(); p != m_counters.end(); )
+    {
+        if (!m_macros.contains(p->first))
+            p = m_counters.erase(p);
+        else
+            ++p;
+    }
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::erase_locked(int id)
+{
+    m_work.matcher.erase(id);
+
+    auto &delta = m_work.delta_reps;
+    auto p = std::lower_bound(delta.begin(), delta.end(), id, [](auto &rep, int id)
+    {
+        return rep.first < id;
+    });
+    if (p != delta.end() && p->first == id)
+        delta.erase(p);
+}
+
+//-------------------------------------------------------------------------
+// Publish a copy of the working set. Readers still using the previous
+// snapshot keep it alive until they are done
+void macro_replacer_t::publish_locked()
+{
+    m_compiled.publish(std::make_unique<compiled_t>(m_work));
+}
+
+//-------------------------------------------------------------------------
+std::shared_ptr<macro_replacer_t::macro_counters_t> macro_replacer_t::counters_locked(std::string_view macro)
+{
+    auto p = m_counters.find(macro);
+    if (p == m_counters.end())
+        p = m_counters.emplace(std::string(macro), std::make_shared<macro_counters_t>()).first;
+    return p->second;
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::begin_update()
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    m_macros.clear();
+    m_incomplete = false;
+}
+
+void macro_replacer_t::update(std::string_view macro, std::string_view expr)
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    auto slot = m_macros.find(macro);
+    if (slot != macro_table_t::npos)
+        m_macros.set_expr(slot, expr);
+    else
+        m_macros.insert(macro, expr);
+}
+
+void macro_replacer_t::end_update()
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    compile_locked();
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::end_update_async(std::string cache_path, uint64_t cache_key)
+{
+    wait_update();
+    m_rebuild_thread = std::thread([this, cache_path = std::move(cache_path), cache_key]()
+    {
+        std::lock_guard<std::mutex> lock(m_write_lock);
+        compile_locked();
+        if (!cache_path.empty())
+            save_cache_locked(cache_path, cache_key);
+    });
+}
+
+void macro_replacer_t::wait_update()
+{
+    if (m_rebuild_thread.joinable())
+        m_rebuild_thread.join();
+}
+
+//-------------------------------------------------------------------------
+// Cache
+//-------------------------------------------------------------------------
+bool macro_replacer_t::save_cache(const std::string &path, uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    if (m_incomplete)
+        return false;
+
+    // Incremental updates live in the delta automaton: fold them first
+    compile_locked();
+    return save_cache_locked(path, key);
+}
+
+//-------------------------------------------------------------------------
+// The working set must have just been compiled: the ids are then the
+// positions of the macros in order
+bool macro_replacer_t::save_cache_locked(const std::string &path, uint64_t key)
+{
+    cache_writer_t w;
+    w.put_u32(uint32_t(m_macros.size()));
+    uint32_t id = 0;
+    for (auto slot: m_macros.order())
+    {
+        auto &rep = (*m_work.main_reps)[id++];
+        w.put_str(m_macros.name(slot));
+        w.put_str(rep.text);
+        w.put_u32(uint32_t(rep.evals.size()));
+        for (auto &span: rep.evals)
+        {
+            w.put_u64(span.start);
+            w.put_u64(span.end);
+            w.put_u64(span.expr_start);
+            w.put_u64(span.expr_end);
+        }
+    }
+    if (!m_work.matcher.save(w))
+        return false;
+
+    std::string error;
+    return write_cache_file(path, CACHE_FORMAT, key, w.data(), error);
+}
+
+//-------------------------------------------------------------------------
+// Everything is read and checked before the working set is touched
+bool macro_replacer_t::load_cache_locked(cache_reader_t &r)
+{
+    uint32_t count;
+    if (!r.get_u32(count))
+        return false;
+
+    macro_table_t macros;
+    macros.reserve(count, r.left());
+    auto reps = std::make_shared<std::vector<replacement_t>>();
+    reps->reserve(count);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        std::string_view name, expr;
+        uint32_t n_evals;
+        if (!r.get_str(name) || !r.get_str(expr) || !r.get_u32(n_evals) || n_evals > r.left() / (4 * sizeof(uint64_t)))
+            return false;
+
+        // The spans are in order and within the expression
+        std::vector<eval_span_t> evals(n_evals);
+        uint64_t pos = 0;
+        for (auto &span: evals)
+        {
+            uint64_t v[4];
+            if (!r.get_bytes(v, sizeof(v))
+                || v[0] < pos || v[0] > v[2] || v[2] > v[3] || v[3] > v[1] || v[1] > expr.size())
+            {
+                return false;
+            }
+            span = { size_t(v[0]), size_t(v[1]), size_t(v[2]), size_t(v[3]) };
+            pos = v[1];
+        }
+
+        if (macros.insert(name, expr) == macro_table_t::npos)
+            return false;
+        reps->emplace_back(expr, std::move(evals), nullptr);
+    }
+
+    macro_matcher_t matcher;
+    if (!matcher.load(r) || matcher.ids() != int(count) || !r.at_end())
+        return false;
+
+    m_macros = std::move(macros);
+    m_ids.assign(m_macros.slots(), -1);
+    int id = 0;
+    for (auto slot: m_macros.order())
+    {
+        m_ids[slot] = id;
+        (*reps)[id++].counters = counters_locked(m_macros.name(slot));
+    }
+    prune_counters_locked();
+    install_locked(matcher, std::move(reps));
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool macro_replacer_t::load_cache_async(const std::string &path, uint64_t key, std::function<void()> on_failure)
+{
+    wait_update();
+    auto file = std::make_unique<cache_file_t>();
+    if (!file->open(path, CACHE_FORMAT, key))
+        return false;
+
+    m_cache_pending.store(true);
+    m_rebuild_thread = std::thread([this, file = std::move(file), path, on_failure = std::move(on_failure)]()
+    {
+        bool ok;
+        {
+            std::lock_guard<std::mutex> lock(m_write_lock);
+            auto r = file->reader();
+            ok = file->verify() && load_cache_locked(r);
+            m_incomplete = !ok;
+        }
+        // Before 'on_failure', which may wait for a thread that expands
+        cache_done();
+        if (ok)
+            return;
+
+        file->close();
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        if (on_failure != nullptr)
+            on_failure();
+    });
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Only the expansions started while the cache loads take the lock
+void macro_replacer_t::wait_cache() const
+{
+    if (!m_cache_pending.load(std::memory_order_acquire))
+        return;
+    std::unique_lock<std::mutex> lock(m_cache_lock);
+    m_cache_done.wait(lock, [this]() { return !m_cache_pending.load(std::memory_order_acquire); });
+}
+
+void macro_replacer_t::cache_done()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_cache_lock);
+        m_cache_pending.store(false, std::memory_order_release);
+    }
+    m_cache_done.notify_all();
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::add(std::string_view macro, std::string_view expr)
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    auto slot = m_macros.find(macro);
+    if (slot == macro_table_t::npos)
+    {
+        slot = m_macros.insert(macro, expr);
+        if (m_ids.size() <= slot)
+            m_ids.resize(slot + 1, -1);
+    }
+    else
+    {
+        if (m_macros.expr(slot) == expr)
+            return;
+        erase_locked(m_ids[slot]);
+        m_macros.set_expr(slot, expr);
+    }
+    const int id = m_work.matcher.insert(macro);
+    m_ids[slot] = id;
+    m_work.delta_reps.emplace_back(id, std::make_shared<const replacement_t>(expr, counters_locked(macro)));
+    if (!macro.empty())
+        m_work.trigger_bytes.add(uint8_t(macro[0]));
+
+    if (m_work.matcher.needs_rebuild())
+        compile_locked();
+    else
+        publish_locked();
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::remove(std::string_view macro)
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    auto slot = m_macros.find(macro);
+    if (slot == macro_table_t::npos)
+        return;
+
+    erase_locked(m_ids[slot]);
+    m_ids[slot] = -1;
+    m_macros.erase(slot);
+    auto counters = m_counters.find(macro);
+    if (counters != m_counters.end())
+        m_counters.erase(counters);
+
+    if (m_work.matcher.needs_rebuild())
+        compile_locked();
+    else
+        publish_locked();
+}
+
+//-------------------------------------------------------------------------
+// Statistics
+//-------------------------------------------------------------------------
+void macro_replacer_t::macro_stats(std::vector<macro_stat_t> &stats) const
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    stats.clear();
+    stats.reserve(m_macros.size());
+    for (auto slot: m_macros.order())
+    {
+        auto name = m_macros.name(slot);
+        auto p = m_counters.find(name);
+        uint64_t matches   = p != m_counters.end() ? p->second->matches.get() : 0;
+        uint64_t bytes_out = p != m_counters.end() ? p->second->bytes_out.get() : 0;
+        stats.push_back({ std::string(name), std::string(m_macros.expr(slot)), matches, matches * name.size(), bytes_out });
+    }
+}
+
+//-------------------------------------------------------------------------
+void macro_replacer_t::reset_stats()
+{
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    for (auto &kv: m_counters)
+    {
+        kv.second->matches.reset();
+        kv.second->bytes_out.reset();
+    }
+    m_stats.lines.reset();
+    m_stats.expanded.reset();
+    m_stats.bytes_in.reset();
+    m_stats.bytes_out.reset();
+    m_stats.evals.reset();
+    m_stats.latency.reset();
+}
+
+//-------------------------------------------------------------------------
+// Streaming expansion
+//-------------------------------------------------------------------------
+
+// Only what starts before the last lookahead() bytes is expanded: its
+// outcome cannot depend on input that has not been fed yet
+void macro_replacer_t::stream_t::feed(std::string_view chunk, std::string &out)
+{
+    m_pending.append(chunk);
+
+    size_t look = m_replacer.lookahead();
+    if (m_pending.size() <= look)
+        return;
+
+    size_t consumed = expand_pending(m_pending.size() - look, out);
+    m_pending.erase(0, consumed);
+    m_lazy_only_before = m_lazy_only_before > consumed ? m_lazy_only_before - consumed : 0;
+}
+
+void macro_replacer_t::stream_t::finish(std::string &out)
+{
+    expand_pending(m_pending.size(), out);
+    m_pending.clear();
+    m_lazy_only_before = 0;
+}
+
+// Expand the pending input up to 'limit'; returns the consumed length
+size_t macro_replacer_t::stream_t::expand_pending(size_t limit, std::string &out)
+{
+    m_replacer.wait_cache();
+    snapshot_ptr_t<compiled_t>::reader_t set(m_replacer.m_compiled);
+    cursor_t c;
+    if (m_replacer.cursor_begin(c, *set, m_pending.data(), m_pending.size(), limit, m_lazy_only_before))
+    {
+        deferred_evals_t deferred;
+        c.deferred = m_replacer.m_batch_func ? &deferred : nullptr;
+        {
+            macro_trace_t::span_t span(macro_trace, "match", "replacer");
+            m_replacer.cursor_run(c, limit, out);
+        }
+        m_replacer.flush_deferred(deferred, out);
+    }
+    else
+    {
+        out.append(m_pending, 0, limit);
+        c.pos = limit;
+    }
+
+    m_lazy_only_before = c.scan.lazy_only_before;
+    return c.pos;
+}
@@ -0,0 +1,337 @@
+/*
+Macro Replacer: Expansion of static macros and inline "${expr}$" expressions
+
+The replacer does not depend on the IDA SDK: dynamic expressions are handed
+to a user supplied evaluation function. When a batch evaluation function is
+supplied too, all the expressions of a line are collected first and
+evaluated by a single call to it.
+
+Complexity: expanding a line of n bytes takes O(n * Lmax) time, where Lmax is
+the length of the longest macro (a constant of the macro set), plus the cost
+of the evaluations. Finding the inline expressions is linear too, except
+when static macros overlap them: the scan then resumes inside the
+expression and the '${' found there are scanned again, for up to
+MAX_EXPR_LEN bytes each, which makes the worst case O(n * MAX_EXPR_LEN).
+Nothing recurses, so stack usage does not depend on the input. Inline
+expressions longer than MAX_EXPR_LEN are left as-is; this also bounds the
+look-ahead needed by the streaming mode.
+
+Threading: expansions read an immutable snapshot of the compiled macro set
+and never take a lock. Updates build a new snapshot and publish it
+atomically, so an expansion sees either the old or the new macro set as a
+whole. Updates are serialized between themselves.
+
+Cache: the compiled macro set can be saved to a cache file (see
+macro_cache.h) and loaded back instead of being compiled. Only the header
+of the cache is checked before returning; the rest is read, validated and
+published on a background thread, like end_update_async() does. The
+expansions started meanwhile wait for it, so that the first lines are not
+expanded with the previous (usually empty) macro set.
+
+Statistics: the replacer counts the lines it expands, how long they take,
+and how often each macro matches (see macro_stats.h). The counters of a
+macro survive the rebuilds of the macro set, until the macro is removed.
+*/
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <map>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "macro_cache.h"
+#include "macro_matcher.h"
+#include "macro_stats.h"
+#include "macro_table.h"
+#include "snapshot.h"
+
+//-------------------------------------------------------------------------
+// Macro Replacement Engine
+//-------------------------------------------------------------------------
+
+// Utility class to replace macros with static patterns and dynamic expressions
+class macro_replacer_t
+{
+public:
+    using repl_func_t = std::function<std::string(std::string_view)>;
+
+    // Evaluate several expressions at once: values[i] is the value of exprs[i]
+    using batch_func_t = std::function<void(const std::vector<std::string_view> &exprs, std::vector<std::string> &values)>;
+
+    // Longest inline expression that gets evaluated
+    static constexpr size_t MAX_EXPR_LEN = 4096;
+
+    // Location of an inline "${expr}$" expression
+    struct eval_span_t
+    {
+        size_t start;       // Offset of the opening "${"
+        size_t end;         // Offset past the closing "}$"
+        size_t expr_start;  // Offset of the expression text
+        size_t expr_end;    // Offset past the expression text
+    };
+
+    // Scanner state carried between find_eval_span() calls on the same
+    // text. It is what keeps repeated scans of a line linear (as long as
+    // each call starts past the previous span, see find_eval_span())
+    struct eval_scan_t
+    {
+        // Only consider '${' starting before this offset
+        size_t starts_before = size_t(-1);
+
+        // Structured scans failed up to this offset: '${' before it only
+        // use the first "}$" rule
+        size_t lazy_only_before = 0;
+
+        // Cached result of the last first-"}$" search
+        size_t lazy_from  = 0;
+        size_t lazy_stop  = 0;
+        bool   lazy_found = false;
+        bool   lazy_valid = false;
+    };
+
+    // Counters of a macro
+    struct macro_counters_t
+    {
+        stat_counter_t matches;
+        stat_counter_t bytes_out;   // Expanded text, values of its expressions included
+    };
+
+    // Statistics of a macro, as read by macro_stats()
+    struct macro_stat_t
+    {
+        std::string macro;
+        std::string expr;
+        uint64_t matches;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+    };
+
+    // Statistics of the expanded lines
+    struct line_stats_t
+    {
+        stat_counter_t lines;       // Lines given to expand()
+        stat_counter_t expanded;    // Lines that had something to expand
+        stat_counter_t bytes_in;
+        stat_counter_t bytes_out;
+        stat_counter_t evals;       // Expressions evaluated
+        latency_histogram_t latency;    // Of the expanded lines
+    };
+
+    class stream_t;
+
+private:
+    // Replacement text pre-split into literal and inline expression spans
+    struct replacement_t
+    {
+        std::string text;
+        std::vector<eval_span_t> evals;
+        std::shared_ptr<macro_counters_t> counters;
+
+        replacement_t(std::string_view text, std::shared_ptr<macro_counters_t> counters = nullptr);
+
+        // With the spans found beforehand (e.g. read from a cache)
+        replacement_t(std::string_view text, std::vector<eval_span_t> evals, std::shared_ptr<macro_counters_t> counters);
+    };
+
+    // Compiled macro set. Published snapshots are never modified: edits
+    // copy the small parts and share the large ones (main automaton and
+    // replacements)
+    struct compiled_t
+    {
+        macro_matcher_t matcher;
+
+        // Replacements of the ids compiled by the last full build, by id
+        std::shared_ptr<const std::vector<replacement_t>> main_reps;
+
+        // Replacements of the ids inserted since then, sorted by id
+        std::vector<std::pair<int, std::shared_ptr<const replacement_t>>> delta_reps;
+
+        // Bytes that may start a macro or an inline expression
+        byte_filter_t trigger_bytes;
+
+        const replacement_t &replacement(int id) const;
+    };
+
+    // Current snapshot: read without locking by the expansions
+    mutable snapshot_ptr_t<compiled_t> m_compiled;
+
+    // Writer side, serialized by m_write_lock: the macros and the compiled
+    // set that the next snapshot is copied from
+    mutable std::mutex m_write_lock;
+    macro_table_t m_macros;
+    std::vector<int> m_ids;     // Matcher pattern ids, by slot of m_macros
+    compiled_t m_work;
+
+    // Counters of the macros, kept across rebuilds (m_write_lock)
+    std::map<std::string, std::shared_ptr<macro_counters_t>, std::less<>> m_counters;
+
+    line_stats_t m_stats;
+
+    // A cache failed to load: the macro set is not the expected one, and
+    // is not saved, until the next full update
+    bool m_incomplete = false;
+
+    std::thread m_rebuild_thread;
+
+    // A cache is being loaded by m_rebuild_thread: the expansions wait
+    // until it is published (or found damaged)
+    std::atomic<bool> m_cache_pending{ false };
+    mutable std::mutex m_cache_lock;
+    mutable std::condition_variable m_cache_done;
+    void wait_cache() const;
+    void cache_done();
+
+    repl_func_t m_repl_func;
+    batch_func_t m_batch_func;
+
+    // Expression whose value goes at 'offset' in the output once the
+    // expressions of the line are evaluated in a batch
+    struct deferred_eval_t
+    {
+        size_t offset;
+        std::string expr;
+        macro_counters_t *counters;     // Macro the expression comes from, if any
+    };
+    using deferred_evals_t = std::vector<deferred_eval_t>;
+
+    // Position of the next static macro and inline expression in a text
+    struct cursor_t
+    {
+        const compiled_t *set;
+        const char *text;
+        size_t len;
+        size_t pos;
+        bool have_m;
+        bool have_e;
+        macro_matcher_t::match_t m;
+        eval_span_t span;
+        eval_scan_t scan;
+
+        // Where evaluations are collected when batching (null otherwise)
+        deferred_evals_t *deferred;
+    };
+    bool cursor_begin(
+        cursor_t &c,
+        const compiled_t &set,
+        const char *text,
+        size_t len,
+        size_t limit,
+        size_t lazy_only_before = 0);
+    void cursor_run(cursor_t &c, size_t limit, std::string &out);
+
+    // Writer helpers (m_write_lock held)
+    void compile_locked();
+    void erase_locked(int id);
+    void publish_locked();
+    std::shared_ptr<macro_counters_t> counters_locked(std::string_view macro);
+    void prune_counters_locked();
+    void install_locked(macro_matcher_t &matcher, std::shared_ptr<std::vector<replacement_t>> reps);
+    bool save_cache_locked(const std::string &path, uint64_t key);
+    bool load_cache_locked(cache_reader_t &r);
+
+    // Expansion helpers appending to 'out', or deferring the evaluations
+    // when 'deferred' is not null
+    void emit_expr(
+        std::string_view expr,
+        std::string &out,
+        deferred_evals_t *deferred,
+        macro_counters_t *counters = nullptr);
+    void emit_replacement(const replacement_t &rep, std::string &out, deferred_evals_t *deferred);
+    void emit_eval(
+        const compiled_t &set,
+        const char *text,
+        const eval_span_t &span,
+        std::string &out,
+        deferred_evals_t *deferred);
+
+    // Evaluate the deferred expressions and insert their values in 'out'
+    void flush_deferred(deferred_evals_t &deferred, std::string &out);
+
+public:
+    macro_replacer_t(repl_func_t repl_func, batch_func_t batch_func = nullptr);
+    ~macro_replacer_t();
+
+    // Replace macros in text
+    std::string operator()(const char* text);
+    std::string operator()(std::string text);
+
+    // Expand 'in' into 'out' (whose capacity is reused).
+    // Returns false, leaving 'out' untouched, if there was nothing to expand
+    bool expand(std::string_view in, std::string &out);
+
+    // Find the next inline expression in text[from..len)
+    static bool find_eval_span(
+        const char *text,
+        size_t len,
+        size_t from,
+        eval_span_t &span,
+        eval_scan_t *scan = nullptr);
+
+    // Number of bytes of look-ahead needed to expand any position
+    size_t lookahead() const;
+
+    // Update the macro replacement map. The previous macro set keeps being
+    // used by the expansions until end_update() publishes the new one
+    void begin_update();
+    void update(std::string_view macro, std::string_view expr);
+    void end_update();
+
+    // Same as end_update() but compiles the macro set on a background
+    // thread. wait_update() waits for it to be published. When a cache
+    // path is given, the compiled set is saved there too (see save_cache())
+    void end_update_async(std::string cache_path = {}, uint64_t cache_key = 0);
+    void wait_update();
+
+    // Save the compiled macro set to a cache file, tagged with the key of
+    // the macros it was compiled from (e.g. the store fingerprint)
+    bool save_cache(const std::string &path, uint64_t key);
+
+    // Replace the macro set with the one of a cache file saved with the
+    // same key. Returns false, leaving the macro set alone, if there is no
+    // such cache. Otherwise the cache is loaded in the background (see
+    // wait_update()); if it turns out to be damaged, the file is removed,
+    // the macro set is left as it was and 'on_failure' is called from the
+    // background thread
+    bool load_cache_async(const std::string &path, uint64_t key, std::function<void()> on_failure = nullptr);
+
+    // Incremental updates of the macro replacement map, effective at once.
+    // Their cost is proportional to the changed macro, not to the set
+    void add(std::string_view macro, std::string_view expr);
+    void remove(std::string_view macro);
+
+    // Statistics of the current macros, and of the expanded lines
+    void macro_stats(std::vector<macro_stat_t> &stats) const;
+    const line_stats_t &line_stats() const { return m_stats; }
+    void reset_stats();
+};
+
+//-------------------------------------------------------------------------
+// Streaming expansion of large inputs. The input is fed in chunks of any
+// size and the expanded text is appended to the output as soon as it is
+// final; at most lookahead() bytes are held back between chunks.
+// The result is identical to expanding the whole input at once
+class macro_replacer_t::stream_t
+{
+    macro_replacer_t &m_replacer;
+    std::string m_pending;
+
+    // Scanner state that must survive across chunks (see eval_scan_t)
+    size_t m_lazy_only_before = 0;
+
+    size_t expand_pending(size_t limit, std::string &out);
+
+public:
+    stream_t(macro_replacer_t &replacer) : m_replacer(replacer) { }
+
+    // Expand a chunk of input, appending the finished output to 'out'
+    void feed(std::string_view chunk, std::string &out);
+
+    // Flush what is left once all the input was fed
+    void finish(std::string &out);
+};
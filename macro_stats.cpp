@@ -0,0 +1,140 @@
+/*
+Macro Statistics: Counters and latency histograms implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include "macro_stats.h"
+
+//-------------------------------------------------------------------------
+// Latency histogram
+//-------------------------------------------------------------------------
+
+// Bucket (k << SUB_BITS) + s holds the values of the s-th quarter of the
+// power of two k (relative to MIN_BITS)
+size_t latency_histogram_t::bucket_of(uint64_t ns)
+{
+    if (ns < (uint64_t(1) << MIN_BITS))
+        return 0;
+
+    const int msb = std::bit_width(ns) - 1;
+    if (msb >= MAX_BITS)
+        return NBUCKETS - 1;
+
+    const size_t sub = size_t(ns >> (msb - SUB_BITS)) & ((size_t(1) << SUB_BITS) - 1);
+    return (size_t(msb - MIN_BITS) << SUB_BITS) + sub;
+}
+
+// The last bucket has no fixed bound (see percentile())
+uint64_t latency_histogram_t::bucket_max(size_t bucket)
+{
+    if (bucket == NBUCKETS - 1)
+        return uint64_t(1) << MAX_BITS;
+
+    const int msb = int(bucket >> SUB_BITS) + MIN_BITS;
+    const uint64_t sub = bucket & ((size_t(1) << SUB_BITS) - 1);
+    return (uint64_t(1) << msb) + ((sub + 1) << (msb - SUB_BITS)) - 1;
+}
+
+//-------------------------------------------------------------------------
+void latency_histogram_t::record(uint64_t ns)
+{
+    const size_t bucket = bucket_of(ns);
+    if (bucket == NBUCKETS - 1)
+        m_overflow_max.raise(ns);
+    m_buckets[bucket].add();
+    m_count.add();
+    m_total_ns.add(ns);
+}
+
+void latency_histogram_t::merge(const latency_histogram_t &other)
+{
+    for (size_t i = 0; i < NBUCKETS; ++i)
+        m_buckets[i].add(other.m_buckets[i].get());
+    m_count.add(other.m_count.get());
+    m_total_ns.add(other.m_total_ns.get());
+    m_overflow_max.raise(other.m_overflow_max.get());
+}
+
+void latency_histogram_t::reset()
+{
+    for (auto &bucket: m_buckets)
+        bucket.reset();
+    m_count.reset();
+    m_total_ns.reset();
+    m_overflow_max.reset();
+}
+
+//-------------------------------------------------------------------------
+uint64_t latency_histogram_t::percentile(double p) const
+{
+    // The buckets are summed rather than trusting m_count, which may be
+    // updated concurrently
+    uint64_t total = 0;
+    for (auto &bucket: m_buckets)
+        total += bucket.get();
+    if (total == 0)
+        return 0;
+
+    const uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(total * std::clamp(p, 0.0, 100.0) / 100.0)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NBUCKETS; ++i)
+    {
+        seen += m_buckets[i].get();
+        if (seen >= rank)
+            return i == NBUCKETS - 1 ? std::max(bucket_max(i), m_overflow_max.get()) : bucket_max(i);
+    }
+    return std::max(bucket_max(NBUCKETS - 1), m_overflow_max.get());
+}
+
+//-------------------------------------------------------------------------
+// Helpers
+//-------------------------------------------------------------------------
+void json_append_string(std::string &out, std::string_view s)
+{
+    static const char HEX[] = "0123456789abcdef";
+    out += '"';
+    for (char ch: s)
+    {
+        switch (ch)
+        {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if (uint8_t(ch) < 0x20)
+                {
+                    out += "\\u00";
+                    out += HEX[uint8_t(ch) >> 4];
+                    out += HEX[uint8_t(ch) & 15];
+                }
+                else
+                {
+                    out += ch;
+                }
+                break;
+        }
+    }
+    out += '"';
+}
+
+//-------------------------------------------------------------------------
+std::string format_duration(uint64_t ns)
+{
+    char buf[32];
+    if (ns < 1000)
+        snprintf(buf, sizeof(buf), "%u ns", unsigned(ns));
+    else if (ns < 1000000)
+        snprintf(buf, sizeof(buf), "%.1f us", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, sizeof(buf), "%.2f ms", ns / 1e6);
+    else
+        snprintf(buf, sizeof(buf), "%.2f s", ns / 1e9);
+    return buf;
+}
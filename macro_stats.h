@@ -0,0 +1,100 @@
+/*
+Macro Statistics: Low overhead counters and latency histograms
+
+The counters are updated with relaxed atomic operations: they may be updated
+from any thread and read at any time, without a lock. A reading taken while
+they are updated is not a consistent snapshot, which is fine for statistics.
+
+Latencies are kept in a log-linear histogram: 4 buckets per power of two of
+nanoseconds, so a percentile is at most 25% above the recorded values (from
+2^MIN_BITS to 2^MAX_BITS ns), and never below them.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+//-------------------------------------------------------------------------
+// Counter that may be incremented from any thread
+//-------------------------------------------------------------------------
+class stat_counter_t
+{
+    std::atomic<uint64_t> m_value{ 0 };
+
+public:
+    stat_counter_t() = default;
+    stat_counter_t(const stat_counter_t &other) : m_value(other.get()) { }
+    stat_counter_t &operator=(const stat_counter_t &other)
+    {
+        m_value.store(other.get(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+
+    // Raise the value to 'v' if it is lower
+    void raise(uint64_t v)
+    {
+        uint64_t cur = get();
+        while (cur < v && !m_value.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+            ;
+    }
+    uint64_t get() const { return m_value.load(std::memory_order_relaxed); }
+    void reset() { m_value.store(0, std::memory_order_relaxed); }
+};
+
+//-------------------------------------------------------------------------
+// Latency histogram
+//-------------------------------------------------------------------------
+class latency_histogram_t
+{
+public:
+    static constexpr int SUB_BITS = 2;
+
+    // Below 2^MIN_BITS ns everything goes to the first bucket; from
+    // 2^MAX_BITS ns (about 69 s) on to the last one, bounded by the largest
+    // value it holds
+    static constexpr int MIN_BITS = 6;
+    static constexpr int MAX_BITS = 36;
+    static constexpr size_t NBUCKETS = (size_t(MAX_BITS - MIN_BITS) << SUB_BITS) + 1;
+
+private:
+    stat_counter_t m_buckets[NBUCKETS];
+    stat_counter_t m_count;
+    stat_counter_t m_total_ns;
+    stat_counter_t m_overflow_max;  // Largest value of the last bucket
+
+    static size_t bucket_of(uint64_t ns);
+
+    // Largest value that goes to a bucket
+    static uint64_t bucket_max(size_t bucket);
+
+public:
+    void record(uint64_t ns);
+
+    // Add the values recorded by another histogram
+    void merge(const latency_histogram_t &other);
+    void reset();
+
+    uint64_t count() const { return m_count.get(); }
+    uint64_t total_ns() const { return m_total_ns.get(); }
+
+    // Upper bound of the p-th percentile (0 < p <= 100); 0 if empty
+    uint64_t percentile(double p) const;
+};
+
+//-------------------------------------------------------------------------
+// Helpers
+//-------------------------------------------------------------------------
+
+// Append 's' as a JSON string literal (quotes included)
+void json_append_string(std::string &out, std::string_view s);
+
+// Format a duration for display: "850 ns", "12.5 us", "3.20 ms"...
+std::string format_duration(uint64_t ns);
@@ -0,0 +1,617 @@
+/*
+Macro Store: Binary file store implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include "macro_store.h"
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+static constexpr char     SNAPSHOT_MAGIC[8] = { 'C', 'L', 'I', 'M', 'A', 'C', 'R', 'O' };
+static constexpr char     JOURNAL_MAGIC[8]  = { 'C', 'L', 'I', 'M', 'J', 'R', 'N', 'L' };
+static constexpr uint32_t SNAPSHOT_VERSION  = 1;
+
+// Journal record: payload size, payload checksum, then the payload:
+// op (1 byte), macro, expression and description lengths (3 x 4 bytes)
+// and the strings
+static constexpr uint8_t JOURNAL_PUT = 1;
+static constexpr uint8_t JOURNAL_DEL = 2;
+static constexpr size_t  JOURNAL_HEADER_SIZE = 16;
+static constexpr size_t  RECORD_HEADER_SIZE  = 8;
+static constexpr size_t  PAYLOAD_FIXED_SIZE  = 13;
+
+//-------------------------------------------------------------------------
+// Helpers
+//-------------------------------------------------------------------------
+static uint64_t fnv1a(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL)
+{
+    auto p = (const uint8_t *)data;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static void put_u32(std::string &out, uint32_t v)
+{
+    out.append((const char *)&v, sizeof(v));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Flush a file to the disk
+static bool sync_file(FILE *fp)
+{
+    if (fflush(fp) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+//-------------------------------------------------------------------------
+// Store
+//-------------------------------------------------------------------------
+file_macro_store_t::file_macro_store_t(std::string path)
+    : m_path(std::move(path)), m_journal_path(m_path + ".journal")
+{
+}
+
+file_macro_store_t::~file_macro_store_t()
+{
+    close();
+}
+
+bool file_macro_store_t::fail(std::string error)
+{
+    m_error = std::move(error);
+    return false;
+}
+
+//-------------------------------------------------------------------------
+bool file_macro_store_t::exists() const
+{
+    std::error_code ec;
+    return std::filesystem::exists(m_path, ec) || std::filesystem::exists(m_journal_path, ec);
+}
+
+//-------------------------------------------------------------------------
+// Each change appends to the journal and each compaction writes a snapshot
+// of a new generation
+uint64_t file_macro_store_t::fingerprint() const
+{
+    uint64_t h = fnv1a(nullptr, 0);
+    bool found = false;
+    for (auto path: { &m_path, &m_journal_path })
+    {
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(*path, ec);
+        if (ec)
+            continue;
+        auto time = std::filesystem::last_write_time(*path, ec).time_since_epoch().count();
+        h = fnv1a(&size, sizeof(size), h);
+        h = fnv1a(&time, sizeof(time), h);
+        found = true;
+    }
+    if (!found)
+        return 0;
+
+    header_t hdr = {};
+    if (FILE *fp = fopen(m_path.c_str(), "rb"); fp != nullptr)
+    {
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+            hdr = header_t();
+        fclose(fp);
+    }
+    h = fnv1a(&hdr, sizeof(hdr), h);
+    return h != 0 ? h : 1;
+}
+
+//-------------------------------------------------------------------------
+bool file_macro_store_t::open()
+{
+    close();
+    m_error.clear();
+    if (!map_snapshot() || !replay_journal())
+    {
+        close();
+        return false;
+    }
+    m_open = true;
+    maybe_compact();
+    return true;
+}
+
+void file_macro_store_t::close()
+{
+    if (m_journal != nullptr)
+    {
+        fclose(m_journal);
+        m_journal = nullptr;
+    }
+    m_map.close();
+    m_count   = 0;
+    m_records = nullptr;
+    m_sorted  = nullptr;
+    m_strings = nullptr;
+    m_strings_size = 0;
+    m_generation   = 0;
+    m_changes.clear();
+    m_journal_records = 0;
+    m_open = false;
+}
+
+//-------------------------------------------------------------------------
+// Map and validate the snapshot; a missing snapshot is an empty one
+bool file_macro_store_t::map_snapshot()
+{
+    std::error_code ec;
+    if (!std::filesystem::exists(m_path, ec))
+        return true;
+    if (!m_map.open(m_path))
+        return fail("cannot map " + m_path);
+
+    const uint8_t *base = m_map.data();
+    const uint64_t size = m_map.size();
+    header_t h;
+    if (size < sizeof(h))
+        return fail(m_path + " is truncated");
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 || h.version != SNAPSHOT_VERSION)
+        return fail(m_path + " is not a macro file of this version");
+
+    auto fits = [size](uint64_t off, uint64_t len) { return off <= size && len <= size - off; };
+    const uint64_t records_size = uint64_t(h.count) * sizeof(record_t);
+    const uint64_t sorted_size  = uint64_t(h.count) * sizeof(uint32_t);
+    if (!fits(h.records_off, records_size) || !fits(h.sorted_off, sorted_size) || !fits(h.strings_off, h.strings_size)
+        || h.records_off % alignof(record_t) != 0 || h.sorted_off % alignof(uint32_t) != 0)
+    {
+        return fail(m_path + " is corrupted");
+    }
+    uint64_t sum = fnv1a(base + h.records_off, size_t(records_size));
+    sum = fnv1a(base + h.sorted_off, size_t(sorted_size), sum);
+    if (sum != h.checksum)
+        return fail(m_path + " is corrupted");
+
+    m_count        = h.count;
+    m_generation   = h.generation;
+    m_records      = (const record_t *)(base + h.records_off);
+    m_sorted       = (const uint32_t *)(base + h.sorted_off);
+    m_strings      = (const char *)(base + h.strings_off);
+    m_strings_size = h.strings_size;
+    for (uint32_t i = 0; i < m_count; ++i)
+    {
+        if (m_sorted[i] >= m_count)
+            return fail(m_path + " is corrupted");
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Strings out of bounds (a damaged file) read as empty
+std::string_view file_macro_store_t::str(uint32_t off, uint32_t len) const
+{
+    if (off > m_strings_size || len > m_strings_size - off)
+        return std::string_view();
+    return std::string_view(m_strings + off, len);
+}
+
+int64_t file_macro_store_t::find_snapshot(std::string_view macro) const
+{
+    auto p = std::lower_bound(m_sorted, m_sorted + m_count, macro, [this](uint32_t i, std::string_view name)
+    {
+        return name_of(i) < name;
+    });
+    if (p == m_sorted + m_count || name_of(*p) != macro)
+        return -1;
+    return *p;
+}
+
+//-------------------------------------------------------------------------
+// Journal
+//-------------------------------------------------------------------------
+
+// Replay the records of the journal of the current snapshot, up to the
+// first damaged one (which is cut off, with everything after it)
+bool file_macro_store_t::replay_journal()
+{
+    FILE *fp = fopen(m_journal_path.c_str(), "rb");
+    if (fp == nullptr)
+        return true;
+
+    std::string data;
+    char buf[65536];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) != 0; )
+        data.append(buf, n);
+    fclose(fp);
+
+    uint64_t generation = 0;
+    if (data.size() >= JOURNAL_HEADER_SIZE)
+        memcpy(&generation, data.data() + sizeof(JOURNAL_MAGIC), sizeof(generation));
+    if (data.size() < JOURNAL_HEADER_SIZE
+        || memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0
+        || generation != m_generation)
+    {
+        // Left by an interrupted compaction, or never completed
+        return reset_journal();
+    }
+
+    auto p = (const uint8_t *)data.data();
+    size_t pos = JOURNAL_HEADER_SIZE;
+    while (data.size() - pos >= RECORD_HEADER_SIZE)
+    {
+        const uint32_t size = get_u32(p + pos);
+        const uint32_t sum  = get_u32(p + pos + 4);
+        if (size < PAYLOAD_FIXED_SIZE || size > data.size() - pos - RECORD_HEADER_SIZE)
+            break;
+        const uint8_t *payload = p + pos + RECORD_HEADER_SIZE;
+        if (uint32_t(fnv1a(payload, size)) != sum)
+            break;
+
+        const uint8_t op = payload[0];
+        const uint64_t lens[3] = { get_u32(payload + 1), get_u32(payload + 5), get_u32(payload + 9) };
+        if ((op != JOURNAL_PUT && op != JOURNAL_DEL) || lens[0] + lens[1] + lens[2] != size - PAYLOAD_FIXED_SIZE)
+            break;
+
+        auto s = (const char *)payload + PAYLOAD_FIXED_SIZE;
+        change_t change;
+        change.seq     = ++m_seq;
+        change.removed = op == JOURNAL_DEL;
+        change.def.macro.assign(s, size_t(lens[0]));
+        change.def.expr.assign(s + lens[0], size_t(lens[1]));
+        change.def.desc.assign(s + lens[0] + lens[1], size_t(lens[2]));
+        std::string name = change.def.macro;
+        m_changes.insert_or_assign(std::move(name), std::move(change));
+
+        ++m_journal_records;
+        pos += RECORD_HEADER_SIZE + size;
+    }
+
+    std::error_code ec;
+    if (pos != data.size())
+        std::filesystem::resize_file(m_journal_path, pos, ec);
+    m_journal = fopen(m_journal_path.c_str(), "ab");
+    if (m_journal == nullptr)
+        return fail("cannot open " + m_journal_path);
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Start an empty journal for the current snapshot
+bool file_macro_store_t::reset_journal()
+{
+    if (m_journal != nullptr)
+        fclose(m_journal);
+    m_journal = fopen(m_journal_path.c_str(), "wb");
+    if (m_journal == nullptr)
+        return fail("cannot create " + m_journal_path);
+
+    fwrite(JOURNAL_MAGIC, 1, sizeof(JOURNAL_MAGIC), m_journal);
+    fwrite(&m_generation, 1, sizeof(m_generation), m_journal);
+    if (!sync_file(m_journal))
+        return fail("cannot write " + m_journal_path);
+    m_journal_records = 0;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// The record is written with a single call and flushed
+bool file_macro_store_t::append(bool removed, const macro_def_t &def)
+{
+    if (m_journal == nullptr && !reset_journal())
+        return false;
+
+    std::string payload;
+    payload += char(removed ? JOURNAL_DEL : JOURNAL_PUT);
+    put_u32(payload, uint32_t(def.macro.size()));
+    put_u32(payload, uint32_t(removed ? 0 : def.expr.size()));
+    put_u32(payload, uint32_t(removed ? 0 : def.desc.size()));
+    payload += def.macro;
+    if (!removed)
+    {
+        payload += def.expr;
+        payload += def.desc;
+    }
+
+    std::string record;
+    put_u32(record, uint32_t(payload.size()));
+    put_u32(record, uint32_t(fnv1a(payload.data(), payload.size())));
+    record += payload;
+    if (fwrite(record.data(), 1, record.size(), m_journal) != record.size() || fflush(m_journal) != 0)
+        return fail("cannot write " + m_journal_path);
+
+    change_t change;
+    change.seq     = ++m_seq;
+    change.removed = removed;
+    change.def     = def;
+    if (removed)
+    {
+        change.def.expr.clear();
+        change.def.desc.clear();
+    }
+    m_changes.insert_or_assign(def.macro, std::move(change));
+    ++m_journal_records;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+void file_macro_store_t::maybe_compact()
+{
+    if (m_journal_records > std::max<size_t>(MIN_COMPACT_RECORDS, m_count / 4))
+        compact();
+}
+
+//-------------------------------------------------------------------------
+// Snapshots
+//-------------------------------------------------------------------------
+
+// The changed macros first, most recent first (like the registry list),
+// then the snapshot in its order
+void file_macro_store_t::current_defs(std::vector<def_view_t> &defs, bool with_desc) const
+{
+    std::vector<const change_t *> changes;
+    changes.reserve(m_changes.size());
+    for (auto &kv: m_changes)
+    {
+        if (!kv.second.removed)
+            changes.push_back(&kv.second);
+    }
+    std::sort(changes.begin(), changes.end(), [](const change_t *a, const change_t *b)
+    {
+        return a->seq > b->seq;
+    });
+
+    defs.clear();
+    defs.reserve(changes.size() + m_count);
+    for (auto c: changes)
+        defs.push_back({ c->def.macro, c->def.expr, c->def.desc });
+
+    for (uint32_t i = 0; i < m_count; ++i)
+    {
+        auto &r = m_records[i];
+        std::string_view macro = str(r.macro_off, r.macro_len);
+        if (!m_changes.empty() && m_changes.find(macro) != m_changes.end())
+            continue;
+        defs.push_back({
+            macro,
+            str(r.expr_off, r.expr_len),
+            with_desc ? str(r.desc_off, r.desc_len) : std::string_view() });
+    }
+}
+
+//-------------------------------------------------------------------------
+// Layout: header, records, sorted index, then the strings: names and
+// expressions first, the descriptions last (they are rarely read)
+bool file_macro_store_t::write_snapshot(const std::vector<def_view_t> &defs)
+{
+    // Duplicates keep their first definition
+    std::vector<uint32_t> sorted(defs.size());
+    for (uint32_t i = 0; i < sorted.size(); ++i)
+        sorted[i] = i;
+    std::stable_sort(sorted.begin(), sorted.end(), [&defs](uint32_t a, uint32_t b)
+    {
+        return defs[a].macro < defs[b].macro;
+    });
+    std::vector<bool> keep(defs.size(), true);
+    for (size_t k = 1; k < sorted.size(); ++k)
+    {
+        if (defs[sorted[k]].macro == defs[sorted[k - 1]].macro)
+            keep[sorted[k]] = false;
+    }
+
+    std::vector<record_t> records;
+    std::vector<uint32_t> number(defs.size());
+    std::string strings;
+    for (uint32_t i = 0; i < defs.size(); ++i)
+    {
+        if (!keep[i])
+            continue;
+        number[i] = uint32_t(records.size());
+        auto &r = records.emplace_back();
+        r.macro_off = uint32_t(strings.size());
+        r.macro_len = uint32_t(defs[i].macro.size());
+        strings += defs[i].macro;
+        r.expr_off  = uint32_t(strings.size());
+        r.expr_len  = uint32_t(defs[i].expr.size());
+        strings += defs[i].expr;
+    }
+    for (uint32_t i = 0; i < defs.size(); ++i)
+    {
+        if (!keep[i])
+            continue;
+        auto &r = records[number[i]];
+        r.desc_off = uint32_t(strings.size());
+        r.desc_len = uint32_t(defs[i].desc.size());
+        strings += defs[i].desc;
+    }
+    if (strings.size() > UINT32_MAX)
+        return fail("too many macros");
+
+    std::vector<uint32_t> index;
+    index.reserve(records.size());
+    for (uint32_t i: sorted)
+    {
+        if (keep[i])
+            index.push_back(number[i]);
+    }
+
+    header_t h = {};
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version      = SNAPSHOT_VERSION;
+    h.count        = uint32_t(records.size());
+    h.generation   = m_generation + 1;
+    h.records_off  = sizeof(header_t);
+    h.sorted_off   = h.records_off + records.size() * sizeof(record_t);
+    h.strings_off  = h.sorted_off + index.size() * sizeof(uint32_t);
+    h.strings_size = strings.size();
+    h.checksum     = fnv1a(index.data(), index.size() * sizeof(uint32_t),
+                           fnv1a(records.data(), records.size() * sizeof(record_t)));
+
+    // Write the new snapshot aside, then replace the old one
+    const std::string tmp_path = m_path + ".tmp";
+    FILE *fp = fopen(tmp_path.c_str(), "wb");
+    if (fp == nullptr)
+        return fail("cannot create " + tmp_path);
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+           && fwrite(records.data(), sizeof(record_t), records.size(), fp) == records.size()
+           && fwrite(index.data(), sizeof(uint32_t), index.size(), fp) == index.size()
+           && fwrite(strings.data(), 1, strings.size(), fp) == strings.size()
+           && sync_file(fp);
+    fclose(fp);
+
+    std::error_code ec;
+    if (!ok)
+    {
+        std::filesystem::remove(tmp_path, ec);
+        return fail("cannot write " + tmp_path);
+    }
+
+    // The defs may point into the current mapping: it goes last
+    m_map.close();
+    std::filesystem::rename(tmp_path, m_path, ec);
+    if (ec)
+    {
+        std::filesystem::remove(tmp_path, ec);
+        map_snapshot();
+        return fail("cannot replace " + m_path);
+    }
+
+    m_changes.clear();
+    if (!map_snapshot())
+        return false;
+    return reset_journal();
+}
+
+//-------------------------------------------------------------------------
+bool file_macro_store_t::compact()
+{
+    if (!m_open)
+        return fail("the store is not open");
+
+    std::vector<def_view_t> defs;
+    current_defs(defs, true);
+    return write_snapshot(defs);
+}
+
+//-------------------------------------------------------------------------
+bool file_macro_store_t::save_all(const macros_t &macros)
+{
+    if (!m_open)
+        return fail("the store is not open");
+
+    std::vector<def_view_t> defs;
+    defs.reserve(macros.size());
+    for (auto &m: macros)
+        defs.push_back({ m.macro, m.expr, m.desc });
+    return write_snapshot(defs);
+}
+
+bool file_macro_store_t::save_all(const macro_table_t &table)
+{
+    if (!m_open)
+        return fail("the store is not open");
+
+    std::vector<def_view_t> defs;
+    defs.reserve(table.size());
+    for (auto slot: table.order())
+        defs.push_back({ table.name(slot), table.expr(slot), table.desc(slot) });
+    return write_snapshot(defs);
+}
+
+//-------------------------------------------------------------------------
+// Queries
+//-------------------------------------------------------------------------
+size_t file_macro_store_t::size() const
+{
+    size_t n = m_count;
+    for (auto &kv: m_changes)
+    {
+        const bool in_snapshot = find_snapshot(kv.first) >= 0;
+        if (kv.second.removed && in_snapshot)
+            --n;
+        else if (!kv.second.removed && !in_snapshot)
+            ++n;
+    }
+    return n;
+}
+
+bool file_macro_store_t::find(std::string_view macro, macro_def_t &def) const
+{
+    auto p = m_changes.find(macro);
+    if (p != m_changes.end())
+    {
+        if (p->second.removed)
+            return false;
+        def = p->second.def;
+        return true;
+    }
+
+    int64_t i = find_snapshot(macro);
+    if (i < 0)
+        return false;
+    auto &r = m_records[i];
+    def.macro = str(r.macro_off, r.macro_len);
+    def.expr  = str(r.expr_off, r.expr_len);
+    def.desc  = str(r.desc_off, r.desc_len);
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// macro_store_t
+//-------------------------------------------------------------------------
+void file_macro_store_t::load(macros_t &macros)
+{
+    std::vector<def_view_t> defs;
+    current_defs(defs, false);
+    macros.reserve(macros.size() + defs.size());
+    for (auto &d: defs)
+        macros.push_back({ std::string(d.macro), std::string(d.expr), std::string(d.desc) });
+}
+
+// Straight from the mapping to the arena of the table
+void file_macro_store_t::load_table(macro_table_t &table)
+{
+    std::vector<def_view_t> defs;
+    current_defs(defs, false);
+    size_t bytes = 0;
+    for (auto &d: defs)
+        bytes += d.macro.size() + d.expr.size();
+    table.reserve(defs.size(), bytes);
+    for (auto &d: defs)
+        table.insert(d.macro, d.expr);
+}
+
+void file_macro_store_t::save(const macro_def_t &macro)
+{
+    if (m_open && append(false, macro))
+        maybe_compact();
+}
+
+void file_macro_store_t::remove(const macro_def_t &macro)
+{
+    if (m_open && append(true, macro))
+        maybe_compact();
+}
+
+std::string file_macro_store_t::desc(const macro_def_t &macro)
+{
+    if (!macro.desc.empty())
+        return macro.desc;
+
+    macro_def_t def;
+    return find(macro.macro, def) ? def.desc : std::string();
+}
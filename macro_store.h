@@ -0,0 +1,165 @@
+/*
+Macro Store: Binary file store of the macro definitions
+
+The macros are kept in a snapshot file, memory mapped when opened, plus a
+journal of the changes made since the snapshot was written:
+- the snapshot holds the definitions in display order, an index sorted by
+  name (for lookups) and the strings. The descriptions are stored apart
+  from the names and expressions and only read when asked for: load()
+  leaves them empty (see desc())
+- each save() and remove() appends a record to the journal. Records carry
+  a checksum: one torn by a crash is dropped when the journal is replayed
+- once the journal is large enough, the store is compacted: a new snapshot
+  is written to a temporary file and renamed over the old one, then the
+  journal is reset. The snapshot and the journal carry a generation
+  number, so a journal left by an interrupted compaction is not replayed
+  over the snapshot that already includes it
+
+Either way, an update is all or nothing. The files use the byte order of
+the machine (little endian in practice).
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "file_mapping.h"
+#include "macro_def.h"
+#include "macro_table.h"
+
+//-------------------------------------------------------------------------
+class file_macro_store_t: public macro_store_t
+{
+public:
+    // The journal is compacted past this many records (or past a quarter
+    // of the macros, if more)
+    static constexpr size_t MIN_COMPACT_RECORDS = 1024;
+
+private:
+    struct header_t
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint64_t generation;
+        uint64_t records_off;   // record_t[count], display order
+        uint64_t sorted_off;    // uint32_t[count], record numbers sorted by name
+        uint64_t strings_off;
+        uint64_t strings_size;
+        uint64_t checksum;      // Of the records and the sorted index
+    };
+
+    // Offsets are relative to the strings
+    struct record_t
+    {
+        uint32_t macro_off, macro_len;
+        uint32_t expr_off,  expr_len;
+        uint32_t desc_off,  desc_len;
+    };
+
+    // Change made since the snapshot
+    struct change_t
+    {
+        uint64_t    seq;
+        bool        removed;
+        macro_def_t def;
+    };
+
+    struct hash_t
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    };
+
+    std::string m_path;
+    std::string m_journal_path;
+    bool m_open = false;
+
+    file_mapping_t m_map;
+    uint32_t  m_count = 0;
+    uint64_t  m_generation = 0;
+    const record_t *m_records = nullptr;
+    const uint32_t *m_sorted  = nullptr;
+    const char     *m_strings = nullptr;
+    uint64_t        m_strings_size = 0;
+
+    std::unordered_map<std::string, change_t, hash_t, std::equal_to<>> m_changes;
+    uint64_t m_seq = 0;
+    size_t   m_journal_records = 0;
+    FILE    *m_journal = nullptr;
+
+    std::string m_error;
+
+    // Snapshot access
+    bool map_snapshot();
+    std::string_view str(uint32_t off, uint32_t len) const;
+    std::string_view name_of(uint32_t i) const { return str(m_records[i].macro_off, m_records[i].macro_len); }
+    int64_t find_snapshot(std::string_view macro) const;
+
+    // Journal
+    bool replay_journal();
+    bool reset_journal();
+    bool append(bool removed, const macro_def_t &def);
+    void maybe_compact();
+
+    // Definition with a view of its strings
+    struct def_view_t
+    {
+        std::string_view macro, expr, desc;
+    };
+    void current_defs(std::vector<def_view_t> &defs, bool with_desc) const;
+
+    // Write a new snapshot with the given definitions and switch to it
+    bool write_snapshot(const std::vector<def_view_t> &defs);
+
+    bool fail(std::string error);
+
+public:
+    // The journal goes next to the snapshot, in "<path>.journal"
+    file_macro_store_t(std::string path);
+    ~file_macro_store_t();
+
+    // Open the store, replaying the journal. A store that does not exist
+    // yet is empty (its files are created on the first change).
+    // Returns false, with the reason in error(), if it cannot be read
+    bool open();
+    void close();
+    bool is_open() const { return m_open; }
+
+    // Does the snapshot or the journal exist on disk?
+    bool exists() const;
+
+    // Identifies the stored macros from the files on disk (sizes, times
+    // and the snapshot header) without reading them, open or not: it
+    // changes whenever the macros do. 0 if the store does not exist
+    uint64_t fingerprint() const;
+
+    const std::string &path() const { return m_path; }
+    std::string error() const override { return m_error; }
+
+    // Number of stored macros
+    size_t size() const;
+
+    // Look a macro up, description included
+    bool find(std::string_view macro, macro_def_t &def) const;
+
+    // Replace all the stored macros at once (writes a new snapshot)
+    bool save_all(const macros_t &macros);
+    bool save_all(const macro_table_t &table) override;
+
+    // Fold the journal into a new snapshot
+    bool compact();
+
+    // macro_store_t: the descriptions are left empty by load()
+    void load(macros_t &macros) override;
+    void load_table(macro_table_t &table) override;
+    void save(const macro_def_t &macro) override;
+    void remove(const macro_def_t &macro) override;
+    std::string desc(const macro_def_t &macro) override;
+};
@@ -0,0 +1,303 @@
+/*
+Macro Table: Flat storage implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <functional>
+#include "macro_table.h"
+
+// The arena is not compacted for less garbage than this
+static constexpr size_t MIN_COMPACT_GARBAGE = 4096;
+
+//-------------------------------------------------------------------------
+// FNV-1a
+uint32_t macro_table_t::hash(std::string_view s)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char ch: s)
+        h = (h ^ ch) * 16777619u;
+    return h;
+}
+
+//-------------------------------------------------------------------------
+// Appending to the arena moves it: the views of it are copied first
+bool macro_table_t::in_arena(std::string_view s) const
+{
+    return !s.empty()
+        && std::less_equal<const char *>()(m_arena.data(), s.data())
+        && std::less<const char *>()(s.data(), m_arena.data() + m_arena.size());
+}
+
+macro_table_t::str_t macro_table_t::intern(std::string_view s)
+{
+    str_t r;
+    r.off = uint32_t(m_arena.size());
+    r.len = uint32_t(s.size());
+    m_arena.append(s);
+    return r;
+}
+
+//-------------------------------------------------------------------------
+// Copy the live strings to a new arena, in slot order
+void macro_table_t::maybe_compact()
+{
+    if (m_garbage < MIN_COMPACT_GARBAGE || m_garbage * 2 < m_arena.size())
+        return;
+
+    std::string arena;
+    arena.reserve(m_arena.size() - m_garbage);
+    auto move = [&](str_t &s)
+    {
+        const uint32_t off = uint32_t(arena.size());
+        arena.append(view(s));
+        s.off = off;
+    };
+    for (uint32_t slot = 0; slot < m_names.size(); ++slot)
+    {
+        if (!m_used[slot])
+            continue;
+        move(m_names[slot]);
+        move(m_exprs[slot]);
+        move(m_descs[slot]);
+    }
+    m_arena.swap(arena);
+    m_garbage = 0;
+}
+
+//-------------------------------------------------------------------------
+// Hash index
+//-------------------------------------------------------------------------
+void macro_table_t::index_insert(uint32_t slot)
+{
+    size_t b = bucket_of(m_hashes[slot]);
+    while (m_index[b] != 0)
+        b = (b + 1) & (m_index.size() - 1);
+    m_index[b] = slot + 1;
+}
+
+//-------------------------------------------------------------------------
+// Backward shift deletion: the entries that follow in the probe sequence
+// move up when their ideal bucket allows it, so lookups never need
+// tombstones
+void macro_table_t::index_erase(uint32_t slot)
+{
+    const size_t mask = m_index.size() - 1;
+    size_t i = bucket_of(m_hashes[slot]);
+    while (m_index[i] != slot + 1)
+        i = (i + 1) & mask;
+
+    for (size_t j = (i + 1) & mask; m_index[j] != 0; j = (j + 1) & mask)
+    {
+        const size_t k = bucket_of(m_hashes[m_index[j] - 1]);
+        const bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays)
+        {
+            m_index[i] = m_index[j];
+            i = j;
+        }
+    }
+    m_index[i] = 0;
+}
+
+//-------------------------------------------------------------------------
+void macro_table_t::rehash(size_t entries)
+{
+    size_t size = 16;
+    while (size < entries * 2)
+        size *= 2;
+    if (size <= m_index.size())
+        return;
+
+    m_index.assign(size, 0);
+    for (uint32_t slot = 0; slot < m_names.size(); ++slot)
+    {
+        if (m_used[slot])
+            index_insert(slot);
+    }
+}
+
+//-------------------------------------------------------------------------
+uint32_t macro_table_t::find(std::string_view name) const
+{
+    if (m_index.empty())
+        return npos;
+
+    const uint32_t h = hash(name);
+    for (size_t b = bucket_of(h); m_index[b] != 0; b = (b + 1) & (m_index.size() - 1))
+    {
+        const uint32_t slot = m_index[b] - 1;
+        if (m_hashes[slot] == h && view(m_names[slot]) == name)
+            return slot;
+    }
+    return npos;
+}
+
+//-------------------------------------------------------------------------
+// Entries
+//-------------------------------------------------------------------------
+void macro_table_t::clear()
+{
+    m_arena.clear();
+    m_garbage = 0;
+    m_names.clear();
+    m_exprs.clear();
+    m_descs.clear();
+    m_hashes.clear();
+    m_used.clear();
+    m_order.clear();
+    m_free.clear();
+    m_index.clear();
+}
+
+void macro_table_t::reserve(size_t entries, size_t bytes)
+{
+    const size_t total = m_order.size() + entries;
+    m_names.reserve(total);
+    m_exprs.reserve(total);
+    m_descs.reserve(total);
+    m_hashes.reserve(total);
+    m_used.reserve(total);
+    m_order.reserve(total);
+    m_arena.reserve(m_arena.size() + bytes);
+    rehash(total);
+}
+
+//-------------------------------------------------------------------------
+macro_def_t macro_table_t::def(uint32_t slot) const
+{
+    return { std::string(name(slot)), std::string(expr(slot)), std::string(desc(slot)) };
+}
+
+//-------------------------------------------------------------------------
+uint32_t macro_table_t::insert(
+    std::string_view name,
+    std::string_view expr,
+    std::string_view desc,
+    size_t pos)
+{
+    if (contains(name))
+        return npos;
+    if (in_arena(name) || in_arena(expr) || in_arena(desc))
+        return insert(std::string(name), std::string(expr), std::string(desc), pos);
+
+    uint32_t slot;
+    if (!m_free.empty())
+    {
+        slot = m_free.back();
+        m_free.pop_back();
+    }
+    else
+    {
+        slot = uint32_t(m_names.size());
+        m_names.emplace_back();
+        m_exprs.emplace_back();
+        m_descs.emplace_back();
+        m_hashes.emplace_back();
+        m_used.push_back(false);
+    }
+
+    m_names[slot]  = intern(name);
+    m_exprs[slot]  = intern(expr);
+    m_descs[slot]  = intern(desc);
+    m_hashes[slot] = hash(name);
+    m_used[slot]   = true;
+
+    if ((m_order.size() + 1) * 2 > m_index.size())
+        rehash(m_order.size() + 1);
+    index_insert(slot);
+
+    m_order.insert(m_order.begin() + std::min(pos, m_order.size()), slot);
+    return slot;
+}
+
+//-------------------------------------------------------------------------
+// Only the strings that changed are appended to the arena
+bool macro_table_t::set(uint32_t slot, std::string_view name, std::string_view expr, std::string_view desc)
+{
+    const bool rename = name != this->name(slot);
+    if (rename && contains(name))
+        return false;
+
+    if (in_arena(name) || in_arena(expr) || in_arena(desc))
+        return set(slot, std::string(name), std::string(expr), std::string(desc));
+
+    if (rename)
+    {
+        index_erase(slot);
+        release(m_names[slot]);
+        m_names[slot]  = intern(name);
+        m_hashes[slot] = hash(name);
+        index_insert(slot);
+    }
+    if (expr != this->expr(slot))
+    {
+        release(m_exprs[slot]);
+        m_exprs[slot] = intern(expr);
+    }
+    if (desc != this->desc(slot))
+    {
+        release(m_descs[slot]);
+        m_descs[slot] = intern(desc);
+    }
+    maybe_compact();
+    return true;
+}
+
+void macro_table_t::set_expr(uint32_t slot, std::string_view expr)
+{
+    if (expr == this->expr(slot))
+        return;
+
+    if (in_arena(expr))
+        return set_expr(slot, std::string(expr));
+
+    release(m_exprs[slot]);
+    m_exprs[slot] = intern(expr);
+    maybe_compact();
+}
+
+void macro_table_t::set_desc(uint32_t slot, std::string_view desc)
+{
+    if (desc == this->desc(slot))
+        return;
+
+    if (in_arena(desc))
+        return set_desc(slot, std::string(desc));
+
+    release(m_descs[slot]);
+    m_descs[slot] = intern(desc);
+    maybe_compact();
+}
+
+//-------------------------------------------------------------------------
+void macro_table_t::erase_at(size_t pos)
+{
+    const uint32_t slot = m_order[pos];
+    m_order.erase(m_order.begin() + pos);
+
+    index_erase(slot);
+    release(m_names[slot]);
+    release(m_exprs[slot]);
+    release(m_descs[slot]);
+    m_names[slot] = m_exprs[slot] = m_descs[slot] = str_t();
+    m_used[slot] = false;
+    m_free.push_back(slot);
+    maybe_compact();
+}
+
+void macro_table_t::erase(uint32_t slot)
+{
+    erase_at(size_t(std::find(m_order.begin(), m_order.end(), slot) - m_order.begin()));
+}
+
+//-------------------------------------------------------------------------
+size_t macro_table_t::memory() const
+{
+    return m_arena.capacity()
+         + (m_names.capacity() + m_exprs.capacity() + m_descs.capacity()) * sizeof(str_t)
+         + m_hashes.capacity() * sizeof(uint32_t)
+         + m_used.capacity() / 8
+         + (m_order.capacity() + m_free.capacity() + m_index.capacity()) * sizeof(uint32_t);
+}
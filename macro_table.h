@@ -0,0 +1,115 @@
+/*
+Macro Table: Flat storage of a large set of macro definitions
+
+The strings of all the macros live in a single arena; the names, expressions
+and descriptions are arrays of (offset, length) pairs into it, and a hash
+index on the names gives O(1) lookups. An entry is addressed by its slot,
+which stays the same while the entry lives; the entries are also kept in an
+order (e.g. the display order of the editor) as a vector of slots.
+
+Replaced and removed strings are left in the arena until they make up half
+of it, then the arena is compacted. The string views returned by the table
+are invalidated by any change to it.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "macro_def.h"
+
+//-------------------------------------------------------------------------
+class macro_table_t
+{
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+private:
+    struct str_t
+    {
+        uint32_t off = 0;
+        uint32_t len = 0;
+    };
+
+    std::string m_arena;
+    size_t m_garbage = 0;       // Bytes of the arena no longer referenced
+
+    // By slot
+    std::vector<str_t>    m_names;
+    std::vector<str_t>    m_exprs;
+    std::vector<str_t>    m_descs;
+    std::vector<uint32_t> m_hashes;
+    std::vector<bool>     m_used;
+
+    std::vector<uint32_t> m_order;
+    std::vector<uint32_t> m_free;
+
+    // Open addressing with linear probing: slot + 1, or 0 if empty.
+    // The size is a power of 2, at least twice the number of entries
+    std::vector<uint32_t> m_index;
+
+    static uint32_t hash(std::string_view s);
+    std::string_view view(str_t s) const { return std::string_view(m_arena.data() + s.off, s.len); }
+    bool in_arena(std::string_view s) const;
+    str_t intern(std::string_view s);
+    void release(str_t s) { m_garbage += s.len; }
+    void maybe_compact();
+
+    size_t bucket_of(uint32_t h) const { return h & (m_index.size() - 1); }
+    void index_insert(uint32_t slot);
+    void index_erase(uint32_t slot);
+    void rehash(size_t entries);
+
+public:
+    // Number of entries
+    size_t size() const { return m_order.size(); }
+    bool empty() const { return m_order.empty(); }
+
+    // One past the largest slot number (to size per-slot arrays)
+    size_t slots() const { return m_names.size(); }
+
+    void clear();
+
+    // Make room for more macros, and for their strings
+    void reserve(size_t entries, size_t bytes = 0);
+
+    // Slot of the entry at 'pos' in the order
+    uint32_t at(size_t pos) const { return m_order[pos]; }
+    const std::vector<uint32_t> &order() const { return m_order; }
+
+    // Slot of a macro, or npos
+    uint32_t find(std::string_view name) const;
+    bool contains(std::string_view name) const { return find(name) != npos; }
+
+    std::string_view name(uint32_t slot) const { return view(m_names[slot]); }
+    std::string_view expr(uint32_t slot) const { return view(m_exprs[slot]); }
+    std::string_view desc(uint32_t slot) const { return view(m_descs[slot]); }
+    macro_def_t def(uint32_t slot) const;
+
+    // Add a macro at 'pos' in the order (at the end by default).
+    // Returns its slot, or npos if the name is taken
+    uint32_t insert(
+        std::string_view name,
+        std::string_view expr,
+        std::string_view desc = {},
+        size_t pos = SIZE_MAX);
+    uint32_t insert(const macro_def_t &def, size_t pos = SIZE_MAX) { return insert(def.macro, def.expr, def.desc, pos); }
+
+    // Change an entry in place. Returns false if renaming it to a taken name
+    bool set(uint32_t slot, std::string_view name, std::string_view expr, std::string_view desc);
+    bool set(uint32_t slot, const macro_def_t &def) { return set(slot, def.macro, def.expr, def.desc); }
+    void set_expr(uint32_t slot, std::string_view expr);
+    void set_desc(uint32_t slot, std::string_view desc);
+
+    // Remove the entry at 'pos' in the order, or a given slot
+    void erase_at(size_t pos);
+    void erase(uint32_t slot);
+
+    // Bytes used, arena and indices included
+    size_t memory() const;
+};
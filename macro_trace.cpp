@@ -0,0 +1,122 @@
+/*
+Macro Trace: Ring buffer and Chrome trace export implementation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include "macro_trace.h"
+#include "macro_stats.h"
+
+macro_trace_t macro_trace;
+
+//-------------------------------------------------------------------------
+// Small thread numbers, in order of first use
+uint32_t macro_trace_t::thread_index()
+{
+    static std::atomic<uint32_t> next{ 1 };
+    thread_local uint32_t index = next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+//-------------------------------------------------------------------------
+void macro_trace_t::enable(bool on, size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (on && !m_enabled.load(std::memory_order_relaxed))
+    {
+        m_events.clear();
+        m_events.resize(std::max<size_t>(capacity, 1));
+        m_count = 0;
+        m_epoch = clock_t::now();
+    }
+    m_enabled.store(on, std::memory_order_relaxed);
+}
+
+//-------------------------------------------------------------------------
+// The slots are reused: their detail strings keep their capacity, so
+// recording does not allocate once the buffer went around
+void macro_trace_t::add(
+    const char *name,
+    const char *cat,
+    clock_t::time_point start,
+    clock_t::time_point end,
+    std::string_view detail)
+{
+    const uint32_t tid = thread_index();
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_enabled.load(std::memory_order_relaxed) || m_events.empty())
+        return;
+
+    auto &ev = m_events[m_count++ % m_events.size()];
+    ev.name  = name;
+    ev.cat   = cat;
+    ev.start = start;
+    ev.dur   = end - start;
+    ev.tid   = tid;
+
+    // Do not cut a UTF-8 sequence
+    size_t len = detail.size();
+    if (len > MAX_DETAIL_LEN)
+    {
+        len = MAX_DETAIL_LEN;
+        while (len > 0 && (uint8_t(detail[len]) & 0xC0) == 0x80)
+            --len;
+    }
+    ev.detail.assign(detail.data(), len);
+}
+
+//-------------------------------------------------------------------------
+void macro_trace_t::clear()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_count = 0;
+}
+
+size_t macro_trace_t::size() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return size_t(std::min<uint64_t>(m_count, m_events.size()));
+}
+
+uint64_t macro_trace_t::dropped() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_count > m_events.size() ? m_count - m_events.size() : 0;
+}
+
+//-------------------------------------------------------------------------
+// Complete ("X") events, oldest first, with microsecond timestamps
+// relative to when tracing started
+void macro_trace_t::write_json(std::string &out) const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    const size_t cap = m_events.size();
+    const size_t n = size_t(std::min<uint64_t>(m_count, cap));
+    const uint64_t first = m_count - n;
+
+    out = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    char buf[96];
+    for (uint64_t k = first; k < m_count; ++k)
+    {
+        auto &ev = m_events[k % cap];
+        out += k == first ? "\n  {\"name\": " : ",\n  {\"name\": ";
+        json_append_string(out, ev.name);
+        out += ", \"cat\": ";
+        json_append_string(out, ev.cat);
+
+        const double ts  = std::chrono::duration<double, std::micro>(ev.start - m_epoch).count();
+        const double dur = std::chrono::duration<double, std::micro>(ev.dur).count();
+        snprintf(buf, sizeof(buf), ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u", ts, dur, ev.tid);
+        out += buf;
+        if (!ev.detail.empty())
+        {
+            out += ", \"args\": {\"detail\": ";
+            json_append_string(out, ev.detail);
+            out += "}";
+        }
+        out += "}";
+    }
+    out += "\n]}\n";
+}
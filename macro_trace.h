@@ -0,0 +1,115 @@
+/*
+Macro Trace: Opt-in tracing of the expansion pipeline
+
+When enabled, the stages of the expansion of a line (matching, each dynamic
+evaluation, the original CLI...) record spans into a ring buffer: the most
+recent events are kept, the older ones are overwritten. The buffer is saved
+in the Chrome trace event format, which chrome://tracing and Perfetto open.
+
+While disabled, a span costs a relaxed atomic load. Spans may be recorded
+from any thread.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//-------------------------------------------------------------------------
+class macro_trace_t
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    static constexpr size_t DEFAULT_CAPACITY = 65536;
+
+    // Longest detail kept with an event
+    static constexpr size_t MAX_DETAIL_LEN = 256;
+
+private:
+    // Completed span. The name and category are string literals
+    struct event_t
+    {
+        const char *name;
+        const char *cat;
+        clock_t::time_point start;
+        clock_t::duration   dur;
+        uint32_t tid;
+        std::string detail;
+    };
+
+    std::atomic<bool> m_enabled{ false };
+
+    mutable std::mutex m_lock;
+    std::vector<event_t> m_events;
+    uint64_t m_count = 0;       // Events recorded since the last clear()
+    clock_t::time_point m_epoch;
+
+    static uint32_t thread_index();
+
+public:
+    // Start recording into a buffer of 'capacity' events, or stop
+    // (the recorded events are kept until the next start)
+    void enable(bool on, size_t capacity = DEFAULT_CAPACITY);
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    // Record a span (only if enabled)
+    void add(
+        const char *name,
+        const char *cat,
+        clock_t::time_point start,
+        clock_t::time_point end,
+        std::string_view detail = {});
+
+    void clear();
+
+    // Events in the buffer, and events overwritten since the last clear()
+    size_t size() const;
+    uint64_t dropped() const;
+
+    // The buffer as a Chrome trace JSON document
+    void write_json(std::string &out) const;
+
+    // Records the span of its scope. The name may be changed before the
+    // end (e.g. to tell how an expression was evaluated)
+    class span_t
+    {
+        macro_trace_t &m_trace;
+        const char *m_name;
+        const char *m_cat;
+        std::string_view m_detail;
+        clock_t::time_point m_start;
+        bool m_on;
+
+    public:
+        span_t(macro_trace_t &trace, const char *name, const char *cat, std::string_view detail = {})
+            : m_trace(trace), m_name(name), m_cat(cat), m_detail(detail), m_on(trace.enabled())
+        {
+            if (m_on)
+                m_start = clock_t::now();
+        }
+        ~span_t()
+        {
+            if (m_on)
+                m_trace.add(m_name, m_cat, m_start, clock_t::now(), m_detail);
+        }
+        span_t(const span_t &) = delete;
+        span_t &operator=(const span_t &) = delete;
+
+        void set_name(const char *name) { m_name = name; }
+
+        // 'detail' must outlive the span
+        void set_detail(std::string_view detail) { m_detail = detail; }
+    };
+};
+
+// Global trace of the expansion pipeline
+extern macro_trace_t macro_trace;
@@ -0,0 +1,416 @@
+/*
+Native Evaluators: Built-in expressions implemented with the IDA SDK
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <map>
+#include "native_eval.h"
+#include "page_cache.h"
+#include <bytes.hpp>
+#include <segment.hpp>
+#include <dbg.hpp>
+
+//-------------------------------------------------------------------------
+// Built-in evaluators
+//-------------------------------------------------------------------------
+static bool native_here(uint64 &value, bool &has_value)
+{
+    value = get_screen_ea();
+    has_value = true;
+    return true;
+}
+
+static bool native_segm_start(uint64 &value, bool &has_value)
+{
+    segment_t *seg = getseg(get_screen_ea());
+    value = seg == nullptr ? BADADDR : seg->start_ea;
+    has_value = true;
+    return true;
+}
+
+static bool native_segm_end(uint64 &value, bool &has_value)
+{
+    segment_t *seg = getseg(get_screen_ea());
+    value = seg == nullptr ? BADADDR : seg->end_ea;
+    has_value = true;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Database values at the cursor
+template<int SIZE>
+static bool native_idb_value(uint64 &value, bool &has_value)
+{
+    ea_t ea = get_screen_ea();
+    switch (SIZE)
+    {
+        case 1: value = get_wide_byte(ea);  break;
+        case 2: value = get_wide_word(ea);  break;
+        case 4: value = get_wide_dword(ea); break;
+        case 8: value = get_qword(ea);      break;
+    }
+    has_value = true;
+    return true;
+}
+
+// Debugger memory cache: it only lives while a line is evaluated, since
+// the memory can also change between lines (patches...) without notice.
+// The pages are read within the segment of the address: the memory regions
+// of the debuggee are segments while it is suspended
+struct dbg_cache_t
+{
+    page_cache_t pages{
+        [](uint64_t addr, void *buf, size_t size)
+        {
+            return read_dbg_memory(ea_t(addr), buf, size) == ssize_t(size);
+        },
+        [](uint64_t addr, uint64_t &start, uint64_t &end)
+        {
+            segment_t *seg = getseg(ea_t(addr));
+            if (seg == nullptr)
+                return false;
+            start = seg->start_ea;
+            end   = seg->end_ea;
+            return true;
+        } };
+    bool in_line = false;
+};
+static dbg_cache_t dbg_cache;
+
+static bool dbg_read(ea_t ea, void *buf, size_t size)
+{
+    // The memory of a running process changes without notice
+    if (dbg_cache.in_line && get_process_state() == DSTATE_SUSP)
+        return dbg_cache.pages.read(ea, buf, size);
+    return read_dbg_memory(ea, buf, size) == ssize_t(size);
+}
+
+// Debugger memory, in the byte order of the database
+template<int SIZE>
+static bool read_dbg_value(ea_t ea, uint64 &value)
+{
+    uint8 buf[SIZE];
+    if (!dbg_read(ea, buf, SIZE))
+        return false;
+
+    value = 0;
+    const bool be = inf_is_be();
+    for (int i = 0; i < SIZE; ++i)
+        value |= uint64(buf[be ? SIZE - 1 - i : i]) << (8 * i);
+    return true;
+}
+
+template<int SIZE>
+static bool native_dbg_value(uint64 &value, bool &has_value)
+{
+    if (!read_dbg_value<SIZE>(get_screen_ea(), value))
+        return false;
+    has_value = true;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Selection bounds (BADADDR when nothing is selected, like idc)
+static void read_selection(ea_t &start, ea_t &end)
+{
+    if (!read_range_selection(nullptr, &start, &end))
+        start = end = BADADDR;
+}
+
+static bool native_sel_start(uint64 &value, bool &has_value)
+{
+    ea_t start, end;
+    read_selection(start, end);
+    value = start;
+    has_value = true;
+    return true;
+}
+
+static bool native_sel_end(uint64 &value, bool &has_value)
+{
+    ea_t start, end;
+    read_selection(start, end);
+    value = end;
+    has_value = true;
+    return true;
+}
+
+static bool native_sel_size(uint64 &value, bool &has_value)
+{
+    ea_t start, end;
+    read_selection(start, end);
+    value = end - start;
+    has_value = true;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+static bool native_msg_clear(uint64 &, bool &has_value)
+{
+    msg_clear();
+    has_value = false;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Registry
+//-------------------------------------------------------------------------
+using native_registry_t = std::map<std::string, native_func_t, std::less<>>;
+
+static native_registry_t &native_registry()
+{
+    static native_registry_t registry =
+    {
+        { "here",       native_here },
+        { "segm_start", native_segm_start },
+        { "segm_end",   native_segm_end },
+        { "byte",       native_idb_value<1> },
+        { "word",       native_idb_value<2> },
+        { "dword",      native_idb_value<4> },
+        { "qword",      native_idb_value<8> },
+        { "dbg_byte",   native_dbg_value<1> },
+        { "dbg_word",   native_dbg_value<2> },
+        { "dbg_dword",  native_dbg_value<4> },
+        { "dbg_qword",  native_dbg_value<8> },
+        { "sel_start",  native_sel_start },
+        { "sel_end",    native_sel_end },
+        { "sel_size",   native_sel_size },
+        { "msg_clear",  native_msg_clear },
+    };
+    return registry;
+}
+
+void register_native_eval(const char *name, native_func_t func)
+{
+    native_registry()[name] = func;
+}
+
+//-------------------------------------------------------------------------
+// Functions of the expression VM
+//-------------------------------------------------------------------------
+
+// Values that do not fit the VM integers (BADADDR...) are left to Python
+static bool to_expr_int(uint64 value, int64_t &result)
+{
+    if (value > uint64(INT64_MAX))
+        return false;
+    result = int64_t(value);
+    return true;
+}
+
+// Addresses passed by the expression
+static bool to_ea(int64_t arg, ea_t &ea)
+{
+    if (arg < 0 || uint64(arg) >= uint64(BADADDR))
+        return false;
+    ea = ea_t(arg);
+    return true;
+}
+
+static bool expr_here(const int64_t *, int64_t &result)
+{
+    return to_expr_int(get_screen_ea(), result);
+}
+
+static bool expr_segm_start(const int64_t *args, int64_t &result)
+{
+    ea_t ea;
+    if (!to_ea(args[0], ea))
+        return false;
+    segment_t *seg = getseg(ea);
+    return seg != nullptr && to_expr_int(seg->start_ea, result);
+}
+
+static bool expr_segm_end(const int64_t *args, int64_t &result)
+{
+    ea_t ea;
+    if (!to_ea(args[0], ea))
+        return false;
+    segment_t *seg = getseg(ea);
+    return seg != nullptr && to_expr_int(seg->end_ea, result);
+}
+
+template<int SIZE>
+static bool expr_idb_value(const int64_t *args, int64_t &result)
+{
+    ea_t ea;
+    if (!to_ea(args[0], ea))
+        return false;
+    switch (SIZE)
+    {
+        case 1: result = get_wide_byte(ea);  return true;
+        case 2: result = get_wide_word(ea);  return true;
+        case 4: result = get_wide_dword(ea); return true;
+        case 8: return to_expr_int(get_qword(ea), result);
+    }
+    return false;
+}
+
+template<int SIZE>
+static bool expr_dbg_value(const int64_t *args, int64_t &result)
+{
+    ea_t ea;
+    uint64 value;
+    return to_ea(args[0], ea) && read_dbg_value<SIZE>(ea, value) && to_expr_int(value, result);
+}
+
+static bool expr_sel_start(const int64_t *, int64_t &result)
+{
+    ea_t start, end;
+    read_selection(start, end);
+    return to_expr_int(start, result);
+}
+
+static bool expr_sel_end(const int64_t *, int64_t &result)
+{
+    ea_t start, end;
+    read_selection(start, end);
+    return to_expr_int(end, result);
+}
+
+static const expr_func_t IDA_EXPR_FUNCS[] =
+{
+    { "here",                 0, expr_here },
+    { "get_screen_ea",        0, expr_here },
+    { "get_segm_start",       1, expr_segm_start },
+    { "get_segm_end",         1, expr_segm_end },
+    { "get_wide_byte",        1, expr_idb_value<1> },
+    { "get_wide_word",        1, expr_idb_value<2> },
+    { "get_wide_dword",       1, expr_idb_value<4> },
+    { "get_qword",            1, expr_idb_value<8> },
+    { "read_dbg_byte",        1, expr_dbg_value<1> },
+    { "read_dbg_word",        1, expr_dbg_value<2> },
+    { "read_dbg_dword",       1, expr_dbg_value<4> },
+    { "read_dbg_qword",       1, expr_dbg_value<8> },
+    { "read_selection_start", 0, expr_sel_start },
+    { "read_selection_end",   0, expr_sel_end },
+};
+
+const expr_func_t *ida_expr_funcs(size_t &count)
+{
+    count = qnumber(IDA_EXPR_FUNCS);
+    return IDA_EXPR_FUNCS;
+}
+
+//-------------------------------------------------------------------------
+// Expressions
+//-------------------------------------------------------------------------
+static std::string_view trim(std::string_view s)
+{
+    while (!s.empty() && qisspace(s.front()))
+        s.remove_prefix(1);
+    while (!s.empty() && qisspace(s.back()))
+        s.remove_suffix(1);
+    return s;
+}
+
+// Split "native:NAME[:FMT]"
+static bool parse_native_expr(
+    std::string_view expr,
+    native_func_t &func,
+    const char *&fmt,
+    qstring *errbuf)
+{
+    expr.remove_prefix(sizeof(NATIVE_EXPR_PREFIX) - 1);
+    size_t sep = expr.find(':');
+    std::string_view name = trim(expr.substr(0, sep));
+    std::string_view spec = sep == std::string_view::npos ? "hex" : trim(expr.substr(sep + 1));
+
+    auto &registry = native_registry();
+    auto p = registry.find(name);
+    if (p == registry.end())
+    {
+        if (errbuf != nullptr)
+            errbuf->sprnt("unknown native evaluator '%.*s'", int(name.size()), name.data());
+        return false;
+    }
+    func = p->second;
+
+    if (spec == "hex")
+        fmt = "0x%" FMT_64 "x";
+    else if (spec == "x")
+        fmt = "%" FMT_64 "x";
+    else if (spec == "d")
+        fmt = "%" FMT_64 "u";
+    else
+    {
+        if (errbuf != nullptr)
+            errbuf->sprnt("unknown native format '%.*s' (hex, x or d)", int(spec.size()), spec.data());
+        return false;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+bool check_native_expr(std::string_view expr, qstring *errbuf)
+{
+    native_func_t func;
+    const char *fmt;
+    return parse_native_expr(expr, func, fmt, errbuf);
+}
+
+//-------------------------------------------------------------------------
+bool eval_native_expr(std::string_view expr, std::string &value)
+{
+    native_func_t func;
+    const char *fmt;
+    if (!parse_native_expr(expr, func, fmt, nullptr))
+        return false;
+
+    uint64 v = 0;
+    bool has_value = false;
+    if (!func(v, has_value))
+        return false;
+
+    value.clear();
+    if (has_value)
+    {
+        char buf[32];
+        qsnprintf(buf, sizeof(buf), fmt, v);
+        value = buf;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Debugger memory cache
+//-------------------------------------------------------------------------
+
+// Size of the debugger memory read by a native evaluator (0 if none)
+static size_t native_dbg_size(native_func_t func)
+{
+    if (func == native_dbg_value<1>) return 1;
+    if (func == native_dbg_value<2>) return 2;
+    if (func == native_dbg_value<4>) return 4;
+    if (func == native_dbg_value<8>) return 8;
+    return 0;
+}
+
+void dbg_cache_begin_line(const std::vector<std::string_view> &exprs)
+{
+    dbg_cache.pages.clear();
+    dbg_cache.in_line = true;
+    if (get_process_state() != DSTATE_SUSP)
+        return;
+
+    // The native evaluators read at the cursor
+    std::vector<page_cache_t::range_t> ranges;
+    for (auto expr: exprs)
+    {
+        native_func_t func;
+        const char *fmt;
+        if (!is_native_expr(expr) || !parse_native_expr(expr, func, fmt, nullptr))
+            continue;
+        if (size_t size = native_dbg_size(func))
+            ranges.push_back({ get_screen_ea(), size });
+    }
+    if (!ranges.empty())
+        dbg_cache.pages.prefetch(std::move(ranges));
+}
+
+void dbg_cache_end_line()
+{
+    dbg_cache.in_line = false;
+    dbg_cache.pages.clear();
+}
@@ -0,0 +1,55 @@
+/*
+Native Evaluators: Built-in "${native:NAME:FMT}$" expressions
+
+Native expressions are evaluated directly against the IDA SDK: they cost a
+few microseconds and work without IDAPython. NAME selects the evaluator and
+FMT the output format:
+  hex  0x-prefixed hexadecimal (default)
+  x    hexadecimal
+  d    decimal
+*/
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "expr_vm.h"
+#include "idasdk.h"
+
+constexpr char NATIVE_EXPR_PREFIX[] = "native:";
+
+// Native evaluator: returns false if the value is not available.
+// Evaluators that only have side effects leave 'has_value' false
+using native_func_t = bool (*)(uint64 &value, bool &has_value);
+
+// Register a native evaluator (the built-in ones are always registered)
+void register_native_eval(const char *name, native_func_t func);
+
+// Returns true if the expression is a native one
+inline bool is_native_expr(std::string_view expr)
+{
+    return expr.substr(0, sizeof(NATIVE_EXPR_PREFIX) - 1) == NATIVE_EXPR_PREFIX;
+}
+
+// Validate a native expression; false with the error if it is malformed
+bool check_native_expr(std::string_view expr, qstring *errbuf);
+
+// Evaluate a native expression. Returns false if it is malformed or the
+// value is not available
+bool eval_native_expr(std::string_view expr, std::string &value);
+
+// IDA query functions callable from the expressions run by the expression VM
+const expr_func_t *ida_expr_funcs(size_t &count);
+
+// While a line is evaluated and the process is suspended, the debugger
+// memory read by the native evaluators and the expression VM goes through
+// a page cache, emptied at the start and at the end of the line. Python
+// code (idc.read_dbg_byte...) reads the debugger directly.
+
+// Start evaluating the expressions of a line: the debugger memory their
+// native evaluators read (at the cursor) is prefetched in one read. The
+// addresses read by the expression VM depend on the values it computes:
+// their pages are loaded on first use
+void dbg_cache_begin_line(const std::vector<std::string_view> &exprs);
+void dbg_cache_end_line();
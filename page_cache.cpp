@@ -0,0 +1,204 @@
+/*
+Page Cache: Coalesced reads of a slow memory
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <cstring>
+#include "page_cache.h"
+
+//-------------------------------------------------------------------------
+page_cache_t::page_t *page_cache_t::find_page(uint64_t index)
+{
+    for (auto &page: m_pages)
+    {
+        if (page.index == index)
+        {
+            page.last_use = ++m_clock;
+            return &page;
+        }
+    }
+    return nullptr;
+}
+
+//-------------------------------------------------------------------------
+// Recycle the least recently used page once the cache is full
+page_cache_t::page_t &page_cache_t::add_page(uint64_t index)
+{
+    page_t *page;
+    if (m_pages.size() < MAX_PAGES)
+    {
+        m_pages.push_back({ 0, 0, 0, 0, std::make_unique<uint8_t[]>(PAGE_SIZE) });
+        page = &m_pages.back();
+    }
+    else
+    {
+        page = &*std::min_element(m_pages.begin(), m_pages.end(), [](auto &a, auto &b)
+        {
+            return a.last_use < b.last_use;
+        });
+    }
+    page->index    = index;
+    page->lo       = 0;
+    page->hi       = 0;
+    page->last_use = ++m_clock;
+    return *page;
+}
+
+//-------------------------------------------------------------------------
+bool page_cache_t::region_of(uint64_t addr, uint64_t &start, uint64_t &end) const
+{
+    if (m_region == nullptr)
+    {
+        start = 0;
+        end   = UINT64_MAX;
+        return true;
+    }
+    return m_region(addr, start, end) && start <= addr && addr < end;
+}
+
+//-------------------------------------------------------------------------
+// The addresses are compared by their last byte: the end of the last page
+// of the address space does not fit in 64 bits
+void page_cache_t::load_page(page_t &page, uint64_t start, uint64_t end)
+{
+    const uint64_t page_addr = page.index * PAGE_SIZE;
+    const uint64_t from = std::max(page_addr, start);
+    const uint64_t to   = std::min(page_addr + (PAGE_SIZE - 1), end - 1);
+    if (from > to)
+        return;
+
+    ++m_reads;
+    if (m_read(from, page.data.get() + (from - page_addr), size_t(to - from + 1)))
+    {
+        page.lo = size_t(from - page_addr);
+        page.hi = size_t(to - page_addr + 1);
+    }
+}
+
+//-------------------------------------------------------------------------
+void page_cache_t::load_pages(uint64_t first, uint64_t last, uint64_t start, uint64_t end)
+{
+    // Runs of missing pages
+    for (uint64_t index = first; index <= last; )
+    {
+        if (find_page(index) != nullptr)
+        {
+            ++index;
+            continue;
+        }
+
+        uint64_t run_end = index + 1;
+        while (run_end <= last && run_end - index < MAX_PAGES && find_page(run_end) == nullptr)
+            ++run_end;
+
+        // One read for the bytes of the run in the region
+        const size_t count = size_t(run_end - index);
+        const uint64_t run_addr = index * PAGE_SIZE;
+        const uint64_t from = std::max(run_addr, start);
+        const uint64_t to   = std::min(run_addr + (count * PAGE_SIZE - 1), end - 1);
+        std::vector<uint8_t> buf;
+        bool ok = false;
+        if (from <= to)
+        {
+            buf.resize(size_t(to - from + 1));
+            ++m_reads;
+            ok = m_read(from, buf.data(), buf.size());
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto &page = add_page(index + i);
+            const uint64_t page_addr = run_addr + i * PAGE_SIZE;
+            const uint64_t page_from = std::max(page_addr, from);
+            const uint64_t page_to   = std::min(page_addr + (PAGE_SIZE - 1), to);
+            if (from > to || page_from > page_to)
+                continue;
+
+            if (ok)
+            {
+                memcpy(page.data.get() + (page_from - page_addr), buf.data() + (page_from - from), size_t(page_to - page_from + 1));
+                page.lo = size_t(page_from - page_addr);
+                page.hi = size_t(page_to - page_addr + 1);
+            }
+            else if (count > 1)
+            {
+                // Page by page if some of the run is unreadable
+                load_page(page, start, end);
+            }
+        }
+        index = run_end;
+    }
+}
+
+//-------------------------------------------------------------------------
+// The spans are clamped to the region of their address, and only merged
+// within a region
+void page_cache_t::prefetch(std::vector<range_t> ranges)
+{
+    struct span_t
+    {
+        uint64_t first, last;   // Pages
+        uint64_t start, end;    // Region
+    };
+    std::vector<span_t> spans;
+    for (auto &r: ranges)
+    {
+        uint64_t start, end;
+        if (r.size == 0 || r.addr + r.size < r.addr || !region_of(r.addr, start, end))
+            continue;
+        const uint64_t last_byte = std::min(r.addr + (r.size - 1), end - 1);
+        spans.push_back({ r.addr / PAGE_SIZE, last_byte / PAGE_SIZE, start, end });
+    }
+    std::sort(spans.begin(), spans.end(), [](auto &a, auto &b) { return a.first < b.first; });
+
+    size_t pages = 0;
+    for (size_t i = 0; i < spans.size(); )
+    {
+        auto span = spans[i];
+        for (++i; i < spans.size() && spans[i].start == span.start && spans[i].first <= span.last + 1 + MAX_GAP_PAGES; ++i)
+            span.last = std::max(span.last, spans[i].last);
+
+        // Do not evict what this prefetch loaded
+        pages += size_t(span.last - span.first + 1);
+        if (pages > MAX_PAGES)
+            break;
+        load_pages(span.first, span.last, span.start, span.end);
+    }
+}
+
+//-------------------------------------------------------------------------
+// Whatever the pages cannot serve is read exactly as requested
+bool page_cache_t::read(uint64_t addr, void *buf, size_t size)
+{
+    if (size == 0)
+        return true;
+
+    // Too large, wrapping around or in no region: not worth caching
+    uint64_t start, end;
+    if (addr + size < addr || size > (MAX_PAGES / 2) * PAGE_SIZE || !region_of(addr, start, end))
+    {
+        ++m_reads;
+        return m_read(addr, buf, size);
+    }
+    const uint64_t first = addr / PAGE_SIZE;
+    const uint64_t last  = (addr + size - 1) / PAGE_SIZE;
+    load_pages(first, last, start, end);
+
+    auto out = static_cast<uint8_t *>(buf);
+    for (uint64_t index = first; index <= last; ++index)
+    {
+        const page_t *page = find_page(index);
+        const uint64_t page_addr = index * PAGE_SIZE;
+        const uint64_t from = std::max(addr, page_addr);
+        const uint64_t to   = std::min(addr + (size - 1), page_addr + (PAGE_SIZE - 1));
+        if (page == nullptr || from - page_addr < page->lo || to - page_addr >= page->hi)
+        {
+            ++m_reads;
+            return m_read(addr, buf, size);
+        }
+        memcpy(out + (from - addr), page->data.get() + (from - page_addr), size_t(to - from + 1));
+    }
+    return true;
+}
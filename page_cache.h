@@ -0,0 +1,97 @@
+/*
+Page Cache: Coalesced reads of a slow memory (e.g. a remote debuggee)
+
+Memory is read by pages through a user supplied read function. The ranges a
+line of macros is going to read can be prefetched together: they are
+coalesced into as few reads as possible (neighbouring pages are read in one
+go). Later reads of the cached pages cost a copy.
+
+The pages are only read within the memory region of the requested address,
+as given by an optional region function: memory outside of the regions is
+never read unless asked for (it may be device memory, or not be mapped at
+all). A read that the cached pages cannot serve, e.g. near the end of a
+region whose size is not a multiple of the page size, falls back to reading
+exactly the requested bytes.
+
+The cache does not know when the memory changes: its owner clears it.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+//-------------------------------------------------------------------------
+class page_cache_t
+{
+public:
+    // Read 'size' bytes at 'addr'. Returns false unless all were read
+    using read_func_t = std::function<bool(uint64_t addr, void *buf, size_t size)>;
+
+    // Bounds [start, end) of the memory region containing 'addr'. Returns
+    // false if the address is in no known region
+    using region_func_t = std::function<bool(uint64_t addr, uint64_t &start, uint64_t &end)>;
+
+    static constexpr size_t PAGE_SIZE = 1024;
+    static constexpr size_t MAX_PAGES = 64;
+
+    // Pages this far apart are still read together
+    static constexpr size_t MAX_GAP_PAGES = 1;
+
+    struct range_t
+    {
+        uint64_t addr;
+        size_t   size;
+    };
+
+private:
+    struct page_t
+    {
+        uint64_t index;         // Address / PAGE_SIZE
+        size_t   lo, hi;        // Offsets of the bytes read in the page (none if lo == hi)
+        uint64_t last_use;
+        std::unique_ptr<uint8_t[]> data;
+    };
+    std::vector<page_t> m_pages;
+
+    read_func_t   m_read;
+    region_func_t m_region;
+    uint64_t m_clock = 0;
+    size_t   m_reads = 0;
+
+    page_t *find_page(uint64_t index);
+    page_t &add_page(uint64_t index);
+
+    // Region of 'addr'; the whole address space without a region function
+    bool region_of(uint64_t addr, uint64_t &start, uint64_t &end) const;
+
+    // Load the pages [first, last] with as few reads as possible, only
+    // reading the bytes in [start, end)
+    void load_pages(uint64_t first, uint64_t last, uint64_t start, uint64_t end);
+
+    // Read the bytes of 'page' in [start, end)
+    void load_page(page_t &page, uint64_t start, uint64_t end);
+
+public:
+    page_cache_t(read_func_t read, region_func_t region = nullptr)
+        : m_read(std::move(read)), m_region(std::move(region))
+    {
+    }
+
+    // Load the pages covering the ranges that are not cached yet
+    void prefetch(std::vector<range_t> ranges);
+
+    // Read through the cache. Returns false if some byte is not readable
+    bool read(uint64_t addr, void *buf, size_t size);
+
+    // Forget all the pages
+    void clear() { m_pages.clear(); }
+
+    // Number of calls made to the read function
+    size_t reads() const { return m_reads; }
+};
@@ -11,9 +11,14 @@ All expressions should resolve to a string (i.e. have a __str__ magic method).
 */
 
 #include "idasdk.h"
+#include <functional>
+#include <memory>
+#include <vector>
 #include <idacpp/callbacks/callbacks.hpp>
 #include "cli_utils.h"
 #include "macro_editor.h"
+#include "macro_eval.h"
+#include "macro_trace.h"
 
 #ifdef _WIN32
     #include <windows.h>
@@ -23,17 +28,93 @@ All expressions should resolve to a string (i.e. have a __str__ magic method).
 
 using namespace idacpp::callbacks;
 
+//-------------------------------------------------------------------------
+// Action of the plugin, in the Edit/Plugins menu and in the popup menu of
+// the macro editor
+struct plugin_action_t: public action_handler_t
+{
+    const char *name;
+    std::function<void()> func;
+
+    plugin_action_t(const char *name, std::function<void()> func)
+        : name(name), func(std::move(func))
+    {
+    }
+
+    int idaapi activate(action_activation_ctx_t *) override
+    {
+        func();
+        return 1;
+    }
+
+    action_state_t idaapi update(action_update_ctx_t *) override
+    {
+        return AST_ENABLE_ALWAYS;
+    }
+};
+
 //-------------------------------------------------------------------------
 class climacros_plg_t : public plugmod_t, public event_listener_t
 {
     macro_editor_t macro_editor;
+    macro_stats_view_t macro_stats_view;
+
+    std::vector<std::unique_ptr<plugin_action_t>> m_actions;
+
+    // Register an action. 'in_menu' also puts it in the Edit/Plugins menu
+    void add_action(
+        const char *name,
+        const char *label,
+        bool in_menu,
+        std::function<void()> func)
+    {
+        auto action = std::make_unique<plugin_action_t>(name, std::move(func));
+        if (!register_action(ACTION_DESC_LITERAL_PLUGMOD(name, label, action.get(), this, nullptr, nullptr, -1)))
+            return;
+        if (in_menu)
+            attach_action_to_menu("Edit/Plugins/", name, SETMENU_APP);
+        m_actions.push_back(std::move(action));
+    }
+
+    void register_actions()
+    {
+        add_action("climacros:budget", "CLI macros time budgets...", true, []()
+        {
+            macro_eval.edit_budget();
+        });
+        add_action("climacros:stats", "CLI macros statistics", true, [this]()
+        {
+            macro_stats_view.choose();
+        });
+        add_action("climacros:trace", "Start tracing the CLI macros", true, [this]()
+        {
+            toggle_trace();
+        });
+        add_action("climacros:filter", "Filter...", false, [this]()
+        {
+            if (macro_editor.ask_filter())
+                refresh_chooser(macro_editor.title);
+        });
+        add_action("climacros:import", "Import a CLI macro pack...", true, [this]()
+        {
+            macro_editor.import_pack();
+            refresh_chooser(macro_editor.title);
+        });
+        add_action("climacros:export", "Export the CLI macros to a pack...", true, [this]()
+        {
+            macro_editor.export_pack();
+        });
+    }
 
 public:
     climacros_plg_t() : plugmod_t()
     {
         msg("IDA Command Line Interface macros initialized\n");
 
-        macro_editor.build_macros_list();
+        macro_editor.start();
+        macro_eval.load_budget();
+        macro_eval.hook();
+        register_actions();
         hook_event_listener(HT_UI, this, HKCB_GLOBAL);
 
         // Hook pre-existing CLIs (like Python) that were loaded before our plugin
@@ -83,12 +164,48 @@ public:
         }
     }
 
-    bool idaapi run(size_t) override
+    bool idaapi run(size_t arg) override
     {
-        macro_editor.choose();
+        // 1: time the expression evaluation paths. Everything else besides
+        // the macro editor goes through the actions
+        if (arg == 1)
+            macro_eval.benchmark();
+        else
+            macro_editor.choose();
         return true;
     }
 
+    // Start tracing the expansions, or stop and save the trace
+    void toggle_trace()
+    {
+        if (!macro_trace.enabled())
+        {
+            macro_trace.enable(true);
+            update_action_label("climacros:trace", "Stop tracing the CLI macros...");
+            msg("climacros: tracing started, stop it to save the trace\n");
+            return;
+        }
+
+        macro_trace.enable(false);
+        update_action_label("climacros:trace", "Start tracing the CLI macros");
+        msg("climacros: tracing stopped (%" FMT_Z " events, %" FMT_64 "u overwritten)\n",
+            macro_trace.size(), macro_trace.dropped());
+
+        const char *path = ask_file(true, "climacros-trace.json", "FILTER JSON files|*.json\nSave the trace as");
+        if (path == nullptr)
+            return;
+
+        std::string json;
+        macro_trace.write_json(json);
+        FILE *fp = qfopen(path, "wb");
+        if (fp == nullptr || qfwrite(fp, json.data(), json.size()) != ssize_t(json.size()))
+            warning("Could not write the trace to '%s'", path);
+        else
+            msg("climacros: trace saved to '%s' (open it with chrome://tracing or https://ui.perfetto.dev)\n", path);
+        if (fp != nullptr)
+            qfclose(fp);
+    }
+
     ssize_t idaapi on_event(ssize_t code, va_list va) override
     {
         switch (code)
@@ -120,6 +237,21 @@ public:
                     request_install_cli(new_cli, false);
                     msg("climacros: unhooked CLI '%s'\n", cli->sname);
                 }
+                break;
+            }
+
+            // The actions go in the popup menu of the macro editor
+            case ui_populating_widget_popup:
+            {
+                auto widget = va_arg(va, TWidget *);
+                auto popup  = va_arg(va, TPopupMenu *);
+                qstring title;
+                if (get_widget_title(&title, widget) && title == macro_editor.title)
+                {
+                    for (auto &action: m_actions)
+                        attach_action_to_popup(widget, popup, action->name);
+                }
+                break;
             }
         }
         return 0;
@@ -127,7 +259,13 @@ public:
 
     ~climacros_plg_t()
     {
+        macro_editor.flush();
+        macro_editor.save_cache();
         unhook_event_listener(HT_UI, this);
+        for (auto &action: m_actions)
+            unregister_action(action->name);
+        macro_eval.unhook();
+        macro_replacer.wait_update();
     }
 };
 
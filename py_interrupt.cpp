@@ -0,0 +1,91 @@
+/*
+Python Interrupt: Interruption of the Python code run by the main thread
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <atomic>
+#include "py_interrupt.h"
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <dlfcn.h>
+#endif
+
+// Python C API (stable ABI)
+using Py_AddPendingCall_t = int (*)(int (*)(void *), void *);
+using PyErr_SetNone_t     = void (*)(void *);
+
+static struct
+{
+    Py_AddPendingCall_t add_pending_call;
+    PyErr_SetNone_t     set_none;
+    void              **keyboard_interrupt;
+    std::atomic<bool>   requested;      // Interrupt requested and not cancelled
+    std::atomic<bool>   queued;         // A pending call is queued
+    bool                ready;
+} g_py;
+
+//-------------------------------------------------------------------------
+static void *find_python_symbol(const char *name)
+{
+#ifdef _WIN32
+    HMODULE module = GetModuleHandleA("python3.dll");
+    return module == nullptr ? nullptr : (void *)GetProcAddress(module, name);
+#else
+    return dlsym(RTLD_DEFAULT, name);
+#endif
+}
+
+//-------------------------------------------------------------------------
+bool py_interrupt_init()
+{
+    if (g_py.ready)
+        return true;
+
+    g_py.add_pending_call   = (Py_AddPendingCall_t)find_python_symbol("Py_AddPendingCall");
+    g_py.set_none           = (PyErr_SetNone_t)find_python_symbol("PyErr_SetNone");
+    g_py.keyboard_interrupt = (void **)find_python_symbol("PyExc_KeyboardInterrupt");
+    if (g_py.add_pending_call == nullptr
+        || g_py.set_none == nullptr
+        || g_py.keyboard_interrupt == nullptr)
+    {
+        return false;
+    }
+
+    g_py.ready = true;
+    return true;
+}
+
+//-------------------------------------------------------------------------
+// Pending call, run by the main thread with the GIL held. Failing with an
+// exception set raises it in the running Python code
+static int raise_interrupt(void *)
+{
+    g_py.queued = false;
+    if (!g_py.requested.exchange(false))
+        return 0;
+
+    g_py.set_none(*g_py.keyboard_interrupt);
+    return -1;
+}
+
+//-------------------------------------------------------------------------
+void py_interrupt_main()
+{
+    if (!g_py.ready)
+        return;
+
+    // A queued call delivers the latest request
+    g_py.requested = true;
+    if (!g_py.queued.exchange(true) && g_py.add_pending_call(raise_interrupt, nullptr) != 0)
+        g_py.queued = false;
+}
+
+//-------------------------------------------------------------------------
+void py_interrupt_cancel()
+{
+    // A call already queued finds nothing to raise
+    g_py.requested = false;
+}
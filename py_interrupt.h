@@ -0,0 +1,21 @@
+/*
+Python Interrupt: Interruption of the Python code run by the main thread
+
+KeyboardInterrupt is raised in the main thread by a pending call of the
+Python runtime IDAPython loaded (Py_AddPendingCall). Scheduling it needs
+neither the GIL nor any lock, so the thread requesting the interrupt never
+waits for the main thread. The pending call runs, and raises the exception,
+when the interpreter gets back to bytecode, so a long native call (e.g. a
+blocking read) is only interrupted once it returns.
+*/
+
+#pragma once
+
+// Find the Python runtime. Returns false if Python is not loaded
+bool py_interrupt_init();
+
+// Raise KeyboardInterrupt in the main thread; called from another thread
+void py_interrupt_main();
+
+// Drop an interrupt that was not delivered yet; called from the main thread
+void py_interrupt_cancel();
@@ -0,0 +1,129 @@
+/*
+Snapshot: RCU-style publication of immutable objects
+
+Readers access the current snapshot without taking any lock: entering and
+leaving a read section costs two atomic increments. Writers publish new
+snapshots; the replaced ones are freed once no reader can still use them
+(epoch scheme with two reader counters). Writers never wait for readers:
+a replaced snapshot still in use is freed by a later publish(), or when
+the snapshot pointer is destroyed.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//-------------------------------------------------------------------------
+template<class T>
+class snapshot_ptr_t
+{
+    std::atomic<const T *> m_current{ nullptr };
+    std::atomic<uint32_t>  m_epoch{ 0 };
+    std::atomic<int32_t>   m_readers[2] = {};
+
+    // Serializes the writers and the reclamation of the retired snapshots
+    std::mutex m_write_lock;
+
+    // Retired snapshots, with the number of grace period steps started
+    // when they were retired
+    struct retired_t
+    {
+        const T *ptr;
+        uint64_t steps;
+    };
+    std::vector<retired_t> m_retired;
+
+    // Grace period steps: each flips the epoch, then waits for the readers
+    // of the previous one to leave. A snapshot is freed once two steps
+    // started after it was retired are done. The steps are advanced
+    // without waiting: a step whose readers are still there is completed
+    // by a later call
+    uint64_t m_steps_started = 0;
+    uint64_t m_steps_done    = 0;
+    uint32_t m_step_epoch    = 0;   // Epoch flipped by the step in progress
+
+    // Advance the grace period as far as the readers allow and free the
+    // snapshots that no reader can still use
+    void reclaim_locked()
+    {
+        while (!m_retired.empty())
+        {
+            if (m_steps_started != m_steps_done)
+            {
+                if (m_readers[m_step_epoch & 1].load() != 0)
+                    break;
+                ++m_steps_done;
+            }
+
+            size_t kept = 0;
+            for (auto &r: m_retired)
+            {
+                if (m_steps_done >= r.steps + 2)
+                    delete r.ptr;
+                else
+                    m_retired[kept++] = r;
+            }
+            m_retired.resize(kept);
+            if (kept == 0)
+                break;
+
+            m_step_epoch = m_epoch.fetch_add(1);
+            ++m_steps_started;
+        }
+    }
+
+public:
+    // Read section: the snapshot stays valid for the lifetime of the reader
+    class reader_t
+    {
+        snapshot_ptr_t &m_owner;
+        uint32_t m_slot;
+        const T *m_ptr;
+
+    public:
+        reader_t(snapshot_ptr_t &owner) : m_owner(owner)
+        {
+            m_slot = owner.m_epoch.load() & 1;
+            owner.m_readers[m_slot].fetch_add(1);
+            m_ptr = owner.m_current.load();
+        }
+
+        ~reader_t()
+        {
+            m_owner.m_readers[m_slot].fetch_sub(1);
+        }
+
+        reader_t(const reader_t &) = delete;
+        reader_t &operator=(const reader_t &) = delete;
+
+        const T *get() const { return m_ptr; }
+        const T *operator->() const { return m_ptr; }
+        const T &operator*() const { return *m_ptr; }
+    };
+
+    snapshot_ptr_t() = default;
+    snapshot_ptr_t(const snapshot_ptr_t &) = delete;
+    snapshot_ptr_t &operator=(const snapshot_ptr_t &) = delete;
+
+    ~snapshot_ptr_t()
+    {
+        delete m_current.load();
+        for (auto &r: m_retired)
+            delete r.ptr;
+    }
+
+    // Replace the current snapshot. The old one is freed at once if no
+    // reader is using it, or else by a later publish()
+    void publish(std::unique_ptr<const T> snapshot)
+    {
+        std::lock_guard<std::mutex> lock(m_write_lock);
+        const T *old = m_current.exchange(snapshot.release());
+        if (old != nullptr)
+            m_retired.push_back({ old, m_steps_started });
+        reclaim_locked();
+    }
+};
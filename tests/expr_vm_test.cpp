@@ -0,0 +1,341 @@
+/*
+Expression VM tests: results of the VM against Python
+
+The VM must either give the result Python gives or fail (the caller then
+falls back to Python). Known expressions are checked against results taken
+from Python; when the build found a Python interpreter, randomly generated
+expressions are also evaluated by it and compared.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include "expr_vm.h"
+#include "test.h"
+
+#ifdef _WIN32
+    #define popen  _popen
+    #define pclose _pclose
+#endif
+
+//-------------------------------------------------------------------------
+// Stub host functions (their Python twins are in PYTHON_PRELUDE)
+static bool stub_here(const int64_t *, int64_t &result)
+{
+    result = 0x401000;
+    return true;
+}
+
+static bool stub_read(const int64_t *args, int64_t &result)
+{
+    result = (args[0] ^ 0x5a5a) & 0xFFFFFFFF;
+    return true;
+}
+
+static bool stub_missing(const int64_t *, int64_t &)
+{
+    return false;
+}
+
+static const expr_func_t STUB_FUNCS[] =
+{
+    { "here",           0, stub_here },
+    { "get_wide_dword", 1, stub_read },
+    { "missing",        0, stub_missing },
+};
+
+// Result of the VM: its value, or "!" if it did not compile or run
+static std::string vm_eval(std::string_view expr, bool *compiled = nullptr)
+{
+    expr_program_t prog;
+    bool ok = prog.compile(expr, STUB_FUNCS, std::size(STUB_FUNCS));
+    if (compiled != nullptr)
+        *compiled = ok;
+    std::string result;
+    if (!ok || !prog.run(result))
+        return "!";
+    return result;
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(expr_vm, known_results)
+{
+    static const struct { const char *expr, *result; } CASES[] =
+    {
+        { "'0x%x' % here()",                        "0x401000" },
+        { "'0x%x' % idc.here()",                    "0x401000" },
+        { "'%X' % idc.get_wide_dword(here())",      "404A5A" },
+        { "hex(255)",                               "0xff" },
+        { "hex(-255)",                              "-0xff" },
+        { "str(-7 // 2) + str(-7 % 3) + str(7 % -3)", "-42-2" },
+        { "str(~5) + str(-(-3))",                   "-63" },
+        { "'%5d|%-5d|%05d|%.3d' % (42, 42, 42, 7)", "   42|42   |00042|007" },
+        { "'%#x %#X' % (255, 255)",                 "0xff 0XFF" },
+        { "'%+d|% d|%+d' % (5, 5, -5)",             "+5| 5|-5" },
+        { "'%-6.3d|%.2s|%5.1s' % (7, 'abc', 'xy')", "007   |ab|    x" },
+        { "'%s-%s' % ('a', 1)",                     "a-1" },
+        { "'%d%%' % 50",                            "50%" },
+        { "'%s' % (1 < 2)",                         "True" },
+        { "str(1 == 2)",                            "False" },
+        { "str(not 0)",                             "True" },
+        { "str(0 or 5) + str(3 and 0)",             "50" },
+        { "str(len('abc'))",                        "3" },
+        { "str(min(3, 1, 2)) + str(max(3, 1, 2))",  "13" },
+        { "str(abs(-5))",                           "5" },
+        { "str(1 << 62)",                           "4611686018427387904" },
+        { "'a' + 'b'",                              "ab" },
+
+        // Python gives what 64-bit integers cannot, or raises
+        { "str(1 << 63)",                           "!" },
+        { "str(9223372036854775807 + 1)",           "!" },
+        { "str(1 // 0)",                            "!" },
+        { "str(1 % 0)",                             "!" },
+        { "str(1 << -1)",                           "!" },
+        { "'%x' % -1",                              "!" },
+        { "'%d %d' % (1,)",                         "!" },
+        { "'%d' % (1, 2)",                          "!" },
+        { "'%d' % 'a'",                             "!" },
+        { "'0x%x' % missing()",                     "!" },
+
+        // Formats where C and Python differ
+        { "'%+x' % 255",                            "!" },
+        { "'% X' % 255",                            "!" },
+        { "'%+o' % 8",                              "!" },
+        { "'%05.3d' % 7",                           "!" },
+        { "'%.0d' % 0",                             "!" },
+        { "'%#o' % 8",                              "!" },
+    };
+    for (auto &c: CASES)
+    {
+        auto result = vm_eval(c.expr);
+        if (result != c.result)
+            test_fail(__FILE__, __LINE__, std::string(c.expr) + ": " + test_str(result) + " != " + test_str(c.result));
+    }
+}
+
+TEST_CASE(expr_vm, outside_subset)
+{
+    for (const char *expr: { "x", "1 + 2", "foo.bar()", "here", "1 +", "[1][0]", "'a' 'b'", "unknown()", "here(1)" })
+    {
+        bool compiled = true;
+        vm_eval(expr, &compiled);
+        if (compiled)
+            test_fail(__FILE__, __LINE__, std::string(expr) + " compiled");
+    }
+}
+
+//-------------------------------------------------------------------------
+// Random expressions
+//-------------------------------------------------------------------------
+class expr_gen_t
+{
+    std::mt19937 &m_rng;
+    const char   *m_flags;          // Of the conversion specifiers
+    bool          m_precision;      // Do the specifiers have one?
+
+    size_t pick(size_t n) { return m_rng() % n; }
+
+public:
+    expr_gen_t(std::mt19937 &rng, const char *flags, bool precision)
+        : m_rng(rng), m_flags(flags), m_precision(precision)
+    {
+    }
+
+    std::string int_expr(int depth)
+    {
+        static const char *const ATOMS[] =
+        {
+            "0", "1", "2", "3", "7", "16", "63", "64", "255", "4096", "0x7fffffff", "0xffffffff",
+            "9223372036854775807", "0x401000", "here()", "idc.here()", "get_wide_dword(0x10)", "True", "False",
+        };
+        static const char *const BINOPS[] = { "+", "-", "*", "//", "%", "<<", ">>", "&", "|", "^", "<", "==", "!=", ">=", "and", "or" };
+        if (depth == 0 || pick(3) == 0)
+            return ATOMS[pick(std::size(ATOMS))];
+        switch (pick(8))
+        {
+            case 0:  return "-" + int_expr(depth - 1);
+            case 1:  return "~" + int_expr(depth - 1);
+            case 2:  return "abs(" + int_expr(depth - 1) + ")";
+            case 3:  return (pick(2) ? "min(" : "max(") + int_expr(depth - 1) + ", " + int_expr(depth - 1) + ")";
+            case 4:  return "len(" + str_expr(depth - 1) + ")";
+            case 5:  return "not " + int_expr(depth - 1);
+            default:
+            {
+                // Shift counts stay small: Python would build huge integers
+                auto op = BINOPS[pick(std::size(BINOPS))];
+                auto rhs = op[0] == '<' && op[1] == '<' ? std::to_string(int(pick(70)) - 2) : int_expr(depth - 1);
+                return "(" + int_expr(depth - 1) + " " + op + " " + rhs + ")";
+            }
+        }
+    }
+
+    std::string format_spec()
+    {
+        static const char CONVS[] = "dixXous";
+        std::string spec = "%";
+        for (size_t i = 0, n = pick(3); i < n; ++i)
+            spec += m_flags[pick(strlen(m_flags))];
+        if (pick(2))
+            spec += std::to_string(pick(12));
+        if (m_precision && pick(3) == 0)
+            spec += "." + std::to_string(pick(6));
+        spec += CONVS[pick(std::size(CONVS) - 1)];
+        return spec;
+    }
+
+    std::string str_expr(int depth)
+    {
+        static const char *const LITERALS[] = { "''", "'abc'", "\"x y\"", "'%'" };
+        switch (depth == 0 ? pick(2) : pick(6))
+        {
+            case 0:  return LITERALS[pick(std::size(LITERALS))];
+            case 1:  return "hex(" + int_expr(depth) + ")";
+            case 2:  return "str(" + int_expr(depth - 1) + ")";
+            case 3:  return str_expr(depth - 1) + " + " + str_expr(depth - 1);
+            default:
+            {
+                size_t n = 1 + pick(3);
+                std::string fmt, args;
+                for (size_t i = 0; i < n; ++i)
+                {
+                    fmt += (i != 0 ? "|" : "") + format_spec();
+                    args += (i != 0 ? ", " : "") + int_expr(depth - 1);
+                }
+                return "'" + fmt + "' % (" + args + (n == 1 ? ",)" : ")");
+            }
+        }
+    }
+};
+
+//-------------------------------------------------------------------------
+// Python cross-check
+//-------------------------------------------------------------------------
+#ifdef CLIMACROS_TEST_PYTHON
+
+static const char PYTHON_PRELUDE[] = R"(
+import sys, types
+
+def here():
+    return 0x401000
+
+def get_wide_dword(ea):
+    return (ea ^ 0x5a5a) & 0xFFFFFFFF
+
+def missing():
+    raise RuntimeError()
+
+idc = types.SimpleNamespace(here=here, get_wide_dword=get_wide_dword, missing=missing)
+env = dict(here=here, get_wide_dword=get_wide_dword, missing=missing, idc=idc)
+for line in open(sys.argv[1]):
+    try:
+        r = eval(line.rstrip('\n'), env)
+        print('=' + r.encode('utf-8').hex() if isinstance(r, str) else '!')
+    except Exception:
+        print('!')
+)";
+
+static std::string unhex(std::string_view s)
+{
+    std::string out;
+    for (size_t i = 0; i + 1 < s.size(); i += 2)
+        out += char(std::stoi(std::string(s.substr(i, 2)), nullptr, 16));
+    return out;
+}
+
+// Results of Python for 'exprs' ("!" when it raised)
+static bool python_eval(const std::vector<std::string> &exprs, std::vector<std::string> &results)
+{
+    const std::string script = test_dir() + "/vm_check.py";
+    const std::string input  = test_dir() + "/vm_exprs.txt";
+    std::ofstream(script) << PYTHON_PRELUDE;
+    {
+        std::ofstream f(input);
+        for (auto &e: exprs)
+            f << e << '\n';
+    }
+
+    std::string cmd = "\"" CLIMACROS_TEST_PYTHON "\" \"" + script + "\" \"" + input + "\"";
+    FILE *fp = popen(cmd.c_str(), "r");
+    if (fp == nullptr)
+        return false;
+    results.clear();
+    std::string line;
+    for (int ch; (ch = fgetc(fp)) != EOF; )
+    {
+        if (ch == '\r')
+            continue;
+        if (ch != '\n')
+        {
+            line += char(ch);
+            continue;
+        }
+        results.push_back(line[0] == '=' ? unhex(std::string_view(line).substr(1)) : "!");
+        line.clear();
+    }
+    return pclose(fp) == 0 && results.size() == exprs.size();
+}
+
+// Compare the VM with Python on random expressions (see expr_gen_t)
+static void check_against_python(uint32_t seed, const char *flags, bool precision, size_t count)
+{
+    std::mt19937 rng(seed);
+    expr_gen_t gen(rng, flags, precision);
+    std::vector<std::string> exprs;
+    for (size_t i = 0; i < count; ++i)
+        exprs.push_back(gen.str_expr(3));
+
+    std::vector<std::string> expected;
+    if (!python_eval(exprs, expected))
+    {
+        test_fail(__FILE__, __LINE__, "cannot run " CLIMACROS_TEST_PYTHON);
+        return;
+    }
+
+    size_t ran = 0, mismatches = 0;
+    for (size_t i = 0; i < exprs.size(); ++i)
+    {
+        auto result = vm_eval(exprs[i]);
+        if (result == "!")
+            continue;
+        ++ran;
+        if (result != expected[i] && ++mismatches <= 10)
+            test_fail(__FILE__, __LINE__, exprs[i] + ": VM " + test_str(result) + ", Python " + test_str(expected[i]));
+    }
+    test_note("%zu of %zu expressions run by the VM, %zu mismatches", ran, exprs.size(), mismatches);
+
+    // Most of the generated expressions must be in the subset
+    CHECK(ran > exprs.size() / 3);
+}
+
+TEST_CASE(expr_vm, python_expressions)
+{
+    check_against_python(4, "-#0", false, 3000);
+}
+
+TEST_CASE(expr_vm, python_format_flags)
+{
+    // All the flags, widths and precisions of the conversion specifiers
+    check_against_python(6, "-+ #0", true, 3000);
+}
+
+TEST_CASE(expr_vm, python_known_results)
+{
+    // The expected results of known_results are what Python gives
+    std::vector<std::string> exprs =
+    {
+        "'%5d|%-5d|%05d|%.3d' % (42, 42, 42, 7)",
+        "'%+d|% d|%+d' % (5, 5, -5)",
+        "'%-6.3d|%.2s|%5.1s' % (7, 'abc', 'xy')",
+        "hex(-255)",
+        "str(-7 // 2) + str(-7 % 3) + str(7 % -3)",
+    };
+    std::vector<std::string> results;
+    CHECK(python_eval(exprs, results));
+    for (size_t i = 0; i < exprs.size() && i < results.size(); ++i)
+        CHECK_EQ(vm_eval(exprs[i]), results[i]);
+}
+
+#endif // CLIMACROS_TEST_PYTHON
@@ -0,0 +1,236 @@
+/*
+Matcher tests: leftmost-longest matches, incremental updates, cache
+
+The matches are compared against a brute-force search over the live
+patterns, after build() and after series of insert() and erase(). The live
+patterns are distinct, as the macro names are.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <cstring>
+#include <map>
+#include <random>
+#include "macro_matcher.h"
+#include "test.h"
+
+//-------------------------------------------------------------------------
+// Leftmost-longest match of the live patterns in text[from..)
+static bool reference_find(
+    const std::map<int, std::string> &live,
+    std::string_view text,
+    size_t from,
+    size_t &pos,
+    size_t &len)
+{
+    for (pos = from; pos < text.size(); ++pos)
+    {
+        len = 0;
+        for (auto &[id, p]: live)
+        {
+            if (!p.empty() && p.size() > len && text.substr(pos, p.size()) == p)
+                len = p.size();
+        }
+        if (len != 0)
+            return true;
+    }
+    return false;
+}
+
+// Compare every match of the matcher in 'text' with the reference
+static void check_matches(
+    const macro_matcher_t &matcher,
+    const std::map<int, std::string> &live,
+    std::string_view text)
+{
+    size_t from = 0;
+    for (;;)
+    {
+        macro_matcher_t::match_t m;
+        size_t pos, len;
+        bool found = matcher.find(text.data(), text.size(), from, m);
+        bool expected = reference_find(live, text, from, pos, len);
+        CHECK_EQ(found, expected);
+        if (!found || !expected)
+            return;
+        CHECK_EQ(m.pos, pos);
+        CHECK_EQ(m.len, len);
+        auto it = live.find(m.id);
+        CHECK(it != live.end() && it->second == text.substr(m.pos, m.len));
+        if (m.pos != pos || m.len != len)
+            return;
+        from = pos + len;
+    }
+}
+
+static bool is_live(const std::map<int, std::string> &live, const std::string &p)
+{
+    for (auto &kv: live)
+    {
+        if (kv.second == p)
+            return true;
+    }
+    return false;
+}
+
+static std::string random_string(std::mt19937 &rng, const char *alphabet, size_t min_len, size_t max_len)
+{
+    size_t n = std::uniform_int_distribution<size_t>(min_len, max_len)(rng);
+    size_t k = strlen(alphabet);
+    std::string s;
+    for (size_t i = 0; i < n; ++i)
+        s += alphabet[rng() % k];
+    return s;
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(matcher, leftmost_longest)
+{
+    macro_matcher_t matcher;
+    std::map<int, std::string> live;
+    for (const char *p: { "he", "she", "his", "hers", "ab", "abc", "b", "bcd", "$!", "$!!", "$<<", "$<" })
+        live[matcher.add(p)] = p;
+    matcher.build();
+
+    // The leftmost match wins over a longer one starting later, then the
+    // longest at that position
+    macro_matcher_t::match_t m;
+    CHECK(matcher.find("ushers", 6, 0, m));
+    CHECK_EQ(m.pos, size_t(1));
+    CHECK_EQ(m.len, size_t(3));
+    CHECK(matcher.find("abcd", 4, 0, m));
+    CHECK_EQ(m.pos, size_t(0));
+    CHECK_EQ(m.len, size_t(3));
+    CHECK(matcher.find("xbcd", 4, 0, m));
+    CHECK_EQ(m.len, size_t(3));
+    CHECK(matcher.find("$!!!", 4, 0, m));
+    CHECK_EQ(m.len, size_t(3));
+    CHECK(!matcher.find("xyz", 3, 0, m));
+    CHECK_EQ(matcher.max_len(), size_t(4));
+
+    for (const char *text: { "ushers", "abcd", "ahishersabc", "$!!$<<<$!", "bbb" })
+        check_matches(matcher, live, text);
+}
+
+TEST_CASE(matcher, empty_patterns)
+{
+    macro_matcher_t matcher;
+    matcher.add("");
+    matcher.build();
+    macro_matcher_t::match_t m;
+    CHECK(matcher.empty());
+    CHECK(!matcher.find("abc", 3, 0, m));
+}
+
+TEST_CASE(matcher, random_build)
+{
+    std::mt19937 rng(1);
+    for (int round = 0; round < 50; ++round)
+    {
+        macro_matcher_t matcher;
+        std::map<int, std::string> live;
+        int n = 1 + int(rng() % 40);
+        for (int i = 0; i < n; ++i)
+        {
+            auto p = random_string(rng, "ab$!c", 1, 5);
+            if (!is_live(live, p))
+                live[matcher.add(p)] = p;
+        }
+        matcher.build();
+        for (int t = 0; t < 5; ++t)
+            check_matches(matcher, live, random_string(rng, "ab$!cx", 0, 200));
+    }
+}
+
+TEST_CASE(matcher, random_insert_erase)
+{
+    std::mt19937 rng(2);
+    for (int round = 0; round < 20; ++round)
+    {
+        macro_matcher_t matcher;
+        std::map<int, std::string> live;
+        for (int i = 0; i < 30; ++i)
+        {
+            auto p = random_string(rng, "ab$!c", 1, 5);
+            if (!is_live(live, p))
+                live[matcher.add(p)] = p;
+        }
+        matcher.build();
+
+        // Past MAX_DELTA_PATTERNS changes, rebuild as the replacer does
+        for (int step = 0; step < 600; ++step)
+        {
+            if (!live.empty() && rng() % 2 == 0)
+            {
+                auto it = live.begin();
+                std::advance(it, rng() % live.size());
+                matcher.erase(it->first);
+                live.erase(it);
+            }
+            else
+            {
+                auto p = random_string(rng, "ab$!c", 1, 6);
+                if (!is_live(live, p))
+                    live[matcher.insert(p)] = p;
+            }
+            if (matcher.needs_rebuild())
+            {
+                macro_matcher_t rebuilt;
+                std::map<int, std::string> ids;
+                for (auto &[id, p]: live)
+                    ids[rebuilt.add(p)] = p;
+                rebuilt.build();
+                matcher = rebuilt;
+                live = ids;
+            }
+            if (step % 10 == 0)
+                check_matches(matcher, live, random_string(rng, "ab$!cx", 0, 120));
+        }
+    }
+}
+
+TEST_CASE(matcher, copies_are_independent)
+{
+    macro_matcher_t a;
+    std::map<int, std::string> live_a;
+    live_a[a.add("foo")] = "foo";
+    a.build();
+
+    macro_matcher_t b = a;
+    std::map<int, std::string> live_b = live_a;
+    live_b[b.insert("fo")] = "fo";
+    live_b[b.insert("oof")] = "oof";
+    b.erase(live_b.begin()->first);
+    live_b.erase(live_b.begin());
+
+    check_matches(a, live_a, "xfoofoo");
+    check_matches(b, live_b, "xfoofoo");
+}
+
+TEST_CASE(matcher, cache_round_trip)
+{
+    macro_matcher_t a;
+    std::map<int, std::string> live;
+    for (auto p: { "$!", "${here}", "$sel", "abc" })
+        live[a.add(p)] = p;
+    a.build();
+
+    cache_writer_t w;
+    CHECK(a.save(w));
+    macro_matcher_t b;
+    cache_reader_t r(w.data().data(), w.data().size());
+    CHECK(b.load(r));
+    CHECK_EQ(b.max_len(), size_t(7));
+    check_matches(b, live, "x $sel ${here} $! abcabc");
+
+    // A stored length that is not the depth of the deepest pattern is
+    // rejected (it follows the 4 bytes of the next id)
+    for (uint64_t max_len: { 0, 6, 8, 1000000 })
+    {
+        std::string data = w.data();
+        memcpy(&data[4], &max_len, sizeof(max_len));
+        macro_matcher_t c;
+        cache_reader_t rc(data.data(), data.size());
+        CHECK(!c.load(rc));
+    }
+}
@@ -0,0 +1,277 @@
+/*
+Page cache tests: coalesced reads, unreadable pages, regions, eviction
+
+The cache reads a fake memory that records the reads made to it.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <vector>
+#include "page_cache.h"
+#include "test.h"
+
+static constexpr uint64_t PAGE = page_cache_t::PAGE_SIZE;
+
+//-------------------------------------------------------------------------
+static uint8_t byte_at(uint64_t addr)
+{
+    return uint8_t(addr * 131 + (addr >> 8));
+}
+
+// Memory made of regions [start, end) (all of it without regions), with
+// unreadable holes
+struct fake_memory_t
+{
+    std::vector<page_cache_t::range_t> regions;
+    std::vector<page_cache_t::range_t> holes;
+    std::vector<page_cache_t::range_t> reads;
+
+    static bool contains(const page_cache_t::range_t &r, uint64_t addr)
+    {
+        return addr >= r.addr && addr - r.addr < r.size;
+    }
+
+    bool mapped(uint64_t addr) const
+    {
+        if (regions.empty())
+            return true;
+        for (auto &r: regions)
+        {
+            if (contains(r, addr))
+                return true;
+        }
+        return false;
+    }
+
+    bool readable(uint64_t addr) const
+    {
+        for (auto &h: holes)
+        {
+            if (contains(h, addr))
+                return false;
+        }
+        return mapped(addr);
+    }
+
+    bool read(uint64_t addr, void *buf, size_t size)
+    {
+        reads.push_back({ addr, size });
+        auto out = static_cast<uint8_t *>(buf);
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (!readable(addr + i))
+                return false;
+            out[i] = byte_at(addr + i);
+        }
+        return true;
+    }
+
+    bool region(uint64_t addr, uint64_t &start, uint64_t &end) const
+    {
+        for (auto &r: regions)
+        {
+            if (contains(r, addr))
+            {
+                start = r.addr;
+                end   = r.addr + r.size;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    page_cache_t cache()
+    {
+        auto read_func = [this](uint64_t addr, void *buf, size_t size) { return read(addr, buf, size); };
+        if (regions.empty())
+            return page_cache_t(read_func);
+        return page_cache_t(read_func, [this](uint64_t addr, uint64_t &start, uint64_t &end)
+        {
+            return region(addr, start, end);
+        });
+    }
+};
+
+// Read through the cache and compare with the memory
+static bool read_ok(page_cache_t &cache, uint64_t addr, size_t size)
+{
+    std::vector<uint8_t> buf(size);
+    if (!cache.read(addr, buf.data(), size))
+        return false;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (buf[i] != byte_at(addr + i))
+            return false;
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(page_cache, coalesced_prefetch)
+{
+    fake_memory_t mem;
+    auto cache = mem.cache();
+
+    // Pages 0, 1 and 3 are one read (the gap is small enough), page 10
+    // another
+    cache.prefetch({ { 8, 8 }, { PAGE + 100, 4 }, { 3 * PAGE, 1 }, { 10 * PAGE + 5, 2 } });
+    CHECK_EQ(mem.reads.size(), size_t(2));
+    CHECK_EQ(mem.reads[0].addr, uint64_t(0));
+    CHECK_EQ(mem.reads[0].size, size_t(4 * PAGE));
+    CHECK_EQ(mem.reads[1].addr, 10 * PAGE);
+    CHECK_EQ(mem.reads[1].size, size_t(PAGE));
+
+    // Served from the pages
+    CHECK(read_ok(cache, 8, 8));
+    CHECK(read_ok(cache, 2 * PAGE + 7, 8));
+    CHECK(read_ok(cache, 10 * PAGE, 1));
+    CHECK_EQ(mem.reads.size(), size_t(2));
+    CHECK_EQ(cache.reads(), size_t(2));
+
+    // Straddling two cached pages, then a cached and a missing one
+    CHECK(read_ok(cache, PAGE - 4, 8));
+    CHECK_EQ(mem.reads.size(), size_t(2));
+    CHECK(read_ok(cache, 4 * PAGE - 4, 8));
+    CHECK_EQ(mem.reads.size(), size_t(3));
+    CHECK_EQ(mem.reads[2].addr, 4 * PAGE);
+    CHECK_EQ(mem.reads[2].size, size_t(PAGE));
+
+    // Straddling two missing pages: one read
+    CHECK(read_ok(cache, 21 * PAGE - 2, 4));
+    CHECK_EQ(mem.reads.size(), size_t(4));
+    CHECK_EQ(mem.reads[3].size, size_t(2 * PAGE));
+}
+
+TEST_CASE(page_cache, partly_unreadable_run)
+{
+    fake_memory_t mem;
+    mem.holes.push_back({ 2 * PAGE + 500, 8 });
+    auto cache = mem.cache();
+
+    // The run fails, then each page is read on its own
+    cache.prefetch({ { 0, 4 * PAGE } });
+    CHECK_EQ(mem.reads.size(), size_t(5));
+    for (size_t i = 1; i < mem.reads.size(); ++i)
+    {
+        CHECK_EQ(mem.reads[i].addr, (i - 1) * PAGE);
+        CHECK_EQ(mem.reads[i].size, size_t(PAGE));
+    }
+
+    CHECK(read_ok(cache, 16, 8));
+    CHECK(read_ok(cache, 3 * PAGE + 16, 8));
+    CHECK_EQ(mem.reads.size(), size_t(5));
+
+    // The unreadable page: the exact range is read, and only fails in the
+    // hole
+    CHECK(read_ok(cache, 2 * PAGE + 16, 8));
+    CHECK_EQ(mem.reads.size(), size_t(6));
+    CHECK_EQ(mem.reads.back().addr, 2 * PAGE + 16);
+    CHECK_EQ(mem.reads.back().size, size_t(8));
+    CHECK(!read_ok(cache, 2 * PAGE + 498, 4));
+}
+
+TEST_CASE(page_cache, unreadable_page_exact_fallback)
+{
+    fake_memory_t mem;
+    mem.holes.push_back({ 5 * PAGE + 900, 1 });
+    auto cache = mem.cache();
+
+    // The page cannot be read whole: the requested bytes are read alone
+    CHECK(read_ok(cache, 5 * PAGE + 100, 8));
+    CHECK_EQ(mem.reads.size(), size_t(2));
+    CHECK_EQ(mem.reads[0].addr, 5 * PAGE);
+    CHECK_EQ(mem.reads[0].size, size_t(PAGE));
+    CHECK_EQ(mem.reads[1].addr, 5 * PAGE + 100);
+    CHECK_EQ(mem.reads[1].size, size_t(8));
+
+    // The page is not read again
+    CHECK(read_ok(cache, 5 * PAGE + 200, 2));
+    CHECK_EQ(mem.reads.size(), size_t(3));
+    CHECK(!read_ok(cache, 5 * PAGE + 896, 8));
+}
+
+TEST_CASE(page_cache, regions)
+{
+    // A region that is not page aligned, and one right after it
+    fake_memory_t mem;
+    mem.regions.push_back({ 0x10000 + 100, 1500 });
+    mem.regions.push_back({ 0x10000 + 1600, 2 * PAGE });
+    auto cache = mem.cache();
+    auto within = [&](const page_cache_t::range_t &r)
+    {
+        for (auto &region: mem.regions)
+        {
+            if (r.addr >= region.addr && r.addr + r.size <= region.addr + region.size)
+                return true;
+        }
+        return false;
+    };
+
+    // The pages are only read within the region of the address; a read
+    // across the regions is made as requested
+    CHECK(read_ok(cache, 0x10000 + 100, 8));
+    CHECK_EQ(mem.reads[0].addr, uint64_t(0x10000 + 100));
+    CHECK_EQ(mem.reads[0].size, size_t(PAGE - 100));
+    CHECK(read_ok(cache, 0x10000 + 1592, 8));
+    CHECK(read_ok(cache, 0x10000 + 1600, 8));
+    CHECK(read_ok(cache, 0x10000 + 1596, 8));
+    cache.prefetch({ { 0x10000 + 1590, 40 }, { 0x10000 + 1600 + 2 * PAGE - 1, 8 } });
+    CHECK_EQ(mem.reads.back().addr, uint64_t(0x10000 + 3 * PAGE));
+    CHECK_EQ(mem.reads.back().size, size_t(1600 + 2 * PAGE - 3 * PAGE));
+    for (auto &r: mem.reads)
+        CHECK(within(r) || (r.addr == 0x10000 + 1596 && r.size == 8));
+
+    // Outside of the regions, only the requested bytes are read
+    mem.reads.clear();
+    CHECK(!read_ok(cache, 0x20000, 4));
+    CHECK_EQ(mem.reads.size(), size_t(1));
+    CHECK_EQ(mem.reads[0].addr, uint64_t(0x20000));
+    CHECK_EQ(mem.reads[0].size, size_t(4));
+    mem.reads.clear();
+    cache.prefetch({ { 0x20000, 4 } });
+    CHECK(mem.reads.empty());
+}
+
+TEST_CASE(page_cache, eviction)
+{
+    fake_memory_t mem;
+    auto cache = mem.cache();
+    const size_t n = page_cache_t::MAX_PAGES;
+
+    // Fill the cache (with pages far enough apart not to be read
+    // together); page 0 is the least recently used
+    CHECK(read_ok(cache, 0, 8));
+    for (size_t i = 1; i < n; ++i)
+        CHECK(read_ok(cache, 1000 * PAGE + 3 * i * PAGE, 8));
+    CHECK_EQ(mem.reads.size(), n);
+
+    // A prefetch of page 0 and of new pages filling the cache keeps all of
+    // them
+    std::vector<page_cache_t::range_t> ranges = { { 0, 8 } };
+    for (size_t i = 1; i < n; ++i)
+        ranges.push_back({ 5000 * PAGE + 3 * i * PAGE, 8 });
+    mem.reads.clear();
+    cache.prefetch(ranges);
+    CHECK_EQ(mem.reads.size(), n - 1);
+    mem.reads.clear();
+    for (auto &r: ranges)
+        CHECK(read_ok(cache, r.addr, r.size));
+    CHECK(mem.reads.empty());
+
+    // The older pages were evicted
+    CHECK(read_ok(cache, 1000 * PAGE + 3 * PAGE, 8));
+    CHECK_EQ(mem.reads.size(), size_t(1));
+
+    // A prefetch stops before evicting its own pages
+    cache.clear();
+    mem.reads.clear();
+    ranges.clear();
+    for (size_t i = 0; i < n + 8; ++i)
+        ranges.push_back({ 3 * i * PAGE, 8 });
+    cache.prefetch(ranges);
+    CHECK_EQ(mem.reads.size(), n);
+    mem.reads.clear();
+    for (size_t i = 0; i < n; ++i)
+        CHECK(read_ok(cache, ranges[i].addr, 8));
+    CHECK(mem.reads.empty());
+}
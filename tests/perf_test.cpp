@@ -0,0 +1,174 @@
+/*
+Performance tests: the complexity guarantees of the macro engine
+
+The checks use ratios between input sizes where they can, and generous
+absolute limits otherwise, so that they hold on slow machines and in
+unoptimized builds. The benchmarks (see bench/) measure the actual figures.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <filesystem>
+#include "macro_index.h"
+#include "macro_matcher.h"
+#include "macro_replacer.h"
+#include "macro_store.h"
+#include "macro_table.h"
+#include "test.h"
+
+static std::string identity(std::string_view expr)
+{
+    return std::string(expr);
+}
+
+// Pathological inputs of 'size' bytes, on one line
+static std::string repeat(std::string_view pattern, size_t size)
+{
+    std::string s;
+    s.reserve(size + pattern.size());
+    while (s.size() < size)
+        s.append(pattern);
+    s.resize(size);
+    return s;
+}
+
+static void add_default_macros(macro_replacer_t &replacer)
+{
+    replacer.begin_update();
+    for (auto &def: DEFAULT_MACROS)
+        replacer.update(def.macro, "${'0x%x' % idc.here()}$");
+    replacer.end_update();
+}
+
+static double expand_ms(macro_replacer_t &replacer, const std::string &input)
+{
+    std::string out;
+    return best_ms(5, [&]() { replacer.expand(input, out); });
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(perf, linear_expansion)
+{
+    macro_replacer_t replacer(identity);
+    add_default_macros(replacer);
+
+    // A macro ending with the '$' of "${": the scan of the inline
+    // expressions resumes inside the expressions, the costly case
+    macro_replacer_t overlap(identity);
+    overlap.begin_update();
+    overlap.update("a$", "x");
+    overlap.end_update();
+
+    // 8 times the input must take about 8 times as long (12 leaves room
+    // for the noise, and rules out anything growing faster than n log n)
+    static const struct
+    {
+        macro_replacer_t *replacer;
+        const char *pattern;
+    } CASES[] =
+    {
+        { &replacer, "${'${\"${{" },                    // Unterminated expressions
+        { &replacer, "${ { " },                         // Unbalanced braces
+        { &replacer, "${ '{ }$ " },                     // Unbalanced, closed by the fallback
+        { &replacer, "$ $$ $x $@ $* $(" },              // Lead bytes of the macros, no match
+        { &replacer, "aaaaaaaa $! bbbbbbbb ${1+2}$ $## " },
+        { &overlap,  "a${{" },                          // Macros overlapping the expressions
+        { &overlap,  "a${ a${{ }$ " },
+    };
+    const size_t SMALL = 256 << 10, LARGE = 2 << 20;
+    for (auto &c: CASES)
+    {
+        double small_ms = expand_ms(*c.replacer, repeat(c.pattern, SMALL));
+        double large_ms = expand_ms(*c.replacer, repeat(c.pattern, LARGE));
+        double ratio = large_ms / std::max(small_ms, 0.01);
+        test_note("%-32s %8.2f ms / %8.2f ms (x%.1f)", c.pattern, small_ms, large_ms, ratio);
+        CHECK(ratio < 12);
+    }
+}
+
+TEST_CASE(perf, throughput)
+{
+    macro_replacer_t replacer(identity);
+    add_default_macros(replacer);
+
+    std::string input;
+    while (input.size() < (4 << 20))
+        input += "auto x = get_wide_dword($!) + $@d; print(\"${hex(x)}$\", $<, $>);\n";
+    double ms = expand_ms(replacer, input);
+    double mb_s = (input.size() / 1048576.0) / (ms / 1000);
+    test_note("%.1f MB/s", mb_s);
+    CHECK(mb_s > 5);
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(perf, incremental_update)
+{
+    // Changing one macro of a large set does not rebuild the set
+    const size_t COUNT = 50000, CHANGES = 200;
+    macro_replacer_t replacer(identity);
+    replacer.begin_update();
+    for (size_t i = 0; i < COUNT; ++i)
+        replacer.update("$m" + std::to_string(i), "value " + std::to_string(i));
+    auto t0 = test_clock_t::now();
+    replacer.end_update();
+    double build_ms = ms_since(t0);
+
+    t0 = test_clock_t::now();
+    for (size_t i = 0; i < CHANGES; ++i)
+    {
+        replacer.add("$new" + std::to_string(i), "new");
+        replacer.remove("$m" + std::to_string(i));
+    }
+    double change_ms = ms_since(t0) / (2 * CHANGES);
+    test_note("build %.1f ms, %.3f ms per change", build_ms, change_ms);
+    CHECK(change_ms < 2);
+    CHECK(change_ms < build_ms / 20);
+
+    std::string out;
+    CHECK(replacer.expand("$new7 $m7 $m300", out));
+    CHECK_EQ(out, "new $m7 value 300");
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(perf, cache_startup)
+{
+    // Opening the cache only reads its header: startup does not depend on
+    // the number of macros
+    const std::string path = test_dir() + "/perf.cache";
+    const size_t COUNT = 50000;
+    macro_replacer_t cold(identity);
+    cold.begin_update();
+    for (size_t i = 0; i < COUNT; ++i)
+        cold.update("$m" + std::to_string(i), "${'%x' % (idc.here() + " + std::to_string(i) + ")}$");
+    cold.end_update();
+    CHECK(cold.save_cache(path, 9));
+
+    macro_replacer_t warm(identity);
+    auto t0 = test_clock_t::now();
+    CHECK(warm.load_cache_async(path, 9));
+    double open_ms = ms_since(t0);
+    warm.wait_update();
+    double load_ms = ms_since(t0);
+    test_note("startup %.3f ms, background load %.1f ms", open_ms, load_ms);
+    CHECK(open_ms < 50);
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(perf, filter_query)
+{
+    const size_t COUNT = 100000;
+    macro_table_t table;
+    macro_index_t index;
+    for (size_t i = 0; i < COUNT; ++i)
+    {
+        auto n = std::to_string(i);
+        uint32_t slot = table.insert("$m" + n, "${native:here:hex}$ + " + n, "Macro number " + n);
+        index.add(slot, table.name(slot), table.expr(slot), table.desc(slot));
+    }
+
+    std::vector<uint32_t> slots;
+    double ms = best_ms(3, [&]() { index.query("number 1234", table.order(), slots); });
+    test_note("%.3f ms for %zu results", ms, slots.size());
+    CHECK_EQ(slots.size(), size_t(11));
+    CHECK(ms < 20);
+}
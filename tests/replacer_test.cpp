@@ -0,0 +1,208 @@
+/*
+Replacer tests: inline expression scanner, expansion, streaming
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <random>
+#include "macro_replacer.h"
+#include "test.h"
+
+using eval_span_t = macro_replacer_t::eval_span_t;
+
+// Expressions of all the inline expressions of 'text', "|"-separated
+static std::string scan_all(std::string_view text)
+{
+    std::string exprs;
+    eval_span_t span;
+    macro_replacer_t::eval_scan_t scan;
+    for (size_t pos = 0; macro_replacer_t::find_eval_span(text.data(), text.size(), pos, span, &scan); pos = span.end)
+    {
+        if (!exprs.empty())
+            exprs += '|';
+        exprs.append(text.substr(span.expr_start, span.expr_end - span.expr_start));
+    }
+    return exprs;
+}
+
+static std::string bracket(std::string_view expr)
+{
+    return "<" + std::string(expr) + ">";
+}
+
+static std::string expand(macro_replacer_t &replacer, std::string_view in)
+{
+    std::string out;
+    if (!replacer.expand(in, out))
+        return std::string(in);
+    return out;
+}
+
+static void add_macros(macro_replacer_t &replacer)
+{
+    replacer.begin_update();
+    replacer.update("$!", "${here}$");
+    replacer.update("$!!", "${item_end}$");
+    replacer.update("$#", "plain");
+    replacer.update("$<", "${'%x' % start}$ to ${'%x' % end}$");
+    replacer.end_update();
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(scanner, spans)
+{
+    CHECK_EQ(scan_all("${x}$"), "x");
+    CHECK_EQ(scan_all("a ${x}$ b ${y + 1}$ c"), "x|y + 1");
+    CHECK_EQ(scan_all("${a}$${b}$"), "a|b");
+    CHECK_EQ(scan_all("$${x}$"), "x");
+    CHECK_EQ(scan_all("}$ ${x}$ ${"), "x");
+    CHECK_EQ(scan_all("$ { x }$"), "");
+}
+
+TEST_CASE(scanner, empty_and_unclosed)
+{
+    CHECK_EQ(scan_all("${}$"), "");
+    CHECK_EQ(scan_all("${}$${x}$"), "x");
+    CHECK_EQ(scan_all("${x"), "");
+    CHECK_EQ(scan_all("${x}"), "");
+    CHECK_EQ(scan_all("${"), "");
+    CHECK_EQ(scan_all("$"), "");
+    CHECK_EQ(scan_all(""), "");
+}
+
+TEST_CASE(scanner, literals_and_braces)
+{
+    // "}$" inside string literals and balanced braces does not close
+    CHECK_EQ(scan_all("${'}$'}$"), "'}$'");
+    CHECK_EQ(scan_all("${\"}$\" + '}$'}$"), "\"}$\" + '}$'");
+    CHECK_EQ(scan_all("${'''}$'''}$"), "'''}$'''");
+    CHECK_EQ(scan_all("${'\\'}$'}$"), "'\\'}$'");
+    CHECK_EQ(scan_all("${ {1: 2}[1] }$"), " {1: 2}[1] ");
+    CHECK_EQ(scan_all("${'{%x}' % 1}$"), "'{%x}' % 1");
+}
+
+TEST_CASE(scanner, unbalanced_fallback)
+{
+    // Unbalanced expressions close at the first "}$" of the line
+    CHECK_EQ(scan_all("${ '{ }$"), " '{ ");
+    CHECK_EQ(scan_all("${ { }$ x"), " { ");
+    CHECK_EQ(scan_all("${ { }$ ${y}$"), " { |y");
+    CHECK_EQ(scan_all("${'${\"${{"), "");
+}
+
+TEST_CASE(scanner, lines)
+{
+    // Expressions do not span lines
+    CHECK_EQ(scan_all("${a\n}$"), "");
+    CHECK_EQ(scan_all("${'a\n'}$"), "");
+    CHECK_EQ(scan_all("${ { \n}$ ${x}$"), "x");
+    CHECK_EQ(scan_all("${a\n${b}$"), "b");
+}
+
+TEST_CASE(scanner, max_expr_len)
+{
+    const size_t max = macro_replacer_t::MAX_EXPR_LEN;
+    std::string expr(max, 'x');
+    CHECK_EQ(scan_all("${" + expr + "}$"), expr);
+    CHECK_EQ(scan_all("${" + expr + "x}$"), "");
+    CHECK_EQ(scan_all("${" + expr + "x}$ ${y}$"), "y");
+
+    // Unbalanced and too long for the structured scan: the fallback obeys
+    // the same limit
+    std::string open = "{" + std::string(max - 1, 'x');
+    CHECK_EQ(scan_all("${" + open + "}$"), open);
+    CHECK_EQ(scan_all("${" + open + "x}$"), "");
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(replacer, expand)
+{
+    macro_replacer_t replacer(bracket);
+    add_macros(replacer);
+
+    std::string out = "kept";
+    CHECK(!replacer.expand("nothing here", out));
+    CHECK_EQ(out, "kept");
+
+    CHECK_EQ(expand(replacer, "a $! b"), "a <here> b");
+    CHECK_EQ(expand(replacer, "$!!$!"), "<item_end><here>");
+    CHECK_EQ(expand(replacer, "$#$<"), "plain<'%x' % start> to <'%x' % end>");
+    CHECK_EQ(expand(replacer, "${1}$${2}$"), "<1><2>");
+    CHECK_EQ(expand(replacer, "x ${}$ y"), "x ${}$ y");
+    CHECK_EQ(expand(replacer, "$$!"), "$<here>");
+}
+
+TEST_CASE(replacer, incremental_updates)
+{
+    macro_replacer_t replacer(bracket);
+    add_macros(replacer);
+
+    replacer.add("$n", "new");
+    replacer.add("$#", "changed");
+    replacer.remove("$!!");
+    CHECK_EQ(expand(replacer, "$n $# $!!"), "new changed <here>!");
+
+    replacer.remove("$!");
+    CHECK_EQ(expand(replacer, "$!!"), "$!!");
+}
+
+TEST_CASE(replacer, batch)
+{
+    size_t calls = 0;
+    macro_replacer_t replacer(bracket, [&](const std::vector<std::string_view> &exprs, std::vector<std::string> &values)
+    {
+        ++calls;
+        values.clear();
+        for (auto e: exprs)
+            values.push_back(bracket(e));
+    });
+    add_macros(replacer);
+    CHECK_EQ(expand(replacer, "$! $< ${x}$"), "<here> <'%x' % start> to <'%x' % end> <x>");
+}
+
+//-------------------------------------------------------------------------
+// Random texts made of macros, inline expression pieces and line breaks
+static std::string random_text(std::mt19937 &rng, size_t size)
+{
+    static const char *const PIECES[] =
+    {
+        "$!", "$!!", "$#", "$<", "$", "$$", "${", "}$", "${x}$", "${'}$'}$", "'", "\"",
+        "{", "}", "\n", " ", "abc", "0x401000", "${ {1:2}[1] }$",
+    };
+    std::string text;
+    while (text.size() < size)
+    {
+        if (rng() % 200 == 0)
+            text.append(rng() % (2 * macro_replacer_t::MAX_EXPR_LEN), 'x');
+        else
+            text += PIECES[rng() % std::size(PIECES)];
+    }
+    return text;
+}
+
+TEST_CASE(replacer, stream_equals_whole)
+{
+    macro_replacer_t replacer(bracket);
+    add_macros(replacer);
+
+    std::mt19937 rng(3);
+    for (int round = 0; round < 40; ++round)
+    {
+        auto text = random_text(rng, 20000);
+        auto whole = expand(replacer, text);
+
+        // Chunks of random sizes, some of them empty or of one byte
+        std::string out;
+        macro_replacer_t::stream_t stream(replacer);
+        for (size_t pos = 0; pos < text.size(); )
+        {
+            size_t n = rng() % 4 == 0 ? rng() % 3 : rng() % 3000;
+            stream.feed(std::string_view(text).substr(pos, n), out);
+            pos += n;
+        }
+        stream.finish(out);
+        CHECK(out == whole);
+        if (out != whole)
+            return;
+    }
+}
@@ -0,0 +1,103 @@
+/*
+Snapshot tests: publication and deferred reclamation
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "snapshot.h"
+#include "test.h"
+
+// Counts the live objects, and is overwritten when freed
+struct tracked_t
+{
+    static inline std::atomic<int> live{ 0 };
+
+    uint64_t value;
+    uint64_t check;
+
+    tracked_t(uint64_t value) : value(value), check(~value) { ++live; }
+    ~tracked_t()
+    {
+        check = value;
+        --live;
+    }
+    bool valid() const { return check == ~value; }
+};
+
+//-------------------------------------------------------------------------
+TEST_CASE(snapshot, deferred_reclamation)
+{
+    {
+        snapshot_ptr_t<tracked_t> ptr;
+        ptr.publish(std::make_unique<tracked_t>(1));
+        ptr.publish(std::make_unique<tracked_t>(2));
+        CHECK_EQ(tracked_t::live.load(), 1);
+
+        {
+            // The writer does not wait for the reader: the snapshot being
+            // read is kept until a later publish()
+            snapshot_ptr_t<tracked_t>::reader_t reader(ptr);
+            ptr.publish(std::make_unique<tracked_t>(3));
+            CHECK_EQ(reader->value, uint64_t(2));
+            CHECK(reader->valid());
+            CHECK_EQ(tracked_t::live.load(), 2);
+
+            snapshot_ptr_t<tracked_t>::reader_t current(ptr);
+            CHECK_EQ(current->value, uint64_t(3));
+        }
+        ptr.publish(std::make_unique<tracked_t>(4));
+        CHECK_EQ(tracked_t::live.load(), 1);
+
+        // Freed with the pointer
+        snapshot_ptr_t<tracked_t>::reader_t *leftover = new snapshot_ptr_t<tracked_t>::reader_t(ptr);
+        ptr.publish(std::make_unique<tracked_t>(5));
+        CHECK_EQ(tracked_t::live.load(), 2);
+        delete leftover;
+    }
+    CHECK_EQ(tracked_t::live.load(), 0);
+}
+
+TEST_CASE(snapshot, concurrent_readers)
+{
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> bad{ 0 };
+    {
+        snapshot_ptr_t<tracked_t> ptr;
+        ptr.publish(std::make_unique<tracked_t>(0));
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; ++i)
+        {
+            readers.emplace_back([&]()
+            {
+                uint64_t last = 0;
+                while (!stop.load())
+                {
+                    snapshot_ptr_t<tracked_t>::reader_t reader(ptr);
+                    if (!reader->valid() || reader->value < last)
+                        ++bad;
+                    last = reader->value;
+                    for (int spin = 0; spin < 100; ++spin)
+                    {
+                        if (!reader->valid())
+                            ++bad;
+                    }
+                }
+            });
+        }
+        for (uint64_t v = 1; v <= 20000; ++v)
+            ptr.publish(std::make_unique<tracked_t>(v));
+        stop = true;
+        for (auto &t: readers)
+            t.join();
+
+        // Once the readers are gone, the next publish() frees everything
+        ptr.publish(std::make_unique<tracked_t>(0));
+        CHECK_EQ(tracked_t::live.load(), 1);
+    }
+    CHECK_EQ(bad.load(), size_t(0));
+    CHECK_EQ(tracked_t::live.load(), 0);
+}
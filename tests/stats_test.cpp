@@ -0,0 +1,114 @@
+/*
+Statistics tests: latency histogram buckets and percentiles
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <cstdint>
+#include <random>
+#include "macro_stats.h"
+#include "test.h"
+
+//-------------------------------------------------------------------------
+// Percentile of a histogram holding a single value
+static uint64_t single(uint64_t ns)
+{
+    latency_histogram_t h;
+    h.record(ns);
+    return h.percentile(50);
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(stats, bucket_edges)
+{
+    // Everything below 2^MIN_BITS ns shares the first bucket
+    CHECK_EQ(single(0), uint64_t(79));
+    CHECK_EQ(single(1), uint64_t(79));
+    CHECK_EQ(single(63), uint64_t(79));
+    CHECK_EQ(single(64), uint64_t(79));
+    CHECK_EQ(single(79), uint64_t(79));
+    CHECK_EQ(single(80), uint64_t(95));
+    CHECK_EQ(single(95), uint64_t(95));
+    CHECK_EQ(single(96), uint64_t(111));
+    CHECK_EQ(single(127), uint64_t(127));
+    CHECK_EQ(single(128), uint64_t(159));
+
+    // Up to 2^MAX_BITS ns, then bounded by the largest value
+    const uint64_t top = uint64_t(1) << latency_histogram_t::MAX_BITS;
+    CHECK_EQ(single(top - 1), top - 1);
+    CHECK_EQ(single(top), top);
+    CHECK_EQ(single(top + 1), top + 1);
+    CHECK_EQ(single(top * 5), top * 5);
+    CHECK_EQ(single(UINT64_MAX), UINT64_MAX);
+
+    latency_histogram_t h;
+    h.record(top * 3);
+    h.record(top * 2);
+    CHECK_EQ(h.percentile(50), top * 3);
+}
+
+TEST_CASE(stats, percentile_bounds)
+{
+    // A percentile is never below the value it stands for, and at most 25%
+    // above it between the first and the last bucket
+    const uint64_t bottom = uint64_t(1) << latency_histogram_t::MIN_BITS;
+    const uint64_t top    = uint64_t(1) << latency_histogram_t::MAX_BITS;
+    std::mt19937_64 rng(7);
+    for (int i = 0; i < 100000; ++i)
+    {
+        const int bits = int(rng() % 48) + 1;
+        const uint64_t ns = (rng() >> (64 - bits)) | (uint64_t(1) << (bits - 1));
+        const uint64_t p = single(ns);
+        if (p < ns || (ns >= bottom && ns < top && double(p) > ns * 1.25))
+        {
+            test_fail(__FILE__, __LINE__, "percentile of " + std::to_string(ns) + " is " + std::to_string(p));
+            break;
+        }
+    }
+}
+
+TEST_CASE(stats, percentile_ranks)
+{
+    latency_histogram_t h;
+    CHECK_EQ(h.percentile(50), uint64_t(0));
+
+    // The rank is rounded up: p50 of 3 values is the second one
+    h.record(100);
+    h.record(1000);
+    h.record(10000);
+    CHECK(h.percentile(50) >= 1000 && h.percentile(50) < 10000);
+    CHECK(h.percentile(99) >= 10000);
+    CHECK(h.percentile(1) >= 100 && h.percentile(1) < 1000);
+
+    // 1..200 us: p50 covers 100 us and p99 198 us
+    latency_histogram_t u;
+    for (uint64_t i = 1; i <= 200; ++i)
+        u.record(i * 1000);
+    CHECK(u.percentile(50) >= 100000 && u.percentile(50) <= 125000);
+    CHECK(u.percentile(99) >= 198000 && u.percentile(99) <= 247500);
+    CHECK(u.percentile(100) >= 200000);
+    CHECK_EQ(u.count(), uint64_t(200));
+    CHECK_EQ(u.total_ns(), uint64_t(200 * 201 / 2 * 1000));
+}
+
+TEST_CASE(stats, merge_and_reset)
+{
+    const uint64_t top = uint64_t(1) << latency_histogram_t::MAX_BITS;
+    latency_histogram_t a, b;
+    for (int i = 0; i < 99; ++i)
+        a.record(1000);
+    b.record(top * 4);
+
+    a.merge(b);
+    CHECK_EQ(a.count(), uint64_t(100));
+    CHECK_EQ(a.total_ns(), 99 * 1000 + top * 4);
+    CHECK(a.percentile(50) >= 1000 && a.percentile(50) <= 1250);
+    CHECK_EQ(a.percentile(100), top * 4);
+
+    a.reset();
+    CHECK_EQ(a.count(), uint64_t(0));
+    CHECK_EQ(a.total_ns(), uint64_t(0));
+    CHECK_EQ(a.percentile(50), uint64_t(0));
+    a.record(top);
+    CHECK_EQ(a.percentile(50), top);
+}
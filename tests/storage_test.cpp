@@ -0,0 +1,438 @@
+/*
+Storage tests: macro table and index, file store and its journal, cache
+files, macro packs
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include "macro_cache.h"
+#include "macro_index.h"
+#include "macro_pack.h"
+#include "macro_replacer.h"
+#include "macro_store.h"
+#include "macro_table.h"
+#include "test.h"
+
+static std::string identity(std::string_view expr)
+{
+    return std::string(expr);
+}
+
+// "name=expr" of the macros of a table, in its order
+static std::string dump(const macro_table_t &table, bool with_desc = false)
+{
+    std::string s;
+    for (auto slot: table.order())
+    {
+        s.append(table.name(slot)).append("=").append(table.expr(slot));
+        if (with_desc)
+            s.append("#").append(table.desc(slot));
+        s += ';';
+    }
+    return s;
+}
+
+static std::string dump(const macros_t &macros)
+{
+    std::string s;
+    for (auto &m: macros)
+        s += m.macro + "=" + m.expr + ";";
+    return s;
+}
+
+static void fill(macro_table_t &table, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        auto n = std::to_string(i);
+        table.insert("$m" + n, "${'%x' % (here() + " + n + ")}$", "Macro\t" + n + "\nline 2 \\");
+    }
+}
+
+static void append_bytes(const std::string &path, std::string_view bytes)
+{
+    std::ofstream(path, std::ios::binary | std::ios::app).write(bytes.data(), std::streamsize(bytes.size()));
+}
+
+//-------------------------------------------------------------------------
+// Macro table and index
+//-------------------------------------------------------------------------
+TEST_CASE(storage, table_against_map)
+{
+    macro_table_t table;
+    std::map<std::string, std::string> ref;
+    std::mt19937 rng(5);
+    for (int step = 0; step < 20000; ++step)
+    {
+        auto name = "$" + std::to_string(rng() % 500);
+        auto expr = std::string(rng() % 40, char('a' + rng() % 26));
+        uint32_t slot = table.find(name);
+        CHECK_EQ(slot != macro_table_t::npos, ref.count(name) != 0);
+        switch (rng() % 3)
+        {
+            case 0:
+                CHECK_EQ(table.insert(name, expr) != macro_table_t::npos, ref.count(name) == 0);
+                ref.emplace(name, expr);
+                break;
+            case 1:
+                if (slot != macro_table_t::npos)
+                {
+                    table.set_expr(slot, expr);
+                    ref[name] = expr;
+                }
+                break;
+            default:
+                if (slot != macro_table_t::npos)
+                {
+                    table.erase(slot);
+                    ref.erase(name);
+                }
+                break;
+        }
+    }
+    CHECK_EQ(table.size(), ref.size());
+    for (auto &[name, expr]: ref)
+    {
+        uint32_t slot = table.find(name);
+        CHECK(slot != macro_table_t::npos && table.expr(slot) == expr);
+    }
+}
+
+TEST_CASE(storage, index_query)
+{
+    macro_table_t table;
+    macro_index_t index;
+    table.insert("$!", "${native:here:hex}$", "Current cursor location");
+    table.insert("$<", "${native:segm_start:hex}$", "Current segment start");
+    table.insert("$dump", "${'%x' % idc.get_wide_dword(here())}$", "Dword at the cursor");
+    for (auto slot: table.order())
+        index.add(slot, table.name(slot), table.expr(slot), table.desc(slot));
+
+    auto names = [&](std::string_view filter)
+    {
+        std::vector<uint32_t> slots;
+        index.query(filter, table.order(), slots);
+        std::string s;
+        for (auto slot: slots)
+            s.append(table.name(slot)).append(" ");
+        return s;
+    };
+    CHECK_EQ(names(""), "$! $< $dump ");
+    CHECK_EQ(names("CURR"), "$! $< ");
+    CHECK_EQ(names("current seg"), "$< ");
+    CHECK_EQ(names("$d"), "$dump ");
+    CHECK_EQ(names("get_wide"), "$dump ");
+    CHECK_EQ(names("nothing"), "");
+
+    index.remove(table.find("$<"));
+    CHECK_EQ(names("curr"), "$! ");
+}
+
+//-------------------------------------------------------------------------
+// File store
+//-------------------------------------------------------------------------
+TEST_CASE(storage, store_round_trip)
+{
+    const std::string path = test_dir() + "/store.macros";
+    macro_table_t table;
+    fill(table, 1000);
+    {
+        file_macro_store_t store(path);
+        CHECK(store.open());
+        CHECK(store.save_all(table));
+    }
+
+    file_macro_store_t store(path);
+    CHECK(store.open());
+    CHECK_EQ(store.size(), size_t(1000));
+    macro_table_t loaded;
+    store.load_table(loaded);
+    CHECK(dump(loaded) == dump(table));
+
+    // The descriptions are read on demand
+    macro_def_t def;
+    CHECK(store.find("$m7", def));
+    CHECK_EQ(def.desc, "Macro\t7\nline 2 \\");
+    CHECK(!store.find("$none", def));
+}
+
+TEST_CASE(storage, journal_replay)
+{
+    const std::string path = test_dir() + "/journal.macros";
+    // The last changed macros come first
+    macros_t expected;
+    {
+        file_macro_store_t store(path);
+        CHECK(store.open());
+        store.save({ "$a", "1", "first" });
+        store.save({ "$b", "2", "" });
+        store.save({ "$a", "3", "changed" });
+        store.remove({ "$b", "", "" });
+        store.save({ "$c", "4", "" });
+        store.load(expected);
+        CHECK_EQ(dump(expected), "$c=4;$a=3;");
+    }
+
+    // Replayed from the journal alone
+    {
+        file_macro_store_t store(path);
+        CHECK(store.open());
+        macros_t macros;
+        store.load(macros);
+        CHECK_EQ(dump(macros), dump(expected));
+        CHECK_EQ(store.desc(macros[1]), "changed");
+    }
+
+    // A torn record at the end of the journal is dropped
+    append_bytes(path + ".journal", std::string("\x20\x00\x00\x00garbage", 11));
+    {
+        file_macro_store_t store(path);
+        CHECK(store.open());
+        macros_t macros;
+        store.load(macros);
+        CHECK_EQ(dump(macros), dump(expected));
+
+        // and the journal goes on after the last good record
+        store.save({ "$d", "5", "" });
+    }
+    file_macro_store_t store(path);
+    CHECK(store.open());
+    macros_t macros;
+    store.load(macros);
+    CHECK_EQ(dump(macros), "$d=5;$c=4;$a=3;");
+}
+
+TEST_CASE(storage, compaction)
+{
+    const std::string path = test_dir() + "/compact.macros";
+    macros_t before;
+    {
+        file_macro_store_t store(path);
+        CHECK(store.open());
+        for (size_t i = 0; i < file_macro_store_t::MIN_COMPACT_RECORDS + 100; ++i)
+            store.save({ "$m" + std::to_string(i % 300), std::to_string(i), "" });
+        store.remove({ "$m5", "", "" });
+        store.load(before);
+        CHECK(store.compact());
+        macros_t after;
+        store.load(after);
+        CHECK(dump(after) == dump(before));
+    }
+
+    file_macro_store_t store(path);
+    CHECK(store.open());
+    macros_t macros;
+    store.load(macros);
+    CHECK(dump(macros) == dump(before));
+    CHECK_EQ(macros.size(), size_t(299));
+}
+
+TEST_CASE(storage, fingerprint)
+{
+    const std::string path = test_dir() + "/fp.macros";
+    file_macro_store_t store(path);
+    CHECK_EQ(store.fingerprint(), uint64_t(0));
+    CHECK(store.open());
+    store.save({ "$a", "1", "" });
+    uint64_t fp1 = store.fingerprint();
+    store.save({ "$b", "2", "" });
+    uint64_t fp2 = store.fingerprint();
+    CHECK(fp1 != 0 && fp2 != 0 && fp1 != fp2);
+}
+
+//-------------------------------------------------------------------------
+// Cache files
+//-------------------------------------------------------------------------
+TEST_CASE(storage, cache_file)
+{
+    const std::string path = test_dir() + "/file.cache";
+    cache_writer_t w;
+    w.put_u32(7);
+    w.put_str("payload");
+    w.put_u64(42);
+    std::string error;
+    CHECK(write_cache_file(path, 3, 0x1234, w.data(), error));
+
+    cache_file_t f;
+    CHECK(!f.open(path, 2, 0x1234));
+    CHECK(!f.open(path, 3, 0x1235));
+    CHECK(f.open(path, 3, 0x1234));
+    CHECK(f.verify());
+    auto r = f.reader();
+    uint32_t u32 = 0;
+    uint64_t u64 = 0;
+    std::string_view s;
+    CHECK(r.get_u32(u32) && r.get_str(s) && r.get_u64(u64) && r.at_end());
+    CHECK_EQ(u32, uint32_t(7));
+    CHECK_EQ(s, "payload");
+    CHECK_EQ(u64, uint64_t(42));
+
+    // Reads past the end fail, and so does everything after them
+    CHECK(!r.get_u32(u32));
+    CHECK(!r.ok());
+    f.close();
+
+    // A changed payload fails the checksum
+    {
+        std::fstream io(path, std::ios::in | std::ios::out | std::ios::binary);
+        io.seekp(-1, std::ios::end);
+        io.put('\x7f');
+    }
+    CHECK(f.open(path, 3, 0x1234));
+    CHECK(!f.verify());
+}
+
+TEST_CASE(storage, replacer_cache)
+{
+    const std::string path = test_dir() + "/replacer.cache";
+    macro_replacer_t cold(identity);
+    cold.begin_update();
+    for (size_t i = 0; i < 500; ++i)
+        cold.update("$m" + std::to_string(i), "${x" + std::to_string(i) + "}$ ${'}$'}$ at " + std::to_string(i));
+    cold.end_update();
+    cold.add("$new", "added ${later}$");
+    cold.remove("$m3");
+    CHECK(cold.save_cache(path, 77));
+
+    // Wrong key: not loaded
+    macro_replacer_t other(identity);
+    CHECK(!other.load_cache_async(path, 78));
+
+    macro_replacer_t warm(identity);
+    bool failed = false;
+    CHECK(warm.load_cache_async(path, 77, [&]() { failed = true; }));
+    warm.wait_update();
+    CHECK(!failed);
+
+    std::string line = "$new $m3 $m1 $m499 $m4990 ${expr}$";
+    std::string a, b;
+    CHECK(cold.expand(line, a));
+    CHECK(warm.expand(line, b));
+    CHECK_EQ(a, b);
+    CHECK_EQ(warm.lookahead(), cold.lookahead());
+
+    // Incremental updates go on from the loaded set
+    warm.add("$m3", "back");
+    CHECK(warm.expand("$m3", b));
+    CHECK_EQ(b, "back");
+}
+
+TEST_CASE(storage, replacer_cache_first_expand)
+{
+    const std::string path = test_dir() + "/first.cache";
+    macro_replacer_t cold(identity);
+    cold.begin_update();
+    for (size_t i = 0; i < 50000; ++i)
+        cold.update("$m" + std::to_string(i), "at " + std::to_string(i));
+    cold.end_update();
+    CHECK(cold.save_cache(path, 5));
+
+    // The expansions started while the cache loads wait for it
+    macro_replacer_t warm(identity);
+    CHECK(warm.load_cache_async(path, 5));
+    std::string out;
+    CHECK(warm.expand("$m49999", out));
+    CHECK_EQ(out, "at 49999");
+    warm.wait_update();
+}
+
+TEST_CASE(storage, replacer_cache_damaged)
+{
+    const std::string path = test_dir() + "/damaged.cache";
+    macro_replacer_t cold(identity);
+    cold.begin_update();
+    cold.update("$a", "cached");
+    cold.end_update();
+    CHECK(cold.save_cache(path, 1));
+    {
+        std::fstream io(path, std::ios::in | std::ios::out | std::ios::binary);
+        io.seekp(-3, std::ios::end);
+        io.put('\x55');
+    }
+
+    // The damage is found in the background: the macro set stays as it
+    // was and the file is removed
+    macro_replacer_t warm(identity);
+    warm.begin_update();
+    warm.update("$a", "kept");
+    warm.end_update();
+    bool failed = false;
+    CHECK(warm.load_cache_async(path, 1, [&]() { failed = true; }));
+    warm.wait_update();
+    CHECK(failed);
+    std::string out;
+    CHECK(warm.expand("$a", out));
+    CHECK_EQ(out, "kept");
+    CHECK(!std::filesystem::exists(path));
+}
+
+//-------------------------------------------------------------------------
+// Macro packs
+//-------------------------------------------------------------------------
+TEST_CASE(storage, pack_round_trip)
+{
+    const std::string path = test_dir() + "/macros.pack";
+    macro_table_t table;
+    fill(table, 300);
+    std::string error;
+    CHECK(export_macro_pack(path, table, error));
+
+    macro_table_t imported;
+    imported.insert("$m0", "old", "");
+    macro_pack_result_t result;
+    CHECK(import_macro_pack(path, imported, false, result, error));
+    CHECK_EQ(result.added, size_t(299));
+    CHECK_EQ(result.unchanged, size_t(1));
+    CHECK_EQ(result.invalid, size_t(0));
+    CHECK_EQ(imported.expr(imported.find("$m0")), "old");
+
+    CHECK(import_macro_pack(path, imported, true, result, error));
+    CHECK_EQ(result.replaced, size_t(1));
+    CHECK(dump(imported, true) == dump(table, true));
+
+    // Malformed lines are counted and reported, the others imported
+    append_bytes(path, "no tabs here\n$z\tz\t\n");
+    macro_table_t partial;
+    CHECK(import_macro_pack(path, partial, false, result, error));
+    CHECK_EQ(result.invalid, size_t(1));
+    CHECK_EQ(result.errors.size(), size_t(1));
+    CHECK(partial.contains("$z"));
+}
+
+TEST_CASE(storage, pack_check)
+{
+    const std::string path = test_dir() + "/checked.pack";
+    append_bytes(path, "$a\tgood\t\n$b\tbad one\t\n$c\tbad\t\n$c\tfixed\t\n$d\tbad\t\n");
+    auto check = [](std::string_view expr, std::string &reason)
+    {
+        if (expr.substr(0, 3) != "bad")
+            return true;
+        reason = "does not compile";
+        return false;
+    };
+
+    // The invalid definitions are reported with their line and left out;
+    // a later valid definition of the macro is used
+    macro_table_t table;
+    table.insert("$d", "kept", "");
+    macro_pack_result_t result;
+    std::string error;
+    CHECK(import_macro_pack(path, table, true, result, error, check));
+    CHECK_EQ(result.added, size_t(2));
+    CHECK_EQ(result.invalid, size_t(3));
+    CHECK_EQ(result.duplicates, size_t(0));
+    CHECK_EQ(result.errors.size(), size_t(3));
+    if (result.errors.size() == 3)
+    {
+        CHECK_EQ(result.errors[0], "2: '$b' is invalid: does not compile");
+        CHECK_EQ(result.errors[1].substr(0, 2), "3:");
+        CHECK_EQ(result.errors[2].substr(0, 2), "5:");
+    }
+    CHECK(!table.contains("$b"));
+    CHECK_EQ(table.expr(table.find("$c")), "fixed");
+    CHECK_EQ(table.expr(table.find("$d")), "kept");
+}
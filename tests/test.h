@@ -0,0 +1,104 @@
+/*
+Test harness: registry of test cases and checks
+
+Test cases are grouped in suites. The test runner runs the suites named on
+its command line (all of them by default); ctest runs one suite per test
+(see tests/CMakeLists.txt). A failed check is reported with its location
+and the test case goes on with the next check.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+//-------------------------------------------------------------------------
+struct test_case_t
+{
+    const char *suite;
+    const char *name;
+    void (*func)();
+};
+
+std::vector<test_case_t> &test_cases();
+
+struct test_registrar_t
+{
+    test_registrar_t(const char *suite, const char *name, void (*func)())
+    {
+        test_cases().push_back({ suite, name, func });
+    }
+};
+
+// Record a failed check of the running test case
+void test_fail(const char *file, int line, const std::string &what);
+
+// Print a line of information (e.g. a measured time) under the test case
+void test_note(const char *fmt, ...);
+
+// Directory for the files of the test cases (emptied before each one)
+std::string test_dir();
+
+//-------------------------------------------------------------------------
+// Values in failure messages
+inline std::string test_str(std::string_view s)
+{
+    return "\"" + std::string(s) + "\"";
+}
+
+template<class T> requires std::is_arithmetic_v<T>
+std::string test_str(T v)
+{
+    return std::to_string(v);
+}
+
+//-------------------------------------------------------------------------
+#define TEST_CASE(suite, name) \
+    static void test_##suite##_##name(); \
+    static test_registrar_t test_reg_##suite##_##name(#suite, #name, test_##suite##_##name); \
+    static void test_##suite##_##name()
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+            test_fail(__FILE__, __LINE__, #cond); \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do \
+    { \
+        const auto &check_a_ = (a); \
+        const auto &check_b_ = (b); \
+        if (!(check_a_ == check_b_)) \
+            test_fail(__FILE__, __LINE__, std::string(#a " == " #b ": ") + test_str(check_a_) + " != " + test_str(check_b_)); \
+    } while (0)
+
+//-------------------------------------------------------------------------
+// Timing of the performance checks
+using test_clock_t = std::chrono::steady_clock;
+
+inline double ms_since(test_clock_t::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(test_clock_t::now() - t0).count();
+}
+
+// Best time of 'runs' calls of 'fn', in milliseconds
+template<class F>
+double best_ms(int runs, F &&fn)
+{
+    double best = 1e300;
+    for (int i = 0; i < runs; ++i)
+    {
+        auto t0 = test_clock_t::now();
+        fn();
+        best = std::min(best, ms_since(t0));
+    }
+    return best;
+}
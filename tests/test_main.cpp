@@ -0,0 +1,102 @@
+/*
+Test runner of the macro engine
+
+Usage: climacros_tests [suite...]
+  Runs the test cases of the given suites, or all of them. Exits with 1 if
+  a check failed.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include "test.h"
+
+static size_t g_failures = 0;
+static bool g_failed = false;
+static const char *g_suite = "";
+
+//-------------------------------------------------------------------------
+std::vector<test_case_t> &test_cases()
+{
+    static std::vector<test_case_t> cases;
+    return cases;
+}
+
+void test_fail(const char *file, int line, const std::string &what)
+{
+    fprintf(stderr, "  %s:%d: check failed: %s\n", file, line, what.c_str());
+    ++g_failures;
+    g_failed = true;
+}
+
+void test_note(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    printf("  ");
+    vprintf(fmt, va);
+    printf("\n");
+    va_end(va);
+}
+
+std::string test_dir()
+{
+    // One per suite: ctest runs the suites in parallel
+    return (std::filesystem::temp_directory_path() / (std::string("climacros_tests_") + g_suite)).string();
+}
+
+static void remove_test_dir()
+{
+    std::error_code ec;
+    if (*g_suite != '\0')
+        std::filesystem::remove_all(test_dir(), ec);
+}
+
+//-------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    auto selected = [&](const char *suite)
+    {
+        if (argc < 2)
+            return true;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], suite) == 0)
+                return true;
+        }
+        return false;
+    };
+
+    size_t ran = 0, failed = 0;
+    for (auto &tc: test_cases())
+    {
+        if (!selected(tc.suite))
+            continue;
+
+        if (strcmp(g_suite, tc.suite) != 0)
+            remove_test_dir();
+        g_suite = tc.suite;
+        remove_test_dir();
+        std::error_code ec;
+        std::filesystem::create_directories(test_dir(), ec);
+
+        printf("%s.%s\n", tc.suite, tc.name);
+        fflush(stdout);
+        g_failed = false;
+        tc.func();
+        ++ran;
+        if (g_failed)
+        {
+            ++failed;
+            printf("  FAILED\n");
+        }
+    }
+
+    remove_test_dir();
+    printf("%zu test cases, %zu failed (%zu failed checks)\n", ran, failed, g_failures);
+    return ran == 0 || failed != 0 ? 1 : 0;
+}
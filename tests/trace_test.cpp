@@ -0,0 +1,378 @@
+/*
+Trace tests: ring buffer, detail truncation, Chrome trace JSON
+
+The JSON documents are checked by a strict parser (which also checks that
+the strings are valid UTF-8), that collects the details of the events.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <iterator>
+#include <string>
+#include <vector>
+#include "macro_trace.h"
+#include "test.h"
+
+//-------------------------------------------------------------------------
+// Strict JSON parser: returns false on anything RFC 8259 rejects
+class json_checker_t
+{
+    std::string_view m_s;
+    size_t m_i = 0;
+    int m_depth = 0;
+
+    bool eof() const { return m_i >= m_s.size(); }
+    char peek() const { return eof() ? '\0' : m_s[m_i]; }
+
+    void skip_ws()
+    {
+        while (!eof() && (peek() == ' ' || peek() == '\t' || peek() == '\n' || peek() == '\r'))
+            ++m_i;
+    }
+
+    bool expect(char ch)
+    {
+        skip_ws();
+        if (peek() != ch)
+            return false;
+        ++m_i;
+        return true;
+    }
+
+    static void append_utf8(std::string &out, uint32_t cp)
+    {
+        if (cp < 0x80)
+        {
+            out += char(cp);
+        }
+        else if (cp < 0x800)
+        {
+            out += char(0xC0 | (cp >> 6));
+            out += char(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += char(0xE0 | (cp >> 12));
+            out += char(0x80 | ((cp >> 6) & 0x3F));
+            out += char(0x80 | (cp & 0x3F));
+        }
+    }
+
+    // Length of the UTF-8 sequence at m_i, 0 if invalid
+    size_t utf8_len() const
+    {
+        const uint8_t lead = uint8_t(m_s[m_i]);
+        size_t n = lead < 0x80 ? 1 : lead >= 0xC2 && lead < 0xE0 ? 2 : lead >= 0xE0 && lead < 0xF0 ? 3 : lead >= 0xF0 && lead < 0xF5 ? 4 : 0;
+        if (n == 0 || m_i + n > m_s.size())
+            return 0;
+        for (size_t k = 1; k < n; ++k)
+        {
+            if ((uint8_t(m_s[m_i + k]) & 0xC0) != 0x80)
+                return 0;
+        }
+        return n;
+    }
+
+    bool string(std::string &out)
+    {
+        out.clear();
+        if (!expect('"'))
+            return false;
+        while (!eof())
+        {
+            const char ch = m_s[m_i];
+            if (ch == '"')
+            {
+                ++m_i;
+                return true;
+            }
+            if (uint8_t(ch) < 0x20)
+                return false;
+            if (ch != '\\')
+            {
+                const size_t n = utf8_len();
+                if (n == 0)
+                    return false;
+                out.append(m_s.substr(m_i, n));
+                m_i += n;
+                continue;
+            }
+
+            if (++m_i >= m_s.size())
+                return false;
+            switch (m_s[m_i++])
+            {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u':
+                {
+                    if (m_i + 4 > m_s.size())
+                        return false;
+                    uint32_t cp = 0;
+                    for (int k = 0; k < 4; ++k)
+                    {
+                        const char h = m_s[m_i++];
+                        cp <<= 4;
+                        if (h >= '0' && h <= '9')
+                            cp |= uint32_t(h - '0');
+                        else if (h >= 'a' && h <= 'f')
+                            cp |= uint32_t(h - 'a' + 10);
+                        else if (h >= 'A' && h <= 'F')
+                            cp |= uint32_t(h - 'A' + 10);
+                        else
+                            return false;
+                    }
+                    append_utf8(out, cp);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        return false;
+    }
+
+    bool number()
+    {
+        skip_ws();
+        const size_t start = m_i;
+        if (peek() == '-')
+            ++m_i;
+        if (peek() == '0')
+        {
+            ++m_i;
+        }
+        else
+        {
+            if (peek() < '1' || peek() > '9')
+                return false;
+            while (peek() >= '0' && peek() <= '9')
+                ++m_i;
+        }
+        if (peek() == '.')
+        {
+            ++m_i;
+            if (peek() < '0' || peek() > '9')
+                return false;
+            while (peek() >= '0' && peek() <= '9')
+                ++m_i;
+        }
+        if (peek() == 'e' || peek() == 'E')
+        {
+            ++m_i;
+            if (peek() == '+' || peek() == '-')
+                ++m_i;
+            if (peek() < '0' || peek() > '9')
+                return false;
+            while (peek() >= '0' && peek() <= '9')
+                ++m_i;
+        }
+        return m_i > start;
+    }
+
+    bool value(std::string_view key)
+    {
+        skip_ws();
+        if (++m_depth > 64)
+            return false;
+        bool ok;
+        switch (peek())
+        {
+            case '{':
+            {
+                ++m_i;
+                ok = true;
+                skip_ws();
+                if (peek() == '}')
+                {
+                    ++m_i;
+                    break;
+                }
+                do
+                {
+                    std::string name;
+                    ok = string(name) && expect(':') && value(name);
+                } while (ok && expect(','));
+                ok = ok && expect('}');
+                break;
+            }
+            case '[':
+            {
+                ++m_i;
+                ok = true;
+                skip_ws();
+                if (peek() == ']')
+                {
+                    ++m_i;
+                    break;
+                }
+                do
+                {
+                    ok = value({});
+                } while (ok && expect(','));
+                ok = ok && expect(']');
+                break;
+            }
+            case '"':
+            {
+                std::string s;
+                ok = string(s);
+                if (ok && key == "detail")
+                    details.push_back(s);
+                if (ok && key == "name")
+                    names.push_back(s);
+                break;
+            }
+            case 't': ok = m_s.substr(m_i, 4) == "true" && (m_i += 4, true); break;
+            case 'f': ok = m_s.substr(m_i, 5) == "false" && (m_i += 5, true); break;
+            case 'n': ok = m_s.substr(m_i, 4) == "null" && (m_i += 4, true); break;
+            default:  ok = number(); break;
+        }
+        --m_depth;
+        return ok;
+    }
+
+public:
+    // Values of the "detail" and "name" members, in order
+    std::vector<std::string> details;
+    std::vector<std::string> names;
+
+    bool check(std::string_view s)
+    {
+        m_s = s;
+        m_i = 0;
+        details.clear();
+        names.clear();
+        if (!value({}))
+            return false;
+        skip_ws();
+        return eof();
+    }
+};
+
+// Record an event of the given detail
+static void add_event(macro_trace_t &trace, std::string_view detail, const char *name = "event")
+{
+    auto now = macro_trace_t::clock_t::now();
+    trace.add(name, "test", now, now + std::chrono::microseconds(3), detail);
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(trace, checker)
+{
+    json_checker_t json;
+    CHECK(json.check("{\"a\": [1, -2.5e3, true, null, \"\\u00e9\"]}"));
+    CHECK(!json.check("{\"a\": [1,]}"));
+    CHECK(!json.check("{\"a\": \"\x01\"}"));
+    CHECK(!json.check("{\"a\": \"\xC3\"}"));
+    CHECK(!json.check("{\"a\": 01}"));
+    CHECK(!json.check("{\"a\": 1} x"));
+}
+
+TEST_CASE(trace, ring_buffer)
+{
+    macro_trace_t trace;
+    json_checker_t json;
+    std::string out;
+
+    // Not recorded while disabled
+    add_event(trace, "x");
+    CHECK_EQ(trace.size(), size_t(0));
+
+    trace.enable(true, 8);
+    for (int i = 0; i < 5; ++i)
+        add_event(trace, std::to_string(i));
+    CHECK_EQ(trace.size(), size_t(5));
+    CHECK_EQ(trace.dropped(), uint64_t(0));
+    trace.write_json(out);
+    CHECK(json.check(out));
+    CHECK_EQ(json.details.size(), size_t(5));
+
+    // Around the buffer: the last 8 events, oldest first
+    for (int i = 5; i < 21; ++i)
+        add_event(trace, std::to_string(i));
+    CHECK_EQ(trace.size(), size_t(8));
+    CHECK_EQ(trace.dropped(), uint64_t(13));
+    trace.write_json(out);
+    CHECK(json.check(out));
+    CHECK_EQ(json.details.size(), size_t(8));
+    for (size_t k = 0; k < json.details.size(); ++k)
+        CHECK_EQ(json.details[k], std::to_string(13 + k));
+
+    // Stopping keeps the events
+    trace.enable(false);
+    add_event(trace, "x");
+    CHECK_EQ(trace.size(), size_t(8));
+    trace.write_json(out);
+    CHECK(json.check(out));
+    CHECK_EQ(json.details.size(), size_t(8));
+
+    trace.clear();
+    CHECK_EQ(trace.size(), size_t(0));
+    CHECK_EQ(trace.dropped(), uint64_t(0));
+    trace.write_json(out);
+    CHECK(json.check(out));
+    CHECK(json.details.empty());
+}
+
+TEST_CASE(trace, detail_truncation)
+{
+    const size_t max_len = macro_trace_t::MAX_DETAIL_LEN;
+    macro_trace_t trace;
+    trace.enable(true, 16);
+
+    const std::string a(max_len, 'a');
+    const std::string cases[] =
+    {
+        a.substr(0, 10) + "\xC3\xA9",                       // Short: kept whole
+        a + "tail",                                         // ASCII: cut at the limit
+        a + "\xE2\x82\xAC",                                 // Sequence at the limit: cut before it
+        a.substr(1) + "\xC3\xA9",                           // Sequence across the limit
+        a.substr(2) + "\xE2\x82\xAC",
+        a.substr(3) + "\xF0\x9F\x98\x80",
+        a.substr(3) + "\xC3\xA9\xC3\xA9",                   // Ends with a whole sequence
+    };
+    const size_t kept[] = { 12, max_len, max_len, max_len - 1, max_len - 2, max_len - 3, max_len - 1 };
+    for (auto &detail: cases)
+        add_event(trace, detail);
+
+    std::string out;
+    trace.write_json(out);
+    json_checker_t json;
+    CHECK(json.check(out));
+    CHECK_EQ(json.details.size(), std::size(cases));
+    for (size_t k = 0; k < json.details.size() && k < std::size(cases); ++k)
+    {
+        CHECK_EQ(json.details[k].size(), kept[k]);
+        CHECK(cases[k].compare(0, kept[k], json.details[k]) == 0);
+    }
+}
+
+TEST_CASE(trace, json_escaping)
+{
+    macro_trace_t trace;
+    trace.enable(true, 16);
+
+    const std::string detail = std::string("quote \" backslash \\ slash / lf \n cr \r tab \t ctl \x01\x1f del \x7f utf8 \xC3\xA9\xE2\x82\xAC");
+    add_event(trace, detail, "name \"quoted\"");
+    add_event(trace, std::string("nul \0 inside", 12));
+
+    std::string out;
+    trace.write_json(out);
+    json_checker_t json;
+    CHECK(json.check(out));
+    CHECK_EQ(json.details.size(), size_t(2));
+    CHECK_EQ(json.names.size(), size_t(2));
+    if (json.details.size() == 2 && json.names.size() == 2)
+    {
+        CHECK(json.details[0] == detail);
+        CHECK(json.details[1] == std::string("nul \0 inside", 12));
+        CHECK_EQ(json.names[0], "name \"quoted\"");
+    }
+}
@@ -0,0 +1,129 @@
+/*
+Watchdog tests: expiry, disarming before and during the expiration function,
+re-arming while it runs
+
+The budgets leave wide margins, so that a loaded machine does not fail them.
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include <atomic>
+#include <thread>
+#include "test.h"
+#include "watchdog.h"
+
+using namespace std::chrono_literals;
+
+//-------------------------------------------------------------------------
+// Wait until 'cond' holds, for up to 'timeout'
+template<class F>
+static bool wait_until(F cond, std::chrono::milliseconds timeout = 5000ms)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    while (!cond())
+    {
+        if (std::chrono::steady_clock::now() - t0 > timeout)
+            return false;
+        std::this_thread::sleep_for(1ms);
+    }
+    return true;
+}
+
+//-------------------------------------------------------------------------
+TEST_CASE(watchdog, expiry)
+{
+    std::atomic<int> fired{ 0 };
+    watchdog_t watchdog([&]() { ++fired; });
+
+    watchdog.arm(10ms);
+    CHECK(wait_until([&]() { return fired == 1; }));
+    CHECK(watchdog.disarm());
+    CHECK_EQ(fired.load(), 1);
+
+    // Each operation is timed on its own
+    watchdog.arm(10ms);
+    CHECK(wait_until([&]() { return fired == 2; }));
+    CHECK(watchdog.disarm());
+}
+
+TEST_CASE(watchdog, disarm_before_deadline)
+{
+    std::atomic<int> fired{ 0 };
+    watchdog_t watchdog([&]() { ++fired; });
+
+    // Disarmed well before the deadline, then past it
+    for (int i = 0; i < 20; ++i)
+    {
+        watchdog.arm(300ms);
+        std::this_thread::sleep_for(1ms);
+        CHECK(!watchdog.disarm());
+    }
+    watchdog.arm(200ms);
+    std::this_thread::sleep_for(100ms);
+    CHECK(!watchdog.disarm());
+    std::this_thread::sleep_for(300ms);
+    CHECK_EQ(fired.load(), 0);
+
+    // An earlier deadline than the one the thread waits for is noticed
+    watchdog.arm(60s);
+    watchdog.disarm();
+    watchdog.arm(10ms);
+    CHECK(wait_until([&]() { return fired == 1; }, 1000ms));
+    CHECK(watchdog.disarm());
+}
+
+TEST_CASE(watchdog, rearm_while_expiring)
+{
+    std::atomic<int> fired{ 0 };
+    std::atomic<bool> release{ false };
+    watchdog_t watchdog([&]()
+    {
+        ++fired;
+        while (!release)
+            std::this_thread::sleep_for(1ms);
+    });
+
+    // Armed again while the expiration function runs: the new budget is
+    // timed once it returns
+    watchdog.arm(1ms);
+    CHECK(wait_until([&]() { return fired == 1; }));
+    watchdog.arm(60s);
+    release = true;
+    std::this_thread::sleep_for(50ms);
+    CHECK(!watchdog.disarm());
+    CHECK_EQ(fired.load(), 1);
+
+    // Same with a short budget: it expires in turn
+    release = false;
+    watchdog.arm(1ms);
+    CHECK(wait_until([&]() { return fired == 2; }));
+    watchdog.arm(20ms);
+    release = true;
+    CHECK(wait_until([&]() { return fired == 3; }));
+    CHECK(watchdog.disarm());
+}
+
+TEST_CASE(watchdog, disarm_waits_for_expiry)
+{
+    std::atomic<bool> entered{ false };
+    std::atomic<bool> done{ false };
+    watchdog_t watchdog([&]()
+    {
+        entered = true;
+        std::this_thread::sleep_for(100ms);
+        done = true;
+    });
+
+    watchdog.arm(1ms);
+    CHECK(wait_until([&]() { return entered.load(); }));
+    CHECK(watchdog.disarm());
+    CHECK(done.load());
+
+    // stop() waits for it too
+    entered = false;
+    done = false;
+    watchdog.arm(1ms);
+    CHECK(wait_until([&]() { return entered.load(); }));
+    watchdog.stop();
+    CHECK(done.load());
+}
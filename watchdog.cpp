@@ -0,0 +1,76 @@
+/*
+Watchdog: Deadline timer for operations that may hang
+
+(c) Elias Bachaalany <elias.bachaalany@gmail.com>
+*/
+
+#include "watchdog.h"
+
+//-------------------------------------------------------------------------
+void watchdog_t::run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (!m_stop)
+    {
+        if (!m_armed)
+        {
+            m_wake_up = std::chrono::steady_clock::time_point::max();
+            m_cv.wait(lock);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < m_deadline)
+        {
+            m_wake_up = m_deadline;
+            m_cv.wait_until(lock, m_deadline);
+            continue;
+        }
+
+        // Expired: call out of the lock, disarm() waits for it
+        m_armed    = false;
+        m_fired    = true;
+        m_expiring = true;
+        lock.unlock();
+        m_on_expire();
+        lock.lock();
+        m_expiring = false;
+        m_cv.notify_all();
+    }
+}
+
+//-------------------------------------------------------------------------
+void watchdog_t::arm(std::chrono::milliseconds budget)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (!m_thread.joinable())
+    {
+        m_stop = false;
+        m_thread = std::thread([this]() { run(); });
+    }
+    m_deadline = std::chrono::steady_clock::now() + budget;
+    m_armed    = true;
+    m_fired    = false;
+    if (m_deadline < m_wake_up)
+        m_cv.notify_all();
+}
+
+//-------------------------------------------------------------------------
+bool watchdog_t::disarm()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_armed = false;
+    m_cv.wait(lock, [this]() { return !m_expiring; });
+    return m_fired;
+}
+
+//-------------------------------------------------------------------------
+void watchdog_t::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop  = true;
+        m_armed = false;
+        m_cv.notify_all();
+    }
+    if (m_thread.joinable())
+        m_thread.join();
+}
@@ -0,0 +1,56 @@
+/*
+Watchdog: Deadline timer for operations that may hang
+
+An operation arms the watchdog with its budget before it starts and disarms
+it when it is done. If the budget runs out first, the expiration function is
+called from the watchdog thread (e.g. to interrupt the operation), and
+disarm() tells so. disarm() never returns while the expiration function
+runs, so the caller can undo its effects. The expiration function must
+therefore never wait for the thread that disarms (e.g. for a lock it may
+hold, like the Python GIL): both would wait for each other.
+
+This module does not depend on the IDA SDK.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+//-------------------------------------------------------------------------
+class watchdog_t
+{
+    std::function<void()> m_on_expire;
+
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::thread m_thread;
+
+    std::chrono::steady_clock::time_point m_deadline;
+
+    // When the thread wakes up next: arming only wakes it up if the new
+    // deadline is earlier, so most operations do not switch threads
+    std::chrono::steady_clock::time_point m_wake_up = std::chrono::steady_clock::time_point::max();
+    bool m_armed    = false;
+    bool m_fired    = false;
+    bool m_expiring = false;
+    bool m_stop     = false;
+
+    void run();
+
+public:
+    watchdog_t(std::function<void()> on_expire) : m_on_expire(std::move(on_expire)) { }
+    ~watchdog_t() { stop(); }
+
+    // Start timing an operation (the thread starts on first use)
+    void arm(std::chrono::milliseconds budget);
+
+    // Stop timing it. Returns true if the budget ran out
+    bool disarm();
+
+    // Stop the watchdog thread
+    void stop();
+};